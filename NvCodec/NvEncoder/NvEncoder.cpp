@@ -26,6 +26,7 @@
  */
 
 #include "NvEncoder/NvEncoder.h"
+#include "PipelineTrace.hpp"
 
 #ifndef _WIN32
 #include <cstring>
@@ -312,6 +313,7 @@ void NvEncoder::CreateEncoder(const NV_ENC_INITIALIZE_PARAMS* pEncoderParams)
     NVENC_API_CALL(m_nvenc.nvEncInitializeEncoder(m_hEncoder, &m_initializeParams));
 
     m_bEncoderInitialized = true;
+    m_bEncodeAsync = m_initializeParams.enableEncodeAsync != 0;
     m_nWidth = m_initializeParams.encodeWidth;
     m_nHeight = m_initializeParams.encodeHeight;
     m_nMaxEncodeWidth = m_initializeParams.maxEncodeWidth;
@@ -359,6 +361,13 @@ void NvEncoder::CreateEncoder(const NV_ENC_INITIALIZE_PARAMS* pEncoderParams)
     }
 
     AllocateInputBuffers(m_nEncoderBuffer);
+
+    if (m_outputCallback && !m_bMotionEstimationOnly && !m_bOutputInVideoMemory && !m_bIsDX12Encode)
+    {
+        m_bAsyncStop = false;
+        m_asyncError = nullptr;
+        m_asyncThread = std::thread(&NvEncoder::AsyncOutputThread, this);
+    }
 }
 
 void NvEncoder::DestroyEncoder()
@@ -380,6 +389,8 @@ void NvEncoder::DestroyHWEncoder()
         return;
     }
 
+    StopAsyncOutput();
+
 #if defined(_WIN32)
     for (uint32_t i = 0; i < m_vpCompletionEvent.size(); i++)
     {
@@ -445,6 +456,8 @@ void NvEncoder::MapResources(uint32_t bfrIdx)
 void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_PIC_PARAMS *pPicParams)
 {
     vPacket.clear();
+    m_vOutputTimeStamps.clear();
+    m_vOutputPictureTypes.clear();
     if (!IsHWEncoderInitialized())
     {
         NVENC_THROW_ERROR("Encoder device not found", NV_ENC_ERR_NO_ENCODE_DEVICE);
@@ -456,7 +469,17 @@ void NvEncoder::EncodeFrame(std::vector<std::vector<uint8_t>> &vPacket, NV_ENC_P
 
     NVENCSTATUS nvStatus = DoEncode(m_vMappedInputBuffers[bfrIdx], m_vBitstreamOutputBuffer[bfrIdx], pPicParams);
 
-    if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
+    if ((nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT) && IsAsyncOutput())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_asyncMutex);
+            m_iToSend++;
+        }
+        m_asyncCondition.notify_all();
+        // The next input buffer must be out of the encoder before the application writes to it
+        WaitForAsyncOutput(m_nEncoderBuffer - 1);
+    }
+    else if (nvStatus == NV_ENC_SUCCESS || nvStatus == NV_ENC_ERR_NEED_MORE_INPUT)
     {
         m_iToSend++;
         GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, true);
@@ -514,6 +537,15 @@ void NvEncoder::GetSequenceParams(std::vector<uint8_t> &seqParams)
     seqParams.insert(seqParams.end(), &spsppsData[0], &spsppsData[spsppsSize]);
 }
 
+void NvEncoder::InvalidateRefFrames(uint64_t invalidRefFrameTimeStamp)
+{
+    if (!m_hEncoder)
+    {
+        NVENC_THROW_ERROR("Encoder Initialization failed", NV_ENC_ERR_NO_ENCODE_DEVICE);
+    }
+    NVENC_API_CALL(m_nvenc.nvEncInvalidateRefFrames(m_hEncoder, invalidRefFrameTimeStamp));
+}
+
 NVENCSTATUS NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, NV_ENC_OUTPUT_PTR outputBuffer, NV_ENC_PIC_PARAMS *pPicParams)
 {
     NV_ENC_PIC_PARAMS picParams = {};
@@ -528,6 +560,11 @@ NVENCSTATUS NvEncoder::DoEncode(NV_ENC_INPUT_PTR inputBuffer, NV_ENC_OUTPUT_PTR
     picParams.inputWidth = GetEncodeWidth();
     picParams.inputHeight = GetEncodeHeight();
     picParams.frameIdx = m_iToSend;
+    if (!pPicParams || !pPicParams->inputTimeStamp)
+    {
+        // Reference invalidation identifies frames by timestamp
+        picParams.inputTimeStamp = m_iToSend;
+    }
     picParams.outputBitstream = outputBuffer;
     picParams.completionEvent = GetCompletionEvent(m_iToSend % m_nEncoderBuffer);
     NVENCSTATUS nvStatus = m_nvenc.nvEncEncodePicture(m_hEncoder, &picParams);
@@ -546,6 +583,8 @@ void NvEncoder::SendEOS()
 void NvEncoder::EndEncode(std::vector<std::vector<uint8_t>> &vPacket)
 {
     vPacket.clear();
+    m_vOutputTimeStamps.clear();
+    m_vOutputPictureTypes.clear();
     if (!IsHWEncoderInitialized())
     {
         NVENC_THROW_ERROR("Encoder device not initialized", NV_ENC_ERR_ENCODER_NOT_INITIALIZED);
@@ -553,6 +592,11 @@ void NvEncoder::EndEncode(std::vector<std::vector<uint8_t>> &vPacket)
 
     SendEOS();
 
+    if (IsAsyncOutput())
+    {
+        WaitForAsyncOutput(0);
+        return;
+    }
     GetEncodedPacket(m_vBitstreamOutputBuffer, vPacket, false);
 }
 
@@ -560,55 +604,150 @@ void NvEncoder::GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer,
 {
     unsigned i = 0;
     int iEnd = bOutputDelay ? m_iToSend - m_nOutputDelay : m_iToSend;
+    m_vOutputTimeStamps.clear();
+    m_vOutputPictureTypes.clear();
     for (; m_iGot < iEnd; m_iGot++)
     {
         WaitForCompletionEvent(m_iGot % m_nEncoderBuffer);
+        TraceSpan lockSpan("bitstream lock");
         NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
         lockBitstreamData.outputBitstream = vOutputBuffer[m_iGot % m_nEncoderBuffer];
         lockBitstreamData.doNotWait = false;
         NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
+        lockSpan.SetFrame(lockBitstreamData.outputTimeStamp);
   
-        uint8_t *pData = (uint8_t *)lockBitstreamData.bitstreamBufferPtr;
         if (vPacket.size() < i + 1)
         {
             vPacket.push_back(std::vector<uint8_t>());
         }
         vPacket[i].clear();
-       
-        if ((m_initializeParams.encodeGUID == NV_ENC_CODEC_AV1_GUID) && (m_bUseIVFContainer))
+        CopyBitstream(lockBitstreamData, vPacket[i]);
+        m_vOutputTimeStamps.push_back(lockBitstreamData.outputTimeStamp);
+        m_vOutputPictureTypes.push_back(lockBitstreamData.pictureType);
+        i++;
+
+        NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+        lockSpan.End();
+
+        UnmapResources(m_iGot % m_nEncoderBuffer);
+    }
+}
+
+void NvEncoder::CopyBitstream(const NV_ENC_LOCK_BITSTREAM &lockBitstreamData, std::vector<uint8_t> &packet)
+{
+    uint8_t *pData = (uint8_t *)lockBitstreamData.bitstreamBufferPtr;
+    if ((m_initializeParams.encodeGUID == NV_ENC_CODEC_AV1_GUID) && (m_bUseIVFContainer))
+    {
+        if (m_bWriteIVFFileHeader)
         {
-            if (m_bWriteIVFFileHeader)
+            m_IVFUtils.WriteFileHeader(packet, MAKE_FOURCC('A', 'V', '0', '1'), m_initializeParams.encodeWidth, m_initializeParams.encodeHeight, m_initializeParams.frameRateNum, m_initializeParams.frameRateDen, 0xFFFF);
+            m_bWriteIVFFileHeader = false;
+        }
+
+        m_IVFUtils.WriteFrameHeader(packet, lockBitstreamData.bitstreamSizeInBytes, lockBitstreamData.outputTimeStamp);
+    }
+    packet.insert(packet.end(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
+}
+
+void NvEncoder::UnmapResources(uint32_t bfrIdx)
+{
+    if (m_vMappedInputBuffers[bfrIdx])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[bfrIdx]));
+        m_vMappedInputBuffers[bfrIdx] = nullptr;
+    }
+
+    if (m_bMotionEstimationOnly && m_vMappedRefBuffers[bfrIdx])
+    {
+        NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedRefBuffers[bfrIdx]));
+        m_vMappedRefBuffers[bfrIdx] = nullptr;
+    }
+}
+
+void NvEncoder::AsyncOutputThread()
+{
+    PipelineTrace::SetThreadName("NVENC output");
+    std::vector<uint8_t> packet;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_asyncMutex);
+            m_asyncCondition.wait(lock, [this] { return m_iGot < m_iToSend || m_bAsyncStop; });
+            if (m_iGot == m_iToSend)
             {
-                m_IVFUtils.WriteFileHeader(vPacket[i], MAKE_FOURCC('A', 'V', '0', '1'), m_initializeParams.encodeWidth, m_initializeParams.encodeHeight, m_initializeParams.frameRateNum, m_initializeParams.frameRateDen, 0xFFFF);
-                m_bWriteIVFFileHeader = false;
+                return;
             }
-
-            m_IVFUtils.WriteFrameHeader(vPacket[i], lockBitstreamData.bitstreamSizeInBytes, lockBitstreamData.outputTimeStamp);
         }
-        vPacket[i].insert(vPacket[i].end(), &pData[0], &pData[lockBitstreamData.bitstreamSizeInBytes]);
-        
-        i++;
 
-        NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+        uint32_t bfrIdx = m_iGot % m_nEncoderBuffer;
+        try
+        {
+            WaitForCompletionEvent(bfrIdx);
+            TraceSpan lockSpan("bitstream lock");
+            NV_ENC_LOCK_BITSTREAM lockBitstreamData = { NV_ENC_LOCK_BITSTREAM_VER };
+            lockBitstreamData.outputBitstream = m_vBitstreamOutputBuffer[bfrIdx];
+            lockBitstreamData.doNotWait = false;
+            NVENC_API_CALL(m_nvenc.nvEncLockBitstream(m_hEncoder, &lockBitstreamData));
+            lockSpan.SetFrame(lockBitstreamData.outputTimeStamp);
+            packet.clear();
+            {
+                // Reconfigure() may replace the parameters the IVF headers are made of
+                std::lock_guard<std::mutex> lock(m_asyncMutex);
+                CopyBitstream(lockBitstreamData, packet);
+            }
+            NVENC_API_CALL(m_nvenc.nvEncUnlockBitstream(m_hEncoder, lockBitstreamData.outputBitstream));
+            lockSpan.End();
+            UnmapResources(bfrIdx);
 
-        if (m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer])
+            lockBitstreamData.bitstreamBufferPtr = nullptr;
+            m_outputCallback(packet, lockBitstreamData);
+        }
+        catch (...)
         {
-            NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer]));
-            m_vMappedInputBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+            // Handed to the submitting thread, which rethrows it from EncodeFrame() or EndEncode()
+            std::lock_guard<std::mutex> lock(m_asyncMutex);
+            m_asyncError = std::current_exception();
+            m_asyncCondition.notify_all();
+            return;
         }
 
-        if (m_bMotionEstimationOnly && m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer])
         {
-            NVENC_API_CALL(m_nvenc.nvEncUnmapInputResource(m_hEncoder, m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer]));
-            m_vMappedRefBuffers[m_iGot % m_nEncoderBuffer] = nullptr;
+            std::lock_guard<std::mutex> lock(m_asyncMutex);
+            m_iGot++;
         }
+        m_asyncCondition.notify_all();
     }
 }
 
+void NvEncoder::WaitForAsyncOutput(int32_t nMaxPending)
+{
+    std::unique_lock<std::mutex> lock(m_asyncMutex);
+    m_asyncCondition.wait(lock, [this, nMaxPending] { return m_iToSend - m_iGot <= nMaxPending || m_asyncError; });
+    if (m_asyncError)
+    {
+        std::rethrow_exception(m_asyncError);
+    }
+}
+
+void NvEncoder::StopAsyncOutput()
+{
+    if (!m_asyncThread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_asyncMutex);
+        m_bAsyncStop = true;
+    }
+    m_asyncCondition.notify_all();
+    m_asyncThread.join();
+}
+
 bool NvEncoder::Reconfigure(const NV_ENC_RECONFIGURE_PARAMS *pReconfigureParams)
 {
     NVENC_API_CALL(m_nvenc.nvEncReconfigureEncoder(m_hEncoder, const_cast<NV_ENC_RECONFIGURE_PARAMS*>(pReconfigureParams)));
 
+    std::lock_guard<std::mutex> lock(m_asyncMutex);
     memcpy(&m_initializeParams, &(pReconfigureParams->reInitEncodeParams), sizeof(m_initializeParams));
     if (pReconfigureParams->reInitEncodeParams.encodeConfig)
     {
@@ -746,12 +885,8 @@ void NvEncoder::WaitForCompletionEvent(int iEvent)
 {
 #if defined(_WIN32)
     // Check if we are in async mode. If not, don't wait for event;
-    NV_ENC_CONFIG sEncodeConfig = { 0 };
-    NV_ENC_INITIALIZE_PARAMS sInitializeParams = { 0 };
-    sInitializeParams.encodeConfig = &sEncodeConfig;
-    GetInitializeParams(&sInitializeParams);
-
-    if (0U == sInitializeParams.enableEncodeAsync)
+    // enableEncodeAsync cannot be reconfigured, the value of CreateEncoder() holds
+    if (!m_bEncodeAsync)
     {
         return;
     }
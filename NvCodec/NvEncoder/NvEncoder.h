@@ -31,6 +31,10 @@
 #include "nvEncodeAPI.h"
 #include <stdint.h>
 #include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <exception>
 #include <string>
 #include <iostream>
 #include <sstream>
@@ -151,6 +155,43 @@ public:
     */
     virtual void EndEncode(std::vector<std::vector<uint8_t>> &vPacket);
 
+    /**
+    *  @brief  This function returns the NV_ENC_LOCK_BITSTREAM::outputTimeStamp of each
+    *  packet returned by the last EncodeFrame() or EndEncode() call, in the same order.
+    *  The output timestamp is the NV_ENC_PIC_PARAMS::inputTimeStamp of the frame.
+    */
+    const std::vector<uint64_t> &GetOutputTimeStamps() const { return m_vOutputTimeStamps; }
+
+    /**
+    *  @brief  This function returns the NV_ENC_LOCK_BITSTREAM::pictureType of each
+    *  packet returned by the last EncodeFrame() or EndEncode() call, in the same order.
+    */
+    const std::vector<NV_ENC_PIC_TYPE> &GetOutputPictureTypes() const { return m_vOutputPictureTypes; }
+
+    /**
+    *  @brief  Callback receiving one encoded frame in async output mode.
+    *  The bitstream has already been unlocked: info.bitstreamBufferPtr is null,
+    *  the other fields (outputTimeStamp, pictureType, frameAvgQP...) are valid.
+    */
+    typedef std::function<void(std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info)> OutputCallback;
+
+    /**
+    *  @brief  This function is used to enable the async output mode.
+    *  Instead of EncodeFrame() collecting the frames submitted m_nOutputDelay
+    *  calls earlier, a retrieval thread waits for each frame's completion event,
+    *  locks its bitstream and passes it to the callback as soon as the hardware
+    *  is done. EncodeFrame() only submits, and EncodeFrame() and EndEncode()
+    *  return no packets. The callback runs on the retrieval thread.
+    *  Must be called before CreateEncoder(); an empty callback restores the
+    *  default mode. Not available in the ME-only mode.
+    */
+    void SetOutputCallback(OutputCallback callback) { m_outputCallback = callback; }
+
+    /**
+    *  @brief  This function returns true if the output is retrieved by the retrieval thread.
+    */
+    bool IsAsyncOutput() const { return m_asyncThread.joinable(); }
+
     /**
     *  @brief  This function is used to query hardware encoder capabilities.
     *  Applications can call this function to query capabilities like maximum encode
@@ -228,6 +269,16 @@ public:
     */
     void GetSequenceParams(std::vector<uint8_t> &seqParams);
 
+    /**
+    *  @brief This function is used to invalidate a reference frame.
+    *  The frame is identified by its NV_ENC_PIC_PARAMS::inputTimeStamp, which is
+    *  the frame index in encode order unless the application passes its own.
+    *  The encoder stops predicting from the frame and from every frame that was
+    *  predicted from it, and falls back to older references or intra coding.
+    *  Check support using ::NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION caps.
+    */
+    void InvalidateRefFrames(uint64_t invalidRefFrameTimeStamp);
+
     /**
     *  @brief  NvEncoder class virtual destructor.
     */
@@ -382,6 +433,38 @@ private:
     */
     void GetEncodedPacket(std::vector<NV_ENC_OUTPUT_PTR> &vOutputBuffer, std::vector<std::vector<uint8_t>> &vPacket, bool bOutputDelay);
 
+    /**
+    *  @brief This is a private function which is used to copy a locked bitstream
+    *         into a packet, with the IVF headers in case of AV1.
+    */
+    void CopyBitstream(const NV_ENC_LOCK_BITSTREAM &lockBitstreamData, std::vector<uint8_t> &packet);
+
+    /**
+    *  @brief This is a private function which is used to unmap the input buffers
+    *         of an encoded frame, so the application can reuse them.
+    */
+    void UnmapResources(uint32_t bfrIdx);
+
+    /**
+    *  @brief This is a private function which is run by the retrieval thread in
+    *         async output mode. It retrieves the frames in submission order until
+    *         StopAsyncOutput() is called and every submitted frame is out.
+    */
+    void AsyncOutputThread();
+
+    /**
+    *  @brief This is a private function which is used to wait until the retrieval
+    *         thread has caught up to m_iToSend - nMaxPending frames. It rethrows
+    *         the error that stopped the retrieval thread, if any.
+    */
+    void WaitForAsyncOutput(int32_t nMaxPending);
+
+    /**
+    *  @brief This is a private function which is used to stop the retrieval thread
+    *         after it has retrieved every submitted frame.
+    */
+    void StopAsyncOutput();
+
     /**
     *  @brief This is a private function which is used to initialize the bitstream buffers.
     *  This is only used in the encoding mode.
@@ -460,9 +543,21 @@ private:
     NV_ENC_DEVICE_TYPE m_eDeviceType;
     NV_ENC_CONFIG m_encodeConfig = {};
     bool m_bEncoderInitialized = false;
+    bool m_bEncodeAsync = false;
     uint32_t m_nExtraOutputDelay = 3; // To ensure encode and graphics can work in parallel, m_nExtraOutputDelay should be set to at least 1
     std::vector<NV_ENC_OUTPUT_PTR> m_vBitstreamOutputBuffer;
     std::vector<NV_ENC_OUTPUT_PTR> m_vMVDataOutputBuffer;
     uint32_t m_nMaxEncodeWidth = 0;
     uint32_t m_nMaxEncodeHeight = 0;
+
+    std::vector<uint64_t> m_vOutputTimeStamps;
+    std::vector<NV_ENC_PIC_TYPE> m_vOutputPictureTypes;
+
+    /// Async output mode. m_iToSend and m_iGot are guarded by m_asyncMutex while the thread runs
+    OutputCallback m_outputCallback;
+    std::thread m_asyncThread;
+    std::mutex m_asyncMutex;
+    std::condition_variable m_asyncCondition;
+    bool m_bAsyncStop = false;
+    std::exception_ptr m_asyncError;
 };
@@ -0,0 +1,98 @@
+#include "Bench.hpp"
+#include "BinaryLog.hpp"
+#include "AllocationCounter.hpp"
+
+bool RunBench(const SampleOptions &options, int argc, char *argv[], int &result)
+{
+    if (options.benchMetricOps > 0)
+    {
+        result = BenchMetrics(options.benchMetricOps);
+    }
+    else if (options.benchTraceSpans > 0)
+    {
+        result = BenchTrace(options.benchTraceSpans);
+    }
+    else if (options.benchLogRecords > 0)
+    {
+        /// Opens its own log
+        BinaryLog::Close();
+        result = BenchBinaryLog(options.benchLogRecords);
+    }
+    else if (!options.benchAbrTrace.empty())
+    {
+        result = BenchAbr(options.benchAbrTrace.c_str(), options.rateConfig);
+    }
+    else if (options.benchBackpressureFrames > 0)
+    {
+        result = BenchBackpressure(options.benchBackpressureFrames);
+    }
+    else if (options.benchPagesFrames > 0)
+    {
+        result = BenchLargePages(options.benchPagesFrames);
+    }
+    else if (options.benchFusedFrames > 0)
+    {
+        result = BenchFused(options.benchFusedFrames);
+    }
+    else if (options.benchAllocFrames > 0)
+    {
+        if (!AllocationCounter::ENABLED)
+        {
+            printf("-benchalloc needs a build with -DCOUNT_ALLOCATIONS=ON\n");
+            result = -1;
+            return true;
+        }
+        result = BenchFrameMetadata(options.benchAllocFrames);
+        if (result == 0 && !options.replayPath.empty())
+        {
+            result = BenchCaptureAllocations(options.benchAllocFrames, argc, argv, options.replayPath, options.replayWidth,
+                options.replayHeight, options.encoderOptions);
+        }
+    }
+    else if (options.benchHashFrames > 0)
+    {
+        result = BenchHash(options.benchHashFrames);
+    }
+    else if (options.benchSchedFrames > 0)
+    {
+        result = BenchScheduler(options.benchSchedFrames);
+    }
+    else if (options.benchRefreshFrames > 0)
+    {
+        if (options.replayPath.empty() || !options.refresh.period)
+        {
+            printf("-benchrefresh needs -replay and -intrarefresh\n");
+            result = -1;
+            return true;
+        }
+        result = BenchRefresh(options.benchRefreshFrames, argc, argv, options.replayPath, options.replayWidth, options.replayHeight,
+            options.refresh, options.encoderOptions);
+    }
+    else if (options.benchHintFrames > 0)
+    {
+        if (options.replayPath.empty() || !options.scrollRows)
+        {
+            printf("-benchhints needs -replay and -scroll\n");
+            result = -1;
+            return true;
+        }
+        result = BenchHints(options.benchHintFrames, argc, argv, options.replayPath, options.replayWidth, options.replayHeight,
+            options.scrollRows, options.encoderOptions);
+    }
+    else if (options.benchRecoveryFrames > 0)
+    {
+        if (options.replayPath.empty())
+        {
+            printf("-benchrecovery needs -replay\n");
+            result = -1;
+            return true;
+        }
+        result = BenchRecovery(options.benchRecoveryFrames, argc, argv, options.replayPath, options.replayWidth, options.replayHeight,
+            options.injectEvery ? options.injectEvery : 60, options.encoderOptions);
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include <string>
+#include "SampleOptions.hpp"
+
+/// Benchmarks of the sample, selected by the -bench* options of SampleOptions instead of the capture loop.
+/// Each prints its results and returns the exit code of the process: 0, 1 if a check failed, -1 if it
+/// could not run
+
+/// Run the benchmark 'options' selects, with 'result' its exit code. False if it selects none
+bool RunBench(const SampleOptions &options, int argc, char *argv[], int &result);
+
+/// Encode the same replayed frames twice, with an IDR every refresh.period frames and with intra refresh
+/// waves of the same period, and compare the frame sizes
+int BenchRefresh(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    const IntraRefreshConfig &refresh, const std::string &encoderOptions);
+
+/// Encode the first replayed frame scrolling by scrollRows per frame twice, without and with motion hints
+/// from the scroll's move rect, and compare the frame sizes and the time per frame
+int BenchHints(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    UINT scrollRows, const std::string &encoderOptions);
+
+/// Capture loss recovery on nFrames replayed frames, the replay failing with DXGI_ERROR_ACCESS_LOST every
+/// injectEvery frames and the loop recovering as Grab60FPS does. Same size, same format: every recovery
+/// must only re-acquire the capture, keep the NVENC session and the output stream (packets keep coming,
+/// frame numbers keep counting up) and complete a time to first frame, also in the
+/// capture_recovery_microseconds metric. Returns 1 if one of these does not hold
+int BenchRecovery(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    UINT injectEvery, const std::string &encoderOptions);
+
+/// Global heap allocations per frame of the capture loop itself: Capture() and Preproc() of nFrames replayed
+/// frames, as Grab60FPS runs them, after a warm-up that fills the frame pool, the arenas and the encoder's
+/// buffers. Every thread of the process counts, the encoder's output thread and the scheduler's workers too.
+/// Returns 1 if the steady state allocates
+int BenchCaptureAllocations(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    const std::string &encoderOptions);
+
+/// The per-frame metadata of the pipeline, built for nFrames synthetic 1080p frames: damage of a window
+/// being dragged, its move rect, dirty runs, a loss report every 30 frames and a log line. Once with
+/// fresh heap containers per frame, once from the arenas of three pool surfaces in rotation, and
+/// counts the global heap allocations per frame after a warm-up of one round
+int BenchFrameMetadata(int nFrames);
+
+/// Tile hashing throughput of nFrames 4K frames on 1 thread up to every thread of the shared scheduler
+/// (its workers and the calling thread), in GB/s of BGRA hashed and as a speedup over one thread
+int BenchHash(int nFrames);
+
+/// CPU side of 1-8 sessions on one host: every session hashes nFrames 1080p frames (latency-critical, timed)
+/// and checksums a 4 MB packet buffer per frame (background, like muxing). Compares threads per session,
+/// one shared scheduler with everything in one lane, and one shared scheduler with priority lanes
+int BenchScheduler(int nFrames);
+
+/// Hashing and CPU conversion of nFrames 4K BGRA frames, from a ring of four frames in 4 KB pages and
+/// then in large pages. The ring is larger than any cache, like a stream of fresh captures
+int BenchLargePages(int nFrames);
+
+/// Fused BGRA to scaled NV12 against convert-then-resize, nFrames synthetic 4K frames to 1080p and 540p:
+/// on the GPU BGRA2NV12Scaled against RGBA2NV12 + ResizeNv12, timed with CUDA events (RGBA2NV12 waits for
+/// its kernel, as it does in CudaConverter), on the CPU CpuBgraToNv12Scaler at the target size against one
+/// at the source size + CpuResizer. Also prints the largest difference between the GPU and CPU fused
+/// outputs, which use the same area filter
+int BenchFused(int nFrames);
+
+/// The adaptive bitrate loop on a recorded trace, as written by -abrtrace: one "damage bytes bitrate" line
+/// per frame, '#' starts a comment. A stand-in encoder produces the recorded packet size scaled by the
+/// bitrate the controller currently asks for over the one it was recorded at, as a CBR encoder fills
+/// whatever budget it gets. A stand-in link sends twice the maximum bitrate, 1.5 times the minimum in the
+/// middle third of the trace; the backlog is the packets it has not finished sending. Checks every
+/// reconfiguration against the controller's contract and returns 1 if one breaks it:
+///   - hold: holdFrames since the previous one, a quarter of that while the link is congested,
+///   - hysteresis: the bitrate changes by more than the hysteresis,
+///   - cut-back: while congested the bitrate only goes down, by at least 30% or to the minimum, and the
+///     first cut comes within the congested hold of the congestion starting.
+/// Congestion is derived here from the backlog as the controller defines it, not taken from the controller
+int BenchAbr(const char *szTrace, const RateControlConfig &cfg);
+
+/// The back-pressure strategies on a simulated pipeline, in steps of 250 us: nFrames captured at 60 fps,
+/// a stand-in encoder (8 ms per frame, 28 ms in the 2nd quarter of the run, as when the GPU is shared;
+/// a quarter of that at half size) and a stand-in sink (4 ms per packet, 25 ms in the 3rd quarter, as on
+/// a congested link; IDR frames take 3 times as long, half size frames a quarter). The encoder makes an IDR every 120 frames, after
+/// a resize and when the sink queue asks for one; every other frame references the one encoded before.
+/// Deterministic, no GPU needed. Latency is capture to delivered by the sink; a delivered frame whose
+/// reference was not delivered before it would be a decoding error
+int BenchBackpressure(int nFrames);
+
+/// Cost per call on the capture thread of a per-frame log line: as DDAImpl wrote it before, to an
+/// ofstream with std::endl, formatted under a lock as Utils/Logger.h does, and as binary log records,
+/// plain, rate-limited and below the level. Calls come in bursts of 1024, between which the drain
+/// thread catches up; only the calls are timed
+int BenchBinaryLog(int nRecords);
+
+/// Cost of a TraceSpan with tracing off and on, then a timeline of a synthetic pipeline: a capture
+/// thread acquiring, converting and submitting nSpans / 8 frames, an output thread locking their
+/// bitstreams and a writer muxing and writing them, exported as bench.trace.json and bench.perfetto-trace
+int BenchTrace(int nSpans);
+
+/// Cost of updating metrics: sharded counters and histograms against a shared atomic counter and a
+/// locked histogram, on one thread and on every hardware thread, then the cost of a snapshot and its
+/// exports, written to bench.metrics.json and bench.metrics.prom
+int BenchMetrics(int nOps);
@@ -0,0 +1,240 @@
+#include "Bench.hpp"
+#include "RateController.hpp"
+#include "Backpressure.hpp"
+#include "FrameLatency.hpp"
+#include <cmath>
+#include <deque>
+#include <fstream>
+
+int BenchAbr(const char *szTrace, const RateControlConfig &cfg)
+{
+    struct TraceFrame
+    {
+        double damage;
+        double bytes;
+        double bitrate;
+    };
+    std::vector<TraceFrame> vTrace;
+    std::ifstream trace(szTrace);
+    std::string line;
+    while (std::getline(trace, line))
+    {
+        TraceFrame frame = {};
+        if (line.empty() || line[0] == '#' || sscanf(line.c_str(), "%lf %lf %lf", &frame.damage, &frame.bytes, &frame.bitrate) != 3)
+        {
+            continue;
+        }
+        vTrace.push_back(frame);
+    }
+    if ((int)vTrace.size() < 4 * cfg.windowFrames)
+    {
+        printf("%s: %s has %zu frames, at least %d needed\n", __FUNCTION__, szTrace, vTrace.size(), 4 * cfg.windowFrames);
+        return 1;
+    }
+
+    const int nFrames = (int)vTrace.size();
+    const int nCongestedHold = std::max(cfg.holdFrames / 4, 1);
+    RateController controller;
+    controller.Init(cfg, cfg.minBitrate / 2 + cfg.maxBitrate / 2);
+    printf("%d frames, %u-%u kbps, link at %u kbps in frames %d-%d\n", nFrames, cfg.minBitrate / 1000, cfg.maxBitrate / 1000,
+        (uint32_t)(cfg.minBitrate * 1.5 / 1000), nFrames / 3, nFrames * 2 / 3 - 1);
+
+    std::deque<double> link;
+    double queuedBytes = 0;
+    int minBacklog = -1;
+    bool bWasCongested = false;
+    int lastChange = -1, congestedSince = 0, cutDeadline = -1, nViolations = 0, nCongestedFrames = 0, maxBacklog = 0;
+    double bytesSent = 0;
+    for (int i = 0; i < nFrames; i++)
+    {
+        const TraceFrame &frame = vTrace[i];
+        double bytes = frame.bitrate > 0 ? frame.bytes * controller.GetCurrentBitrate() / frame.bitrate : frame.bytes;
+        link.push_back(bytes);
+        queuedBytes += bytes;
+        double budget = (i >= nFrames / 3 && i < nFrames * 2 / 3 ? cfg.minBitrate * 1.5 : cfg.maxBitrate * 2.0) / 8 / cfg.fps;
+        while (!link.empty() && budget >= link.front())
+        {
+            budget -= link.front();
+            queuedBytes -= link.front();
+            bytesSent += link.front();
+            link.pop_front();
+        }
+        if (!link.empty())
+        {
+            link.front() -= budget;
+            queuedBytes -= budget;
+            bytesSent += budget;
+        }
+        int backlog = (int)link.size();
+        maxBacklog = std::max(maxBacklog, backlog);
+        minBacklog = minBacklog < 0 ? backlog : std::min(minBacklog, backlog);
+        bool bCongested = backlog - minBacklog > cfg.maxBacklog;
+        nCongestedFrames += bCongested;
+
+        uint32_t before = controller.GetCurrentBitrate();
+        if (bCongested && !bWasCongested && before * 0.8 > cfg.minBitrate)
+        {
+            congestedSince = i;
+            cutDeadline = std::max(i, lastChange + nCongestedHold);
+        }
+        bWasCongested = bCongested;
+
+        RateDecision decision;
+        if (controller.OnFrame(frame.damage, (size_t)bytes, backlog, decision))
+        {
+            uint32_t after = decision.averageBitRate;
+            printf("Frame %5d: %6u -> %6u kbps, backlog %d%s\n", i, before / 1000, after / 1000, backlog, bCongested ? ", congested" : "");
+            if (i - lastChange < (bCongested ? nCongestedHold : cfg.holdFrames))
+            {
+                printf("Frame %d: reconfigured %d frames after the previous one\n", i, i - lastChange);
+                nViolations++;
+            }
+            if (fabs((double)after - before) <= cfg.hysteresis * before)
+            {
+                printf("Frame %d: change of %.1f%% within the hysteresis\n", i, 100.0 * ((double)after - before) / before);
+                nViolations++;
+            }
+            if (bCongested && after > std::max(before * 0.7, (double)cfg.minBitrate) + 1)
+            {
+                printf("Frame %d: congested, but %u kbps is no cut from %u kbps\n", i, after / 1000, before / 1000);
+                nViolations++;
+            }
+            lastChange = i;
+            cutDeadline = after < before ? -1 : cutDeadline;
+        }
+        if (cutDeadline >= 0 && (!bCongested || i >= cutDeadline))
+        {
+            if (bCongested)
+            {
+                printf("Frame %d: congested since frame %d and still at %u kbps\n", i, congestedSince, controller.GetCurrentBitrate() / 1000);
+                nViolations++;
+            }
+            cutDeadline = -1;
+        }
+    }
+    printf("%llu reconfigurations, %d congested frames, backlog up to %d packets, %.0f kbps sent on average, %s\n",
+        (unsigned long long)controller.GetReconfigCount(), nCongestedFrames, maxBacklog, bytesSent * 8 * cfg.fps / nFrames / 1000,
+        nViolations ? "FAILED" : "OK");
+    return nViolations ? 1 : 0;
+}
+
+int BenchBackpressure(int nFrames)
+{
+    const int64_t STEP_US = 250;
+    const int64_t FRAME_US = 16667;
+    const int GOP = 120;
+    struct SimFrame
+    {
+        int64_t captureUs;
+        int divisor;
+        bool bRepeat;
+    };
+    struct SimPacket
+    {
+        int64_t captureUs;
+        uint64_t seq;
+        int divisor;
+        bool bIdr;
+        bool bRepeat;
+    };
+    printf("%d frames at 60 fps, encoder slow in frames %d-%d, sink slow in frames %d-%d\n", nFrames, nFrames / 4, nFrames / 2 - 1,
+        nFrames / 2, nFrames * 3 / 4 - 1);
+    const BackpressureStrategy strategies[] = { BackpressureStrategy::Block, BackpressureStrategy::DropOldest, BackpressureStrategy::DropNewest,
+        BackpressureStrategy::Repeat, BackpressureStrategy::LowerFrameRate, BackpressureStrategy::LowerResolution };
+    for (BackpressureStrategy strategy : strategies)
+    {
+        BackpressureConfig cfg;
+        cfg.strategy = strategy;
+        BackpressureController controller;
+        controller.Init(cfg);
+        BoundedPacketQueue<SimPacket> sinkQueue;
+        sinkQueue.Init(strategy, cfg.maxQueuedPackets);
+
+        std::deque<SimFrame> encodeQueue;
+        SimFrame encoding = {};
+        bool bEncoding = false, bRecoveryRequested = false;
+        int64_t encodeDoneUs = 0, lastAgeUs = 0;
+        uint64_t nSeq = 0;
+        int lastDivisor = 1;
+        SimPacket sending = {};
+        bool bSending = false;
+        int64_t sendDoneUs = 0;
+        /// Sequence number of the last delivered frame the decoder could decode, -1 while waiting for an IDR
+        int64_t decodable = -1;
+        uint64_t nDelivered = 0, nBroken = 0, nIdr = 0;
+        LatencyHistogram latency;
+        int nCaptured = 0;
+        for (int64_t nowUs = 0; nCaptured < nFrames || !encodeQueue.empty() || bEncoding || bSending || !sinkQueue.Empty(); nowUs += STEP_US)
+        {
+            /// Sink
+            if (bSending && nowUs >= sendDoneUs)
+            {
+                bSending = false;
+                bool bOk = sending.bIdr || (decodable >= 0 && (uint64_t)decodable + 1 == sending.seq);
+                nBroken += !bOk;
+                decodable = bOk ? (int64_t)sending.seq : -1;
+                nDelivered++;
+                latency.Add(nowUs - sending.captureUs);
+            }
+            if (!bSending && sinkQueue.Pop(sending))
+            {
+                int frame = (int)(sending.captureUs / FRAME_US);
+                int64_t costUs = frame >= nFrames / 2 && frame < nFrames * 3 / 4 ? 25000 : 4000;
+                costUs = sending.bRepeat ? STEP_US : (sending.bIdr ? costUs * 3 : costUs) / ((int64_t)sending.divisor * sending.divisor);
+                sendDoneUs = nowUs + costUs;
+                bSending = true;
+            }
+            /// Encoder
+            if (bEncoding && nowUs >= encodeDoneUs)
+            {
+                bEncoding = false;
+                SimPacket packet;
+                packet.captureUs = encoding.captureUs;
+                packet.seq = nSeq++;
+                packet.divisor = encoding.divisor;
+                packet.bIdr = packet.seq % GOP == 0 || bRecoveryRequested || encoding.divisor != lastDivisor;
+                packet.bRepeat = encoding.bRepeat;
+                nIdr += packet.bIdr;
+                bRecoveryRequested = bRecoveryRequested && !packet.bIdr;
+                lastDivisor = encoding.divisor;
+                lastAgeUs = nowUs - encoding.captureUs;
+                if (sinkQueue.Push(packet, packet.bIdr))
+                {
+                    bRecoveryRequested = true;
+                }
+            }
+            if (!bEncoding && !encodeQueue.empty())
+            {
+                encoding = encodeQueue.front();
+                encodeQueue.pop_front();
+                int frame = (int)(encoding.captureUs / FRAME_US);
+                int64_t costUs = frame >= nFrames / 4 && frame < nFrames / 2 ? 28000 : 8000;
+                costUs = encoding.bRepeat ? 1000 : costUs / ((int64_t)encoding.divisor * encoding.divisor);
+                encodeDoneUs = nowUs + costUs;
+                bEncoding = true;
+            }
+            /// Capture
+            if (nCaptured < nFrames && nowUs >= nCaptured * FRAME_US)
+            {
+                int nBacklog = (int)(encodeQueue.size() + bEncoding);
+                if (!BackpressureController::IsQueueBounded(strategy))
+                {
+                    nBacklog += (int)sinkQueue.GetSize();
+                }
+                FrameAction action = controller.OnFrame(nBacklog, lastAgeUs / 1000.0);
+                if (action != FrameAction::Drop)
+                {
+                    encodeQueue.push_back({ nowUs, controller.GetScaleDivisor(), action == FrameAction::Repeat });
+                }
+                nCaptured++;
+            }
+        }
+        const BackpressureStats &stats = controller.GetStats();
+        printf("%-10s: %4llu encoded, %4llu repeated, %4llu dropped at capture, %4llu dropped queued, %4llu delivered, %3llu IDR, "
+            "%llu broken, latency p50 %6.1f ms, p99 %6.1f ms\n",
+            BackpressureController::GetStrategyName(strategy), (unsigned long long)stats.nEncoded, (unsigned long long)stats.nRepeated,
+            (unsigned long long)stats.nDropped, (unsigned long long)sinkQueue.GetDropped(), (unsigned long long)nDelivered,
+            (unsigned long long)nIdr, (unsigned long long)nBroken, latency.GetPercentile(50) / 1000.0, latency.GetPercentile(99) / 1000.0);
+    }
+    return 0;
+}
@@ -0,0 +1,256 @@
+#include "Bench.hpp"
+#include "TaskScheduler.hpp"
+#include "TileHasher.hpp"
+#include "FrameLatency.hpp"
+#include "Crc32.hpp"
+#include "FrameArena.hpp"
+#include "OutputLayout.hpp"
+#include "LargePageBuffer.hpp"
+#include "CpuResize.hpp"
+#include "AllocationCounter.hpp"
+#include <cstring>
+#include <memory>
+#include <thread>
+
+int BenchFrameMetadata(int nFrames)
+{
+    const int WIDTH = 1920, HEIGHT = 1080;
+    const int POOL_SIZE = 3;
+    DamageMap damage;
+    damage.Init(WIDTH, HEIGHT);
+    std::vector<std::unique_ptr<FrameArena>> vArenas;
+    for (int i = 0; i < POOL_SIZE; i++)
+    {
+        vArenas.push_back(std::make_unique<FrameArena>(FramePool::ARENA_BYTES));
+    }
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        uint64_t nAllocations = 0;
+        size_t nRuns = 0;
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+        for (int f = 0; f < nFrames + POOL_SIZE; f++)
+        {
+            if (f == POOL_SIZE)
+            {
+                nAllocations = AllocationCounter::GetCount();
+            }
+            /// Heap containers per frame, or the metadata of a recycled pool surface
+            FrameArena *pArena = pass ? vArenas[f % POOL_SIZE].get() : nullptr;
+            std::pmr::memory_resource *pResource = pArena ? (std::pmr::memory_resource *)pArena : std::pmr::new_delete_resource();
+            {
+                FrameMetadata metadata(pResource);
+                FrameVector<RECT> vRuns(pResource);
+                FrameString log(pResource);
+
+                LONG x = (f * 8) % (WIDTH - 400);
+                damage.Clear();
+                damage.AddRect(x, 200, x + 400, 500);
+                damage.AddRect(0, HEIGHT - 40, WIDTH, HEIGHT);
+                DXGI_OUTDUPL_MOVE_RECT move = { { x - 8, 200 }, { x, 200, x + 400, 500 } };
+                metadata.vMoveRects.push_back(move);
+                if (f % 30 == 0)
+                {
+                    metadata.vInvalidFrames.push_back(f);
+                }
+                OutputLayout::GetDirtyRuns(damage, vRuns);
+                nRuns += vRuns.size();
+                log.resize(128);
+                log.resize(snprintf(&log[0], log.size(), "frame %d: %zu dirty runs, %zu move rects", f, vRuns.size(), metadata.vMoveRects.size()));
+            }
+            if (pArena)
+            {
+                /// The frame retired
+                pArena->Reset();
+            }
+        }
+        QueryPerformanceCounter(&end);
+        nAllocations = AllocationCounter::GetCount() - nAllocations;
+        printf("%-12s: %.2f heap allocations per frame, %.2f us per frame (%zu dirty runs)\n", pass ? "Frame arena" : "Heap", (double)nAllocations / nFrames,
+            (end.QuadPart - start.QuadPart) * 1e6 / freq.QuadPart / (nFrames + POOL_SIZE), nRuns);
+    }
+    for (int i = 0; i < POOL_SIZE; i++)
+    {
+        printf("Arena %d: %zu bytes high water, %llu heap blocks\n", i, vArenas[i]->GetHighWater(), (unsigned long long)vArenas[i]->GetHeapAllocations());
+    }
+    return 0;
+}
+
+int BenchHash(int nFrames)
+{
+    const int WIDTH = 3840, HEIGHT = 2160;
+    std::vector<uint8_t> vFrame((size_t)WIDTH * HEIGHT * 4);
+    uint32_t seed = 1;
+    for (uint8_t &b : vFrame)
+    {
+        seed = seed * 1664525 + 1013904223;
+        b = (uint8_t)(seed >> 24);
+    }
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    int maxThreads = TaskScheduler::GetShared().GetWorkerCount() + 1;
+    printf("%d frames of %dx%d, %d hardware threads\n", nFrames, WIDTH, HEIGHT, (int)std::thread::hardware_concurrency());
+    if (std::thread::hardware_concurrency() < 2)
+    {
+        printf("%s: one hardware thread, the speedup over one thread is not measured\n", __FUNCTION__);
+    }
+    double singleGBs = 0;
+    for (int nThreads = 1; nThreads <= maxThreads; nThreads++)
+    {
+        TileHasher hasher;
+        hasher.Init(WIDTH, HEIGHT, nThreads);
+        DamageMap damage;
+        /// The first frame sizes the damage map and starts the workers
+        hasher.Process(vFrame.data(), WIDTH * 4, damage);
+        LARGE_INTEGER t0, t1;
+        QueryPerformanceCounter(&t0);
+        for (int f = 0; f < nFrames; f++)
+        {
+            /// One changed row per frame, as a cursor or a clock would
+            vFrame[(size_t)(f * 97 % HEIGHT) * WIDTH * 4] ^= 1;
+            hasher.Process(vFrame.data(), WIDTH * 4, damage);
+        }
+        QueryPerformanceCounter(&t1);
+        double seconds = (double)(t1.QuadPart - t0.QuadPart) / freq.QuadPart;
+        double GBs = (double)vFrame.size() * nFrames / seconds / 1e9;
+        if (nThreads == 1)
+        {
+            singleGBs = GBs;
+        }
+        printf("%2d threads: %6.2f GB/s, %.2f ms per frame, %.2fx\n", hasher.GetThreadCount(), GBs, seconds * 1000 / nFrames, GBs / singleGBs);
+    }
+    return 0;
+}
+
+int BenchScheduler(int nFrames)
+{
+    const int WIDTH = 1920, HEIGHT = 1080;
+    const size_t PACKET_BYTES = 4 << 20;
+    const char *szModes[] = { "Threads per session", "Shared, one lane", "Shared, lanes" };
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    printf("%d frames of %dx%d per session, %u hardware threads\n", nFrames, WIDTH, HEIGHT, std::thread::hardware_concurrency());
+    if (std::thread::hardware_concurrency() < 8)
+    {
+        /// Sessions beyond the cores only time-slice: the numbers show the lanes, not scaling across cores
+        printf("%s: fewer hardware threads than the 8 sessions, multi-core scaling is not measured\n", __FUNCTION__);
+    }
+    for (int nSessions = 1; nSessions <= 8; nSessions *= 2)
+    {
+        for (int mode = 0; mode < 3; mode++)
+        {
+            std::vector<std::unique_ptr<TaskScheduler>> vSchedulers;
+            for (int i = 0; i < (mode == 0 ? nSessions : 1); i++)
+            {
+                vSchedulers.push_back(std::make_unique<TaskScheduler>());
+            }
+            std::vector<LatencyHistogram> vLatency(nSessions);
+            std::vector<std::thread> vSessions;
+            LARGE_INTEGER start, end;
+            QueryPerformanceCounter(&start);
+            for (int s = 0; s < nSessions; s++)
+            {
+                vSessions.emplace_back([&, s]
+                {
+                    TaskScheduler *pScheduler = vSchedulers[mode == 0 ? s : 0].get();
+                    TaskPriority muxPriority = mode == 2 ? TaskPriority::Background : TaskPriority::Critical;
+                    std::vector<uint8_t> vFrame((size_t)WIDTH * HEIGHT * 4, (uint8_t)s);
+                    std::vector<uint8_t> vPacket(PACKET_BYTES, (uint8_t)s);
+                    TileHasher hasher;
+                    hasher.Init(WIDTH, HEIGHT, 0, pScheduler);
+                    DamageMap damage;
+                    TaskGroup muxing;
+                    for (int f = 0; f < nFrames; f++)
+                    {
+                        /// A band of rows changes every frame
+                        memset(&vFrame[(size_t)(f * 64 % HEIGHT) * WIDTH * 4], f, (size_t)WIDTH * 4 * 16);
+                        LARGE_INTEGER t0, t1;
+                        QueryPerformanceCounter(&t0);
+                        hasher.Process(vFrame.data(), WIDTH * 4, damage);
+                        QueryPerformanceCounter(&t1);
+                        vLatency[s].Add((t1.QuadPart - t0.QuadPart) * 1000000 / freq.QuadPart);
+                        pScheduler->Submit([&vPacket] { Crc32C(vPacket.data(), vPacket.size()); }, muxPriority, s, &muxing);
+                    }
+                    pScheduler->Wait(muxing);
+                });
+            }
+            for (std::thread &t : vSessions)
+            {
+                t.join();
+            }
+            QueryPerformanceCounter(&end);
+            double seconds = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+            LatencyHistogram total;
+            for (const LatencyHistogram &latency : vLatency)
+            {
+                total.Merge(latency);
+            }
+            printf("%d sessions, %-19s: %7.1f frames/s, hash p50 %.2f ms, p99 %.2f ms, max %.2f ms\n", nSessions, szModes[mode],
+                nSessions * nFrames / seconds, total.GetPercentile(50) / 1000.0, total.GetPercentile(99) / 1000.0, total.GetMax() / 1000.0);
+        }
+    }
+    return 0;
+}
+
+int BenchLargePages(int nFrames)
+{
+    const int WIDTH = 3840, HEIGHT = 2160;
+    const int DST_WIDTH = 1920, DST_HEIGHT = 1080;
+    const int RING_SIZE = 4;
+    const char *szKinds[] = { "none", "4 KB pages", "large pages", "transparent huge pages" };
+    size_t pitch = LargePageBuffer::GetPitch((size_t)WIDTH * 4);
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    printf("%d frames of %dx%d, converted to %dx%d NV12, large page size %zu KB\n", nFrames, WIDTH, HEIGHT, DST_WIDTH, DST_HEIGHT,
+        LargePageBuffer::GetLargePageSize() >> 10);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        bool bLargePages = pass == 1;
+        LargePageBuffer ring[RING_SIZE];
+        LargePageBuffer nv12;
+        for (LargePageBuffer &frame : ring)
+        {
+            if (!frame.Allocate(pitch * HEIGHT, bLargePages))
+            {
+                return 1;
+            }
+            /// Touch every page before timing
+            for (int y = 0; y < HEIGHT; y++)
+            {
+                memset(frame.GetData() + y * pitch, (y * 7) & 0xFF, pitch);
+            }
+        }
+        if (!nv12.Allocate((size_t)DST_WIDTH * DST_HEIGHT * 3 / 2, bLargePages))
+        {
+            return 1;
+        }
+        memset(nv12.GetData(), 0, nv12.GetSize());
+
+        TileHasher hasher;
+        hasher.Init(WIDTH, HEIGHT, 1);
+        DamageMap damage;
+        CpuBgraToNv12Scaler scaler;
+        scaler.Init(WIDTH, HEIGHT, DST_WIDTH, DST_HEIGHT);
+        LONGLONG hashTicks = 0, convertTicks = 0;
+        for (int f = 0; f < nFrames; f++)
+        {
+            LargePageBuffer &frame = ring[f % RING_SIZE];
+            /// A band of rows changes every frame
+            memset(frame.GetData() + (size_t)(f * 64 % HEIGHT) * pitch, f, pitch * 16);
+            LARGE_INTEGER t0, t1, t2;
+            QueryPerformanceCounter(&t0);
+            hasher.Process(frame.GetData(), (int)pitch, damage);
+            QueryPerformanceCounter(&t1);
+            scaler.Convert(frame.GetData(), (int)pitch, nv12.GetData(), DST_WIDTH);
+            QueryPerformanceCounter(&t2);
+            hashTicks += t1.QuadPart - t0.QuadPart;
+            convertTicks += t2.QuadPart - t1.QuadPart;
+        }
+        printf("%-22s: hash %.2f ms per frame, convert %.2f ms per frame\n", szKinds[(int)ring[0].GetPageKind()],
+            hashTicks * 1000.0 / freq.QuadPart / nFrames, convertTicks * 1000.0 / freq.QuadPart / nFrames);
+        LargePageBuffer::PrintStats();
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include "Bench.hpp"
+#include "CpuResize.hpp"
+#include "../src/Encoders/RGBToNV12.h"
+#include "NvCodecUtils.h"
+#include <cstdlib>
+
+int BenchFused(int nFrames)
+{
+    const int WIDTH = 3840, HEIGHT = 2160;
+    const int vDstSizes[][2] = { { 1920, 1080 }, { 960, 540 } };
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+
+    /// Gradients under a fine checkerboard, so the filter footprint matters
+    std::vector<uint8_t> vBgra((size_t)WIDTH * HEIGHT * 4);
+    for (int y = 0; y < HEIGHT; y++)
+    {
+        for (int x = 0; x < WIDTH; x++)
+        {
+            uint8_t *p = &vBgra[((size_t)y * WIDTH + x) * 4];
+            p[0] = (uint8_t)(x * 255 / WIDTH);
+            p[1] = (uint8_t)(y * 255 / HEIGHT);
+            p[2] = ((x / 3 ^ y / 3) & 1) ? 230 : 20;
+            p[3] = 255;
+        }
+    }
+
+    cudaArray_t srcArray = nullptr;
+    cudaChannelFormatDesc format = cudaCreateChannelDesc<uchar4>();
+    uint8_t *dpFull = nullptr, *dpDst = nullptr;
+    size_t fullPitch = 0, dstPitch = 0;
+    cudaEvent_t start = nullptr, stop = nullptr;
+    if (cudaMallocArray(&srcArray, &format, WIDTH, HEIGHT) != cudaSuccess ||
+        cudaMemcpy2DToArray(srcArray, 0, 0, vBgra.data(), WIDTH * 4, WIDTH * 4, HEIGHT, cudaMemcpyHostToDevice) != cudaSuccess ||
+        cudaMallocPitch((void **)&dpFull, &fullPitch, WIDTH, HEIGHT * 3 / 2) != cudaSuccess ||
+        cudaMallocPitch((void **)&dpDst, &dstPitch, vDstSizes[0][0], vDstSizes[0][1] * 3 / 2) != cudaSuccess ||
+        cudaEventCreate(&start) != cudaSuccess || cudaEventCreate(&stop) != cudaSuccess)
+    {
+        printf("CUDA setup failed: %s\n", cudaGetErrorString(cudaGetLastError()));
+        return 1;
+    }
+
+    printf("%d frames of %dx%d BGRA\n", nFrames, WIDTH, HEIGHT);
+    for (const int *pSize : vDstSizes)
+    {
+        const int w = pSize[0], h = pSize[1];
+        float vGpuMs[2] = { 0, 0 };
+        for (int pass = 0; pass < 2; pass++)
+        {
+            /// One untimed frame loads the kernels
+            for (int f = -1; f < nFrames; f++)
+            {
+                if (f == 0)
+                {
+                    cudaEventRecord(start);
+                }
+                if (pass == 0)
+                {
+                    BGRA2NV12Scaled(srcArray, WIDTH, HEIGHT, dpDst, dstPitch, w, h);
+                }
+                else
+                {
+                    RGBA2NV12(srcArray, dpFull, fullPitch, WIDTH, HEIGHT);
+                    ResizeNv12(dpDst, (int)dstPitch, w, h, dpFull, (int)fullPitch, WIDTH, HEIGHT);
+                }
+            }
+            cudaEventRecord(stop);
+            cudaEventSynchronize(stop);
+            cudaEventElapsedTime(&vGpuMs[pass], start, stop);
+        }
+        if (cudaGetLastError() != cudaSuccess)
+        {
+            printf("GPU conversion failed\n");
+            return 1;
+        }
+        std::vector<uint8_t> vGpuNv12((size_t)w * h * 3 / 2);
+        BGRA2NV12Scaled(srcArray, WIDTH, HEIGHT, dpDst, dstPitch, w, h);
+        cudaMemcpy2D(vGpuNv12.data(), w, dpDst, dstPitch, w, h * 3 / 2, cudaMemcpyDeviceToHost);
+
+        std::vector<uint8_t> vNv12((size_t)w * h * 3 / 2);
+        std::vector<uint8_t> vFullNv12((size_t)WIDTH * HEIGHT * 3 / 2);
+        CpuBgraToNv12Scaler fused, convert;
+        fused.Init(WIDTH, HEIGHT, w, h);
+        convert.Init(WIDTH, HEIGHT, WIDTH, HEIGHT);
+        CpuResizer resizer;
+        resizer.Init(WIDTH, HEIGHT, w, h, CpuResizeFilter::Area);
+        LONGLONG vCpuTicks[2] = { 0, 0 };
+        for (int pass = 0; pass < 2; pass++)
+        {
+            LARGE_INTEGER t0, t1;
+            QueryPerformanceCounter(&t0);
+            for (int f = 0; f < nFrames; f++)
+            {
+                if (pass == 0)
+                {
+                    fused.Convert(vBgra.data(), WIDTH * 4, vNv12.data(), w);
+                }
+                else
+                {
+                    convert.Convert(vBgra.data(), WIDTH * 4, vFullNv12.data(), WIDTH);
+                    resizer.ResizeNv12(vNv12.data(), w, vFullNv12.data(), WIDTH);
+                }
+            }
+            QueryPerformanceCounter(&t1);
+            vCpuTicks[pass] = t1.QuadPart - t0.QuadPart;
+        }
+        fused.Convert(vBgra.data(), WIDTH * 4, vNv12.data(), w);
+        int maxDiff = 0;
+        for (size_t i = 0; i < vNv12.size(); i++)
+        {
+            maxDiff = std::max(maxDiff, abs((int)vNv12[i] - (int)vGpuNv12[i]));
+        }
+
+        printf("%dx%d: GPU fused %.3f ms, two-pass %.3f ms per frame; CPU fused %.2f ms, two-pass %.2f ms per frame; "
+            "GPU and CPU fused differ by up to %d\n", w, h, vGpuMs[0] / nFrames, vGpuMs[1] / nFrames,
+            vCpuTicks[0] * 1000.0 / freq.QuadPart / nFrames, vCpuTicks[1] * 1000.0 / freq.QuadPart / nFrames, maxDiff);
+    }
+    cudaEventDestroy(start);
+    cudaEventDestroy(stop);
+    cudaFree(dpDst);
+    cudaFree(dpFull);
+    cudaFreeArray(srcArray);
+    return 0;
+}
@@ -0,0 +1,246 @@
+#include "Bench.hpp"
+#include "Metrics.hpp"
+#include "AllocationCounter.hpp"
+#include <cstring>
+#include <memory>
+
+/// Encode nFrames replayed frames as fast as they can be read. Returns the milliseconds per frame, or a negative value on failure
+static double EncodeReplay(CudaH264Array *pEncoder, int nFrames)
+{
+    HRESULT hr = pEncoder->Init();
+    if (FAILED(hr))
+    {
+        printf("Initialization failed with error 0x%08x\n", hr);
+        return -1;
+    }
+    LARGE_INTEGER start, end, freq;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+    /// Identical consecutive frames are skipped by the replay, give up on a file of those
+    int nEncoded = 0;
+    for (int nAttempts = 0; nEncoded < nFrames && nAttempts < nFrames * 4; nAttempts++)
+    {
+        hr = pEncoder->Capture(0);
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+        {
+            continue;
+        }
+        if (FAILED(hr) || FAILED(hr = pEncoder->Preproc()))
+        {
+            printf("Encoding failed with error 0x%08x\n", hr);
+            return -1;
+        }
+        nEncoded++;
+    }
+    QueryPerformanceCounter(&end);
+    return nEncoded ? (end.QuadPart - start.QuadPart) * 1000.0 / freq.QuadPart / nEncoded : 0;
+}
+
+int BenchRefresh(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    const IntraRefreshConfig &refresh, const std::string &encoderOptions)
+{
+    PacketStats vStats[2];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        std::unique_ptr<CudaH264Array> Cudah264 = std::make_unique<CudaH264Array>(argc, argv);
+        Cudah264->SetReplay(replayPath, width, height, 0);
+        if (pass == 0)
+        {
+            Cudah264->SetEncoderOptions(encoderOptions + " -gop " + std::to_string(refresh.period));
+        }
+        else
+        {
+            Cudah264->SetEncoderOptions(encoderOptions);
+            Cudah264->SetIntraRefresh(refresh);
+        }
+        if (EncodeReplay(Cudah264.get(), nFrames) < 0)
+        {
+            return -1;
+        }
+        vStats[pass] = Cudah264->GetPacketStats();
+    }
+    vStats[0].Print("IDR GOP      ");
+    vStats[1].Print("Intra refresh");
+    return 0;
+}
+
+int BenchHints(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    UINT scrollRows, const std::string &encoderOptions)
+{
+    PacketStats vStats[2];
+    double vMs[2];
+    for (int pass = 0; pass < 2; pass++)
+    {
+        std::unique_ptr<CudaH264Array> Cudah264 = std::make_unique<CudaH264Array>(argc, argv);
+        Cudah264->SetReplay(replayPath, width, height, 0);
+        Cudah264->SetReplayScroll(scrollRows);
+        Cudah264->SetEncoderOptions(encoderOptions);
+        Cudah264->SetMotionHints(pass == 1);
+        vMs[pass] = EncodeReplay(Cudah264.get(), nFrames);
+        if (vMs[pass] < 0)
+        {
+            return -1;
+        }
+        vStats[pass] = Cudah264->GetPacketStats();
+        if (pass == 1)
+        {
+            printf("%llu of %d frames hinted\n", (unsigned long long)Cudah264->GetHintedFrames(), nFrames);
+        }
+    }
+    printf("Scrolling %u rows per frame:\n", scrollRows);
+    vStats[0].Print("Motion search");
+    printf("  %.2f ms per frame\n", vMs[0]);
+    vStats[1].Print("Move rect hints");
+    printf("  %.2f ms per frame\n", vMs[1]);
+    return 0;
+}
+
+int BenchRecovery(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    UINT injectEvery, const std::string &encoderOptions)
+{
+    std::unique_ptr<CudaH264Array> Cudah264 = std::make_unique<CudaH264Array>(argc, argv);
+    Cudah264->SetReplay(replayPath, width, height, injectEvery);
+    Cudah264->SetEncoderOptions(encoderOptions);
+    uint64_t nPackets = 0, nRecoveryPoints = 0, lastFrame = 0, nOutOfOrder = 0;
+    Cudah264->SetPacketSink([&](const std::vector<uint8_t> &packet, const FrameTiming &timing) {
+        nOutOfOrder += nPackets && timing.frameNumber <= lastFrame;
+        lastFrame = timing.frameNumber;
+        nRecoveryPoints += timing.bRecoveryPoint;
+        nPackets++;
+    });
+    HRESULT hr = Cudah264->Init();
+    if (FAILED(hr))
+    {
+        printf("Initialization failed with error 0x%08x\n", hr);
+        return -1;
+    }
+    auto GetRecoveryTimes = []() {
+        for (const MetricSample &sample : MetricsRegistry::Snapshot())
+        {
+            if (!strcmp(sample.pMetric->szName, "capture_recovery_microseconds"))
+            {
+                return sample.histogram.GetCount();
+            }
+        }
+        return (uint64_t)0;
+    };
+
+    const UINT nSessions = Cudah264->GetEncoderSessionCount();
+    const uint64_t nTimesBefore = GetRecoveryTimes();
+    int nEncoded = 0, nLosses = 0, nFailures = 0;
+    uint64_t packetsAtLoss = 0;
+    for (int nAttempts = 0; nEncoded < nFrames && nAttempts < nFrames * 4; nAttempts++)
+    {
+        hr = Cudah264->Capture(0);
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+        {
+            continue;
+        }
+        if (FAILED(hr))
+        {
+            if (!Cudah264->IsRecovering())
+            {
+                nLosses++;
+                packetsAtLoss = nPackets;
+            }
+            if (FAILED(hr = Cudah264->Recover(hr)))
+            {
+                printf("Recovery failed with error 0x%08x\n", hr);
+                return 1;
+            }
+            continue;
+        }
+        bool bRecovering = Cudah264->IsRecovering();
+        if (FAILED(hr = Cudah264->Preproc()))
+        {
+            printf("Encoding failed with error 0x%08x\n", hr);
+            return 1;
+        }
+        nEncoded++;
+        if (!bRecovering)
+        {
+            continue;
+        }
+        /// The first frame after a loss
+        if (Cudah264->IsRecovering() || Cudah264->GetLastRecoveryMs() <= 0)
+        {
+            printf("Frame %d: no time to first frame after the loss\n", nEncoded);
+            nFailures++;
+        }
+        if (Cudah264->GetLastRecoveryLevel() != RecoveryLevel::Capture)
+        {
+            printf("Frame %d: recovery rebuilt up to level %d, only the capture was lost\n", nEncoded, (int)Cudah264->GetLastRecoveryLevel());
+            nFailures++;
+        }
+        if (Cudah264->GetEncoderSessionCount() != nSessions)
+        {
+            printf("Frame %d: the recovery created a new encoder session\n", nEncoded);
+            nFailures++;
+        }
+    }
+    /// Every loss but one still in progress at the end was recovered, and the metric saw each of them
+    const UINT nRecoveries = Cudah264->GetRecoveryCount();
+    const uint64_t nTimes = GetRecoveryTimes() - nTimesBefore;
+    if (nLosses < 1 || nRecoveries + 1 < (UINT)nLosses || nTimes != nRecoveries)
+    {
+        printf("%d losses, %u recoveries, %llu times to first frame in the metric\n", nLosses, nRecoveries, (unsigned long long)nTimes);
+        nFailures++;
+    }
+    printf("%d frames, %d losses, %u recoveries, time to first frame %.1f ms last, %.1f ms worst, %u encoder session(s)\n", nEncoded,
+        nLosses, nRecoveries, Cudah264->GetLastRecoveryMs(), Cudah264->GetMaxRecoveryMs(), Cudah264->GetEncoderSessionCount());
+    /// Flushes the encoder: the frames after the last loss come out of the same stream
+    Cudah264.reset();
+    if (nOutOfOrder || nPackets <= packetsAtLoss)
+    {
+        printf("Output stream broken: %llu packets out of order, %llu packets after the last loss\n", (unsigned long long)nOutOfOrder,
+            (unsigned long long)(nPackets - packetsAtLoss));
+        nFailures++;
+    }
+    printf("%llu packets, %llu recovery points, %s\n", (unsigned long long)nPackets, (unsigned long long)nRecoveryPoints,
+        nFailures ? "FAILED" : "OK");
+    return nFailures ? 1 : 0;
+}
+
+int BenchCaptureAllocations(int nFrames, int argc, char *argv[], const std::string &replayPath, DWORD width, DWORD height,
+    const std::string &encoderOptions)
+{
+    const int WARMUP_FRAMES = 60;
+    std::unique_ptr<CudaH264Array> Cudah264 = std::make_unique<CudaH264Array>(argc, argv);
+    Cudah264->SetReplay(replayPath, width, height, 0);
+    Cudah264->SetEncoderOptions(encoderOptions);
+    HRESULT hr = Cudah264->Init();
+    if (FAILED(hr))
+    {
+        printf("Initialization failed with error 0x%08x\n", hr);
+        return -1;
+    }
+    uint64_t nAllocations = 0;
+    int nEncoded = 0;
+    for (int nAttempts = 0; nEncoded < WARMUP_FRAMES + nFrames && nAttempts < (WARMUP_FRAMES + nFrames) * 4; nAttempts++)
+    {
+        hr = Cudah264->Capture(0);
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+        {
+            continue;
+        }
+        if (FAILED(hr) || FAILED(hr = Cudah264->Preproc()))
+        {
+            printf("Encoding failed with error 0x%08x\n", hr);
+            return -1;
+        }
+        if (++nEncoded == WARMUP_FRAMES)
+        {
+            nAllocations = AllocationCounter::GetCount();
+        }
+    }
+    nAllocations = AllocationCounter::GetCount() - nAllocations;
+    int nMeasured = nEncoded - WARMUP_FRAMES;
+    if (nMeasured <= 0)
+    {
+        printf("%s: %d frames encoded, none after the warm-up\n", __FUNCTION__, nEncoded);
+        return 1;
+    }
+    printf("Capture loop: %.2f heap allocations per frame over %d frames after %d warm-up frames\n", (double)nAllocations / nMeasured,
+        nMeasured, WARMUP_FRAMES);
+    return nAllocations ? 1 : 0;
+}
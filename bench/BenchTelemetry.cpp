@@ -0,0 +1,268 @@
+#include "Bench.hpp"
+#include "BinaryLog.hpp"
+#include "PipelineTrace.hpp"
+#include "Metrics.hpp"
+#include "FrameLatency.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+int BenchBinaryLog(int nRecords)
+{
+    const int BURST = 1024;
+    const char *szModes[] = { "ofstream, std::endl", "ostringstream, lock", "BINLOG", "BINLOG_EVERY_MS(1000)", "BINLOG, level off" };
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    if (!BinaryLog::Open("bench.blog", BinaryLogLevel::Info))
+    {
+        return 1;
+    }
+    std::ofstream ofs("bench.txt");
+    std::mutex mutex;
+    for (int mode = 0; mode < 5; mode++)
+    {
+        LONGLONG ticks = 0;
+        for (int n = 0; n < nRecords; n += BURST)
+        {
+            LARGE_INTEGER t0, t1;
+            QueryPerformanceCounter(&t0);
+            for (int i = n; i < n + BURST; i++)
+            {
+                long long pts = 1000000LL + i * 16667LL;
+                switch (mode)
+                {
+                case 0:
+                    ofs << "frameNo: " << i << " | Accumulated: " << 1 << " | PTS: " << pts << " | PTSInterval: " << 16667 << std::endl;
+                    break;
+                case 1:
+                {
+                    std::ostringstream oss;
+                    oss << "frameNo: " << i << " | Accumulated: " << 1 << " | PTS: " << pts << " | PTSInterval: " << 16667;
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ofs << oss.str() << '\n';
+                    break;
+                }
+                case 2:
+                    BINLOG(BinaryLogLevel::Info, "Output %u frame %d: accumulated %u, PTS %lld, PTS interval %lld us", 0u, i, 1u, pts, 16667LL);
+                    break;
+                case 3:
+                    BINLOG_EVERY_MS(1000, BinaryLogLevel::Info, "Output %u frame %d: accumulated %u, PTS %lld", 0u, i, 1u, pts);
+                    break;
+                case 4:
+                    BINLOG(BinaryLogLevel::Trace, "Output %u frame %d: accumulated %u, PTS %lld", 0u, i, 1u, pts);
+                    break;
+                }
+            }
+            QueryPerformanceCounter(&t1);
+            ticks += t1.QuadPart - t0.QuadPart;
+            if (mode >= 2)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(4));
+            }
+        }
+        printf("%-22s: %7.1f ns per call\n", szModes[mode], ticks * 1e9 / freq.QuadPart / nRecords);
+    }
+    BinaryLog::Close();
+    printf("%llu records written to bench.blog, %llu dropped\n", (unsigned long long)BinaryLog::GetWritten(), (unsigned long long)BinaryLog::GetDropped());
+    return 0;
+}
+
+int BenchTrace(int nSpans)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    for (int pass = 0; pass < 2; pass++)
+    {
+        PipelineTrace::Enable(pass == 1);
+        LARGE_INTEGER t0, t1;
+        QueryPerformanceCounter(&t0);
+        for (int i = 0; i < nSpans; i++)
+        {
+            TraceSpan span("convert", (uint64_t)i);
+        }
+        QueryPerformanceCounter(&t1);
+        printf("Tracing %-3s: %6.1f ns per span\n", pass ? "on" : "off", (t1.QuadPart - t0.QuadPart) * 1e9 / freq.QuadPart / nSpans);
+    }
+    PipelineTrace::Clear();
+
+    /// Busy work standing in for a stage, in microseconds
+    auto work = [&freq](int us)
+    {
+        LARGE_INTEGER start, now;
+        QueryPerformanceCounter(&start);
+        do
+        {
+            QueryPerformanceCounter(&now);
+        } while ((now.QuadPart - start.QuadPart) * 1000000 < us * freq.QuadPart);
+    };
+    const int nFrames = std::max(nSpans / 8, 1);
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<uint64_t> encoded, locked;
+    bool bDone = false;
+    std::thread output([&]
+    {
+        PipelineTrace::SetThreadName("NVENC output");
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            cv.wait(lock, [&] { return !encoded.empty() || bDone; });
+            if (encoded.empty())
+            {
+                break;
+            }
+            uint64_t frame = encoded.front();
+            encoded.pop_front();
+            lock.unlock();
+            {
+                TraceSpan span("bitstream lock", frame);
+                work(300);
+            }
+            lock.lock();
+            locked.push_back(frame);
+            cv.notify_all();
+        }
+    });
+    std::thread writer([&]
+    {
+        PipelineTrace::SetThreadName("writer");
+        int nWritten = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (nWritten < nFrames)
+        {
+            cv.wait(lock, [&] { return !locked.empty(); });
+            uint64_t frame = locked.front();
+            locked.pop_front();
+            lock.unlock();
+            {
+                TraceSpan span("mux", frame);
+                work(100);
+            }
+            {
+                TraceSpan span("write", frame);
+                work(200);
+            }
+            nWritten++;
+            lock.lock();
+        }
+    });
+    PipelineTrace::SetThreadName("capture");
+    for (int f = 0; f < nFrames; f++)
+    {
+        {
+            TraceSpan span("acquire", (uint64_t)f);
+            work(200);
+        }
+        {
+            TraceSpan span("convert", (uint64_t)f);
+            work(500);
+        }
+        {
+            TraceSpan span("submit", (uint64_t)f);
+            work(100);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        encoded.push_back(f);
+        cv.notify_all();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bDone = true;
+        cv.notify_all();
+    }
+    output.join();
+    writer.join();
+    for (const char *szPath : { "bench.trace.json", "bench.perfetto-trace" })
+    {
+        int64_t n = PipelineTrace::Export(szPath);
+        if (n < 0)
+        {
+            return 1;
+        }
+        printf("%lld spans of %d frames written to %s\n", (long long)n, nFrames, szPath);
+    }
+    PipelineTrace::Enable(false);
+    return 0;
+}
+
+int BenchMetrics(int nOps)
+{
+    static MetricCounter s_benchCounter("bench_ops_total", "Counter updates of -benchmetrics");
+    static MetricHistogram s_benchHistogram("bench_duration_microseconds", "Histogram updates of -benchmetrics");
+    std::atomic<uint64_t> sharedCounter{ 0 };
+    std::mutex histogramMutex;
+    LatencyHistogram lockedHistogram;
+
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    /// Nanoseconds per call of fn(i) on nThreads threads at once, each making nOps calls
+    auto time = [&](int nThreads, auto fn)
+    {
+        std::vector<std::thread> vThreads;
+        std::atomic<int> nReady{ 0 };
+        LARGE_INTEGER t0, t1;
+        QueryPerformanceCounter(&t0);
+        for (int t = 0; t < nThreads; t++)
+        {
+            vThreads.emplace_back([&, t]
+            {
+                /// Start together, so the threads contend
+                nReady++;
+                while (nReady.load() < nThreads)
+                {
+                }
+                for (int i = 0; i < nOps; i++)
+                {
+                    fn(t * 7919 + i);
+                }
+            });
+        }
+        for (std::thread &thread : vThreads)
+        {
+            thread.join();
+        }
+        QueryPerformanceCounter(&t1);
+        return (t1.QuadPart - t0.QuadPart) * 1e9 / freq.QuadPart / nOps;
+    };
+    auto counter = [&](int) { s_benchCounter.Add(); };
+    auto atomicCounter = [&](int) { sharedCounter.fetch_add(1, std::memory_order_relaxed); };
+    auto histogram = [&](int i) { s_benchHistogram.Observe(i % 20000); };
+    auto locked = [&](int i)
+    {
+        std::lock_guard<std::mutex> lock(histogramMutex);
+        lockedHistogram.Add(i % 20000);
+    };
+
+    int nThreads = (int)std::min(std::max(std::thread::hardware_concurrency(), 2u), 8u);
+    printf("%d updates per thread, ns per update per thread\n", nOps);
+    printf("%-22s %10s %10s\n", "", "1 thread", (std::to_string(nThreads) + " threads").c_str());
+    printf("%-22s %10.1f %10.1f\n", "Sharded counter", time(1, counter), time(nThreads, counter));
+    printf("%-22s %10.1f %10.1f\n", "Shared atomic counter", time(1, atomicCounter), time(nThreads, atomicCounter));
+    printf("%-22s %10.1f %10.1f\n", "Sharded histogram", time(1, histogram), time(nThreads, histogram));
+    printf("%-22s %10.1f %10.1f\n", "Locked histogram", time(1, locked), time(nThreads, locked));
+    uint64_t nExpected = (uint64_t)nOps * (1 + nThreads);
+    if (s_benchCounter.GetValue() != nExpected || s_benchHistogram.GetHistogram().GetCount() != nExpected)
+    {
+        printf("Metrics lost updates: counter %llu, histogram %llu, expected %llu\n", (unsigned long long)s_benchCounter.GetValue(),
+            (unsigned long long)s_benchHistogram.GetHistogram().GetCount(), (unsigned long long)nExpected);
+        return 1;
+    }
+
+    LARGE_INTEGER t0, t1, t2, t3;
+    QueryPerformanceCounter(&t0);
+    std::vector<MetricSample> vSamples = MetricsRegistry::Snapshot();
+    QueryPerformanceCounter(&t1);
+    std::string json = MetricsRegistry::ToJson(vSamples);
+    QueryPerformanceCounter(&t2);
+    std::string prometheus = MetricsRegistry::ToPrometheus(vSamples);
+    QueryPerformanceCounter(&t3);
+    printf("Snapshot of %zu metrics: %.1f us, JSON %zu bytes in %.1f us, Prometheus %zu bytes in %.1f us\n", vSamples.size(),
+        (t1.QuadPart - t0.QuadPart) * 1e6 / freq.QuadPart, json.size(), (t2.QuadPart - t1.QuadPart) * 1e6 / freq.QuadPart,
+        prometheus.size(), (t3.QuadPart - t2.QuadPart) * 1e6 / freq.QuadPart);
+    s_benchHistogram.GetHistogram().Print("Bench histogram");
+    return MetricsRegistry::WriteFile("bench.metrics.json") && MetricsRegistry::WriteFile("bench.metrics.prom") ? 0 : 1;
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+class AllocationCounter
+{
+    /// Global heap allocations of the process, for -benchalloc. Counting replaces every replaceable
+    /// operator new and delete of the program (AllocationCounter.cpp), so it is only built with
+    /// -DCOUNT_ALLOCATIONS=ON; other builds keep the allocator of the C++ runtime and count nothing
+public:
+#ifdef COUNT_ALLOCATIONS
+    static constexpr bool ENABLED = true;
+    /// Calls of operator new in any form, from any thread, since the process started
+    static uint64_t GetCount();
+#else
+    static constexpr bool ENABLED = false;
+    static uint64_t GetCount() { return 0; }
+#endif
+};
@@ -0,0 +1,384 @@
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <utility>
+#include <type_traits>
+#include <optional>
+#include <functional>
+#include <deque>
+#include <queue>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include "DesktopTypes.hpp"
+#include "FrameLatency.hpp"
+#include "TaskScheduler.hpp"
+#include "Backpressure.hpp"
+
+/// Coroutine layer over the pipeline. Session logic is written as straight-line AsyncTask coroutines
+/// that co_await frames, encoded packets and writes instead of blocking a thread on them; every
+/// resumption runs as a task of a TaskScheduler, so any number of sessions share its workers.
+
+namespace AsyncDetail
+{
+    /// Continues the coroutine that awaited a finished task, on the same thread
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept
+        {
+            std::coroutine_handle<> next = h.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    struct PromiseBase
+    {
+        std::coroutine_handle<> continuation;
+        std::exception_ptr exception;
+        /// Tasks start when awaited
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    template <typename T>
+    struct Promise : PromiseBase
+    {
+        std::optional<T> value;
+        template <typename U>
+        void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+        T Result()
+        {
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+            return std::move(*value);
+        }
+    };
+
+    template <>
+    struct Promise<void> : PromiseBase
+    {
+        void return_void() {}
+        void Result()
+        {
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+        }
+    };
+}
+
+template <typename T = void>
+class AsyncTask
+{
+    /// A coroutine returning T. Starts when it is co_awaited and resumes the awaiting coroutine when
+    /// it returns; an exception it throws is rethrown there. Move only, owns the coroutine frame
+public:
+    struct promise_type : AsyncDetail::Promise<T>
+    {
+        AsyncTask get_return_object() { return AsyncTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    AsyncTask() = default;
+    AsyncTask(AsyncTask &&other) noexcept : m_handle(std::exchange(other.m_handle, nullptr)) {}
+    AsyncTask &operator=(AsyncTask &&other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+    AsyncTask(const AsyncTask &) = delete;
+    AsyncTask &operator=(const AsyncTask &) = delete;
+    ~AsyncTask()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    auto operator co_await() noexcept
+    {
+        struct Awaiter
+        {
+            std::coroutine_handle<promise_type> handle;
+            bool await_ready() noexcept { return !handle || handle.done(); }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+            T await_resume() { return handle.promise().Result(); }
+        };
+        return Awaiter{ m_handle };
+    }
+
+private:
+    explicit AsyncTask(std::coroutine_handle<promise_type> handle) : m_handle(handle) {}
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+class PipelineExecutor
+{
+    /// Runs coroutines on the workers of a TaskScheduler. A spawned session carries an affinity and
+    /// a priority lane; whenever it is resumed, by a timer, a packet or a finished write, it is
+    /// queued on that worker and lane again, so it stays warm in one core's cache while other
+    /// sessions and the rest of the pipeline share the same threads. One timer thread serves all
+    /// Delay() calls; their precision is that of the OS timer (Windows defaults to 15.6 ms unless a
+    /// process raised it with timeBeginPeriod()).
+public:
+    explicit PipelineExecutor(TaskScheduler &scheduler = TaskScheduler::GetShared());
+    /// Waits for the spawned sessions
+    ~PipelineExecutor();
+    PipelineExecutor(const PipelineExecutor &) = delete;
+    PipelineExecutor &operator=(const PipelineExecutor &) = delete;
+
+    /// Start a session. 'affinity' is the preferred worker, -1 for any. onDone, if given, is called
+    /// on the worker that finished it. An exception escaping the session is printed
+    void Spawn(AsyncTask<void> task, int affinity = -1, TaskPriority priority = TaskPriority::Critical,
+        std::function<void()> onDone = nullptr);
+    /// Block the calling thread, which must not be a worker, until all spawned sessions returned
+    void Join();
+    /// Run a task as a session and block the calling thread until it returns its result
+    template <typename T>
+    T SyncWait(AsyncTask<T> task, int affinity = -1, TaskPriority priority = TaskPriority::Critical);
+
+    /// Lane and worker of a session, restored on the thread that resumes it
+    struct Context
+    {
+        int affinity = -1;
+        TaskPriority priority = TaskPriority::Critical;
+    };
+    /// Context of the session running on this thread
+    static Context GetCurrentContext();
+    /// Queue h on the lane and worker of a session
+    void Resume(std::coroutine_handle<> h, const Context &context);
+    void Resume(std::coroutine_handle<> h) { Resume(h, GetCurrentContext()); }
+    /// Suspend for ms milliseconds. 0 requeues the session behind the work already queued
+    auto Delay(int ms)
+    {
+        struct Awaiter
+        {
+            PipelineExecutor *pExecutor;
+            int ms;
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { pExecutor->Schedule(h, ms); }
+            void await_resume() noexcept {}
+        };
+        return Awaiter{ this, ms };
+    }
+    /// Let other sessions run
+    auto Yield() { return Delay(0); }
+    /// Call fn, which must not block, until it returns something other than DXGI_ERROR_WAIT_TIMEOUT
+    /// or waitMs have passed, suspending intervalMs between calls. Returns the last result
+    AsyncTask<HRESULT> Poll(std::function<HRESULT()> fn, int waitMs, int intervalMs = 1);
+
+    TaskScheduler &GetScheduler() { return m_scheduler; }
+
+private:
+    struct Timer
+    {
+        std::chrono::steady_clock::time_point due;
+        std::coroutine_handle<> handle;
+        Context context;
+        bool operator>(const Timer &other) const { return due > other.due; }
+    };
+
+    TaskScheduler &m_scheduler;
+    /// Sessions that have not returned
+    int m_nRunning = 0;
+    std::mutex m_mutex;
+    std::condition_variable m_cvIdle;
+
+    std::thread m_timerThread;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> m_timers;
+    std::mutex m_timerMutex;
+    std::condition_variable m_cvTimer;
+    bool m_bQuit = false;
+
+    /// Resume h after ms milliseconds, in the context of the calling session
+    void Schedule(std::coroutine_handle<> h, int ms);
+    void TimerProc();
+    void SessionDone();
+};
+
+/// Acquire a frame from a capture source without holding a worker while the desktop is idle:
+/// GetCapturedFrame() is polled with no wait until a frame comes or waitMs have passed. Source is an
+/// ICaptureSource, or anything else with its GetCapturedFrame()
+template <typename Source, typename Texture>
+AsyncTask<HRESULT> AcquireFrame(PipelineExecutor &executor, Source &source, Texture **ppTex2D, int waitMs)
+{
+    co_return co_await executor.Poll([&source, ppTex2D] { return source.GetCapturedFrame(ppTex2D, 0); }, waitMs);
+}
+
+/// An encoded frame with the timestamps of its capture
+struct EncodedPacket
+{
+    std::vector<uint8_t> data;
+    FrameTiming timing;
+};
+
+class PacketChannel
+{
+    /// Completion of encoded frames. The encoder pushes every packet it finishes, e.g. from
+    /// CudaH264Array::SetPacketSink() on its retrieval thread; one session co_awaits Receive() for
+    /// each and is resumed on its worker when the packet arrives.
+public:
+    explicit PacketChannel(PipelineExecutor &executor) : m_executor(executor) {}
+
+    /// Bound the queue for a receiver that falls behind, see BoundedPacketQueue. onRecoveryNeeded is
+    /// called after drops that left the receiver waiting for a recovery point, e.g. with
+    /// CudaH264Array::ForceRecovery(). Before the first Push()
+    void SetLimit(BackpressureStrategy strategy, size_t nMaxPackets, std::function<void()> onRecoveryNeeded);
+    /// Queue a packet. Any thread
+    void Push(const std::vector<uint8_t> &data, const FrameTiming &timing);
+    /// No more packets, Receive() returns empty once the queued ones are taken. Any thread
+    void Close();
+
+    /// The next packet, or nothing when the channel was closed. One receiver at a time
+    auto Receive()
+    {
+        struct Awaiter
+        {
+            PacketChannel *pChannel;
+            bool await_ready()
+            {
+                std::lock_guard<std::mutex> lock(pChannel->m_mutex);
+                return !pChannel->m_queue.Empty() || pChannel->m_bClosed;
+            }
+            bool await_suspend(std::coroutine_handle<> h) { return pChannel->Wait(h); }
+            std::optional<EncodedPacket> await_resume() { return pChannel->Pop(); }
+        };
+        return Awaiter{ this };
+    }
+
+    /// Queued packets, the sink's share of the backlog. Any thread
+    size_t GetSize();
+    uint64_t GetDropped();
+
+private:
+    PipelineExecutor &m_executor;
+    std::mutex m_mutex;
+    BoundedPacketQueue<EncodedPacket> m_queue;
+    std::function<void()> m_onRecoveryNeeded;
+    bool m_bClosed = false;
+    /// Suspended receiver, resumed by the next Push() or Close()
+    std::coroutine_handle<> m_waiter;
+    PipelineExecutor::Context m_waiterContext;
+
+    /// Park the receiver unless a packet arrived meanwhile
+    bool Wait(std::coroutine_handle<> h);
+    std::optional<EncodedPacket> Pop();
+    /// Resume the receiver, if any. Called with m_mutex held
+    void WakeWaiter();
+};
+
+class AsyncFileWriter
+{
+    /// Output file written from sessions without blocking them: each Write() runs on a background
+    /// lane worker and resumes the session when the data is in the file. A session awaits each write
+    /// before issuing the next, so writes land in order.
+public:
+    explicit AsyncFileWriter(PipelineExecutor &executor) : m_executor(executor) {}
+    ~AsyncFileWriter() { Close(); }
+
+    bool Open(const std::string &path);
+    void Close();
+    bool IsOpen() const { return m_fp.is_open(); }
+    uint64_t GetBytesWritten() const { return m_nBytes; }
+
+    /// Append data. Returns false if the write failed
+    auto Write(std::vector<uint8_t> data)
+    {
+        struct Awaiter
+        {
+            AsyncFileWriter *pWriter;
+            std::vector<uint8_t> data;
+            bool bOk = false;
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) { pWriter->Submit(h, data, bOk); }
+            bool await_resume() noexcept { return bOk; }
+        };
+        return Awaiter{ this, std::move(data) };
+    }
+
+private:
+    PipelineExecutor &m_executor;
+    std::ofstream m_fp;
+    std::mutex m_mutex;
+    uint64_t m_nBytes = 0;
+
+    /// Write data on a background worker, set bOk and resume h. data and bOk live in h's frame
+    void Submit(std::coroutine_handle<> h, const std::vector<uint8_t> &data, bool &bOk);
+};
+
+namespace AsyncDetail
+{
+    template <typename T>
+    AsyncTask<void> StoreResult(AsyncTask<T> task, std::optional<T> &result, std::exception_ptr &exception)
+    {
+        try
+        {
+            result.emplace(co_await task);
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+    }
+
+    inline AsyncTask<void> StoreResult(AsyncTask<void> task, std::optional<bool> &result, std::exception_ptr &exception)
+    {
+        try
+        {
+            co_await task;
+            result.emplace(true);
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+    }
+}
+
+template <typename T>
+T PipelineExecutor::SyncWait(AsyncTask<T> task, int affinity, TaskPriority priority)
+{
+    std::optional<std::conditional_t<std::is_void_v<T>, bool, T>> result;
+    std::exception_ptr exception;
+    std::mutex mutex;
+    std::condition_variable cvDone;
+    bool bDone = false;
+    Spawn(AsyncDetail::StoreResult(std::move(task), result, exception), affinity, priority, [&]
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bDone = true;
+        cvDone.notify_all();
+    });
+    std::unique_lock<std::mutex> lock(mutex);
+    cvDone.wait(lock, [&] { return bDone; });
+    if (exception)
+    {
+        std::rethrow_exception(exception);
+    }
+    if constexpr (!std::is_void_v<T>)
+    {
+        return std::move(*result);
+    }
+}
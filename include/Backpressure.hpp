@@ -0,0 +1,215 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <deque>
+#include <utility>
+#include <algorithm>
+
+/// What the pipeline gives up when the stages after capture fall behind
+enum class BackpressureStrategy
+{
+    /// Nothing: every frame is encoded and queued, the loop slows down to the slowest stage and
+    /// latency grows with the queues
+    Block,
+    /// Packets that find a sink queue full push out the oldest queued ones, a sink that catches up
+    /// gets the most recent frames. Captured frames are dropped while the encoder is congested,
+    /// there is never more than one waiting for it
+    DropOldest,
+    /// Packets that find a sink queue full are dropped, the queued ones are delivered. Captured
+    /// frames are dropped while the encoder is congested
+    DropNewest,
+    /// Captured frames are not converted while congested; the previous frame is encoded again,
+    /// which NVENC turns into a near empty P frame, so the stream keeps its cadence
+    Repeat,
+    /// Only every 2nd, 4th, ... captured frame is encoded
+    LowerFrameRate,
+    /// Frames are scaled down by 2, 4, ... before encoding
+    LowerResolution
+};
+
+/// Thresholds of the back-pressure policy
+struct BackpressureConfig
+{
+    BackpressureStrategy strategy = BackpressureStrategy::Block;
+    /// Frames submitted to the encoder and not yet written, plus packets queued for a sink, above the
+    /// lowest backlog seen (the encoder's own output delay), at which the pipeline is congested
+    int maxBacklog = 3;
+    /// Age of the last written packet, present to written, above which the pipeline is congested
+    double maxLatencyMs = 100;
+    /// Packets a sink queue holds before DropOldest or DropNewest discard some
+    size_t maxQueuedPackets = 8;
+    /// LowerFrameRate and LowerResolution: frames between two steps down, so the backlog can drain ...
+    int holdFrames = 30;
+    /// ... frames without congestion before a step is undone ...
+    int recoverFrames = 120;
+    /// ... and the deepest step: a frame rate or size divisor of 2^maxSteps
+    int maxSteps = 2;
+};
+
+/// What to do with a captured frame
+enum class FrameAction
+{
+    Encode,
+    /// Release the frame unconverted
+    Drop,
+    /// Encode the previous frame again instead
+    Repeat
+};
+
+/// Decision counters, the metrics of the policy
+struct BackpressureStats
+{
+    uint64_t nFrames = 0;
+    uint64_t nCongested = 0;
+    uint64_t nEncoded = 0;
+    uint64_t nDropped = 0;
+    uint64_t nRepeated = 0;
+    uint64_t nStepsDown = 0;
+    uint64_t nStepsUp = 0;
+};
+
+class BackpressureController
+{
+    /// Decides per captured frame how the pipeline reacts to the stages after capture falling behind.
+    /// Fed the encoder backlog and the age of the last written packet; congestion is either one over
+    /// its limit. The drop strategies act on the frame at hand. LowerFrameRate and LowerResolution
+    /// step down one level on congestion, hold the level for holdFrames so the backlog can drain,
+    /// and step back up after recoverFrames without congestion.
+    /// Like RateController it holds no encoder state, so it can be driven by simulated stages.
+    /// Not thread safe: called from the capture loop.
+public:
+    void Init(const BackpressureConfig &cfg);
+    /// One captured frame. nBacklog: frames submitted and not yet written; latencyMs: age of the last
+    /// written packet, 0 if unknown
+    FrameAction OnFrame(int nBacklog, double latencyMs);
+
+    /// Only every GetFrameDivisor()-th frame is encoded
+    int GetFrameDivisor() const { return m_eStrategy == BackpressureStrategy::LowerFrameRate ? 1 << m_nLevel : 1; }
+    /// Frames are encoded at 1/GetScaleDivisor() of their width and height
+    int GetScaleDivisor() const { return m_eStrategy == BackpressureStrategy::LowerResolution ? 1 << m_nLevel : 1; }
+    /// The scale divisor changed with the last OnFrame(), the encoder must be resized
+    bool IsScaleChanged() const { return m_bScaleChanged; }
+
+    const BackpressureConfig &GetConfig() const { return m_cfg; }
+    const BackpressureStats &GetStats() const { return m_stats; }
+    void PrintStats() const;
+
+    /// DropOldest and DropNewest bound the sink queues and drop there, a sink's backlog is not the
+    /// encoder's congestion for them
+    static bool IsQueueBounded(BackpressureStrategy strategy)
+    {
+        return strategy == BackpressureStrategy::DropOldest || strategy == BackpressureStrategy::DropNewest;
+    }
+    static const char *GetStrategyName(BackpressureStrategy strategy);
+    /// Parse "strategy[:maxBacklog[:maxLatencyMs]]" as given on the command line, strategy one of
+    /// block, dropoldest, dropnewest, repeat, fps, resolution
+    static bool ParseConfig(const char *szArg, BackpressureConfig &cfg);
+
+private:
+    BackpressureConfig m_cfg;
+    BackpressureStrategy m_eStrategy = BackpressureStrategy::Block;
+    BackpressureStats m_stats;
+    /// Lowest backlog seen
+    int m_nMinBacklog = -1;
+    /// Current step of LowerFrameRate or LowerResolution
+    int m_nLevel = 0;
+    int m_nSinceChange = 0;
+    int m_nUncongested = 0;
+    bool m_bScaleChanged = false;
+};
+
+template <typename T>
+class BoundedPacketQueue
+{
+    /// FIFO of encoded packets between the encoder and a sink that may fall behind. Under DropOldest
+    /// and DropNewest it holds at most maxQueuedPackets; other strategies leave it unbounded and
+    /// throttle at capture instead. Drops never break the reference chain the decoder sees:
+    ///   - a queued recovery point (IDR frame, or the first frame of a forced intra refresh wave) is
+    ///     never dropped,
+    ///   - with it go the packets that depend on a dropped one, i.e. everything up to the next
+    ///     recovery point. If none is queued yet, the queue discards arriving packets until one
+    ///     arrives, and Push() asks the caller for one (CudaH264Array::ForceRecovery()) as soon as
+    ///     the queue has room for it; asked for earlier it would be dropped in turn.
+    /// Not thread safe, the owner locks around it.
+public:
+    void Init(BackpressureStrategy strategy, size_t nMaxPackets)
+    {
+        m_eStrategy = strategy;
+        m_nMaxPackets = BackpressureController::IsQueueBounded(strategy) ? std::max(nMaxPackets, (size_t)1) : SIZE_MAX;
+    }
+
+    /// Queue a packet. Returns true if the encoder must make a recovery point
+    bool Push(T item, bool bRecoveryPoint)
+    {
+        if (m_bAwaitRecovery)
+        {
+            if (!bRecoveryPoint)
+            {
+                m_nDropped++;
+                bool bRequest = !m_bRecoveryRequested && m_queue.size() < m_nMaxPackets;
+                m_bRecoveryRequested = m_bRecoveryRequested || bRequest;
+                return bRequest;
+            }
+            m_bAwaitRecovery = false;
+        }
+        m_queue.push_back({ std::move(item), bRecoveryPoint });
+        if (m_queue.size() <= m_nMaxPackets || bRecoveryPoint)
+        {
+            return false;
+        }
+        if (m_eStrategy == BackpressureStrategy::DropNewest)
+        {
+            m_queue.pop_back();
+            m_nDropped++;
+            m_bAwaitRecovery = true;
+            m_bRecoveryRequested = false;
+            return false;
+        }
+        /// The oldest run of dependent packets, after the recovery points in front of it
+        size_t first = 0;
+        while (m_queue[first].bRecoveryPoint)
+        {
+            first++;
+        }
+        size_t last = first;
+        while (last < m_queue.size() && !m_queue[last].bRecoveryPoint)
+        {
+            last++;
+        }
+        bool bToNewest = last == m_queue.size() && last > first;
+        m_queue.erase(m_queue.begin() + first, m_queue.begin() + last);
+        m_nDropped += last - first;
+        m_bAwaitRecovery = m_bRecoveryRequested = bToNewest;
+        return bToNewest;
+    }
+
+    bool Pop(T &item)
+    {
+        if (m_queue.empty())
+        {
+            return false;
+        }
+        item = std::move(m_queue.front().item);
+        m_queue.pop_front();
+        return true;
+    }
+
+    bool Empty() const { return m_queue.empty(); }
+    size_t GetSize() const { return m_queue.size(); }
+    uint64_t GetDropped() const { return m_nDropped; }
+
+private:
+    struct Entry
+    {
+        T item;
+        bool bRecoveryPoint;
+    };
+    std::deque<Entry> m_queue;
+    BackpressureStrategy m_eStrategy = BackpressureStrategy::Block;
+    /// Unbounded until Init(), like Block
+    size_t m_nMaxPackets = SIZE_MAX;
+    /// Packets were dropped up to the newest; the ones arriving before the next recovery point depend on them
+    bool m_bAwaitRecovery = false;
+    bool m_bRecoveryRequested = false;
+    uint64_t m_nDropped = 0;
+};
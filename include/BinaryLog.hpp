@@ -0,0 +1,195 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <type_traits>
+
+/// Severity of a binary log record
+enum class BinaryLogLevel : uint8_t
+{
+    Trace,
+    Info,
+    Warning,
+    Error
+};
+
+class BinaryLogSite
+{
+    /// One BINLOG statement: level, source location and format string, registered once on first use.
+    /// Records refer to it by id, the strings are written to the log only once
+public:
+    BinaryLogSite(BinaryLogLevel level, const char *szFile, int line, const char *szFormat);
+
+    const BinaryLogLevel level;
+    const char *const szFile;
+    const int line;
+    const char *const szFormat;
+    const uint32_t id;
+
+private:
+    friend class BinaryLog;
+    /// BINLOG_EVERY_MS: ticks before which records are suppressed, and how many were
+    std::atomic<int64_t> m_nextTicks{ 0 };
+    std::atomic<uint32_t> m_nSuppressed{ 0 };
+};
+
+/// Type of an argument slot of a record
+enum class BinaryLogArg : uint8_t
+{
+    Int,
+    UInt,
+    Double,
+    /// Pointer to a string that outlives the log, e.g. a literal or __FUNCTION__; copied by the drain thread
+    String
+};
+
+/// A log statement as the hot path stores it: no formatting, just the site and the raw arguments
+struct BinaryLogRecord
+{
+    static const int MAX_ARGS = 5;
+    int64_t ticks;
+    uint32_t siteId;
+    /// Records of a rate-limited site suppressed since the previous one
+    uint32_t nSuppressed;
+    /// 2 bits per argument, BinaryLogArg
+    uint16_t argTypes;
+    uint8_t nArgs;
+    uint8_t reserved[5];
+    uint64_t args[MAX_ARGS];
+};
+static_assert(sizeof(BinaryLogRecord) == 64, "a record is one cache line");
+
+class BinaryLog
+{
+    /// Process wide logger for per-frame and other hot-path logs. A BINLOG statement copies its
+    /// arguments into a fixed-size record in a lock-free ring of the calling thread, one producer and
+    /// one consumer, and returns; no formatting, no lock, no system call. A background thread drains
+    /// the rings every few milliseconds into a binary file: each site's format string once, then
+    /// records. Formatting is deferred to Decode(), e.g. with -decodelog. A full ring drops the record
+    /// and counts it rather than block the caller. Nothing is recorded until Open().
+public:
+    /// Start logging to szPath, records of minLevel and above
+    static bool Open(const char *szPath, BinaryLogLevel minLevel = BinaryLogLevel::Trace);
+    /// Drain everything logged so far and stop
+    static void Close();
+    static bool IsEnabled(BinaryLogLevel level) { return (int)level >= s_minLevel.load(std::memory_order_relaxed); }
+
+    /// Records written and dropped since Open()
+    static uint64_t GetWritten();
+    static uint64_t GetDropped();
+
+    /// Write the records of a log file as text, in time order. Returns false if it is no binary log
+    static bool Decode(const char *szPath, FILE *fpOut);
+
+    template <typename... Args>
+    static void Write(BinaryLogSite &site, const Args &... args)
+    {
+        WriteAt(site, GetTicks(), 0, args...);
+    }
+
+    /// Write unless the site wrote less than intervalMs ago; the next record counts the ones suppressed
+    template <typename... Args>
+    static void WriteEvery(BinaryLogSite &site, int intervalMs, const Args &... args)
+    {
+        int64_t ticks = GetTicks();
+        int64_t next = site.m_nextTicks.load(std::memory_order_relaxed);
+        if (ticks < next || !site.m_nextTicks.compare_exchange_strong(next, ticks + intervalMs * s_ticksPerMs))
+        {
+            site.m_nSuppressed.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        WriteAt(site, ticks, site.m_nSuppressed.exchange(0, std::memory_order_relaxed), args...);
+    }
+
+    /// Called by BinaryLogSite
+    static uint32_t RegisterSite(BinaryLogSite *pSite);
+
+private:
+    /// Ring of the calling thread, nullptr if it is full; the record is counted as dropped
+    static BinaryLogRecord *BeginRecord();
+    static void CommitRecord();
+    static int64_t GetTicks();
+
+    static std::atomic<int> s_minLevel;
+    static int64_t s_ticksPerMs;
+
+    template <typename... Args>
+    static void WriteAt(BinaryLogSite &site, int64_t ticks, uint32_t nSuppressed, const Args &... args)
+    {
+        static_assert(sizeof...(Args) <= BinaryLogRecord::MAX_ARGS, "too many arguments for a binary log record");
+        BinaryLogRecord *pRecord = BeginRecord();
+        if (!pRecord)
+        {
+            return;
+        }
+        pRecord->ticks = ticks;
+        pRecord->siteId = site.id;
+        pRecord->nSuppressed = nSuppressed;
+        pRecord->argTypes = 0;
+        pRecord->nArgs = 0;
+        (StoreArg(*pRecord, args), ...);
+        CommitRecord();
+    }
+
+    template <typename T>
+    static void StoreArg(BinaryLogRecord &record, const T &arg)
+    {
+        BinaryLogArg type;
+        uint64_t value = 0;
+        if constexpr (std::is_floating_point_v<T>)
+        {
+            double d = (double)arg;
+            memcpy(&value, &d, sizeof(d));
+            type = BinaryLogArg::Double;
+        }
+        else if constexpr (std::is_same_v<std::decay_t<T>, const char *> || std::is_same_v<std::decay_t<T>, char *>)
+        {
+            value = (uint64_t)(uintptr_t)arg;
+            type = BinaryLogArg::String;
+        }
+        else if constexpr (std::is_pointer_v<T>)
+        {
+            value = (uint64_t)(uintptr_t)arg;
+            type = BinaryLogArg::UInt;
+        }
+        else if constexpr (std::is_enum_v<T>)
+        {
+            value = (uint64_t)(int64_t)arg;
+            type = BinaryLogArg::Int;
+        }
+        else
+        {
+            static_assert(std::is_integral_v<T>, "binary log arguments are numbers, pointers or string literals");
+            value = std::is_signed_v<T> ? (uint64_t)(int64_t)arg : (uint64_t)arg;
+            type = std::is_signed_v<T> ? BinaryLogArg::Int : BinaryLogArg::UInt;
+        }
+        record.args[record.nArgs] = value;
+        record.argTypes |= (uint16_t)((int)type << (2 * record.nArgs));
+        record.nArgs++;
+    }
+};
+
+/// printf style record, e.g. BINLOG(BinaryLogLevel::Info, "frame %d, %.1f ms", n, ms). Arguments
+/// are numbers, pointers or strings that outlive the log
+#define BINLOG(level, szFormat, ...) \
+    do \
+    { \
+        static BinaryLogSite s_binaryLogSite(level, __FILE__, __LINE__, szFormat); \
+        if (BinaryLog::IsEnabled(level)) \
+        { \
+            BinaryLog::Write(s_binaryLogSite, ##__VA_ARGS__); \
+        } \
+    } while (0)
+
+/// BINLOG at most once every intervalMs per statement
+#define BINLOG_EVERY_MS(intervalMs, level, szFormat, ...) \
+    do \
+    { \
+        static BinaryLogSite s_binaryLogSite(level, __FILE__, __LINE__, szFormat); \
+        if (BinaryLog::IsEnabled(level)) \
+        { \
+            BinaryLog::WriteEvery(s_binaryLogSite, intervalMs, ##__VA_ARGS__); \
+        } \
+    } while (0)
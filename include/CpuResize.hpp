@@ -0,0 +1,122 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/// Filters supported by the CPU resizer
+enum class CpuResizeFilter
+{
+    /// 2-tap bilinear, same footprint as the texture sampling used by Resize.cu
+    Bilinear,
+    /// Box filter weighted by pixel coverage. Best choice for large downscales (thumbnails)
+    Area,
+    /// Lanczos with a = 2, widened by the scale factor when downscaling
+    Lanczos2
+};
+
+class CpuResizer
+{
+    /// CPU (SSE2) counterpart of ResizeNv12/ResizeP016/ScaleYUV420 in Utils/Resize.cu
+    /// Used to produce renditions and thumbnails when the GPU is saturated.
+    /// Filtering is separable: a vertical pass over whole source rows followed by a horizontal pass,
+    /// both driven by coefficient tables that are built once in Init() and reused for every frame.
+    ///
+    /// Chroma is sited the MPEG-2 way (co-sited with even luma columns, centered between luma rows).
+    /// When bCudaCompat is set, the bilinear sample positions replicate the texture coordinates used by
+    /// the CUDA kernels instead. The output then differs from the GPU path only by rounding: the kernels
+    /// truncate, so the CPU is the same or 1 higher, plus at most 1 either way from the 8-bit filter
+    /// weights of the texture unit.
+public:
+    /// Precomputed filter taps for one direction of one plane
+    struct FilterTable
+    {
+        /// Taps per output sample, rounded up to a multiple of 4 (extra taps carry zero weight)
+        int nTaps = 0;
+        /// Index of the first source sample for each output sample. May be negative near the edges
+        std::vector<int> vStart;
+        /// nTaps weights per output sample, normalized to 1
+        std::vector<float> vCoef;
+        /// Samples that fall outside the source on either side, replicated from the edge
+        int nPadLeft = 0;
+        int nPadRight = 0;
+    };
+
+private:
+    /// Source and destination luma dimensions of the cached tables
+    int m_nSrcWidth = 0;
+    int m_nSrcHeight = 0;
+    int m_nDstWidth = 0;
+    int m_nDstHeight = 0;
+    CpuResizeFilter m_eFilter = CpuResizeFilter::Bilinear;
+    bool m_bCudaCompat = false;
+    /// Set by Init(), cleared by Cleanup()
+    bool m_bInit = false;
+
+    /// Luma tables
+    FilterTable m_lumaH, m_lumaV;
+    /// Chroma tables for the NV12/P016 interleaved UV plane (ResizeNv12/ResizeP016 geometry)
+    FilterTable m_chromaH, m_chromaV;
+    /// Chroma tables for ScaleYUV420 geometry. Identical to the above unless bCudaCompat is set
+    FilterTable m_scaleChromaH, m_scaleChromaV;
+
+    /// Scratch rows reused between calls
+    std::vector<float> m_vRowV;
+    std::vector<float> m_vRowPad;
+
+private:
+    template<typename T>
+    void ResizePlane(const FilterTable &h, const FilterTable &v, const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+        uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight, int nChannels);
+
+public:
+    /// Build the coefficient tables for the given luma dimensions. Dimensions must be even for NV12/P016
+    bool Init(int nSrcWidth, int nSrcHeight, int nDstWidth, int nDstHeight, CpuResizeFilter eFilter = CpuResizeFilter::Bilinear, bool bCudaCompat = false);
+    /// Release the tables and scratch buffers
+    void Cleanup();
+    /// True if the cached tables can be used for the given parameters
+    bool Matches(int nSrcWidth, int nSrcHeight, int nDstWidth, int nDstHeight, CpuResizeFilter eFilter, bool bCudaCompat) const;
+
+    /// Same contract as ResizeNv12() in Resize.cu, on host memory
+    void ResizeNv12(uint8_t *pDstNv12, int nDstPitch, const uint8_t *pSrcNv12, int nSrcPitch, uint8_t *pDstNv12UV = nullptr);
+    /// Same contract as ResizeP016() in Resize.cu, on host memory
+    void ResizeP016(uint8_t *pDstP016, int nDstPitch, const uint8_t *pSrcP016, int nSrcPitch, uint8_t *pDstP016UV = nullptr);
+    /// Same contract as ScaleYUV420() in Resize.cu, on host memory
+    void ScaleYUV420(uint8_t *pDstY, uint8_t *pDstU, uint8_t *pDstV, int nDstPitch, int nDstChromaPitch,
+        const uint8_t *pSrcY, const uint8_t *pSrcU, const uint8_t *pSrcV, int nSrcPitch, int nSrcChromaPitch, bool bSemiplanar);
+
+    /// Build a table mapping nSrc samples to nDst samples.
+    /// Output sample j is centered on source position (j + fDstOffset) * nSrc / nDst - fSrcOffset.
+    static void BuildFilterTable(FilterTable &table, int nSrc, int nDst, CpuResizeFilter eFilter, float fDstOffset, float fSrcOffset);
+};
+
+/// One-shot helpers mirroring the CUDA entry points. Prefer a CpuResizer instance when resizing repeatedly.
+void ResizeNv12Cpu(uint8_t *pDstNv12, int nDstPitch, int nDstWidth, int nDstHeight, const uint8_t *pSrcNv12, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+    CpuResizeFilter eFilter = CpuResizeFilter::Bilinear, uint8_t *pDstNv12UV = nullptr);
+void ResizeP016Cpu(uint8_t *pDstP016, int nDstPitch, int nDstWidth, int nDstHeight, const uint8_t *pSrcP016, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+    CpuResizeFilter eFilter = CpuResizeFilter::Bilinear, uint8_t *pDstP016UV = nullptr);
+
+class CpuBgraToNv12Scaler
+{
+    /// CPU counterpart of BGRA2NV12Scaled in RGBToNV12.cu.
+    /// Filters and downsamples BGRA and emits NV12 at the target resolution in one pass, so the
+    /// full resolution NV12 intermediate of convert-then-resize is never written or read back
+    /// (-benchfused measures both). Uses the CpuResizer tables for luma, chroma is the 2x2 average
+    /// of the filtered pixels. At the same size it is a plain BGRA to NV12 conversion.
+private:
+    int m_nSrcWidth = 0;
+    int m_nSrcHeight = 0;
+    int m_nDstWidth = 0;
+    int m_nDstHeight = 0;
+    CpuResizer::FilterTable m_h, m_v;
+    /// Scratch rows reused between calls
+    std::vector<float> m_vRowV;
+    std::vector<float> m_vRowPad;
+    /// Chroma accumulated over a pair of output rows
+    std::vector<float> m_vU, m_vV;
+
+public:
+    /// Build the coefficient tables. Target dimensions must be even
+    bool Init(int nSrcWidth, int nSrcHeight, int nDstWidth, int nDstHeight, CpuResizeFilter eFilter = CpuResizeFilter::Area);
+    /// Convert one BGRA frame. The UV plane follows the luma plane unless pDstNv12UV is given
+    void Convert(const uint8_t *pBgra, int nSrcPitch, uint8_t *pDstNv12, int nDstPitch, uint8_t *pDstNv12UV = nullptr);
+};
@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/// CRC flavours. Both are the reflected 32-bit CRCs with ~0 init and final XOR
+enum class CrcType
+{
+    /// IEEE 802.3 / zlib polynomial 0x04C11DB7. Accelerated with PCLMULQDQ folding
+    Crc32 = 0,
+    /// Castagnoli polynomial 0x1EDC6F41. Accelerated with the SSE4.2 crc32 instruction
+    Crc32C = 1
+};
+
+/// Continue a CRC over pData. 'crc' is the result for the preceding data, 0 for the first call,
+/// so CrcUpdate(t, CrcUpdate(t, 0, a, n), b, m) equals the CRC of a followed by b (same contract as zlib crc32()).
+/// The fastest implementation supported by the CPU is selected on first use, with a table fallback.
+uint32_t CrcUpdate(CrcType eType, uint32_t crc, const void *pData, size_t nSize);
+
+/// CRC of nBuffers independent buffers. pCrc[i] is the preceding CRC on input (0 to start) and the result on output.
+/// CRC32C buffers are processed four at a time with interleaved crc32 instructions, which hides the
+/// 3 cycle latency a single stream is bound by. Meant for many small records, e.g. encoded packets
+void CrcUpdateMulti(CrcType eType, const void *const *ppData, const size_t *pSize, uint32_t *pCrc, int nBuffers);
+
+/// Name of the implementation in use, for logs
+const char *CrcGetImplName(CrcType eType);
+
+inline uint32_t Crc32(const void *pData, size_t nSize) { return CrcUpdate(CrcType::Crc32, 0, pData, nSize); }
+inline uint32_t Crc32C(const void *pData, size_t nSize) { return CrcUpdate(CrcType::Crc32C, 0, pData, nSize); }
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+#include <fstream>
+#include "Crc32.hpp"
+
+/// One record of a data file: the bytes [offset, offset + size) have checksum crc
+struct CrcIndexEntry
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t crc;
+};
+
+/// Header of a "<data file>.crc" sidecar, followed by CrcIndexEntry records in file order
+struct CrcIndexHeader
+{
+    char magic[4];
+    uint32_t version;
+    /// CrcType
+    uint32_t type;
+    uint32_t reserved;
+};
+
+class CrcIndexWriter
+{
+    /// Writes the checksum sidecar of an append-only data file (encoded bitstream or raw frames).
+    /// Call Add() with exactly the bytes written to the data file, in the same order.
+private:
+    std::ofstream m_fp;
+    CrcType m_eType = CrcType::Crc32C;
+    /// Offset of the next record in the data file
+    uint64_t m_nOffset = 0;
+
+public:
+    static const uint32_t VERSION = 1;
+
+    /// Create "<dataPath>.crc". The data file must be empty at this point
+    bool Open(const std::string &dataPath, CrcType eType = CrcType::Crc32C);
+    /// Record the next nSize bytes written to the data file
+    void Add(const void *pData, size_t nSize);
+    void Close();
+    bool IsOpen() const { return m_fp.is_open(); }
+};
+
+/// Outcome of VerifyCrcIndex()
+struct CrcVerifyResult
+{
+    uint64_t nEntries = 0;
+    uint64_t nBad = 0;
+    /// Records missing from the end of the data file
+    uint64_t nMissing = 0;
+    uint64_t nBytes = 0;
+    double seconds = 0;
+};
+
+/// Check dataPath against "<dataPath>.crc". The data file is read sequentially in large chunks with the
+/// next chunk read while the current one is checksummed, so it runs at disk speed. Bad records are
+/// printed when bVerbose is set. Returns false if the index cannot be read or any record is bad
+bool VerifyCrcIndex(const std::string &dataPath, CrcVerifyResult &result, bool bVerbose = true);
@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <unordered_map>
+#include "DamageMap.hpp"
+
+/// Pointer shape encodings, same values as DXGI_OUTDUPL_POINTER_SHAPE_TYPE
+enum class CursorShapeType
+{
+    /// 1 bpp AND mask followed by 1 bpp XOR mask
+    Monochrome = 1,
+    /// 32 bpp BGRA with straight alpha
+    Color = 2,
+    /// 32 bpp BGR, alpha byte selects replace (0x00) or XOR (0xFF)
+    MaskedColor = 4
+};
+
+class CursorCompositor
+{
+    /// Draws the mouse pointer into captured frames. DDA excludes the pointer from the desktop image
+    /// and reports position and shape separately; shapes are decoded once and cached by a hash of
+    /// the raw shape buffer, so toggling between e.g. arrow and I-beam never decodes twice.
+    /// Only the pixels under the pointer are touched, and the tiles under the current and previous
+    /// pointer rect are reported as damage so incremental paths repaint where the pointer was.
+public:
+    /// Decoded shape. Every pixel is blended as dst = blend + dst * (255 - alpha) / 255, then XORed
+    struct Shape
+    {
+        int width = 0;
+        int height = 0;
+        int hotX = 0;
+        int hotY = 0;
+        /// Premultiplied BGRA
+        std::vector<uint32_t> vBlend;
+        /// BGR XOR value applied after blending, 0 for most pixels
+        std::vector<uint32_t> vXor;
+        bool bHasXor = false;
+    };
+
+    /// Maximum number of cached shapes before the cache is flushed
+    static const size_t MAX_CACHED_SHAPES = 32;
+
+private:
+    std::unordered_map<uint64_t, Shape> m_shapeCache;
+    /// Currently selected shape, points into m_shapeCache
+    const Shape *m_pShape = nullptr;
+    uint64_t m_shapeId = 0;
+    /// Pointer position in desktop coordinates (top-left of the shape, DDA convention)
+    int m_x = 0;
+    int m_y = 0;
+    bool m_bVisible = false;
+    /// Pointer rect drawn into the previous frame, in desktop coordinates. Empty if nothing was drawn
+    int m_prevRect[4] = { 0, 0, 0, 0 };
+
+private:
+    static void Decode(CursorShapeType eType, int width, int height, int pitch, const uint8_t *pBuffer, Shape &shape);
+
+public:
+    /// Update position and visibility from DXGI_OUTDUPL_FRAME_INFO::PointerPosition
+    void UpdatePosition(int x, int y, bool bVisible);
+    /// Update the shape from GetFramePointerShape(). Height is the DXGI height, i.e. twice the pointer height for monochrome
+    void UpdateShape(CursorShapeType eType, int width, int height, int pitch, int hotX, int hotY, const uint8_t *pBuffer, uint32_t nBufferSize);
+    /// Take position, visibility and shape from the pointer of a display placed at (originX, originY)
+    /// of this frame. The shape is copied into this cache once. With a divisor the position is that on
+    /// a frame scaled down by it; the shape keeps its size
+    void Follow(const CursorCompositor &src, int originX, int originY, int divisor = 1);
+
+    /// Current pointer rect clipped to a width x height frame. False if nothing is drawn
+    bool GetRect(int width, int height, int rc[4]) const;
+    /// Mark the tiles under the current and previous pointer rect dirty
+    void AddDamage(DamageMap &damage) const;
+    /// Remember the current rect as drawn. Call once per composited frame
+    void EndFrame(int width, int height);
+
+    /// Blend into an NV12 region in host memory whose top-left pixel is at (originX, originY) of the frame.
+    /// originX/originY must be even. Used on a downloaded copy of the tiles under the pointer
+    void CompositeNv12(uint8_t *pY, int nPitchY, uint8_t *pUV, int nPitchUV, int originX, int originY, int regionWidth, int regionHeight);
+
+    uint64_t GetShapeId() const { return m_shapeId; }
+    size_t GetCachedShapeCount() const { return m_shapeCache.size(); }
+    bool IsVisible() const { return m_bVisible && m_pShape; }
+};
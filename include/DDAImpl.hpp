@@ -32,8 +32,23 @@
 #include <fstream>
 #include <dxgi1_2.h>
 #include <d3d11_2.h>
+#include <string>
+#include "ICaptureSource.hpp"
 
-class DDAImpl
+/// A display output found by DDAImpl::EnumerateOutputs()
+struct DisplayOutput
+{
+    /// Index of the adapter in IDXGIFactory1::EnumAdapters1() and of the output in IDXGIAdapter::EnumOutputs()
+    UINT adapter = 0;
+    UINT output = 0;
+    /// Adapter description and output device name, e.g. \\.\DISPLAY2
+    std::wstring adapterName;
+    std::wstring outputName;
+    RECT desktopRect = { 0, 0, 0, 0 };
+    DXGI_MODE_ROTATION rotation = DXGI_MODE_ROTATION_UNSPECIFIED;
+};
+
+class DDAImpl : public ICaptureSource
 {
     ///  Thin wrapper around IDXGIOutputDuplication interface
     /// Manages IDXGIOutputDuplication object lifecycle
@@ -48,43 +63,83 @@ private:
     ID3D11DeviceContext* pCtx = nullptr;
     /// The resource used to acquire a new captured frame from DDA
     IDXGIResource *pResource = nullptr;
+    /// Index of the captured output on the adapter of pD3DDev
+    UINT outputIndex = 0;
+    /// Position of the output on the virtual desktop, from DXGI_OUTPUT_DESC
+    RECT desktopRect = { 0, 0, 0, 0 };
     /// Output width obtained from DXGI_OUTDUPL_DESC
     DWORD width = 0;
     /// Output height obtained from DXGI_OUTDUPL_DESC
     DWORD height = 0;
     /// Running count of no. of accumulated desktop updates
     int frameno = 0;
-    /// output file stream to dump timestamps
-    std::ofstream ofs;
     /// DXGI_OUTDUPL_FRAME_INFO::latPresentTime from the last Acquired frame
     LARGE_INTEGER lastPTS = { 0 };
+    /// QPC time the last acquired image was presented, or the pointer moved for pointer only updates
+    LONGLONG presentTime = 0;
     /// Clock frequency from QueryPerformaceFrequency()
     LARGE_INTEGER qpcFreq = { 0 };
+    /// Tiles changed by the last acquired frame, from its dirty and move rects
+    DamageMap damage;
+    /// Move rects of the last acquired frame
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> vMoveRects;
+    /// Scratch buffer for GetFrameMoveRects() / GetFrameDirtyRects()
+    std::vector<BYTE> vMetaData;
+    /// Scratch buffer for GetFramePointerShape()
+    std::vector<BYTE> vPointerShape;
+    /// Pointer state and shape cache
+    CursorCompositor cursor;
+    /// When set, pointer only updates are returned as frames so the composited pointer moves
+    bool bCompositeCursor = true;
+    /// Set by Init(), cleared by the first acquired desktop image. That frame is entirely dirty
+    bool bFirstFrame = true;
     /// Default constructor
     DDAImpl() {}
-    
+    /// Fill 'damage' and 'vMoveRects' from the frame metadata. Marks the whole frame dirty if it cannot be read
+    void UpdateDamage(const DXGI_OUTDUPL_FRAME_INFO &frameInfo);
+    /// Update the pointer position and, when it changed, the pointer shape
+    void UpdatePointer(const DXGI_OUTDUPL_FRAME_INFO &frameInfo);
+
 public:
     /// Initialize DDA
-    HRESULT Init();
+    HRESULT Init() override;
+    /// Release the duplication and duplicate the output again on the same device
+    HRESULT Reacquire() override;
     /// Acquire a new frame from DDA, and return it as a Texture2D object.
     /// 'wait' specifies the time in milliseconds that DDA shoulo wait for a new screen update.
-    HRESULT GetCapturedFrame(ID3D11Texture2D **pTex2D, int wait);
+    HRESULT GetCapturedFrame(ID3D11Texture2D **pTex2D, int wait) override;
     /// Release all resources
-    int Cleanup();
+    int Cleanup() override;
     /// Return output height to caller
-    inline DWORD getWidth() { return width; }
+    inline DWORD getWidth() override { return width; }
     /// Return output width to caller
-    inline DWORD getHeight() { return height; }
+    inline DWORD getHeight() override { return height; }
+    /// Damage of the last acquired frame, including the pointer tiles when compositing
+    inline const DamageMap &getDamage() override { return damage; }
+    /// Move rects of the last acquired frame
+    inline const std::vector<DXGI_OUTDUPL_MOVE_RECT> &getMoveRects() override { return vMoveRects; }
+    /// Present time of the last acquired frame
+    inline LONGLONG getPresentTime() override { return presentTime; }
+    /// Position of the output on the virtual desktop
+    inline RECT getDesktopRect() override { return desktopRect; }
+    /// Pointer state of the last acquired frame
+    inline CursorCompositor &getCursor() override { return cursor; }
+    /// Enable or disable pointer compositing
+    inline void setCompositeCursor(bool bEnable) override { bCompositeCursor = bEnable; }
+
+    /// Every output of every adapter, in enumeration order. Only the outputs of the adapter a
+    /// device was created on can be duplicated with that device
+    static HRESULT EnumerateOutputs(std::vector<DisplayOutput> &vOutputs);
 
 public:
-    /// Constructor
-    DDAImpl(ID3D11Device *pDev, ID3D11DeviceContext* pDevCtx)
+    /// Constructor. 'output' is the index of the display on the adapter of pDev, 0 for the primary one
+    DDAImpl(ID3D11Device *pDev, ID3D11DeviceContext* pDevCtx, UINT output = 0)
         :   pD3DDev(pDev)
         ,   pCtx(pDevCtx)
+        ,   outputIndex(output)
     {
         pD3DDev->AddRef();
         pCtx->AddRef();
-        ofs = std::ofstream("PresentTSLog.txt");
         QueryPerformanceFrequency(&qpcFreq);
     }
     /// Destructor. Release all resources before destroying the object
@@ -0,0 +1,50 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+class DamageMap
+{
+    /// Per frame damage region on a fixed grid of square tiles.
+    /// Built from DDA dirty/move rects, the cursor stage or content hashing, and consumed by the
+    /// incremental paths (conversion, rate control, QP maps) that only care about changed tiles.
+public:
+    /// Tile edge in pixels
+    static const int TILE_SIZE = 64;
+
+private:
+    int m_nWidth = 0;
+    int m_nHeight = 0;
+    int m_nTilesX = 0;
+    int m_nTilesY = 0;
+    /// One byte per tile, non-zero when dirty
+    std::vector<uint8_t> m_vTiles;
+    /// Number of dirty tiles, kept up to date by the setters
+    int m_nDirty = 0;
+
+public:
+    /// Size the grid for a width x height frame. All tiles start clean
+    void Init(int nWidth, int nHeight);
+    /// Mark every tile clean
+    void Clear();
+    /// Mark every tile dirty, e.g. for the first frame or after a mode change
+    void MarkAll();
+    /// Mark all tiles touched by the half-open pixel rect [left, right) x [top, bottom). Clipped to the frame
+    void AddRect(int left, int top, int right, int bottom);
+    /// Mark a single tile dirty
+    void SetDirty(int tx, int ty);
+    /// OR another map of the same size into this one
+    void Merge(const DamageMap &other);
+
+    bool IsDirty(int tx, int ty) const { return m_vTiles[ty * m_nTilesX + tx] != 0; }
+    int GetDirtyCount() const { return m_nDirty; }
+    int GetTileCount() const { return m_nTilesX * m_nTilesY; }
+    /// Fraction of the frame area covered by dirty tiles, in [0, 1]
+    double GetDirtyFraction() const { return m_vTiles.empty() ? 0.0 : (double)m_nDirty / m_vTiles.size(); }
+    bool Empty() const { return m_nDirty == 0; }
+
+    int GetWidth() const { return m_nWidth; }
+    int GetHeight() const { return m_nHeight; }
+    int GetTilesX() const { return m_nTilesX; }
+    int GetTilesY() const { return m_nTilesY; }
+    const uint8_t *GetTiles() const { return m_vTiles.data(); }
+};
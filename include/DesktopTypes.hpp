@@ -0,0 +1,34 @@
+#pragma once
+/// Desktop rects, move rects and capture results as DXGI reports them. On Windows these are the Windows
+/// types; elsewhere stand-ins with the same layout, so the geometry (OutputLayout, MotionHints) and the
+/// coroutine layer (AsyncPipeline) build and are tested without D3D
+#if defined(_WIN32)
+#include <dxgi1_2.h>
+#else
+#include <stdint.h>
+
+typedef int32_t LONG;
+typedef int32_t HRESULT;
+
+#define DXGI_ERROR_WAIT_TIMEOUT ((HRESULT)0x887A0027)
+
+struct POINT
+{
+    LONG x;
+    LONG y;
+};
+
+struct RECT
+{
+    LONG left;
+    LONG top;
+    LONG right;
+    LONG bottom;
+};
+
+struct DXGI_OUTDUPL_MOVE_RECT
+{
+    POINT SourcePoint;
+    RECT DestinationRect;
+};
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "DamageMap.hpp"
+
+/// Tuning of the QP delta map. Deltas are added to the QP rate control picks, negative means more bits
+struct EmphasisConfig
+{
+    /// Blocks that look like text or UI: sharp glyph edges blur first
+    int8_t textDelta = -4;
+    /// Blocks that changed in motionFrames consecutive frames and are not text: video, animation,
+    /// scrolling images. Motion hides the extra distortion and frees bits for the text
+    int8_t motionDelta = 3;
+    int motionFrames = 3;
+    /// Difference between horizontally adjacent luma samples that counts as a strong edge
+    uint8_t edgeThreshold = 48;
+    /// Fraction of the sampled pixel pairs on a strong edge above which a block counts as text
+    double textDensity = 0.06;
+};
+
+class EmphasisMap
+{
+    /// Builds the per block QP delta map of NV_ENC_PIC_PARAMS::qpDeltaMap (one byte per MB for H.264,
+    /// per CTB for HEVC, per superblock for AV1, in raster order) from the damage of the frame and
+    /// a text detector.
+    ///
+    /// The detector counts strong horizontal luma edges on every other row of a block: rendered text
+    /// and UI have a high density of near black/white steps, camera content and gradients do not.
+    /// Only blocks in damaged tiles are analyzed; the others keep their class and delta, so a static
+    /// desktop costs nothing and the luma plane only has to be valid in the damaged tiles.
+    /// The block size must divide DamageMap::TILE_SIZE. All buffers are kept between frames.
+public:
+    /// Size the map for a width x height frame and nBlockSize square blocks. Every block starts unclassified
+    void Init(int nWidth, int nHeight, int nBlockSize, const EmphasisConfig &cfg = EmphasisConfig());
+    /// Classify the blocks of the damaged tiles of a frame and update the map.
+    /// pLuma is the 8-bit luma plane; only the damaged tiles are read
+    void Update(const uint8_t *pLuma, int nPitch, const DamageMap &damage);
+
+    const int8_t *GetMap() const { return m_vMap.data(); }
+    /// Size in bytes, for NV_ENC_PIC_PARAMS::qpDeltaMapSize
+    uint32_t GetMapSize() const { return (uint32_t)m_vMap.size(); }
+    int GetWidth() const { return m_nWidth; }
+    int GetHeight() const { return m_nHeight; }
+    int GetBlockSize() const { return m_nBlockSize; }
+    int GetBlocksX() const { return m_nBlocksX; }
+    int GetBlocksY() const { return m_nBlocksY; }
+    /// Blocks currently classified as text / motion
+    int GetTextCount() const { return m_nText; }
+    int GetMotionCount() const { return m_nMotion; }
+
+    /// Number of horizontally adjacent pixel pairs (x, x + 1), x < nPairs, that differ by more than
+    /// threshold on rows 0, 2, 4... of an h row block. Reads pBlock[nPairs] on every sampled row
+    static int CountStrongEdges(const uint8_t *pBlock, int nPitch, int nPairs, int h, uint8_t threshold);
+
+private:
+    EmphasisConfig m_cfg;
+    int m_nWidth = 0;
+    int m_nHeight = 0;
+    int m_nBlockSize = 16;
+    int m_nBlocksX = 0;
+    int m_nBlocksY = 0;
+    std::vector<int8_t> m_vMap;
+    /// Per block: text class from the last analysis, and frames in a row the block was damaged
+    std::vector<uint8_t> m_vText;
+    std::vector<uint8_t> m_vMotionRun;
+    int m_nText = 0;
+    int m_nMotion = 0;
+};
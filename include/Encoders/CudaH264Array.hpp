@@ -2,10 +2,61 @@
 
 #include "IEncoder.hpp"
 #include <memory>
+#include <mutex>
 #include "DDAImpl.hpp"
+#include "ReplayCaptureSource.hpp"
+#include "MultiOutputCapture.hpp"
 #include "NvEnc.h"
 #include "NvEncoderD3D11.h"
+#include "NvEncoderCLIOptions.h"
 #include "D3D11TextureConverter.h"
+#include "Simulcast.hpp"
+#include "PartitionedEncoder.hpp"
+#include "FramePool.hpp"
+#include "CrcIndex.hpp"
+#include "RateController.hpp"
+#include "PacketStats.hpp"
+#include "EmphasisMap.hpp"
+#include "MotionHints.hpp"
+#include "FrameLatency.hpp"
+#include "LargePageBuffer.hpp"
+#include "Backpressure.hpp"
+#include <functional>
+
+/// How much of the pipeline a capture failure forced to be rebuilt, cheapest first
+enum class RecoveryLevel
+{
+    /// Only the capture session was re-acquired
+    Capture,
+    /// The captured format or size changed: conversion texture, CUDA registration and converter were rebuilt
+    Conversion,
+    /// The size changed: the encoder was reconfigured or recreated
+    Encoder,
+    /// Device lost: everything was torn down and initialized again
+    Restart
+};
+
+/// Streaming mode: gradual intra refresh instead of periodic IDR frames.
+/// Each frame of a wave intra codes a band of the picture, so the refresh cost is spread over
+/// 'frames' frames instead of landing in one IDR frame many times the average size
+struct IntraRefreshConfig
+{
+    /// Frames from the start of one wave to the start of the next. 0 keeps the IDR GOP
+    uint32_t period = 0;
+    /// Frames a wave takes to refresh the whole picture, less than period
+    uint32_t frames = 0;
+};
+
+/// Which displays are captured and how they are encoded
+enum class OutputMode
+{
+    /// One display, the primary one unless SetCaptureOutput() chose another
+    Single,
+    /// All displays of the adapter on one canvas, encoded as one stream
+    Composite,
+    /// All displays of the adapter captured together, each encoded into its own stream
+    Separate
+};
 
 class CudaH264Array : public IEncoder
 {
@@ -18,15 +69,18 @@ class CudaH264Array : public IEncoder
 private:
     CUdevice cuDevice = 0;
     /// Cuda device context used for the operations demonstrated in this application
-    CUcontext cuContext;
+    CUcontext cuContext = nullptr;
 
-    /// DDA wrapper object, defined in DDAImpl.h
-    DDAImpl *pDDAWrapper = nullptr;
+    /// Capture source. DDAImpl, or ReplayCaptureSource when SetReplay() was called, in a
+    /// MultiOutputCapture when several displays are captured
+    ICaptureSource *pCapture = nullptr;
+    /// pCapture when it captures several displays, otherwise null
+    MultiOutputCapture *m_pDisplays = nullptr;
 
 
     /// NVENCODE API wrapper. Defined in NvEncoderCuda.h. This class is imported from NVIDIA Video SDK
     //NvEnc *pEnc;
-    NvEncoderCuda *pEnc;
+    NvEncoderCuda *pEnc = nullptr;
     //NvEncoderD3D11 *pEnc;
     /// D3D11 device context used for the operations demonstrated in this application
     ID3D11Device *pD3DDev = nullptr;
@@ -38,10 +92,12 @@ private:
     /// D3D11 RGB Texture2D object that recieves the captured image from DDA
     ID3D11Texture2D *pDupTex2D = nullptr;
 
-    /// D3D11 RGB Texture2D object that has the correct rights to send the image to NVENCCUDA for mapping and video encoding
-    ID3D11Texture2D *m_pEncBuf = nullptr;
-    /// m_pEncBuf Description
-
+    /// Converted frames, preallocated and registered with CUDA, that the captured image is converted into
+    std::unique_ptr<FramePool> m_framePool;
+    /// Surfaces in m_framePool: one being converted, one being encoded, one spare
+    static const UINT FRAME_POOL_SIZE = 3;
+    /// Frame converted by the last Capture(), held until Preproc() is done with it
+    FrameHandle m_frame;
 
     /// D3D11 device context
     ID3D11DeviceContext *pCtx = nullptr;
@@ -52,26 +108,191 @@ private:
     /// Arguments for Cuda
     NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
     NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
-    //    NvEncoderInitParam encodeCLIOptions;
+    /// Codec, preset, tuning and rate control options applied on top of the preset defaults, see SetEncoderOptions()
+    NvEncoderInitParam encodeCLIOptions;
     int iGpu;
     std::ofstream fpOut;
+    /// Checksum sidecar of fpOut, one record per packet or raw frame
+    CrcIndexWriter m_crcIndex;
     /// Failure count from Capture API
     UINT failCount = 0;
     char **argv;
     int argc;
 
     std::unique_ptr<D3D11TextureConverter> m_textureConverter;
+    /// Convert and scale with BGRA2NV12Scaled in Encode() instead of m_textureConverter, see SetFusedConversion()
+    bool m_bFusedConversion = false;
+    /// m_framePool holds captured BGRA frames at the captured size. Set by InitFramePool()
+    bool m_bFusedActive = false;
 
     NV_ENC_BUFFER_FORMAT m_pixelFormat = NV_ENC_BUFFER_FORMAT_NV12;
-    CUgraphicsResource m_cuResource;
     CUstream m_stream = 0;
 
+    /// Scaled renditions encoded from the same converted frame. Empty when simulcast is off
+    std::vector<RenditionConfig> m_vRenditions;
+    std::unique_ptr<Simulcast> m_simulcast;
+
+    /// Partitioned encoding, see SetPartition(). In stream mode the stripes replace the single session and pEnc is null
+    PartitionConfig m_partition;
+    std::unique_ptr<PartitionedEncoder> m_partitioned;
+
+    /// Encode the converted frame in every stripe, loss reports become an IDR frame in all of them
+    HRESULT EncodePartitioned(CUarray cuArray);
+    /// One stripe session per display of m_pDisplays, at its place on the canvas
+    HRESULT InitDisplayEncoders();
+    /// Split each frame of the single session across the NVENC engines
+    void ConfigureSplitEncode(NV_ENC_INITIALIZE_PARAMS &params);
+
+    /// Draw the mouse pointer into the encoded frames
+    bool m_bCompositeCursor = true;
+    /// Host copy of the NV12 tiles under the pointer
+    std::vector<uint8_t> m_vCursorRegion;
+
+    /// Blend the pointer into the converted NV12 frame. Only the tiles under the pointer are read back
+    HRESULT CompositeCursor(CUarray cuArray);
+
+    /// Per block QP deltas from damage and text detection. Off unless SetQpMap() was called
+    bool m_bQpMap = false;
+    EmphasisMap m_emphasis;
+    /// MB, CTB or superblock size of the current codec
+    int m_nQpBlockSize = 16;
+    /// Host copy of the luma plane, valid in the damaged tiles of the current frame
+    LargePageBuffer m_luma;
+
+    /// Read back the damaged luma tiles, update the QP delta map and attach it to the picture parameters
+    HRESULT UpdateQpMap(CUarray cuArray, NV_ENC_PIC_PARAMS &picParams);
+
+    /// External ME hints from the move rects of the capture. Off unless SetMotionHints() was called
+    bool m_bMotionHints = false;
+    /// Hints are enabled in the current session
+    bool m_bMotionHintsActive = false;
+    MotionHints m_motionHints;
+    UINT64 m_nHintedFrames = 0;
+
+    /// Attach the hints of the frame's move rects to the picture parameters, if it has any
+    void ApplyMotionHints(NV_ENC_PIC_PARAMS &picParams, const DXGI_OUTDUPL_MOVE_RECT *pMoves, size_t nMoves);
+
+    /// Adaptive bitrate. Off unless SetRateControl() was called
+    bool m_bAdaptiveRate = false;
+    RateControlConfig m_rateConfig;
+    RateController m_rateController;
+    /// Per-frame statistics the rate controller was fed, see SetRateTrace()
+    std::ofstream m_rateTrace;
+    /// Frames handed to the encoder and packets received back, their difference is the output backlog.
+    /// Bytes received since the last rate control update. Guarded by m_outputMutex
+    UINT64 m_nFramesSubmitted = 0;
+    UINT64 m_nPacketsReceived = 0;
+    size_t m_nPendingBytes = 0;
+
+    /// Feed the last frame to the rate controller and reconfigure the encoder when it asks to
+    void UpdateRateControl();
+
+    /// Streaming mode, see SetIntraRefresh()
+    IntraRefreshConfig m_intraRefresh;
+    /// Intra refresh is enabled in the current session
+    bool m_bIntraRefreshActive = false;
+    /// The current session supports reference invalidation
+    bool m_bRefInvalidation = false;
+    /// Number of the next frame, counted over all sessions. Used as the frame's input timestamp
+    UINT64 m_nFrameNumber = 0;
+    /// Number of the last IDR frame; nothing before it can be referenced anymore
+    UINT64 m_nLastIdr = 0;
+    /// Loss reports, queued by any thread and applied before the next frame
+    std::mutex m_lossMutex;
+    std::vector<UINT64> m_vInvalidFrames;
+    bool m_bRecoveryRequested = false;
+    UINT m_nInvalidations = 0;
+    UINT m_nForcedRecoveries = 0;
+    /// Sizes of the encoded frames of the main stream
+    PacketStats m_packetStats;
+
+    /// Packets are written by the encoder's retrieval thread as soon as they are done, see SetAsyncOutput()
+    bool m_bAsyncOutput = false;
+    /// Serializes fpOut, m_crcIndex, m_packetStats and the counters between the two threads
+    std::mutex m_outputMutex;
+
+    /// Write one encoded frame and account for it. 'timeStamp' is the NVENC output timestamp, the
+    /// frame number. Called from either thread
+    void WritePacket(const std::vector<uint8_t> &packet, uint64_t timeStamp, NV_ENC_PIC_TYPE pictureType);
+
+    /// Back-pressure policy, see SetBackpressure()
+    bool m_bBackpressure = false;
+    BackpressureController m_backpressure;
+    /// Queue depth of the packet sink, counted as backlog
+    std::function<size_t()> m_sinkBacklog;
+    /// Age of the last written packet, present to written, in QPC ticks. Guarded by m_outputMutex
+    int64_t m_lastPacketAge = 0;
+    /// The last encoded frame, encoded again by the Repeat strategy
+    FrameHandle m_lastFrame;
+    /// Frames are converted and encoded at 1/m_nScaleDivisor of the captured size (LowerResolution)
+    int m_nScaleDivisor = 1;
+    /// The capture's pointer at its scaled position
+    CursorCompositor m_scaledCursor;
+    /// First frame of the last forced intra refresh wave. Guarded by m_outputMutex
+    UINT64 m_nRefreshRecoveryFrame = UINT64_MAX;
+
+    /// Run the policy on the frame just captured. Resizes the encoder when the scale changed
+    HRESULT ApplyBackpressure(FrameAction &action);
+    /// Size frames of a w x h capture are encoded at
+    void GetEncodeSize(DWORD w, DWORD h, DWORD &encodeW, DWORD &encodeH) const;
+
+    /// Timestamps of the frames from capture to output
+    LatencyTracker m_latency;
+    /// Capture side timestamps of the frame being prepared, completed in Encode()
+    FrameTiming m_captureTiming;
+    /// Receives every packet with the timestamps of its frame, after it was written
+    std::function<void(const std::vector<uint8_t> &packet, const FrameTiming &timing)> m_packetSink;
+
+    /// Enable intra refresh and reference invalidation in a new session's configuration, as far as the GPU supports them
+    void ConfigureStreaming(NV_ENC_INITIALIZE_PARAMS &params);
+    /// Apply the queued loss reports: invalidate the lost frames, or make the next frame a recovery point.
+    /// vInvalidFrames receives the reports, from the arena of the frame being encoded
+    void ApplyLossReports(NV_ENC_PIC_PARAMS &picParams, FrameVector<UINT64> &vInvalidFrames);
+
+    /// Raw BGRA file played back instead of capturing the desktop, see SetReplay()
+    std::string m_replayPath;
+    DWORD m_replayWidth = 0;
+    DWORD m_replayHeight = 0;
+    UINT m_replayInjectEvery = 0;
+    UINT m_replayScroll = 0;
+
+    /// Displays to capture, see SetOutputMode()
+    OutputMode m_outputMode = OutputMode::Single;
+    UINT m_captureOutput = 0;
+    /// Copies of the replay standing in for displays, side by side. 0 replays a single display
+    UINT m_syntheticOutputs = 0;
+    /// Create one capture source per display of the adapter, or per synthetic display
+    void AddDisplays(MultiOutputCapture *pDisplays);
+
+    /// Format and size of the captured frames m_framePool and the converter were built for
+    D3D11_TEXTURE2D_DESC m_captureDesc = { 0 };
+    /// Create m_framePool for captured frames of the given format and size
+    HRESULT InitFramePool(UINT width, UINT height, DXGI_FORMAT captureFormat);
+
+    /// Capture loss bookkeeping. Set by Recover(), cleared by the first encoded frame after it
+    bool m_bRecovering = false;
+    LARGE_INTEGER m_lossStart = { 0 };
+    RecoveryLevel m_lastRecoveryLevel = RecoveryLevel::Capture;
+    UINT m_nRecoveries = 0;
+    double m_lastRecoveryMs = 0;
+    double m_maxRecoveryMs = 0;
+    /// NVENC sessions created for the main stream, a recovery that keeps the session does not add one
+    UINT m_nEncoderSessions = 0;
+
+    /// Create the NVENC session for a w x h input
+    HRESULT CreateEncoder(DWORD w, DWORD h);
+    /// Release everything built for the captured frame format: the frame pool and the converter
+    void ReleaseConversion();
+    /// Move the encoder to a new input size: Reconfigure() when it fits the session, a new session otherwise
+    HRESULT ResizeEncoder(DWORD w, DWORD h);
+
 public:
     explicit CudaH264Array(int argc, char *_argv[]);
     ~CudaH264Array() override;
     HRESULT InitEnc() override;
     HRESULT Encode() override;
-    HRESULT Encode(CUarray cuArray);
+    /// Encode a mapped NV12 frame. pMetadata is the metadata of the frame, null for a frame not from the pool
+    HRESULT Encode(CUarray cuArray, FrameMetadata *pMetadata = nullptr);
     HRESULT WriteRawFrame(ID3D11Texture2D *pBuffer);
     void Cleanup(bool bDelete) override;
 
@@ -98,4 +319,126 @@ public:
     void WriteEncOutput();
 
     HRESULT SaveFrameToFile(const void* pBuffer, int width, int height);
+
+    /// Enable simulcast. Must be called before Init()
+    void SetRenditions(const std::vector<RenditionConfig> &vRenditions) { m_vRenditions = vRenditions; }
+
+    /// Encode the frame as N horizontal or vertical stripes, each in its own session and stream, or as
+    /// one stream split across the NVENC engines. Must be called before Init()
+    void SetPartition(const PartitionConfig &cfg) { m_partition = cfg; }
+    /// Stripe sessions, null unless partitioned into streams
+    PartitionedEncoder *GetPartitionedEncoder() { return m_partitioned.get(); }
+    /// CUDA context of the encoder. Current on the thread that called Init(); another thread must push
+    /// it before calling Capture(), Preproc() or Recover()
+    CUcontext GetCudaContext() const { return cuContext; }
+
+    /// Enable or disable the mouse pointer in the output. Must be called before Init()
+    void SetCompositeCursor(bool bEnable) { m_bCompositeCursor = bEnable; }
+    /// Convert BGRA to NV12 and scale it in one CUDA pass into the encoder input (BGRA2NV12Scaled) instead
+    /// of converting into NV12 surfaces with the D3D11 video processor. Used for 8-bit BGRA captures encoded
+    /// as NV12 by a single session without pointer, QP map or simulcast; other frames take the video
+    /// processor. Must be called before Init()
+    void SetFusedConversion(bool bEnable) { m_bFusedConversion = bEnable; }
+
+    /// Recover from a capture failure, rebuilding only what the failure invalidated.
+    /// Starts the time-to-first-frame measurement, which the next encoded frame completes
+    HRESULT Recover(HRESULT hrCapture);
+    /// True between a capture failure and the next encoded frame
+    bool IsRecovering() const { return m_bRecovering; }
+    /// Milliseconds since the capture failure that started the current recovery
+    double GetTimeSinceLoss() const;
+    /// Time from the last capture failure to the next encoded frame, and the worst one so far
+    double GetLastRecoveryMs() const { return m_lastRecoveryMs; }
+    double GetMaxRecoveryMs() const { return m_maxRecoveryMs; }
+    UINT GetRecoveryCount() const { return m_nRecoveries; }
+    /// What the last recovery had to rebuild
+    RecoveryLevel GetLastRecoveryLevel() const { return m_lastRecoveryLevel; }
+    UINT GetEncoderSessionCount() const { return m_nEncoderSessions; }
+
+    /// Play back raw BGRA frames instead of capturing the desktop, optionally failing with
+    /// DXGI_ERROR_ACCESS_LOST every injectEvery frames. Must be called before Init()
+    void SetReplay(const std::string &path, DWORD width, DWORD height, UINT injectEvery)
+    {
+        m_replayPath = path;
+        m_replayWidth = width;
+        m_replayHeight = height;
+        m_replayInjectEvery = injectEvery;
+    }
+
+    /// Capture all displays of the adapter, composited into one stream or each into its own stream
+    /// (out_display<i>), or a single display. Must be called before Init()
+    void SetOutputMode(OutputMode mode) { m_outputMode = mode; }
+    /// Index of the display captured in single mode, on the adapter of the D3D11 device. Must be called before Init()
+    void SetCaptureOutput(UINT index) { m_captureOutput = index; }
+    /// With SetReplay(), play the file on 'count' synthetic displays side by side, for testing
+    /// multi-display capture without the displays. Must be called before Init()
+    void SetSyntheticOutputs(UINT count) { m_syntheticOutputs = count; }
+    /// Displays captured together, null in single mode
+    MultiOutputCapture *GetDisplays() { return m_pDisplays; }
+
+    /// Scroll the first replayed frame by 'rows' per frame instead of playing the file, see ReplayCaptureSource::setScroll()
+    void SetReplayScroll(UINT rows) { m_replayScroll = rows; }
+
+    /// Encoder options in NvEncoderInitParam syntax ("-codec h264 -preset p3 -rc cbr -bitrate 8M ...").
+    /// Unspecified options keep the defaults: H.264, preset P3, ultra low latency tuning.
+    /// The string is expected to have passed EncoderProfiles::Validate(). Must be called before Init()
+    void SetEncoderOptions(const std::string &options);
+
+    /// Encode text and UI at a lower QP than motion, with a per block QP delta map built every frame. Must be called before Init()
+    void SetQpMap(bool bEnable) { m_bQpMap = bEnable; }
+
+    /// Receive every packet of the main stream with the timestamps of the frame it encodes, e.g. to
+    /// mux or send it with its capture time (FrameTiming::present). Called after the packet was written,
+    /// on the encoder's retrieval thread in async output mode. Must be called before Init()
+    void SetPacketSink(std::function<void(const std::vector<uint8_t> &packet, const FrameTiming &timing)> sink) { m_packetSink = sink; }
+    /// Per stage latency histograms, from the present time of a frame to its packet being written
+    LatencyTracker &GetLatency() { return m_latency; }
+
+    /// Pass the move rects of window drags and scrolls to the encoder as motion vector hints. Must be called before Init()
+    void SetMotionHints(bool bEnable) { m_bMotionHints = bEnable; }
+    /// Frames encoded with hints
+    UINT64 GetHintedFrames() const { return m_nHintedFrames; }
+
+    /// Streaming mode: replace periodic IDR frames with intra refresh waves. Must be called before Init()
+    void SetIntraRefresh(const IntraRefreshConfig &cfg) { m_intraRefresh = cfg; }
+    /// Parse "period[:frames]" as given on the command line. frames defaults to half the period
+    static bool ParseIntraRefresh(const char *szArg, IntraRefreshConfig &cfg);
+
+    /// Number of the next frame to be encoded. Frames are numbered from 0 in encode order, across
+    /// encoder sessions; a client reports losses in these numbers
+    UINT64 GetFrameNumber() const { return m_nFrameNumber; }
+    /// A client lost frames firstFrame..lastFrame. The encoder stops predicting from them if the GPU
+    /// supports reference invalidation and the frames are still in its DPB, otherwise the next frame
+    /// becomes a recovery point. Can be called from any thread, takes effect with the next frame
+    void InvalidateFrames(UINT64 firstFrame, UINT64 lastFrame);
+    /// Make the next frame a recovery point: an intra refresh wave in streaming mode, an IDR frame
+    /// otherwise. Can be called from any thread
+    void ForceRecovery();
+    /// Size statistics of the encoded frames, compare with and without intra refresh
+    const PacketStats &GetPacketStats() const { return m_packetStats; }
+
+    /// Retrieve the encoded frames on a dedicated thread that writes each one as soon as NVENC is done
+    /// with it, instead of collecting them three frames later in Encode(). Must be called before Init()
+    void SetAsyncOutput(bool bEnable) { m_bAsyncOutput = bEnable; }
+
+    /// Enable damage aware adaptive bitrate, overrides the rate control options. Must be called before Init()
+    void SetRateControl(const RateControlConfig &cfg) { m_rateConfig = cfg; m_bAdaptiveRate = true; }
+    /// Record what the rate controller sees each frame, one "damage bytes bitrate" line: the damaged
+    /// fraction of the frame, the packet bytes received since the previous frame and the average bitrate
+    /// the encoder was configured for. -benchabr replays such a trace. Needs SetRateControl()
+    bool SetRateTrace(const char *szPath)
+    {
+        m_rateTrace.open(szPath, std::ios::out | std::ios::trunc);
+        return m_rateTrace.is_open();
+    }
+
+    /// Decide per captured frame what to give up when encoding or output falls behind, instead of
+    /// letting the loop slow down. LowerResolution needs a single session without QP maps, motion
+    /// hints or simulcast; otherwise LowerFrameRate is used. Must be called before Init()
+    void SetBackpressure(const BackpressureConfig &cfg) { m_backpressure.Init(cfg); m_bBackpressure = true; }
+    /// Count the packets queued in the packet sink as backlog, e.g. PacketChannel::GetSize(), unless the
+    /// strategy bounds the queue itself. Any thread
+    void SetSinkBacklog(std::function<size_t()> fn) { m_sinkBacklog = fn; }
+    bool IsBackpressureEnabled() const { return m_bBackpressure; }
+    const BackpressureController &GetBackpressure() const { return m_backpressure; }
 };
@@ -0,0 +1,44 @@
+#pragma once
+#include <string>
+#include <vector>
+
+/// A named set of NvEncoderInitParam options, e.g. "-codec h264 -preset p3 -rc cbr -bitrate 8M"
+struct EncoderProfile
+{
+    std::string name;
+    std::string options;
+    /// Where the profile came from: "built-in" or file:line
+    std::string origin;
+};
+
+class EncoderProfiles
+{
+    /// Encoder tuning that can be changed without a rebuild. Holds the built-in profiles
+    /// (lowlatency, archival, screentext) and any profiles loaded from a file, which replace
+    /// built-ins of the same name. A profile file has one profile per line:
+    ///     # comment
+    ///     name = -codec h264 -preset p4 -tuninginfo lowlatency -rc vbr -cq 22
+    /// Every profile is validated when it is added, so a bad file is reported before capture starts.
+private:
+    std::vector<EncoderProfile> m_vProfiles;
+
+public:
+    /// Starts with the built-in profiles
+    EncoderProfiles();
+
+    /// Add the profiles of a file. Returns false, and prints every offending line, if the file
+    /// cannot be read or any of its profiles does not validate; valid profiles are kept regardless
+    bool LoadFile(const std::string &path);
+    /// Add or replace a profile. Returns false and leaves the set unchanged if it does not validate
+    bool Add(const EncoderProfile &profile, std::string &error);
+    /// nullptr if there is no profile of that name
+    const EncoderProfile *Find(const std::string &name) const;
+    const std::vector<EncoderProfile> &GetProfiles() const { return m_vProfiles; }
+
+    /// Check an option string the way the encoder will parse it, plus the constraints of this
+    /// application: NV12 input, and no B frames or lookahead with the low latency tunings.
+    /// Returns false and a message in 'error' when the options would be rejected or ignored
+    static bool Validate(const std::string &options, std::string &error);
+    /// Encoder options and profile usage, for the command line help
+    static std::string GetHelpMessage();
+};
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <optional>
+#include <atomic>
+#include <dxgi1_2.h>
+#include <d3d11_2.h>
+#include "Defs.hpp"
+#include "FrameArena.hpp"
+#include <cuda.h>
+
+/// What the pipeline knows about the frame in a surface, allocated from the surface's arena. Exists
+/// from FramePool::Acquire() until the surface returns to the pool, then the arena is reset at once
+struct FrameMetadata
+{
+    explicit FrameMetadata(std::pmr::memory_resource *pArena) : vMoveRects(pArena), vInvalidFrames(pArena) {}
+    /// Move rects of the capture, for motion hints
+    FrameVector<DXGI_OUTDUPL_MOVE_RECT> vMoveRects;
+    /// Frames the client reported lost, applied when this frame is encoded
+    FrameVector<UINT64> vInvalidFrames;
+};
+
+struct FramePoolShared;
+
+/// One preallocated input surface of a FramePool
+struct FrameSurface
+{
+    /// Converted frame, written by the video processor and read by CUDA
+    ID3D11Texture2D *pTex = nullptr;
+    /// pTex registered with CUDA once when the pool was created
+    CUgraphicsResource cuResource = nullptr;
+    /// Position in the pool
+    UINT index = 0;
+    /// Backs the metadata of the frame in the surface, recycled with it
+    std::unique_ptr<FrameArena> pArena;
+    std::optional<FrameMetadata> metadata;
+    /// Handles referring to the surface; it returns to the pool when the count drops to zero
+    std::atomic<long> nRefs{ 0 };
+    /// Pool state the surface belongs to
+    FramePoolShared *pPool = nullptr;
+};
+
+/// State of a FramePool shared with the outstanding handles. Counted by hand, not by a shared_ptr, so
+/// acquiring and releasing a surface allocates nothing: one reference for the pool and one for every
+/// surface out of it
+struct FramePoolShared
+{
+    CUcontext cuContext = nullptr;
+    /// Never resized: surfaces cannot move while handles point at them
+    std::vector<FrameSurface> vSurfaces;
+    std::mutex mutex;
+    std::condition_variable released;
+    /// Indices of the surfaces no handle refers to
+    std::vector<UINT> vFree;
+    std::atomic<long> nRefs{ 1 };
+
+    /// Unregisters and releases every surface
+    ~FramePoolShared();
+    void AddRef() { nRefs.fetch_add(1, std::memory_order_relaxed); }
+    /// Deletes the state with the last reference
+    void Release();
+};
+
+class FrameHandle
+{
+    /// Reference to a surface of a FramePool. Copies share the surface, which returns to the pool
+    /// when the last copy is released or destroyed. A stage keeps a copy for as long as it uses the
+    /// frame, so capture can convert the next frame into another surface while it is encoded.
+    /// The count is kept in the surface, so copies and moves never allocate.
+public:
+    FrameHandle() {}
+    FrameHandle(const FrameHandle &other) : m_pSurface(other.m_pSurface)
+    {
+        if (m_pSurface)
+        {
+            m_pSurface->nRefs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    FrameHandle(FrameHandle &&other) noexcept : m_pSurface(other.m_pSurface) { other.m_pSurface = nullptr; }
+    FrameHandle &operator=(FrameHandle other) noexcept
+    {
+        std::swap(m_pSurface, other.m_pSurface);
+        return *this;
+    }
+    ~FrameHandle() { Release(); }
+
+    ID3D11Texture2D *GetTexture() const { return m_pSurface ? m_pSurface->pTex : nullptr; }
+    CUgraphicsResource GetCudaResource() const { return m_pSurface ? m_pSurface->cuResource : nullptr; }
+    UINT GetIndex() const { return m_pSurface ? m_pSurface->index : 0; }
+    /// Metadata of the frame; allocate anything else that lives as long as the frame from the arena
+    FrameMetadata *GetMetadata() const { return m_pSurface ? &*m_pSurface->metadata : nullptr; }
+    FrameArena *GetArena() const { return m_pSurface ? m_pSurface->pArena.get() : nullptr; }
+    /// Number of handles sharing the surface, 0 for an empty handle
+    long GetRefCount() const { return m_pSurface ? m_pSurface->nRefs.load(std::memory_order_relaxed) : 0; }
+    explicit operator bool() const { return m_pSurface != nullptr; }
+    /// Drop this reference
+    void Release();
+
+private:
+    friend class FramePool;
+    /// Takes over a reference counted already
+    explicit FrameHandle(FrameSurface *pSurface) : m_pSurface(pSurface) {}
+    FrameSurface *m_pSurface = nullptr;
+};
+
+class FramePool
+{
+    /// A fixed set of input surfaces of one size and format, created and registered with CUDA up
+    /// front, so nothing is allocated or registered while frames flow. Acquire() hands out a free
+    /// surface as a FrameHandle. The pool may be cleaned up while handles are still held: the
+    /// surfaces are then released with the last handle.
+private:
+    ID3D11Device *m_pDev = nullptr;
+    CUcontext m_cuContext = nullptr;
+    /// The pool's reference to the state shared with the outstanding handles
+    FramePoolShared *m_pShared = nullptr;
+    UINT m_nWidth = 0;
+    UINT m_nHeight = 0;
+    DXGI_FORMAT m_format = DXGI_FORMAT_UNKNOWN;
+    /// Acquire() calls that found no free surface
+    UINT64 m_nExhausted = 0;
+
+public:
+    /// Initial size of each surface's metadata arena
+    static constexpr size_t ARENA_BYTES = 16 << 10;
+
+public:
+    /// Constructor. Surfaces are created on pDev and registered in cuContext
+    FramePool(ID3D11Device *pDev, CUcontext cuContext);
+    /// Destructor
+    ~FramePool()
+    {
+        Cleanup();
+        SAFE_RELEASE(m_pDev);
+    }
+
+    /// Create and register 'count' surfaces of width x height in 'format', each with a metadata arena
+    HRESULT Init(UINT count, UINT width, UINT height, DXGI_FORMAT format);
+    /// A free surface, waiting up to waitMs for one to be released. Empty if none became free
+    FrameHandle Acquire(int waitMs);
+    /// Drop the pool's reference to the surfaces
+    void Cleanup();
+
+    UINT GetCount() const { return m_pShared ? (UINT)m_pShared->vSurfaces.size() : 0; }
+    UINT GetFreeCount();
+    UINT GetWidth() const { return m_nWidth; }
+    UINT GetHeight() const { return m_nHeight; }
+    DXGI_FORMAT GetFormat() const { return m_format; }
+    UINT64 GetExhaustedCount() const { return m_nExhausted; }
+    /// Heap blocks the arenas took since Init(), stops growing once they fit the busiest frame
+    UINT64 GetArenaHeapAllocations();
+};
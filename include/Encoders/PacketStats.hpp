@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "FrameLatency.hpp"
+
+class PacketStats
+{
+    /// Size distribution of the encoded frames. Used to compare GOP structures: a stream whose
+    /// frames all stay close to the per frame budget (bitrate / fps) can be sent without queueing,
+    /// while every frame above it delays the frames behind it by (size - budget) / bitrate.
+    /// Sizes go into a fixed log-linear histogram, not a list, so a long stream adds nothing per frame:
+    /// percentiles and counts are within 1/16 of a size, the mean, deviation and maximum are exact.
+private:
+    LatencyHistogram m_sizes;
+    double m_sumSquares = 0;
+
+public:
+    /// Add the total size of the packets of one frame
+    void Add(size_t nBytes);
+    void Reset();
+
+    size_t GetCount() const { return (size_t)m_sizes.GetCount(); }
+    double GetMean() const;
+    double GetStdDev() const;
+    /// Standard deviation relative to the mean, comparable between bitrates
+    double GetCoefficientOfVariation() const;
+    /// Size at the given percentile, 0-100
+    uint32_t GetPercentile(double percentile) const;
+    uint32_t GetMax() const;
+    /// Number of frames larger than 'factor' times the mean, not counting those within 1/16 above it
+    size_t GetCountAbove(double factor) const;
+
+    /// One line summary
+    void Print(const char *szLabel) const;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+/// Direction of the cuts between partitions
+enum class PartitionOrientation
+{
+    /// Stripes stacked top to bottom, each the full width
+    Horizontal,
+    /// Stripes side by side, each the full height. Suits a wall of monitors next to each other
+    Vertical
+};
+
+/// What the partitions are encoded into
+enum class PartitionOutput
+{
+    /// One session per stripe, each writing an independently decodable stream
+    Streams,
+    /// One session that splits every frame across the NVENC engines of the GPU into a single
+    /// bitstream. HEVC and AV1 only; AV1 gets one tile per strip
+    Split
+};
+
+/// Settings of partitioned encoding
+struct PartitionConfig
+{
+    /// Number of partitions. 0 or 1 encodes the frame in one piece
+    uint32_t count = 0;
+    PartitionOrientation orientation = PartitionOrientation::Horizontal;
+    PartitionOutput output = PartitionOutput::Streams;
+    /// Frames between load balancing decisions. 0 keeps the initial equal split
+    uint32_t balanceInterval = 300;
+};
+
+class PartitionLayout
+{
+    /// Where PartitionedEncoder places its cuts, and its command line. Kept apart from the encoder so
+    /// it builds and is tested without CUDA
+public:
+    /// Split 'length' into vSize.size() parts that end at multiples of 'align', except the last one,
+    /// each as close as possible to an equal share of the cost. vCost holds the cost of each 'align'
+    /// wide band from the start. Parts are kept between minSize and maxSize
+    static void ComputeCuts(uint32_t length, uint32_t align, const std::vector<double> &vCost, uint32_t minSize, uint32_t maxSize,
+        std::vector<uint32_t> &vSize);
+    /// Parse "N[h|v][:split]" as given on the command line
+    static bool ParseConfig(const char *szArg, PartitionConfig &cfg);
+};
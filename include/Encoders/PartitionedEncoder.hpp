@@ -0,0 +1,131 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <mutex>
+#include "Defs.hpp"
+#include "NvEncoder/NvEncoderCuda.h"
+#include "NvEncoderCLIOptions.h"
+#include "CrcIndex.hpp"
+#include "PartitionLayout.hpp"
+
+class PartitionedEncoder
+{
+    /// Encodes a frame too large for one NVENC session as N stripes, each with its own session,
+    /// retrieval thread and output file (out_stripe<i>.h264, .hevc or .av1). Every stripe encodes every
+    /// frame with the same input timestamp and the same IDR frames, so frame k of each stream is part
+    /// of the same picture.
+    ///
+    /// Rate control is shared: the configured bitrate is the budget of the whole frame and is divided
+    /// among the stripes by their complexity, the bits of their recent frames times the quantizer step.
+    /// Stripes then settle at about the same QP, and the quality does not jump at a seam.
+    ///
+    /// The load is balanced by moving the cuts: every balanceInterval frames the encode time of each
+    /// stripe is spread over its rows (columns) and the cuts are placed at equal shares of the total.
+    /// A new layout takes an IDR frame in every stripe, so it is only applied when the slowest stripe
+    /// is clearly slower than the average. Each layout is appended to out.partition as
+    /// "<first frame> <h|v> <offset>:<size> ..." for the receiver that stitches the stripes together.
+    ///
+    /// InitRegions() encodes fixed rectangles instead, one per display of a multi-display canvas, into
+    /// out_display<i> files with the same shared rate control. Their layout is written to out.displays
+    /// as "<first frame> r <x>,<y>:<width>x<height> ...".
+private:
+    struct Stripe
+    {
+        /// First row (horizontal) or column (vertical) of the stripe, and its rows (columns)
+        UINT offset = 0;
+        UINT size = 0;
+        /// Area of the frame in region mode
+        RECT region = { 0, 0, 0, 0 };
+        std::unique_ptr<NvEncoderCuda> pEnc;
+        std::ofstream fpOut;
+        CrcIndexWriter crcIndex;
+        /// Packets returned by EncodeFrame() and EndEncode(). Empty, the retrieval thread writes them
+        std::vector<std::vector<uint8_t>> vPacket;
+        /// QPC time of the submission of the frames in flight, indexed by frame number
+        std::vector<LONGLONG> vSubmitTime;
+        /// Bitrate share, 0-1
+        double rateShare = 0;
+        /// Sums since the last rate and balance decisions. Guarded by m_statsMutex
+        double complexity = 0;
+        UINT64 encodeUs = 0;
+        UINT nTimedFrames = 0;
+        /// Totals. Guarded by m_statsMutex
+        UINT64 framesEncoded = 0;
+        UINT64 bytesEncoded = 0;
+        UINT64 totalEncodeUs = 0;
+    };
+
+    CUcontext m_cuContext = nullptr;
+    LARGE_INTEGER m_qpcFreq = { 0 };
+    PartitionConfig m_cfg;
+    NvEncoderInitParam m_options;
+    UINT m_nWidth = 0;
+    UINT m_nHeight = 0;
+    /// Cuts are placed at multiples of this, the superblock size, so they also fall on MB and CTB boundaries
+    UINT m_nAlign = 64;
+    /// Stripe size limits along the cut direction. Input buffers are allocated for the largest
+    UINT m_nMinSize = 0;
+    UINT m_nMaxSize = 0;
+    /// Bitrate of the whole frame shared by the stripes, 0 with constant QP
+    uint32_t m_totalBitrate = 0;
+    uint32_t m_totalMaxBitrate = 0;
+    uint32_t m_totalVbvSize = 0;
+    bool m_bAV1 = false;
+    /// Fixed rectangles set by InitRegions() instead of stripes
+    bool m_bRegions = false;
+    std::vector<std::unique_ptr<Stripe>> m_vStripes;
+    std::mutex m_statsMutex;
+    std::ofstream m_layoutFile;
+    UINT64 m_nFrames = 0;
+    UINT m_nRebalances = 0;
+
+private:
+    HRESULT InitStripe(Stripe &s, UINT index);
+    /// Copy the stripe's part of the NV12 frame into its encoder input
+    CUresult CopyStripe(CUarray cuArray, const Stripe &s);
+    /// Called on the stripe's retrieval thread with every packet
+    void OnPacket(Stripe &s, const std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info);
+    /// Divide the bitrate by the complexity the stripes had since the last update
+    void UpdateRateShares();
+    /// Move the cuts if the stripes are out of balance. True if the layout changed
+    bool Rebalance(UINT64 frameNumber);
+    /// Reconfigure every stripe to its offset and size, with an IDR
+    HRESULT ApplyLayout();
+    /// Bitrate, maximum bitrate and VBV size of a stripe from its share
+    void SetStripeRate(const Stripe &s, NV_ENC_RC_PARAMS &rc) const;
+    void WriteLayout(UINT64 frameNumber);
+    UINT GetLength() const { return m_cfg.orientation == PartitionOrientation::Horizontal ? m_nHeight : m_nWidth; }
+    UINT GetStripeX(const Stripe &s) const;
+    UINT GetStripeY(const Stripe &s) const;
+    UINT GetStripeWidth(const Stripe &s) const;
+    UINT GetStripeHeight(const Stripe &s) const;
+
+public:
+    /// Constructor. The stripes share the CUDA context of the main pipeline
+    explicit PartitionedEncoder(CUcontext cuContext);
+    /// Destructor. Flushes all encoders
+    ~PartitionedEncoder() { Cleanup(); }
+
+    /// Create a session per stripe of a width x height NV12 frame. 'options' are the encoder options of
+    /// the single session; the bitrate in them is the budget of the whole frame
+    HRESULT Init(const PartitionConfig &cfg, const NvEncoderInitParam &options, UINT width, UINT height);
+    /// Create a session per rectangle of a width x height NV12 frame, e.g. per display of a canvas.
+    /// Rectangles are shrunk to even coordinates. They keep their place, only the bitrate is shared
+    HRESULT InitRegions(const std::vector<RECT> &vRegions, const NvEncoderInitParam &options, UINT width, UINT height);
+    /// Encode the mapped NV12 frame in every stripe. 'frameNumber' becomes the input timestamp of all
+    /// stripes, bForceIdr makes it an IDR frame in all of them
+    HRESULT Encode(CUarray cuArray, UINT64 frameNumber, bool bForceIdr);
+    /// Flush all encoders and release all resources
+    void Cleanup();
+
+    size_t GetStripeCount() const { return m_vStripes.size(); }
+    UINT GetStripeOffset(size_t i) const { return m_vStripes[i]->offset; }
+    UINT GetStripeSize(size_t i) const { return m_vStripes[i]->size; }
+    bool IsRegions() const { return m_bRegions; }
+    UINT GetRebalanceCount() const { return m_nRebalances; }
+    /// Per stripe frames, size, encode time and bitrate share
+    void PrintStats();
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+/// Limits and tuning of the adaptive bitrate loop. Bitrates in bits per second
+struct RateControlConfig
+{
+    uint32_t minBitrate = 2000000;
+    uint32_t maxBitrate = 20000000;
+    /// Encoder frame rate, converts between per frame sizes and bitrates
+    double fps = 60;
+    /// Peak bitrate as a multiple of the average bitrate
+    double peakRatio = 1.5;
+    /// VBV buffer size in frames at the average bitrate. 1 keeps the single frame VBV of ultra low latency
+    double vbvFrames = 1;
+    /// Smoothed damage at or below which the desktop counts as idle (min bitrate) ...
+    double idleDamage = 0.01;
+    /// ... and at or above which it counts as busy (max bitrate)
+    double busyDamage = 0.30;
+    /// Number of frames the packet size and damage statistics are averaged over
+    int windowFrames = 30;
+    /// Minimum number of frames between two reconfigurations
+    int holdFrames = 30;
+    /// Relative bitrate change below which no reconfiguration is issued
+    double hysteresis = 0.20;
+    /// Output queue backlog, in frames above its steady state, that counts as congestion
+    int maxBacklog = 2;
+};
+
+/// New rate control settings for NV_ENC_RC_PARAMS
+struct RateDecision
+{
+    uint32_t averageBitRate = 0;
+    uint32_t maxBitRate = 0;
+    uint32_t vbvBufferSize = 0;
+    uint32_t vbvInitialDelay = 0;
+};
+
+class RateController
+{
+    /// Damage aware bitrate controller. Each frame it is fed the damaged fraction of the frame, the size
+    /// of the packets that came out of the encoder and the output queue backlog, and decides when the
+    /// encoder should be retuned:
+    ///   - the damage, smoothed over the window, maps linearly to a bitrate between min and max,
+    ///   - if the encoder spends nearly all of its current budget, the target is raised by a step,
+    ///   - if the output queue backs up, the target is cut immediately (after a short hold).
+    /// A new target is only issued when it differs from the current one by more than the hysteresis
+    /// and the hold time has passed, so the encoder is not reconfigured on every frame.
+    /// The class holds no encoder state, so it can be driven by recorded traces as well as by NVENC.
+private:
+    RateControlConfig m_cfg;
+    /// Ring buffers of the last windowFrames frames
+    std::vector<double> m_vDamage;
+    std::vector<size_t> m_vBytes;
+    int m_nPos = 0;
+    int m_nFilled = 0;
+    double m_damageSum = 0;
+    uint64_t m_bytesSum = 0;
+    /// Lowest backlog seen, the steady state of the encoder's output delay
+    int m_nMinBacklog = -1;
+    /// Currently configured average bitrate
+    uint32_t m_nCurrent = 0;
+    int m_nSinceChange = 0;
+    uint64_t m_nReconfigs = 0;
+
+public:
+    /// Start at nInitialBitrate, clamped to the configured range
+    void Init(const RateControlConfig &cfg, uint32_t nInitialBitrate);
+    /// Feed the statistics of one frame. Returns true and fills decision when the encoder should be reconfigured
+    bool OnFrame(double damageFraction, size_t nPacketBytes, int nBacklog, RateDecision &decision);
+    /// Rate control settings for a given average bitrate
+    RateDecision MakeDecision(uint32_t nAverageBitrate) const;
+
+    uint32_t GetCurrentBitrate() const { return m_nCurrent; }
+    uint64_t GetReconfigCount() const { return m_nReconfigs; }
+    /// Bitrate actually produced over the window
+    double GetMeasuredBitrate() const { return m_nFilled ? (double)m_bytesSum * 8 * m_cfg.fps / m_nFilled : 0; }
+    double GetSmoothedDamage() const { return m_nFilled ? m_damageSum / m_nFilled : 0; }
+
+    /// Parse "minKbps:maxKbps" as given on the command line
+    static bool ParseLimits(const char *szArg, RateControlConfig &cfg);
+};
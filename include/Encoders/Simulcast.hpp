@@ -0,0 +1,111 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <fstream>
+#include "Defs.hpp"
+#include "NvEncoder/NvEncoderCuda.h"
+#include "NvEncoderCLIOptions.h"
+#include "D3D11TextureConverter.h"
+#include "CrcIndex.hpp"
+
+/// What a rendition does with a frame it cannot keep up with
+enum class RenditionDropPolicy
+{
+    /// Encode every frame allowed by the rate limit, even if the branch is running late
+    Never,
+    /// Skip the frame if the previous encode of this branch overran the branch frame budget
+    DropIfLate
+};
+
+/// Settings of a single simulcast branch
+struct RenditionConfig
+{
+    UINT width = 0;
+    UINT height = 0;
+    /// Maximum frame rate of this rendition. 0 encodes every captured frame
+    double maxFps = 0;
+    /// Average and peak bitrate of this rendition in bits per second. 0 keeps the session default for its size;
+    /// a peak of 0 is the average
+    uint32_t averageBitRate = 0;
+    uint32_t maxBitRate = 0;
+    RenditionDropPolicy dropPolicy = RenditionDropPolicy::DropIfLate;
+    /// Output file. Defaults to out_<width>x<height> with the extension of the codec
+    std::string outFile;
+};
+
+class Simulcast
+{
+    /// Fans the shared full resolution NV12 frame out to N scaled renditions.
+    /// Each branch owns a scaler, an NVENC session and an output file.
+    /// Branches are sorted by size and each one is scaled from the next larger branch
+    /// (e.g. 4K -> 1080p -> 540p) so only the first branch reads the full resolution frame.
+private:
+    struct Rendition
+    {
+        RenditionConfig cfg;
+        /// Index of the branch this one is scaled from, -1 for the shared full resolution frame
+        int parent = -1;
+        /// NV12 texture at the rendition size
+        ID3D11Texture2D *pTex = nullptr;
+        /// Video processor used to scale parent -> pTex
+        std::unique_ptr<D3D11TextureConverter> scaler;
+        /// pTex registered with CUDA once at Init()
+        CUgraphicsResource cuResource = nullptr;
+        std::unique_ptr<NvEncoderCuda> pEnc;
+        std::ofstream fpOut;
+        CrcIndexWriter crcIndex;
+        std::vector<std::vector<uint8_t>> vPacket;
+        /// QPC timestamp of the last encoded frame
+        LARGE_INTEGER lastEncode = { 0 };
+        /// Duration of the last scale + encode in microseconds
+        LONGLONG lastCostUs = 0;
+        UINT64 framesEncoded = 0;
+        UINT64 framesDropped = 0;
+    };
+
+    ID3D11Device *m_pDev = nullptr;
+    ID3D11DeviceContext *m_pCtx = nullptr;
+    CUcontext m_cuContext = nullptr;
+    LARGE_INTEGER m_qpcFreq = { 0 };
+    /// Encoder options of the main stream, applied to every branch
+    NvEncoderInitParam m_options;
+    UINT m_srcWidth = 0;
+    UINT m_srcHeight = 0;
+    std::vector<std::unique_ptr<Rendition>> m_vRenditions;
+
+private:
+    HRESULT InitRendition(Rendition &r);
+    HRESULT EncodeRendition(Rendition &r, CUstream stream);
+    /// True if the rate limit and drop policy of the branch accept a frame at 'now'
+    bool WantsFrame(Rendition &r, LARGE_INTEGER now);
+
+public:
+    /// Constructor
+    Simulcast(ID3D11Device *pDev, ID3D11DeviceContext *pCtx, CUcontext cuContext);
+    /// Destructor. Flushes all encoders and releases all resources
+    ~Simulcast()
+    {
+        Cleanup();
+        SAFE_RELEASE(m_pCtx);
+        SAFE_RELEASE(m_pDev);
+    }
+
+    /// Create all branches with the codec, preset and rate control options of the main stream.
+    /// Renditions larger than the source are rejected
+    HRESULT Init(const std::vector<RenditionConfig> &vConfig, const NvEncoderInitParam &options, UINT srcWidth, UINT srcHeight);
+    /// Scale and encode the shared NV12 frame into every branch that wants it
+    HRESULT Process(ID3D11Texture2D *pFullResNv12, CUstream stream);
+    /// Flush all encoders and release all resources
+    void Cleanup();
+
+    /// Number of active branches
+    size_t GetRenditionCount() const { return m_vRenditions.size(); }
+    /// Per branch counters
+    UINT64 GetFramesEncoded(size_t i) const { return m_vRenditions[i]->framesEncoded; }
+    UINT64 GetFramesDropped(size_t i) const { return m_vRenditions[i]->framesDropped; }
+
+    /// Parse "WxH[@fps][:kbps[:maxKbps]],..." as given on the command line
+    static bool ParseRenditions(const char *szArg, std::vector<RenditionConfig> &vConfig);
+};
@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <string>
+#include <memory_resource>
+
+class FrameArena : public std::pmr::memory_resource
+{
+    /// Monotonic allocator for the short-lived metadata of one frame: rect lists, loss reports,
+    /// log lines. Allocation bumps a pointer, deallocation does nothing, and Reset() releases
+    /// everything at once when the frame retires. The memory is kept for the next frame; if a
+    /// frame needed more than the first block, Reset() replaces the blocks with one block of the
+    /// total size, so after a few frames the arena stops allocating from the heap at all.
+    /// Not thread safe: a frame's metadata is built by one stage at a time.
+public:
+    explicit FrameArena(size_t nBlockBytes = DEFAULT_BLOCK_BYTES);
+    ~FrameArena();
+    FrameArena(const FrameArena &) = delete;
+    FrameArena &operator=(const FrameArena &) = delete;
+
+    /// Release all allocations. Containers using the arena must be gone or cleared before
+    void Reset();
+
+    /// Bytes handed out since the last Reset()
+    size_t GetUsed() const { return m_nUsed; }
+    /// Most bytes used by one frame
+    size_t GetHighWater() const { return m_nHighWater; }
+    size_t GetCapacity() const;
+    /// Blocks taken from the heap over the arena's lifetime
+    uint64_t GetHeapAllocations() const { return m_nHeapAllocations; }
+
+    static const size_t DEFAULT_BLOCK_BYTES = 16 << 10;
+
+protected:
+    void *do_allocate(size_t bytes, size_t alignment) override;
+    void do_deallocate(void *, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override { return this == &other; }
+
+private:
+    struct Block
+    {
+        uint8_t *pData = nullptr;
+        size_t nSize = 0;
+    };
+    std::vector<Block> m_vBlocks;
+    /// Block being filled and the offset in it
+    size_t m_iBlock = 0;
+    size_t m_nOffset = 0;
+    size_t m_nBlockBytes = 0;
+    size_t m_nUsed = 0;
+    size_t m_nHighWater = 0;
+    uint64_t m_nHeapAllocations = 0;
+
+    void AddBlock(size_t nMinBytes);
+    void FreeBlocks();
+};
+
+/// Containers for per-frame metadata. Pass the frame's arena; default constructed they use the heap
+template <typename T>
+using FrameVector = std::pmr::vector<T>;
+using FrameString = std::pmr::string;
@@ -0,0 +1,115 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <mutex>
+
+/// Timestamps of one frame on its way through the pipeline, in ticks of the clock the tracker was
+/// initialized with (QueryPerformanceCounter). 0 when a stage has not been reached
+struct FrameTiming
+{
+    /// Number of the frame in encode order, its NV_ENC_PIC_PARAMS::inputTimeStamp
+    uint64_t frameNumber = 0;
+    /// The desktop image was presented (DXGI_OUTDUPL_FRAME_INFO::LastPresentTime)
+    int64_t present = 0;
+    /// The capture source returned the frame
+    int64_t acquired = 0;
+    /// Conversion to NV12 was issued
+    int64_t converted = 0;
+    /// The frame was handed to NVENC
+    int64_t submitted = 0;
+    /// The bitstream was retrieved from NVENC
+    int64_t ready = 0;
+    /// The packet was written to the output
+    int64_t written = 0;
+    /// Decoding can start at this frame: an IDR frame, or the first frame of a forced intra refresh wave
+    bool bRecoveryPoint = false;
+};
+
+enum class LatencyStage
+{
+    /// present -> acquired
+    Capture,
+    /// acquired -> converted
+    Convert,
+    /// converted -> submitted: CUDA copy, pointer, QP map, hints
+    Prepare,
+    /// submitted -> ready
+    Encode,
+    /// ready -> written
+    Write,
+    /// present -> written, the age of the frame a packet encodes when the packet leaves
+    Total,
+    Count
+};
+
+class LatencyHistogram
+{
+    /// Log-linear histogram of durations in microseconds: exact below 16 us, 16 buckets per power of
+    /// two above, so a percentile is within 1/16 of its value. Fixed size, adding is O(1)
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    /// Up to 2^40 us, 12 days
+    static const int BUCKETS = (40 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    void Add(int64_t us);
+    /// Add every duration of another histogram
+    void Merge(const LatencyHistogram &other);
+    /// Add durations counted elsewhere in the same buckets, e.g. a shard of MetricHistogram
+    void Merge(const uint64_t (&buckets)[BUCKETS], int64_t sum, int64_t max);
+    void Reset();
+    uint64_t GetCount() const { return m_nCount; }
+    double GetMean() const { return m_nCount ? (double)m_sum / m_nCount : 0; }
+    int64_t GetSum() const { return m_sum; }
+    int64_t GetMax() const { return m_max; }
+    uint64_t GetBucketCount(int bucket) const { return m_buckets[bucket]; }
+    /// Duration at the percentile, 0-100: the middle of the bucket holding it
+    int64_t GetPercentile(double percentile) const;
+    /// One line summary in milliseconds
+    void Print(const char *szLabel) const;
+
+    static int GetBucket(int64_t us);
+    static int64_t GetBucketStart(int bucket);
+
+private:
+    uint64_t m_buckets[BUCKETS] = {};
+    uint64_t m_nCount = 0;
+    int64_t m_sum = 0;
+    int64_t m_max = 0;
+};
+
+class LatencyTracker
+{
+    /// Follows frames from capture to output. A record is opened when a frame is submitted to the
+    /// encoder and looked up again by the frame number NVENC returns with the packet
+    /// (NV_ENC_LOCK_BITSTREAM::outputTimeStamp); completing it adds every stage to the histograms.
+    /// Submit() and Find()/Complete() may be called from different threads.
+public:
+    /// 'frequency' is the number of ticks per second of the timestamps
+    void Init(int64_t frequency);
+    /// Open the record of a submitted frame. Records of frames that never return are overwritten
+    /// after MAX_IN_FLIGHT newer ones
+    void Submit(const FrameTiming &timing);
+    /// Record of the frame a packet encodes. False if it was never submitted or has been overwritten
+    bool Find(uint64_t frameNumber, FrameTiming &timing);
+    /// Add the stage latencies of a record to the histograms and close it
+    void Complete(const FrameTiming &timing);
+    void Reset();
+
+    /// Copy of a stage's histogram
+    LatencyHistogram GetHistogram(LatencyStage stage);
+    int64_t ToMicroseconds(int64_t ticks) const { return m_frequency ? ticks * 1000000 / m_frequency : 0; }
+    /// Summary of every stage
+    void Print();
+
+    static const char *GetStageName(LatencyStage stage);
+    static const size_t MAX_IN_FLIGHT = 256;
+
+private:
+    int64_t m_frequency = 0;
+    std::mutex m_mutex;
+    std::vector<FrameTiming> m_vRecords = std::vector<FrameTiming>(MAX_IN_FLIGHT);
+    std::vector<bool> m_vOpen = std::vector<bool>(MAX_IN_FLIGHT);
+    LatencyHistogram m_stages[(int)LatencyStage::Count];
+};
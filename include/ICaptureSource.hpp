@@ -0,0 +1,39 @@
+#pragma once
+#include <vector>
+#include <dxgi1_2.h>
+#include <d3d11_2.h>
+#include "DamageMap.hpp"
+#include "CursorCompositor.hpp"
+
+class ICaptureSource
+{
+    /// A source of BGRA desktop frames on the D3D11 device the encoder uses.
+    /// Implemented by DDAImpl for a display, by ReplayCaptureSource for recorded frames and by
+    /// MultiOutputCapture for several of either composited into one canvas.
+public:
+    virtual ~ICaptureSource() {}
+    /// Initialize the source. Sets width and height
+    virtual HRESULT Init() = 0;
+    /// Drop the capture session and open a new one, keeping the device. Used to recover from
+    /// DXGI_ERROR_ACCESS_LOST; width and height may change
+    virtual HRESULT Reacquire() = 0;
+    /// Acquire a new frame. 'wait' is the time in milliseconds to wait for a screen update.
+    /// Returns DXGI_ERROR_WAIT_TIMEOUT when nothing changed
+    virtual HRESULT GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait) = 0;
+    /// Release all resources
+    virtual int Cleanup() = 0;
+    virtual DWORD getWidth() = 0;
+    virtual DWORD getHeight() = 0;
+    /// Damage of the last acquired frame
+    virtual const DamageMap &getDamage() = 0;
+    /// Move rects of the last acquired frame, empty if the source does not report them
+    virtual const std::vector<DXGI_OUTDUPL_MOVE_RECT> &getMoveRects() = 0;
+    /// QueryPerformanceCounter() time at which the last acquired frame was shown on screen, or the
+    /// time it was acquired for sources that do not know
+    virtual LONGLONG getPresentTime() = 0;
+    /// Position and size on the virtual desktop. Pointer positions are relative to its top-left corner
+    virtual RECT getDesktopRect() = 0;
+    /// Pointer state. Invisible for sources without a pointer
+    virtual CursorCompositor &getCursor() = 0;
+    virtual void setCompositeCursor(bool bEnable) = 0;
+};
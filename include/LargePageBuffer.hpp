@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/// Pages backing a LargePageBuffer
+enum class PageKind
+{
+    None,
+    /// 4 KB pages, the fallback
+    Small,
+    /// Explicit large pages: MEM_LARGE_PAGES on Windows, MAP_HUGETLB elsewhere
+    Large,
+    /// 4 KB mapping advised for transparent huge pages; the kernel promotes it when it can
+    Transparent
+};
+
+class LargePageBuffer
+{
+    /// Page-backed memory for frame-sized CPU buffers: raw BGRA frames, luma read back for analysis,
+    /// conversion targets. A 4K BGRA frame spans more than 8000 4 KB pages, so a pass over it misses
+    /// the TLB every few rows; with 2 MB pages it touches 17. Large pages are tried first:
+    /// on Windows they need the "Lock pages in memory" right (SeLockMemoryPrivilege), which is enabled
+    /// on first use if the account holds it, and physically contiguous free memory. When they cannot
+    /// be had the buffer falls back to transparent huge pages where the OS has them, then to 4 KB pages,
+    /// with a warning on the first fallback. Memory is page aligned, so it is always ALIGNMENT aligned;
+    /// GetPitch() pads rows to the same alignment. New memory is zeroed.
+public:
+    LargePageBuffer() = default;
+    ~LargePageBuffer() { Free(); }
+    LargePageBuffer(const LargePageBuffer &) = delete;
+    LargePageBuffer &operator=(const LargePageBuffer &) = delete;
+    LargePageBuffer(LargePageBuffer &&other) noexcept;
+    LargePageBuffer &operator=(LargePageBuffer &&other) noexcept;
+
+    /// Allocate nBytes, releasing the current memory. Keeps the memory if it has the size already.
+    /// Buffers smaller than a large page, or bLargePages = false, use 4 KB pages
+    bool Allocate(size_t nBytes, bool bLargePages = true);
+    void Free();
+
+    uint8_t *GetData() { return m_pData; }
+    const uint8_t *GetData() const { return m_pData; }
+    size_t GetSize() const { return m_nSize; }
+    PageKind GetPageKind() const { return m_eKind; }
+
+    /// SIMD loads and NVENC input pitches
+    static const size_t ALIGNMENT = 64;
+    /// Row pitch for rows of nRowBytes, a multiple of ALIGNMENT
+    static size_t GetPitch(size_t nRowBytes) { return (nRowBytes + ALIGNMENT - 1) & ~(ALIGNMENT - 1); }
+    /// Size of a large page, 0 if the OS has none
+    static size_t GetLargePageSize();
+
+    /// Process wide accounting of the live buffers
+    struct Stats
+    {
+        uint64_t nLargeBytes = 0;
+        uint64_t nTransparentBytes = 0;
+        uint64_t nSmallBytes = 0;
+        /// Allocations that asked for large pages and did not get them
+        uint64_t nFallbacks = 0;
+    };
+    static Stats GetStats();
+    static void PrintStats();
+
+private:
+    uint8_t *m_pData = nullptr;
+    /// Requested and mapped bytes
+    size_t m_nSize = 0;
+    size_t m_nMapped = 0;
+    PageKind m_eKind = PageKind::None;
+};
@@ -0,0 +1,106 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "FrameLatency.hpp"
+
+enum class MetricType
+{
+    /// Monotonic count, e.g. frames captured
+    Counter,
+    /// Current level, e.g. a queue depth
+    Gauge,
+    /// Distribution of durations in microseconds
+    Histogram
+};
+
+class Metric
+{
+    /// A named value of the MetricsRegistry, registered when constructed; typically a static of the
+    /// module that updates it. Metrics are never unregistered
+public:
+    const MetricType type;
+    /// Prometheus name, e.g. frames_captured_total
+    const char *const szName;
+    const char *const szHelp;
+    /// Prometheus labels without the braces, e.g. stage="encode"; empty for none
+    const char *const szLabels;
+    /// Slot among the metrics of its type, -1 if the registry is full and the metric ignored
+    const int id;
+
+protected:
+    Metric(MetricType type, const char *szName, const char *szHelp, const char *szLabels);
+};
+
+class MetricCounter : public Metric
+{
+    /// Count summed over threads: each thread adds to its own shard, no atomic read-modify-write and
+    /// no shared cache line; GetValue() and snapshots add the shards up
+public:
+    MetricCounter(const char *szName, const char *szHelp, const char *szLabels = "") : Metric(MetricType::Counter, szName, szHelp, szLabels) {}
+    void Add(uint64_t n = 1);
+    uint64_t GetValue() const;
+};
+
+class MetricGauge : public Metric
+{
+    /// A level set by whoever knows it, e.g. the owner of a queue. Not sharded: a level is not a sum
+public:
+    MetricGauge(const char *szName, const char *szHelp, const char *szLabels = "") : Metric(MetricType::Gauge, szName, szHelp, szLabels) {}
+    void Set(int64_t value) { m_value.store(value, std::memory_order_relaxed); }
+    int64_t GetValue() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> m_value{ 0 };
+};
+
+class MetricHistogram : public Metric
+{
+    /// Durations in microseconds, in the buckets of LatencyHistogram (exact below 16 us, within 1/16
+    /// above). Each thread adds to its own shard, which it allocates on first use
+public:
+    MetricHistogram(const char *szName, const char *szHelp, const char *szLabels = "") : Metric(MetricType::Histogram, szName, szHelp, szLabels) {}
+    void Observe(int64_t us);
+    /// Sum of the shards
+    LatencyHistogram GetHistogram() const;
+};
+
+/// Value of a metric when the snapshot was taken
+struct MetricSample
+{
+    const Metric *pMetric;
+    /// Counter or gauge
+    int64_t value = 0;
+    LatencyHistogram histogram;
+};
+
+class MetricsRegistry
+{
+    /// Process wide counters, gauges and histograms of the pipeline: frames captured, dropped and
+    /// repeated, packets and bytes out, queue depths, stage latencies. Updating a metric touches only
+    /// the calling thread's shard; Snapshot() sums the shards while they keep being updated, so a
+    /// snapshot is consistent per metric, not across metrics. Snapshots are written as JSON or as
+    /// Prometheus text, to a file and/or over HTTP on a loopback port by StartExport().
+public:
+    static const int MAX_COUNTERS = 256;
+    static const int MAX_HISTOGRAMS = 32;
+
+    static std::vector<MetricSample> Snapshot();
+    static std::string ToJson(const std::vector<MetricSample> &vSamples);
+    /// Text exposition format 0.0.4
+    static std::string ToPrometheus(const std::vector<MetricSample> &vSamples);
+    /// Write a snapshot to szPath, JSON if it ends in .json, Prometheus text otherwise (e.g. .prom for
+    /// a node_exporter textfile collector). Replaces the file at once, readers never see half of it
+    static bool WriteFile(const char *szPath);
+
+    /// Background export until StopExport(): a snapshot to szPath every intervalMs, and/or HTTP on
+    /// 127.0.0.1:port serving /metrics (Prometheus) and /metrics.json. nullptr or 0 to skip either
+    static bool StartExport(const char *szPath, int port, int intervalMs = 1000);
+    /// Write the final snapshot and stop serving
+    static void StopExport();
+
+    /// Called by Metric
+    static int RegisterMetric(Metric *pMetric);
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "DesktopTypes.hpp"
+#include "nvEncodeAPI.h"
+
+class MotionHints
+{
+    /// Turns the move rects of a captured frame into NVENC external ME hints: one candidate per 16x16
+    /// macroblock for H.264 and HEVC (NV_ENC_PIC_PARAMS::meExternalHints), one per 64x64 superblock
+    /// for AV1 (NV_ENC_PIC_PARAMS::meExternalSbHints).
+    ///
+    /// A move rect is the exact displacement of a window drag or a scroll. The encoder's own search
+    /// only finds it when it is within its search range, which a fast scroll at 4K is not.
+    /// A block gets the vector of the move rect covering most of it, at least half of it; every other
+    /// block gets a zero vector, a candidate the encoder evaluates anyway. Vectors outside the range
+    /// of the hint fields (x -2048..2047, y -512..511) are dropped. All buffers are kept between frames.
+public:
+    /// Size the hints for a width x height frame, superblock hints for AV1
+    void Init(int nWidth, int nHeight, bool bSuperblocks);
+    /// Build the hints of a frame from its move rects. Returns the number of blocks with a non-zero
+    /// vector; when there is none the frame is better encoded without hints
+    int Update(const DXGI_OUTDUPL_MOVE_RECT *pMoves, size_t nMoves);
+
+    /// One candidate per macroblock in raster order, GetBlockCount() entries. Valid after Update() without superblocks
+    NVENC_EXTERNAL_ME_HINT *GetHints() { return m_vHints.data(); }
+    /// One candidate per superblock in raster order, GetBlockCount() entries. Valid after Update() with superblocks
+    NVENC_EXTERNAL_ME_SB_HINT *GetSbHints() { return m_vSbHints.data(); }
+
+    int GetWidth() const { return m_nWidth; }
+    int GetHeight() const { return m_nHeight; }
+    bool IsSuperblocks() const { return m_bSuperblocks; }
+    int GetBlockSize() const { return m_nBlockSize; }
+    int GetBlocksX() const { return m_nBlocksX; }
+    int GetBlocksY() const { return m_nBlocksY; }
+    uint32_t GetBlockCount() const { return (uint32_t)m_vMvx.size(); }
+    /// Vector of a block in full pixels, pointing from the block to its content in the previous frame
+    int GetMvx(int bx, int by) const { return m_vMvx[(size_t)by * m_nBlocksX + bx]; }
+    int GetMvy(int bx, int by) const { return m_vMvy[(size_t)by * m_nBlocksX + bx]; }
+
+private:
+    int m_nWidth = 0;
+    int m_nHeight = 0;
+    int m_nBlockSize = 16;
+    int m_nBlocksX = 0;
+    int m_nBlocksY = 0;
+    bool m_bSuperblocks = false;
+    std::vector<int16_t> m_vMvx;
+    std::vector<int16_t> m_vMvy;
+    /// Pixels of each block covered by the move rect its vector came from
+    std::vector<int32_t> m_vCoverage;
+    std::vector<NVENC_EXTERNAL_ME_HINT> m_vHints;
+    std::vector<NVENC_EXTERNAL_ME_SB_HINT> m_vSbHints;
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <vector>
+#include "ICaptureSource.hpp"
+#include "OutputLayout.hpp"
+
+class MultiOutputCapture : public ICaptureSource
+{
+    /// Captures several displays into one BGRA canvas laid out as on the virtual desktop, see OutputLayout.
+    /// Each display is its own capture source, a DDAImpl per output or a ReplayCaptureSource per
+    /// synthetic display. One thread serves them all: every GetCapturedFrame() polls each source once,
+    /// in turn, blocking on one only until the first of them has an update, and copies only the
+    /// dirty tiles of the updated ones into the canvas. Damage and move rects are mapped to canvas
+    /// coordinates, so the incremental paths work on the canvas as on a single display.
+    /// Displays overlapping an earlier one, i.e. clones, are dropped by Init().
+private:
+    ID3D11Device *pD3DDev = nullptr;
+    ID3D11DeviceContext *pCtx = nullptr;
+    /// One source per display, owned
+    std::vector<ICaptureSource *> vSources;
+    OutputLayout layout;
+    /// BGRA canvas the displays are copied into
+    ID3D11Texture2D *pCanvas = nullptr;
+    DWORD width = 0;
+    DWORD height = 0;
+    RECT desktopRect = { 0, 0, 0, 0 };
+    DamageMap damage;
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> vMoveRects;
+    /// Scratch buffer for the dirty runs of one display
+    FrameVector<RECT> vRuns;
+    /// Oldest present time of the displays updated in the last frame
+    LONGLONG presentTime = 0;
+    /// Pointer of the display it is on, in canvas coordinates
+    CursorCompositor cursor;
+    bool bCompositeCursor = true;
+    /// Display polled first by the next GetCapturedFrame(), so a busy one cannot starve the others
+    size_t nextSource = 0;
+    /// Displays whose frames were skipped for a format other than the canvas format, reported once
+    std::vector<bool> vFormatReported;
+
+    /// Lay out the sources and create the canvas for their current desktop rects
+    HRESULT InitCanvas();
+    /// Copy the dirty tiles of source i into the canvas and add its damage and move rects
+    void CopyToCanvas(size_t i, ID3D11Texture2D *pTex);
+
+public:
+    /// Constructor. Sources are added with addSource() before Init()
+    MultiOutputCapture(ID3D11Device *pDev, ID3D11DeviceContext *pDevCtx);
+    ~MultiOutputCapture() { Cleanup(); }
+
+    /// Add a display. Takes ownership of the source
+    void addSource(ICaptureSource *pSource) { vSources.push_back(pSource); }
+
+    HRESULT Init() override;
+    HRESULT Reacquire() override;
+    HRESULT GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait) override;
+    int Cleanup() override;
+    DWORD getWidth() override { return width; }
+    DWORD getHeight() override { return height; }
+    const DamageMap &getDamage() override { return damage; }
+    const std::vector<DXGI_OUTDUPL_MOVE_RECT> &getMoveRects() override { return vMoveRects; }
+    LONGLONG getPresentTime() override { return presentTime; }
+    /// Bounding rect of the displays
+    RECT getDesktopRect() override { return desktopRect; }
+    CursorCompositor &getCursor() override { return cursor; }
+    void setCompositeCursor(bool bEnable) override;
+
+    size_t getOutputCount() { return vSources.size(); }
+    /// Rect of display i on the canvas
+    RECT getOutputRect(size_t i) { return layout.GetRect(i); }
+    ICaptureSource *getSource(size_t i) { return vSources[i]; }
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include <stddef.h>
+#include <vector>
+#include "DesktopTypes.hpp"
+#include "DamageMap.hpp"
+#include "FrameArena.hpp"
+
+class OutputLayout
+{
+    /// Places the displays on one canvas as they are arranged on the virtual desktop, shifted so the
+    /// top-left display corner is at 0,0. Gaps between displays of different sizes stay black.
+    /// Maps the damage and move rects each display reports in its own coordinates to the canvas.
+public:
+    /// Lay out displays at the given virtual desktop rects. False if two of them overlap (cloned displays)
+    bool Init(const std::vector<RECT> &vDesktopRects);
+
+    /// Canvas size, rounded up to even for NV12
+    int GetCanvasWidth() const { return m_nWidth; }
+    int GetCanvasHeight() const { return m_nHeight; }
+    size_t GetOutputCount() const { return m_vRects.size(); }
+    /// Rect of display i on the canvas
+    const RECT &GetRect(size_t i) const { return m_vRects[i]; }
+
+    /// Mark the canvas tiles under the dirty runs of display i, as returned by GetDirtyRuns()
+    void MapDamage(size_t i, const FrameVector<RECT> &vRuns, DamageMap &canvas) const;
+    /// Append the move rects of display i, moved to canvas coordinates
+    void MapMoveRects(size_t i, const std::vector<DXGI_OUTDUPL_MOVE_RECT> &vMoves, std::vector<DXGI_OUTDUPL_MOVE_RECT> &vCanvasMoves) const;
+
+    /// Dirty area of a map as few rects: runs of dirty tiles in a row, merged with the same run in
+    /// the rows below. Clipped to the frame
+    static void GetDirtyRuns(const DamageMap &damage, FrameVector<RECT> &vRuns);
+    static bool Overlaps(const RECT &a, const RECT &b);
+
+private:
+    std::vector<RECT> m_vRects;
+    int m_nWidth = 0;
+    int m_nHeight = 0;
+};
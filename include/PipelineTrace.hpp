@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/// One finished span as the thread that ran it recorded it
+struct TraceSpanRecord
+{
+    /// QPC ticks, exported in nanoseconds
+    int64_t start;
+    int64_t end;
+    /// A string that outlives the trace, e.g. a literal
+    const char *szName;
+    /// Frame the span worked on, its encode order number; NO_FRAME for work of no particular frame
+    uint64_t frame;
+};
+
+class PipelineTrace
+{
+    /// Timeline of the pipeline: TraceSpan scopes around capture acquire, conversion, encoder submit,
+    /// bitstream lock, mux and write record their start and end into a ring of the thread that ran
+    /// them, a flight recorder of the last RING_SIZE spans per thread. Export() writes the rings as
+    /// Chrome trace JSON (chrome://tracing, ui.perfetto.dev) or as a Perfetto protobuf trace, with a
+    /// flow arrow linking the spans of each frame across threads. Spans are only recorded between
+    /// Enable(true) and Enable(false); otherwise a span costs one relaxed load. No locks on the hot
+    /// path, the first span of a thread allocates its ring.
+public:
+    static const uint64_t NO_FRAME = UINT64_MAX;
+    static const uint32_t RING_SIZE = 16384;
+
+    static void Enable(bool bEnable) { s_bEnabled.store(bEnable, std::memory_order_relaxed); }
+    static bool IsEnabled() { return s_bEnabled.load(std::memory_order_relaxed); }
+    /// Name of the calling thread's track, e.g. "capture"; a literal
+    static void SetThreadName(const char *szName);
+
+    /// Write the spans recorded so far to szPath: Chrome trace JSON if it ends in .json, a Perfetto
+    /// protobuf trace otherwise (.perfetto-trace, .pftrace). Spans keep being recorded meanwhile.
+    /// Returns the number of spans written, -1 on failure
+    static int64_t Export(const char *szPath);
+    /// Forget the recorded spans
+    static void Clear();
+
+    static void Record(const char *szName, int64_t start, int64_t end, uint64_t frame);
+    /// QPC ticks on Windows, steady clock nanoseconds elsewhere
+    static int64_t GetTicks();
+
+private:
+    static std::atomic<bool> s_bEnabled;
+};
+
+class TraceSpan
+{
+    /// Scope of pipeline work on the timeline, see PipelineTrace:
+    ///     TraceSpan span("convert", frameNumber);
+    /// The frame may be set later, when it is only known at the end, e.g. after the bitstream lock
+public:
+    explicit TraceSpan(const char *szName, uint64_t frame = PipelineTrace::NO_FRAME)
+        : m_szName(szName)
+        , m_frame(frame)
+        , m_start(PipelineTrace::IsEnabled() ? PipelineTrace::GetTicks() : 0)
+    {
+    }
+    ~TraceSpan() { End(); }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    void SetFrame(uint64_t frame) { m_frame = frame; }
+    /// End the span before the scope does
+    void End()
+    {
+        if (m_start)
+        {
+            PipelineTrace::Record(m_szName, m_start, PipelineTrace::GetTicks(), m_frame);
+            m_start = 0;
+        }
+    }
+
+private:
+    const char *m_szName;
+    uint64_t m_frame;
+    int64_t m_start;
+};
@@ -0,0 +1,86 @@
+#pragma once
+#include <string>
+#include <fstream>
+#include "ICaptureSource.hpp"
+#include "TileHasher.hpp"
+#include "LargePageBuffer.hpp"
+
+class ReplayCaptureSource : public ICaptureSource
+{
+    /// Plays back raw BGRA frames, as written by CudaH264Array::WriteRawFrame(), as if they were captured.
+    /// Loops at the end of the file. There are no dirty rects, damage comes from a TileHasher.
+    /// Frames are kept in large pages; the file holds them with unpadded rows.
+    /// Capture failures can be injected to exercise the recovery paths without a real desktop:
+    /// every N frames the source reports the injected error and keeps failing until Reacquire().
+    /// In scroll mode the first frame of the file is scrolled by a fixed step every frame and the
+    /// scroll is reported as a move rect, as DDA reports a scrolling window.
+private:
+    ID3D11Device *pD3DDev = nullptr;
+    ID3D11DeviceContext *pCtx = nullptr;
+    /// BGRA texture the frames are uploaded to
+    ID3D11Texture2D *pTex = nullptr;
+    std::string path;
+    std::ifstream fp;
+    DWORD width = 0;
+    DWORD height = 0;
+    /// Current frame, rows padded to pitch
+    LargePageBuffer frame;
+    size_t pitch = 0;
+    TileHasher hasher;
+    DamageMap damage;
+    std::vector<DXGI_OUTDUPL_MOVE_RECT> vMoveRects;
+    /// Never visible, replays carry no pointer
+    CursorCompositor cursor;
+
+    /// Fault injection
+    UINT injectEvery = 0;
+    HRESULT injectError = DXGI_ERROR_ACCESS_LOST;
+    UINT framesSinceInject = 0;
+    bool bLost = false;
+    UINT64 frameno = 0;
+    /// QPC time of the last GetCapturedFrame(), replayed frames carry no present time
+    LONGLONG presentTime = 0;
+    /// Rows the picture moves up per frame in scroll mode, 0 plays the file
+    UINT scrollStep = 0;
+    /// Where the replay sits on the virtual desktop when it stands in for one of several displays
+    LONG originX = 0;
+    LONG originY = 0;
+
+    /// Read the next frame of the file into 'frame'
+    bool readFrame();
+
+public:
+    /// Constructor. width x height is the size of the frames in the file
+    ReplayCaptureSource(ID3D11Device *pDev, ID3D11DeviceContext *pDevCtx, const std::string &path, DWORD width, DWORD height);
+    ~ReplayCaptureSource() { Cleanup(); }
+
+    /// Return 'hr' from GetCapturedFrame() after every 'everyNFrames' frames. 0 disables injection
+    void setFaultInjection(UINT everyNFrames, HRESULT hr = DXGI_ERROR_ACCESS_LOST)
+    {
+        injectEvery = everyNFrames;
+        injectError = hr;
+    }
+
+    /// Scroll the first frame up by 'rows' every frame instead of playing the file. 0 plays the file
+    void setScroll(UINT rows) { scrollStep = rows; }
+
+    /// Place the replay at (x, y) on the virtual desktop, as a synthetic display next to others
+    void setOrigin(LONG x, LONG y)
+    {
+        originX = x;
+        originY = y;
+    }
+
+    HRESULT Init() override;
+    HRESULT Reacquire() override;
+    HRESULT GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait) override;
+    int Cleanup() override;
+    DWORD getWidth() override { return width; }
+    DWORD getHeight() override { return height; }
+    const DamageMap &getDamage() override { return damage; }
+    const std::vector<DXGI_OUTDUPL_MOVE_RECT> &getMoveRects() override { return vMoveRects; }
+    LONGLONG getPresentTime() override { return presentTime; }
+    RECT getDesktopRect() override { return { originX, originY, originX + (LONG)width, originY + (LONG)height }; }
+    CursorCompositor &getCursor() override { return cursor; }
+    void setCompositeCursor(bool) override {}
+};
@@ -0,0 +1,103 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <vector>
+#include "CudaH264Array.hpp"
+
+struct SampleOptions
+{
+    /// Command line of Grab60FPS(). Parse() reads it, Apply() hands the capture and encoder settings to a
+    /// CudaH264Array; the -bench* counts select a benchmark instead of the capture loop (bench/Bench.hpp).
+    /// -log, -trace, -metrics, -metricsport, -verify and -decodelog are handled by main()
+
+    /// -h or -help: print the encoder options and exit
+    bool bHelp = false;
+    /// -listdisplays: list the displays of every adapter and exit
+    bool bListDisplays = false;
+
+    bool bNoCursor = false;
+    bool bQpMap = false;
+    bool bAsyncOutput = false;
+    bool bMotionHints = false;
+    bool bFusedConversion = false;
+    bool bCoroutines = false;
+    std::optional<UINT> captureOutput;
+    std::optional<OutputMode> outputMode;
+    std::optional<UINT> syntheticOutputs;
+    std::optional<PartitionConfig> partition;
+    std::optional<BackpressureConfig> backpressure;
+    std::vector<RenditionConfig> vRenditions;
+    IntraRefreshConfig refresh;
+    /// Set by -abr; the limits also drive -benchabr without it
+    bool bAdaptiveBitrate = false;
+    RateControlConfig rateConfig;
+    std::string rateTracePath;
+    UINT reportLossEvery = 0;
+
+    /// -replay WxH file, with -injectloss and -scroll
+    std::string replayPath;
+    DWORD replayWidth = 0;
+    DWORD replayHeight = 0;
+    UINT injectEvery = 0;
+    UINT scrollRows = 0;
+
+    /// The profile's options followed by every unrecognized argument, validated
+    std::string encoderOptions;
+
+    int benchRefreshFrames = 0;
+    int benchHintFrames = 0;
+    int benchRecoveryFrames = 0;
+    int benchSchedFrames = 0;
+    int benchHashFrames = 0;
+    int benchAllocFrames = 0;
+    int benchPagesFrames = 0;
+    int benchFusedFrames = 0;
+    int benchBackpressureFrames = 0;
+    std::string benchAbrTrace;
+    int benchLogRecords = 0;
+    int benchTraceSpans = 0;
+    int benchMetricOps = 0;
+
+    /// -simulcast WxH[@fps][:kbps[:maxKbps]],... encodes scaled renditions next to the full resolution stream, each at its
+    /// own frame rate and bitrate
+    /// -nocursor records the desktop without the mouse pointer
+    /// -qpmap encodes text at a lower QP than motion, from a per block QP delta map
+    /// -asyncoutput writes every packet as soon as NVENC has finished it, from a retrieval thread
+    /// -motionhints passes the move rects of window drags and scrolls to the encoder as motion vector hints
+    /// -partition N[h|v][:split] encodes N horizontal or vertical stripes in their own sessions and streams,
+    /// or with :split one stream split across the NVENC engines (HEVC, AV1)
+    /// -display N captures display N of the adapter instead of the primary one, -displays composite|separate captures
+    /// all of them into one canvas stream or one stream each, -synthdisplays N replays on N displays side by side,
+    /// -listdisplays lists the displays of every adapter
+    /// -abr minKbps:maxKbps adapts the bitrate to the amount of screen change, -abrtrace file records what the rate
+    /// control sees per frame, -benchabr file replays such a trace against a stand-in encoder and link and checks
+    /// hold, hysteresis and congestion cut-back
+    /// -backpressure strategy[:maxBacklog[:maxLatencyMs]] drops, repeats or scales frames when encoding or output falls behind,
+    /// strategy one of block, dropoldest, dropnewest, repeat, fps, resolution; -benchbackpressure N compares them on a simulated pipeline
+    /// -replay WxH file plays back raw BGRA frames instead of capturing, -injectloss N fails the replay every N frames,
+    /// -benchrecovery N replays N frames failing every -injectloss frames (default 60) and checks each recovery,
+    /// -scroll N scrolls the first frame by N rows per frame instead, -benchhints N compares N scrolled frames without and with -motionhints
+    /// -encprofile name applies a set of encoder options, -encprofiles file adds profiles to the built-in ones
+    /// -intrarefresh period[:frames] streams with intra refresh waves instead of IDR frames
+    /// -reportloss N reports every Nth frame as lost by the client, -benchrefresh N compares IDR GOP and intra refresh on N replayed frames
+    /// -coroutines runs the capture loop as a coroutine on the task scheduler and writes a copy of the stream from a second one
+    /// -log file records per-frame capture logs to file instead of capture.blog, -decodelog file prints such a log as text,
+    /// -benchlog N compares N per-frame log calls as text lines and as binary log records
+    /// -trace file records a timeline of every frame's capture, conversion, encoding and output, written at exit as Chrome
+    /// trace JSON (file.json) or Perfetto protobuf (other names); -benchtrace N times N spans and exports a synthetic timeline
+    /// -metrics file writes counters, gauges and latency histograms every second and at exit, as JSON (file.json) or
+    /// Prometheus text (other names); -metricsport N serves them on http://127.0.0.1:N/metrics and /metrics.json;
+    /// -benchmetrics N times N metric updates per thread, sharded and shared
+    /// -fusedconvert converts and scales the captured frame to NV12 in one CUDA kernel instead of the D3D11 video processor
+    /// (with -nocursor, without -qpmap or -simulcast); -benchfused N times that and convert-then-resize on the GPU and the CPU
+    /// -benchpages N times tile hashing and CPU conversion of 4K frames in 4 KB pages and in large pages
+    /// -benchalloc N counts the heap allocations per frame of the frame metadata, with and without the frame arenas, and
+    /// with -replay of N frames of the Capture()/Preproc() loop (needs a build with -DCOUNT_ALLOCATIONS=ON)
+    /// -benchhash N times tile hashing of N 4K frames on 1 to all threads of the shared task scheduler
+    /// -benchsched N measures frame throughput and hashing latency of 1-8 sessions sharing the CPU task scheduler
+    /// Every other argument is an encoder option (-codec, -preset, -rc, -bitrate, -gop, ...) and overrides the profile.
+    /// Stops at -h and -listdisplays. False, with the reason printed, on an invalid argument
+    bool Parse(int argc, char *argv[]);
+    /// Configure 'encoder' before its Init(). False if the rate trace cannot be written
+    bool Apply(CudaH264Array &encoder) const;
+};
@@ -0,0 +1,134 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+/// Lanes of the scheduler, served in this order
+enum class TaskPriority
+{
+    /// On the path of a frame: capture, conversion bands, hashing
+    Critical,
+    Normal,
+    /// Work nobody waits for: muxing, checksums, logs. Never takes all workers
+    Background,
+    Count
+};
+
+class TaskGroup
+{
+    /// Counts the tasks submitted with it that have not finished, see TaskScheduler::Wait()
+private:
+    friend class TaskScheduler;
+    std::atomic<int> m_nPending{ 0 };
+    std::mutex m_mutex;
+    std::condition_variable m_cvDone;
+};
+
+class TaskScheduler
+{
+    /// Runs CPU work of all pipelines of the process on one set of worker threads, one per core, so
+    /// several sessions on a host share the cores instead of each bringing its own threads.
+    ///
+    /// Every worker has a deque per priority lane. A task submitted from a worker goes to the back
+    /// of that worker's deque and the worker takes it back from there, while its cache is warm.
+    /// Tasks from other threads go to the worker named by the affinity hint, e.g. the session
+    /// index, or round-robin. A worker looking for work takes the highest lane that has a task
+    /// anywhere: its own deque first, then the front of the others' (stealing). Tasks are not
+    /// preempted, so background tasks are limited to half the workers and a critical task always
+    /// finds one free soon.
+public:
+    /// nWorkers = 0 uses all hardware threads but one, the caller of ParallelFor() works too.
+    /// bPinThreads binds worker i to core i
+    explicit TaskScheduler(int nWorkers = 0, bool bPinThreads = false);
+    ~TaskScheduler();
+    TaskScheduler(const TaskScheduler &) = delete;
+    TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+    /// Queue a task. 'affinity' is the worker it should run on, taken modulo the worker count, or -1.
+    /// Idle workers steal it regardless. pGroup, if given, counts the task until it has run
+    void Submit(std::function<void()> fn, TaskPriority priority = TaskPriority::Normal, int affinity = -1, TaskGroup *pGroup = nullptr);
+    /// Wait for the tasks of a group. Runs queued tasks meanwhile, so it can be called from a task
+    void Wait(TaskGroup &group);
+    /// Call fn(i) for every i in [0, count) on up to maxParallel threads (0: all workers), the
+    /// calling thread included. Returns when all calls have returned. fn is called through a
+    /// reference, not copied, and the call state is recycled: a call allocates nothing
+    template <typename Fn>
+    void ParallelFor(int count, Fn &&fn, TaskPriority priority = TaskPriority::Critical, int maxParallel = 0)
+    {
+        ParallelFor(count, [](void *pFn, int i) { (*static_cast<std::remove_reference_t<Fn> *>(pFn))(i); }, (void *)&fn, priority, maxParallel);
+    }
+
+    int GetWorkerCount() const { return (int)m_vWorkers.size(); }
+    /// Tasks run, and tasks taken from another worker's deque
+    uint64_t GetExecutedCount() const { return m_nExecuted.load(); }
+    uint64_t GetStolenCount() const { return m_nStolen.load(); }
+
+    /// Scheduler of the process, created on first use with the default settings
+    static TaskScheduler &GetShared();
+
+private:
+    struct Task
+    {
+        std::function<void()> fn;
+        TaskPriority priority = TaskPriority::Normal;
+        TaskGroup *pGroup = nullptr;
+    };
+
+    /// Deque of tasks in a ring that only grows, so queueing and taking tasks allocates nothing once
+    /// it has room for the longest queue (std::deque allocates and frees blocks as tasks flow)
+    struct TaskRing
+    {
+        std::vector<Task> vTasks;
+        size_t head = 0;
+        size_t count = 0;
+
+        bool empty() const { return count == 0; }
+        void push_back(Task &&task);
+        Task pop_back();
+        Task pop_front();
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        TaskRing lanes[(int)TaskPriority::Count];
+        std::thread thread;
+    };
+
+    /// State of one ParallelFor() call, shared with its helper tasks, see TaskScheduler.cpp
+    struct ForState;
+
+    std::vector<std::unique_ptr<Worker>> m_vWorkers;
+    /// Queued tasks per lane, so a worker knows which lanes to look at without locking
+    std::atomic<int> m_nQueued[(int)TaskPriority::Count];
+    std::atomic<int> m_nBackgroundRunning{ 0 };
+    int m_nMaxBackground = 1;
+    std::atomic<unsigned> m_nNextWorker{ 0 };
+    std::atomic<uint64_t> m_nExecuted{ 0 };
+    std::atomic<uint64_t> m_nStolen{ 0 };
+    /// Idle workers sleep here
+    std::mutex m_sleepMutex;
+    std::condition_variable m_cvWork;
+    bool m_bQuit = false;
+    /// ForStates no call or helper refers to, reused by the next ParallelFor()
+    std::mutex m_forStateMutex;
+    std::vector<ForState *> m_vFreeForStates;
+    size_t m_nForStates = 0;
+
+    void WorkerProc(int index, bool bPin);
+    /// Take the most urgent task, from 'self' first (-1 for a thread that is not a worker)
+    bool Take(int self, Task &task);
+    bool PopLane(int worker, int lane, bool bBack, Task &task);
+    void Run(Task &task);
+    bool HasWork();
+    void ParallelFor(int count, void (*pfnCall)(void *, int), void *pFn, TaskPriority priority, int maxParallel);
+    ForState *AcquireForState();
+    void ReleaseForState(ForState *pState);
+};
@@ -0,0 +1,65 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "DamageMap.hpp"
+#include "TaskScheduler.hpp"
+
+class TileHasher
+{
+    /// Builds a DamageMap by hashing every DamageMap::TILE_SIZE square tile of a BGRA frame and
+    /// comparing against the hashes of the previous frame. Used for capture sources that do not
+    /// report dirty rects (replays, other capture APIs, remote input).
+    ///
+    /// The hash is an xxh3 style 64-bit hash: four 128-bit accumulators take a multiply-add of
+    /// (data ^ secret) per 16 bytes and are scrambled every 16 stripes, so a tile costs about one
+    /// multiply per 8 bytes. Tile rows are spread over the workers of a TaskScheduler as
+    /// latency-critical work; the calling thread works too.
+    ///
+    /// False negatives: a changed tile is missed only when its old and new hashes collide. For a
+    /// 64-bit hash with good dispersion that is ~2^-64 per changed tile, i.e. at 4K60 with every
+    /// tile changing (8160 tiles/frame) one expected miss per ~10^9 years. tests/TileHasherTest checks
+    /// the dispersion: a single bit flip anywhere in a tile flips each output bit with probability 1/2
+    /// (within 1.3% for every bit), and 2^18 one-pixel variants of a tile have distinct hashes and only
+    /// the birthday-bound collisions of random numbers in any 24 of their bits. The hash is not keyed or
+    /// cryptographic: crafted content can collide, so do not use it where the input is adversarial.
+    /// A missed tile stays stale only until the next change of that tile.
+public:
+    TileHasher() = default;
+    ~TileHasher() { Cleanup(); }
+    TileHasher(const TileHasher &) = delete;
+    TileHasher &operator=(const TileHasher &) = delete;
+
+    /// Size for a width x height frame. Rows are hashed on up to nThreads threads of pScheduler,
+    /// nThreads = 0 uses all its workers. pScheduler = nullptr uses TaskScheduler::GetShared()
+    void Init(int nWidth, int nHeight, int nThreads = 0, TaskScheduler *pScheduler = nullptr);
+    /// Free the hash tables
+    void Cleanup();
+    /// Forget the previous frame, the next Process() marks every tile dirty
+    void Reset() { m_bHavePrev = false; }
+
+    /// Hash pFrame and fill damage with the tiles that differ from the previous Process() call.
+    /// damage is (re)initialized to the frame size
+    void Process(const uint8_t *pFrame, int nPitch, DamageMap &damage);
+
+    /// 64-bit hash of a w x h BGRA block. Exposed for analysis
+    static uint64_t HashTile(const uint8_t *pTile, int nPitch, int w, int h);
+
+    int GetThreadCount() const { return m_nThreads; }
+
+private:
+    int m_nWidth = 0;
+    int m_nHeight = 0;
+    int m_nTilesX = 0;
+    int m_nTilesY = 0;
+    std::vector<uint64_t> m_vHash;
+    std::vector<uint64_t> m_vPrevHash;
+    bool m_bHavePrev = false;
+
+    TaskScheduler *m_pScheduler = nullptr;
+    int m_nThreads = 1;
+
+private:
+    /// Hash one row of tiles of pFrame into m_vHash
+    void HashRow(const uint8_t *pFrame, int nPitch, int ty);
+};
@@ -0,0 +1,78 @@
+#include "AllocationCounter.hpp"
+#include <stdlib.h>
+#include <stddef.h>
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+namespace
+{
+    std::atomic<uint64_t> g_nAllocations{ 0 };
+
+    void *Allocate(size_t size) noexcept
+    {
+        g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+        return malloc(size ? size : 1);
+    }
+
+    /// The block malloc returned is stored in front of the aligned pointer
+    void *AllocateAligned(size_t size, std::align_val_t alignment) noexcept
+    {
+        g_nAllocations.fetch_add(1, std::memory_order_relaxed);
+        size_t align = std::max((size_t)alignment, sizeof(void *));
+        void *pBlock = malloc(size + align + sizeof(void *));
+        if (!pBlock)
+        {
+            return nullptr;
+        }
+        uintptr_t p = ((uintptr_t)pBlock + sizeof(void *) + align - 1) & ~(uintptr_t)(align - 1);
+        ((void **)p)[-1] = pBlock;
+        return (void *)p;
+    }
+
+    void FreeAligned(void *p) noexcept
+    {
+        if (p)
+        {
+            free(((void **)p)[-1]);
+        }
+    }
+
+    void *Checked(void *p)
+    {
+        if (!p)
+        {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+}
+
+uint64_t AllocationCounter::GetCount()
+{
+    return g_nAllocations.load(std::memory_order_relaxed);
+}
+
+/// Every replaceable form, so no allocation bypasses the count and no block reaches a delete of
+/// another allocator: plain, array, nothrow, over-aligned (e.g. std::pmr::new_delete_resource()), sized
+void *operator new(size_t size) { return Checked(Allocate(size)); }
+void *operator new[](size_t size) { return Checked(Allocate(size)); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept { return Allocate(size); }
+void *operator new[](size_t size, const std::nothrow_t &) noexcept { return Allocate(size); }
+void *operator new(size_t size, std::align_val_t alignment) { return Checked(AllocateAligned(size, alignment)); }
+void *operator new[](size_t size, std::align_val_t alignment) { return Checked(AllocateAligned(size, alignment)); }
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return AllocateAligned(size, alignment); }
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept { return AllocateAligned(size, alignment); }
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+void operator delete(void *p, const std::nothrow_t &) noexcept { free(p); }
+void operator delete[](void *p, const std::nothrow_t &) noexcept { free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { FreeAligned(p); }
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept { FreeAligned(p); }
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept { FreeAligned(p); }
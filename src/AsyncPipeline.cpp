@@ -0,0 +1,281 @@
+#include "AsyncPipeline.hpp"
+#include "Metrics.hpp"
+#include <stdio.h>
+
+namespace
+{
+    MetricGauge g_channelDepth("packet_channel_depth", "Encoded packets queued for the session that receives them");
+    MetricCounter g_channelDropped("packet_channel_dropped_total", "Encoded packets the bounded packet queue dropped");
+
+    /// Session being run on this thread, so awaitables resume it in the same context
+    thread_local PipelineExecutor::Context t_context;
+
+    /// Top level coroutine of a spawned session: runs the task and destroys itself when it returns
+    struct DetachedTask
+    {
+        struct promise_type
+        {
+            DetachedTask get_return_object() { return DetachedTask{ std::coroutine_handle<promise_type>::from_promise(*this) }; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { std::terminate(); }
+        };
+        std::coroutine_handle<promise_type> handle;
+    };
+
+    DetachedTask RunDetached(AsyncTask<void> task, std::function<void()> onDone)
+    {
+        try
+        {
+            co_await task;
+        }
+        catch (const std::exception &e)
+        {
+            printf("%s: Session failed: %s\n", __FUNCTION__, e.what());
+        }
+        catch (...)
+        {
+            printf("%s: Session failed\n", __FUNCTION__);
+        }
+        onDone();
+    }
+}
+
+PipelineExecutor::PipelineExecutor(TaskScheduler &scheduler)
+    : m_scheduler(scheduler)
+{
+    m_timerThread = std::thread(&PipelineExecutor::TimerProc, this);
+}
+
+PipelineExecutor::~PipelineExecutor()
+{
+    Join();
+    {
+        std::lock_guard<std::mutex> lock(m_timerMutex);
+        m_bQuit = true;
+    }
+    m_cvTimer.notify_all();
+    m_timerThread.join();
+}
+
+PipelineExecutor::Context PipelineExecutor::GetCurrentContext()
+{
+    return t_context;
+}
+
+void PipelineExecutor::Spawn(AsyncTask<void> task, int affinity, TaskPriority priority, std::function<void()> onDone)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_nRunning++;
+    }
+    DetachedTask detached = RunDetached(std::move(task), [this, onDone = std::move(onDone)]
+    {
+        if (onDone)
+        {
+            onDone();
+        }
+        SessionDone();
+    });
+    Context context;
+    context.affinity = affinity;
+    context.priority = priority;
+    Resume(detached.handle, context);
+}
+
+void PipelineExecutor::SessionDone()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_nRunning == 0)
+    {
+        m_cvIdle.notify_all();
+    }
+}
+
+void PipelineExecutor::Join()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cvIdle.wait(lock, [this] { return m_nRunning == 0; });
+}
+
+void PipelineExecutor::Resume(std::coroutine_handle<> h, const Context &context)
+{
+    m_scheduler.Submit([h, context]
+    {
+        Context previous = t_context;
+        t_context = context;
+        h.resume();
+        t_context = previous;
+    }, context.priority, context.affinity);
+}
+
+void PipelineExecutor::Schedule(std::coroutine_handle<> h, int ms)
+{
+    if (ms <= 0)
+    {
+        Resume(h);
+        return;
+    }
+    Timer timer;
+    timer.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    timer.handle = h;
+    timer.context = t_context;
+    {
+        std::lock_guard<std::mutex> lock(m_timerMutex);
+        m_timers.push(timer);
+    }
+    m_cvTimer.notify_one();
+}
+
+void PipelineExecutor::TimerProc()
+{
+    std::unique_lock<std::mutex> lock(m_timerMutex);
+    while (!m_bQuit)
+    {
+        if (m_timers.empty())
+        {
+            m_cvTimer.wait(lock);
+            continue;
+        }
+        Timer timer = m_timers.top();
+        if (std::chrono::steady_clock::now() < timer.due)
+        {
+            m_cvTimer.wait_until(lock, timer.due);
+            continue;
+        }
+        m_timers.pop();
+        lock.unlock();
+        Resume(timer.handle, timer.context);
+        lock.lock();
+    }
+}
+
+AsyncTask<HRESULT> PipelineExecutor::Poll(std::function<HRESULT()> fn, int waitMs, int intervalMs)
+{
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(waitMs);
+    for (;;)
+    {
+        HRESULT hr = fn();
+        if (hr != DXGI_ERROR_WAIT_TIMEOUT || std::chrono::steady_clock::now() >= deadline)
+        {
+            co_return hr;
+        }
+        co_await Delay(intervalMs);
+    }
+}
+
+void PacketChannel::SetLimit(BackpressureStrategy strategy, size_t nMaxPackets, std::function<void()> onRecoveryNeeded)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.Init(strategy, nMaxPackets);
+    m_onRecoveryNeeded = onRecoveryNeeded;
+}
+
+void PacketChannel::Push(const std::vector<uint8_t> &data, const FrameTiming &timing)
+{
+    bool bRecoveryNeeded;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        EncodedPacket packet;
+        packet.data = data;
+        packet.timing = timing;
+        uint64_t nDropped = m_queue.GetDropped();
+        bRecoveryNeeded = m_queue.Push(std::move(packet), timing.bRecoveryPoint);
+        g_channelDropped.Add(m_queue.GetDropped() - nDropped);
+        g_channelDepth.Set((int64_t)m_queue.GetSize());
+        WakeWaiter();
+    }
+    /// Outside the lock, the encoder takes its own
+    if (bRecoveryNeeded && m_onRecoveryNeeded)
+    {
+        m_onRecoveryNeeded();
+    }
+}
+
+size_t PacketChannel::GetSize()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.GetSize();
+}
+
+uint64_t PacketChannel::GetDropped()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_queue.GetDropped();
+}
+
+void PacketChannel::Close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_bClosed = true;
+    WakeWaiter();
+}
+
+void PacketChannel::WakeWaiter()
+{
+    if (m_waiter)
+    {
+        /// Queued, not resumed here: the pusher may be the encoder's retrieval thread
+        m_executor.Resume(std::exchange(m_waiter, nullptr), m_waiterContext);
+    }
+}
+
+bool PacketChannel::Wait(std::coroutine_handle<> h)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_queue.Empty() || m_bClosed)
+    {
+        return false;
+    }
+    m_waiter = h;
+    m_waiterContext = PipelineExecutor::GetCurrentContext();
+    return true;
+}
+
+std::optional<EncodedPacket> PacketChannel::Pop()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    EncodedPacket packet;
+    if (!m_queue.Pop(packet))
+    {
+        return std::nullopt;
+    }
+    g_channelDepth.Set((int64_t)m_queue.GetSize());
+    return packet;
+}
+
+bool AsyncFileWriter::Open(const std::string &path)
+{
+    Close();
+    m_fp.open(path, std::ios::out | std::ios::binary);
+    m_nBytes = 0;
+    return m_fp.is_open();
+}
+
+void AsyncFileWriter::Close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fp.is_open())
+    {
+        m_fp.close();
+    }
+}
+
+void AsyncFileWriter::Submit(std::coroutine_handle<> h, const std::vector<uint8_t> &data, bool &bOk)
+{
+    PipelineExecutor::Context context = PipelineExecutor::GetCurrentContext();
+    m_executor.GetScheduler().Submit([this, h, &data, &bOk, context]
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fp.write(reinterpret_cast<const char *>(data.data()), data.size());
+            bOk = m_fp.good();
+            if (bOk)
+            {
+                m_nBytes += data.size();
+            }
+        }
+        m_executor.Resume(h, context);
+    }, TaskPriority::Background, context.affinity);
+}
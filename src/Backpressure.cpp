@@ -0,0 +1,156 @@
+#include "Backpressure.hpp"
+#include <stdio.h>
+#include <string.h>
+
+void BackpressureController::Init(const BackpressureConfig &cfg)
+{
+    m_cfg = cfg;
+    m_eStrategy = cfg.strategy;
+    m_stats = BackpressureStats();
+    m_nMinBacklog = -1;
+    m_nLevel = 0;
+    m_nSinceChange = 0;
+    m_nUncongested = 0;
+    m_bScaleChanged = false;
+}
+
+FrameAction BackpressureController::OnFrame(int nBacklog, double latencyMs)
+{
+    if (m_nMinBacklog < 0 || nBacklog < m_nMinBacklog)
+    {
+        m_nMinBacklog = nBacklog;
+    }
+    bool bCongested = nBacklog - m_nMinBacklog >= m_cfg.maxBacklog || (m_cfg.maxLatencyMs > 0 && latencyMs > m_cfg.maxLatencyMs);
+    m_stats.nFrames++;
+    m_stats.nCongested += bCongested;
+    m_bScaleChanged = false;
+
+    FrameAction action = FrameAction::Encode;
+    switch (m_eStrategy)
+    {
+    case BackpressureStrategy::Block:
+        break;
+    case BackpressureStrategy::DropOldest:
+    case BackpressureStrategy::DropNewest:
+        action = bCongested ? FrameAction::Drop : FrameAction::Encode;
+        break;
+    case BackpressureStrategy::Repeat:
+        action = bCongested ? FrameAction::Repeat : FrameAction::Encode;
+        break;
+    case BackpressureStrategy::LowerFrameRate:
+    case BackpressureStrategy::LowerResolution:
+    {
+        int nLevel = m_nLevel;
+        m_nSinceChange++;
+        m_nUncongested = bCongested ? 0 : m_nUncongested + 1;
+        if (bCongested && m_nLevel < m_cfg.maxSteps && m_nSinceChange >= m_cfg.holdFrames)
+        {
+            m_nLevel++;
+            m_stats.nStepsDown++;
+        }
+        else if (m_nLevel > 0 && m_nUncongested >= m_cfg.recoverFrames)
+        {
+            m_nLevel--;
+            m_stats.nStepsUp++;
+            m_nUncongested = 0;
+        }
+        if (m_nLevel != nLevel)
+        {
+            m_nSinceChange = 0;
+            m_bScaleChanged = m_eStrategy == BackpressureStrategy::LowerResolution;
+            printf("%s: backlog %d, latency %.1f ms: %s 1/%d\n", __FUNCTION__, nBacklog, latencyMs,
+                m_eStrategy == BackpressureStrategy::LowerFrameRate ? "frame rate" : "resolution", 1 << m_nLevel);
+        }
+        if ((m_stats.nFrames - 1) % GetFrameDivisor() != 0)
+        {
+            action = FrameAction::Drop;
+        }
+        break;
+    }
+    }
+
+    switch (action)
+    {
+    case FrameAction::Encode:
+        m_stats.nEncoded++;
+        break;
+    case FrameAction::Drop:
+        m_stats.nDropped++;
+        break;
+    case FrameAction::Repeat:
+        m_stats.nRepeated++;
+        break;
+    }
+    return action;
+}
+
+void BackpressureController::PrintStats() const
+{
+    printf("Back-pressure (%s): %llu frames, %llu congested, %llu encoded, %llu dropped, %llu repeated, %llu steps down, %llu steps up\n",
+        GetStrategyName(m_eStrategy), (unsigned long long)m_stats.nFrames, (unsigned long long)m_stats.nCongested,
+        (unsigned long long)m_stats.nEncoded, (unsigned long long)m_stats.nDropped, (unsigned long long)m_stats.nRepeated,
+        (unsigned long long)m_stats.nStepsDown, (unsigned long long)m_stats.nStepsUp);
+}
+
+namespace
+{
+    struct StrategyName
+    {
+        BackpressureStrategy strategy;
+        const char *szName;
+    };
+    const StrategyName g_strategyNames[] = {
+        { BackpressureStrategy::Block, "block" },
+        { BackpressureStrategy::DropOldest, "dropoldest" },
+        { BackpressureStrategy::DropNewest, "dropnewest" },
+        { BackpressureStrategy::Repeat, "repeat" },
+        { BackpressureStrategy::LowerFrameRate, "fps" },
+        { BackpressureStrategy::LowerResolution, "resolution" },
+    };
+}
+
+const char *BackpressureController::GetStrategyName(BackpressureStrategy strategy)
+{
+    for (const StrategyName &name : g_strategyNames)
+    {
+        if (name.strategy == strategy)
+        {
+            return name.szName;
+        }
+    }
+    return "unknown";
+}
+
+bool BackpressureController::ParseConfig(const char *szArg, BackpressureConfig &cfg)
+{
+    const char *szColon = strchr(szArg, ':');
+    size_t nLen = szColon ? (size_t)(szColon - szArg) : strlen(szArg);
+    bool bFound = false;
+    for (const StrategyName &name : g_strategyNames)
+    {
+        if (strlen(name.szName) == nLen && !strncmp(szArg, name.szName, nLen))
+        {
+            cfg.strategy = name.strategy;
+            bFound = true;
+        }
+    }
+    if (!bFound)
+    {
+        printf("%s: Unknown back-pressure strategy '%.*s'\n", __FUNCTION__, (int)nLen, szArg);
+        return false;
+    }
+    if (szColon)
+    {
+        int maxBacklog = 0;
+        double maxLatencyMs = cfg.maxLatencyMs;
+        int n = sscanf(szColon + 1, "%d:%lf", &maxBacklog, &maxLatencyMs);
+        if (n < 1 || maxBacklog < 1 || maxLatencyMs < 0)
+        {
+            printf("%s: Invalid back-pressure limits '%s', expected maxBacklog[:maxLatencyMs]\n", __FUNCTION__, szColon + 1);
+            return false;
+        }
+        cfg.maxBacklog = maxBacklog;
+        cfg.maxLatencyMs = maxLatencyMs;
+    }
+    return true;
+}
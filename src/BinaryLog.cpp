@@ -0,0 +1,497 @@
+#include "BinaryLog.hpp"
+#include <windows.h>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <fstream>
+#include <algorithm>
+#include <climits>
+#include <ctype.h>
+
+namespace
+{
+    const char MAGIC[8] = { 'B', 'I', 'N', 'L', 'O', 'G', '1', 0 };
+    /// Chunks of the file after the header
+    const uint8_t CHUNK_SITE = 'S';
+    const uint8_t CHUNK_RECORD = 'R';
+    const uint8_t CHUNK_DROPPED = 'D';
+    const int DRAIN_INTERVAL_MS = 10;
+    /// Longest string argument kept
+    const size_t MAX_STRING = 1024;
+
+    struct Ring
+    {
+        /// Records per thread between two drains, 256 KB
+        static const uint32_t SIZE = 4096;
+        BinaryLogRecord records[SIZE];
+        /// Written by the thread only ...
+        alignas(64) std::atomic<uint32_t> head{ 0 };
+        /// ... and its last view of tail
+        uint32_t cachedTail = 0;
+        /// Written by the drain thread only
+        alignas(64) std::atomic<uint32_t> tail{ 0 };
+        std::atomic<uint64_t> nDropped{ 0 };
+        /// The thread has exited, the ring is freed once drained
+        std::atomic<bool> bRetired{ false };
+        uint32_t threadIndex = 0;
+    };
+
+    /// State shared by the threads and the drain thread
+    struct LogState
+    {
+        std::mutex mutex;
+        std::vector<BinaryLogSite *> vSites;
+        std::vector<std::unique_ptr<Ring>> vRings;
+        uint32_t nThreads = 0;
+        std::ofstream fp;
+        size_t nSitesWritten = 0;
+        std::thread drainThread;
+        std::condition_variable cvStop;
+        bool bStop = false;
+        std::atomic<uint64_t> nWritten{ 0 };
+        std::atomic<uint64_t> nDropped{ 0 };
+    };
+
+    /// Never destroyed: sites register from static initializers and threads may log during exit
+    LogState &GetState()
+    {
+        static LogState *s_pState = new LogState();
+        return *s_pState;
+    }
+
+    struct ThreadRing
+    {
+        Ring *pRing = nullptr;
+        ~ThreadRing()
+        {
+            if (pRing)
+            {
+                pRing->bRetired.store(true, std::memory_order_release);
+                pRing = nullptr;
+            }
+        }
+    };
+    thread_local ThreadRing t_ring;
+
+    Ring *GetThreadRing()
+    {
+        if (!t_ring.pRing)
+        {
+            LogState &state = GetState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.vRings.push_back(std::make_unique<Ring>());
+            t_ring.pRing = state.vRings.back().get();
+            t_ring.pRing->threadIndex = state.nThreads++;
+        }
+        return t_ring.pRing;
+    }
+
+    template <typename T>
+    void Put(std::ofstream &fp, const T &value)
+    {
+        fp.write(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    void PutString(std::ofstream &fp, const char *sz)
+    {
+        uint16_t nLen = (uint16_t)(sz ? strnlen(sz, MAX_STRING) : 0);
+        Put(fp, nLen);
+        fp.write(sz, nLen);
+    }
+
+    /// Write what the rings hold. Called with state.mutex held
+    void Drain(LogState &state)
+    {
+        std::vector<uint32_t> vHeads;
+        for (std::unique_ptr<Ring> &pRing : state.vRings)
+        {
+            vHeads.push_back(pRing->head.load(std::memory_order_acquire));
+        }
+        /// Every site of a record up to the heads is registered by now
+        for (; state.nSitesWritten < state.vSites.size(); state.nSitesWritten++)
+        {
+            const BinaryLogSite *pSite = state.vSites[state.nSitesWritten];
+            Put(state.fp, CHUNK_SITE);
+            Put(state.fp, pSite->id);
+            Put(state.fp, (uint8_t)pSite->level);
+            Put(state.fp, (int32_t)pSite->line);
+            PutString(state.fp, pSite->szFile);
+            PutString(state.fp, pSite->szFormat);
+        }
+        for (size_t i = 0; i < state.vRings.size(); i++)
+        {
+            Ring &ring = *state.vRings[i];
+            uint32_t tail = ring.tail.load(std::memory_order_relaxed);
+            for (; tail != vHeads[i]; tail++)
+            {
+                const BinaryLogRecord &record = ring.records[tail % Ring::SIZE];
+                Put(state.fp, CHUNK_RECORD);
+                Put(state.fp, ring.threadIndex);
+                Put(state.fp, record);
+                /// String arguments are copied now, the record only holds their address
+                for (int arg = 0; arg < record.nArgs; arg++)
+                {
+                    if ((BinaryLogArg)((record.argTypes >> (2 * arg)) & 3) == BinaryLogArg::String)
+                    {
+                        PutString(state.fp, (const char *)(uintptr_t)record.args[arg]);
+                    }
+                }
+                state.nWritten.fetch_add(1, std::memory_order_relaxed);
+            }
+            ring.tail.store(tail, std::memory_order_release);
+            uint64_t nDropped = ring.nDropped.exchange(0, std::memory_order_relaxed);
+            if (nDropped)
+            {
+                Put(state.fp, CHUNK_DROPPED);
+                Put(state.fp, ring.threadIndex);
+                Put(state.fp, nDropped);
+                state.nDropped.fetch_add(nDropped, std::memory_order_relaxed);
+            }
+        }
+        state.fp.flush();
+
+        /// Rings of exited threads, drained above unless the thread wrote after the heads were read
+        state.vRings.erase(std::remove_if(state.vRings.begin(), state.vRings.end(), [](const std::unique_ptr<Ring> &pRing)
+        {
+            return pRing->bRetired.load(std::memory_order_acquire)
+                && pRing->tail.load(std::memory_order_relaxed) == pRing->head.load(std::memory_order_acquire);
+        }), state.vRings.end());
+    }
+
+    void DrainProc()
+    {
+        LogState &state = GetState();
+        std::unique_lock<std::mutex> lock(state.mutex);
+        while (!state.bStop)
+        {
+            state.cvStop.wait_for(lock, std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+            Drain(state);
+        }
+    }
+
+    /// Format one record: each conversion of the format takes the next argument, formatted by its
+    /// stored type whatever length modifier the format has
+    std::string FormatRecord(const char *szFormat, const BinaryLogRecord &record, const std::vector<std::string> &vStrings)
+    {
+        std::string text;
+        int arg = 0;
+        size_t iString = 0;
+        char szBuffer[MAX_STRING + 64];
+        for (const char *p = szFormat; *p; p++)
+        {
+            if (*p != '%')
+            {
+                text += *p;
+                continue;
+            }
+            if (p[1] == '%')
+            {
+                text += '%';
+                p++;
+                continue;
+            }
+            /// Flags, width and precision are kept, length modifiers dropped
+            std::string spec = "%";
+            const char *q = p + 1;
+            while (*q && strchr("-+ #0", *q))
+            {
+                spec += *q++;
+            }
+            while (*q && (isdigit((unsigned char)*q) || *q == '.'))
+            {
+                spec += *q++;
+            }
+            while (*q && strchr("hljztLIq", *q))
+            {
+                /// I64, I32
+                q += *q == 'I' && isdigit((unsigned char)q[1]) ? 3 : 1;
+            }
+            char conv = *q;
+            p = *q ? q : q - 1;
+            if (arg >= record.nArgs)
+            {
+                text += "<?>";
+                continue;
+            }
+            BinaryLogArg type = (BinaryLogArg)((record.argTypes >> (2 * arg)) & 3);
+            uint64_t value = record.args[arg++];
+            switch (type)
+            {
+            case BinaryLogArg::Int:
+            case BinaryLogArg::UInt:
+                if (conv == 'c')
+                {
+                    snprintf(szBuffer, sizeof(szBuffer), (spec + "c").c_str(), (int)value);
+                }
+                else if (conv == 'p')
+                {
+                    snprintf(szBuffer, sizeof(szBuffer), "0x%llx", (unsigned long long)value);
+                }
+                else
+                {
+                    if (!strchr("diouxX", conv))
+                    {
+                        conv = type == BinaryLogArg::Int ? 'd' : 'u';
+                    }
+                    snprintf(szBuffer, sizeof(szBuffer), (spec + "ll" + conv).c_str(), value);
+                }
+                break;
+            case BinaryLogArg::Double:
+            {
+                double d;
+                memcpy(&d, &value, sizeof(d));
+                snprintf(szBuffer, sizeof(szBuffer), (spec + (strchr("fFeEgGaA", conv) ? conv : 'g')).c_str(), d);
+                break;
+            }
+            case BinaryLogArg::String:
+                snprintf(szBuffer, sizeof(szBuffer), (spec + "s").c_str(), iString < vStrings.size() ? vStrings[iString].c_str() : "");
+                iString++;
+                break;
+            }
+            text += szBuffer;
+        }
+        return text;
+    }
+
+    template <typename T>
+    bool Get(std::ifstream &fp, T &value)
+    {
+        return (bool)fp.read(reinterpret_cast<char *>(&value), sizeof(value));
+    }
+
+    bool GetString(std::ifstream &fp, std::string &s)
+    {
+        uint16_t nLen;
+        if (!Get(fp, nLen))
+        {
+            return false;
+        }
+        s.resize(nLen);
+        return nLen == 0 || (bool)fp.read(&s[0], nLen);
+    }
+}
+
+std::atomic<int> BinaryLog::s_minLevel{ INT_MAX };
+int64_t BinaryLog::s_ticksPerMs = 1;
+
+BinaryLogSite::BinaryLogSite(BinaryLogLevel level, const char *szFile, int line, const char *szFormat)
+    : level(level)
+    , szFile(szFile)
+    , line(line)
+    , szFormat(szFormat)
+    , id(BinaryLog::RegisterSite(this))
+{
+}
+
+uint32_t BinaryLog::RegisterSite(BinaryLogSite *pSite)
+{
+    LogState &state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    state.vSites.push_back(pSite);
+    return (uint32_t)state.vSites.size() - 1;
+}
+
+int64_t BinaryLog::GetTicks()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+BinaryLogRecord *BinaryLog::BeginRecord()
+{
+    Ring *pRing = GetThreadRing();
+    uint32_t head = pRing->head.load(std::memory_order_relaxed);
+    if (head - pRing->cachedTail == Ring::SIZE)
+    {
+        pRing->cachedTail = pRing->tail.load(std::memory_order_acquire);
+        if (head - pRing->cachedTail == Ring::SIZE)
+        {
+            pRing->nDropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+    }
+    return &pRing->records[head % Ring::SIZE];
+}
+
+void BinaryLog::CommitRecord()
+{
+    Ring *pRing = t_ring.pRing;
+    pRing->head.store(pRing->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+bool BinaryLog::Open(const char *szPath, BinaryLogLevel minLevel)
+{
+    Close();
+    LogState &state = GetState();
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.fp.open(szPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!state.fp.is_open())
+        {
+            printf("%s: Unable to open %s\n", __FUNCTION__, szPath);
+            return false;
+        }
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        s_ticksPerMs = std::max(freq.QuadPart / 1000, (LONGLONG)1);
+        state.fp.write(MAGIC, sizeof(MAGIC));
+        Put(state.fp, (int64_t)freq.QuadPart);
+        Put(state.fp, GetTicks());
+        /// Sites registered before are written with the first drain, records logged before are discarded
+        state.nSitesWritten = 0;
+        for (std::unique_ptr<Ring> &pRing : state.vRings)
+        {
+            pRing->tail.store(pRing->head.load(std::memory_order_acquire), std::memory_order_release);
+            pRing->nDropped.store(0);
+        }
+        state.nWritten = 0;
+        state.nDropped = 0;
+        state.bStop = false;
+    }
+    state.drainThread = std::thread(DrainProc);
+    s_minLevel.store((int)minLevel);
+    return true;
+}
+
+void BinaryLog::Close()
+{
+    LogState &state = GetState();
+    s_minLevel.store(INT_MAX);
+    if (!state.drainThread.joinable())
+    {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.bStop = true;
+    }
+    state.cvStop.notify_one();
+    state.drainThread.join();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    Drain(state);
+    state.fp.close();
+}
+
+uint64_t BinaryLog::GetWritten()
+{
+    return GetState().nWritten.load();
+}
+
+uint64_t BinaryLog::GetDropped()
+{
+    return GetState().nDropped.load();
+}
+
+bool BinaryLog::Decode(const char *szPath, FILE *fpOut)
+{
+    std::ifstream fp(szPath, std::ios::in | std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    int64_t freq = 0, start = 0;
+    if (!fp.read(magic, sizeof(magic)) || memcmp(magic, MAGIC, sizeof(MAGIC)) || !Get(fp, freq) || !Get(fp, start) || freq <= 0)
+    {
+        printf("%s: %s is no binary log\n", __FUNCTION__, szPath);
+        return false;
+    }
+
+    struct Site
+    {
+        uint8_t level;
+        int32_t line;
+        std::string file;
+        std::string format;
+    };
+    struct Line
+    {
+        int64_t ticks;
+        uint32_t threadIndex;
+        std::string text;
+    };
+    const char *szLevels[] = { "TRACE", "INFO", "WARN", "ERROR" };
+    std::vector<Site> vSites;
+    std::vector<Line> vLines;
+    uint64_t nDropped = 0;
+    uint8_t chunk;
+    while (Get(fp, chunk))
+    {
+        if (chunk == CHUNK_SITE)
+        {
+            uint32_t id;
+            Site site;
+            if (!Get(fp, id) || !Get(fp, site.level) || !Get(fp, site.line) || !GetString(fp, site.file) || !GetString(fp, site.format))
+            {
+                break;
+            }
+            if (id >= vSites.size())
+            {
+                vSites.resize(id + 1);
+            }
+            vSites[id] = site;
+        }
+        else if (chunk == CHUNK_RECORD)
+        {
+            uint32_t threadIndex;
+            BinaryLogRecord record;
+            if (!Get(fp, threadIndex) || !Get(fp, record) || record.nArgs > BinaryLogRecord::MAX_ARGS)
+            {
+                break;
+            }
+            std::vector<std::string> vStrings;
+            for (int arg = 0; arg < record.nArgs; arg++)
+            {
+                if ((BinaryLogArg)((record.argTypes >> (2 * arg)) & 3) == BinaryLogArg::String)
+                {
+                    vStrings.emplace_back();
+                    GetString(fp, vStrings.back());
+                }
+            }
+            if (record.siteId >= vSites.size())
+            {
+                continue;
+            }
+            const Site &site = vSites[record.siteId];
+            const char *szFile = site.file.c_str();
+            for (const char *p = szFile; *p; p++)
+            {
+                if (*p == '/' || *p == '\\')
+                {
+                    szFile = p + 1;
+                }
+            }
+            std::string text = std::string("[") + szLevels[site.level & 3] + "] " + szFile + ":" + std::to_string(site.line) + " "
+                + FormatRecord(site.format.c_str(), record, vStrings);
+            if (record.nSuppressed)
+            {
+                text += " (" + std::to_string(record.nSuppressed) + " suppressed)";
+            }
+            vLines.push_back({ record.ticks, threadIndex, text });
+        }
+        else if (chunk == CHUNK_DROPPED)
+        {
+            uint32_t threadIndex;
+            uint64_t n;
+            if (!Get(fp, threadIndex) || !Get(fp, n))
+            {
+                break;
+            }
+            nDropped += n;
+        }
+        else
+        {
+            printf("%s: Unknown chunk %u, log truncated\n", __FUNCTION__, chunk);
+            break;
+        }
+    }
+
+    /// Rings are drained one after the other, the threads' records interleave by time
+    std::stable_sort(vLines.begin(), vLines.end(), [](const Line &a, const Line &b) { return a.ticks < b.ticks; });
+    for (const Line &line : vLines)
+    {
+        fprintf(fpOut, "%12.3f ms T%u %s\n", (line.ticks - start) * 1000.0 / freq, line.threadIndex, line.text.c_str());
+    }
+    fprintf(fpOut, "%zu records, %llu dropped\n", vLines.size(), (unsigned long long)nDropped);
+    return true;
+}
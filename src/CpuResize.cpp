@@ -0,0 +1,406 @@
+#include "CpuResize.hpp"
+#include <emmintrin.h>
+#include <algorithm>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+namespace
+{
+    /// sinc(x) * sinc(x / 2), zero outside [-2, 2]
+    double Lanczos2(double x)
+    {
+        x = std::fabs(x);
+        if (x < 1e-8)
+            return 1.0;
+        if (x >= 2.0)
+            return 0.0;
+        double px = M_PI * x;
+        return 2.0 * std::sin(px) * std::sin(px / 2.0) / (px * px);
+    }
+
+    /// Convert 8 consecutive samples to two float vectors
+    inline void Load8(const uint8_t *p, __m128 &lo, __m128 &hi)
+    {
+        __m128i zero = _mm_setzero_si128();
+        __m128i v16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), zero);
+        lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, zero));
+        hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v16, zero));
+    }
+
+    inline void Load8(const uint16_t *p, __m128 &lo, __m128 &hi)
+    {
+        __m128i zero = _mm_setzero_si128();
+        __m128i v16 = _mm_loadu_si128((const __m128i *)p);
+        lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, zero));
+        hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v16, zero));
+    }
+
+    /// Horizontal dot product of nTaps (multiple of 4) floats
+    inline float Dot(const float *pSrc, const float *pCoef, int nTaps)
+    {
+        __m128 sum = _mm_setzero_ps();
+        for (int t = 0; t < nTaps; t += 4)
+        {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(pSrc + t), _mm_loadu_ps(pCoef + t)));
+        }
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+        return _mm_cvtss_f32(sum);
+    }
+
+    /// Filter source rows into one row of nRowSamples floats for output row y
+    template<typename T>
+    void VerticalPass(const CpuResizer::FilterTable &v, int y, const uint8_t *pSrc, int nSrcPitch, int nSrcHeight, int nRowSamples, float *pRowV)
+    {
+        std::fill(pRowV, pRowV + nRowSamples, 0.0f);
+        const float *pCoefV = &v.vCoef[(size_t)y * v.nTaps];
+        for (int t = 0; t < v.nTaps; t++)
+        {
+            float w = pCoefV[t];
+            if (w == 0.0f)
+                continue;
+            int row = std::min(std::max(v.vStart[y] + t, 0), nSrcHeight - 1);
+            const T *pRow = (const T *)(pSrc + (size_t)row * nSrcPitch);
+            __m128 vw = _mm_set1_ps(w);
+            int x = 0;
+            for (; x + 8 <= nRowSamples; x += 8)
+            {
+                __m128 lo, hi;
+                Load8(pRow + x, lo, hi);
+                _mm_storeu_ps(pRowV + x, _mm_add_ps(_mm_loadu_ps(pRowV + x), _mm_mul_ps(lo, vw)));
+                _mm_storeu_ps(pRowV + x + 4, _mm_add_ps(_mm_loadu_ps(pRowV + x + 4), _mm_mul_ps(hi, vw)));
+            }
+            for (; x < nRowSamples; x++)
+            {
+                pRowV[x] += w * pRow[x];
+            }
+        }
+    }
+
+    /// Deinterleave the first nOutChannels of an interleaved row into per-channel rows with replicated edges,
+    /// so the horizontal taps are contiguous. Each output row is nPadLeft + nSrcWidth + nPadRight floats
+    void PadChannels(const CpuResizer::FilterTable &h, const float *pRowV, int nSrcWidth, int nChannels, int nOutChannels, float *pRowPad)
+    {
+        const int nPadded = h.nPadLeft + nSrcWidth + h.nPadRight;
+        for (int c = 0; c < nOutChannels; c++)
+        {
+            float *pPad = pRowPad + (size_t)c * nPadded;
+            float left = pRowV[c], right = pRowV[(nSrcWidth - 1) * nChannels + c];
+            for (int i = 0; i < h.nPadLeft; i++)
+                pPad[i] = left;
+            for (int i = 0; i < nSrcWidth; i++)
+                pPad[h.nPadLeft + i] = pRowV[i * nChannels + c];
+            for (int i = 0; i < h.nPadRight; i++)
+                pPad[h.nPadLeft + nSrcWidth + i] = right;
+        }
+    }
+}
+
+void CpuResizer::BuildFilterTable(FilterTable &table, int nSrc, int nDst, CpuResizeFilter eFilter, float fDstOffset, float fSrcOffset)
+{
+    const double scale = (double)nSrc / nDst;
+    /// Bilinear keeps the fixed 2-tap footprint of texture sampling, the other filters widen when downscaling
+    const double support = (eFilter == CpuResizeFilter::Bilinear) ? 1.0 : std::max(scale, 1.0);
+
+    std::vector<int> vFirst(nDst);
+    std::vector<std::vector<double>> vWeights(nDst);
+    int nMaxTaps = 1;
+
+    for (int j = 0; j < nDst; j++)
+    {
+        double p = (j + fDstOffset) * scale - fSrcOffset;
+        double radius = 0;
+        switch (eFilter)
+        {
+        case CpuResizeFilter::Bilinear: radius = 1.0; break;
+        case CpuResizeFilter::Area: radius = support / 2.0 + 0.5; break;
+        case CpuResizeFilter::Lanczos2: radius = 2.0 * support; break;
+        }
+        int lo = (int)std::floor(p - radius);
+        int hi = (int)std::ceil(p + radius);
+
+        std::vector<double> w;
+        int first = lo;
+        for (int i = lo; i <= hi; i++)
+        {
+            double wi = 0;
+            switch (eFilter)
+            {
+            case CpuResizeFilter::Bilinear:
+                wi = std::max(0.0, 1.0 - std::fabs(i - p));
+                break;
+            case CpuResizeFilter::Area:
+                /// Coverage of source pixel [i - 0.5, i + 0.5] by the output footprint
+                wi = std::max(0.0, std::min(i + 0.5, p + support / 2.0) - std::max(i - 0.5, p - support / 2.0));
+                break;
+            case CpuResizeFilter::Lanczos2:
+                wi = Lanczos2((i - p) / support);
+                break;
+            }
+            /// Trim leading zero taps
+            if (w.empty() && std::fabs(wi) < 1e-9)
+            {
+                first = i + 1;
+                continue;
+            }
+            w.push_back(wi);
+        }
+        while (!w.empty() && std::fabs(w.back()) < 1e-9)
+        {
+            w.pop_back();
+        }
+        if (w.empty())
+        {
+            /// Degenerate footprint, fall back to nearest sample
+            first = (int)std::floor(p + 0.5);
+            w.push_back(1.0);
+        }
+
+        double sum = 0;
+        for (double wi : w)
+            sum += wi;
+        for (double &wi : w)
+            wi /= sum;
+
+        vFirst[j] = first;
+        nMaxTaps = std::max(nMaxTaps, (int)w.size());
+        vWeights[j] = std::move(w);
+    }
+
+    table.nTaps = (nMaxTaps + 3) & ~3;
+    table.vStart = vFirst;
+    table.vCoef.assign((size_t)nDst * table.nTaps, 0.0f);
+    table.nPadLeft = 0;
+    table.nPadRight = 0;
+    for (int j = 0; j < nDst; j++)
+    {
+        for (size_t t = 0; t < vWeights[j].size(); t++)
+        {
+            table.vCoef[(size_t)j * table.nTaps + t] = (float)vWeights[j][t];
+        }
+        table.nPadLeft = std::max(table.nPadLeft, -vFirst[j]);
+        table.nPadRight = std::max(table.nPadRight, vFirst[j] + table.nTaps - nSrc);
+    }
+}
+
+bool CpuResizer::Init(int nSrcWidth, int nSrcHeight, int nDstWidth, int nDstHeight, CpuResizeFilter eFilter, bool bCudaCompat)
+{
+    if (nSrcWidth <= 0 || nSrcHeight <= 0 || nDstWidth <= 0 || nDstHeight <= 0)
+    {
+        return false;
+    }
+
+    m_nSrcWidth = nSrcWidth;
+    m_nSrcHeight = nSrcHeight;
+    m_nDstWidth = nDstWidth;
+    m_nDstHeight = nDstHeight;
+    m_eFilter = eFilter;
+    m_bCudaCompat = bCudaCompat;
+
+    int srcChromaW = nSrcWidth / 2, srcChromaH = nSrcHeight / 2;
+    int dstChromaW = nDstWidth / 2, dstChromaH = nDstHeight / 2;
+    int srcScaleW = (nSrcWidth + 1) / 2, srcScaleH = (nSrcHeight + 1) / 2;
+    int dstScaleW = (nDstWidth + 1) / 2, dstScaleH = (nDstHeight + 1) / 2;
+
+    if (bCudaCompat)
+    {
+        /// tex2D(x * scale) with linear filtering samples texel centers at integer + 0.5
+        BuildFilterTable(m_lumaH, nSrcWidth, nDstWidth, eFilter, 0.0f, 0.5f);
+        BuildFilterTable(m_lumaV, nSrcHeight, nDstHeight, eFilter, 0.0f, 0.5f);
+        /// Resize() adds 0.5 to the chroma row coordinate
+        BuildFilterTable(m_chromaH, srcChromaW, dstChromaW, eFilter, 0.0f, 0.5f);
+        BuildFilterTable(m_chromaV, srcChromaH, dstChromaH, eFilter, 0.0f, 0.0f);
+        BuildFilterTable(m_scaleChromaH, srcScaleW, dstScaleW, eFilter, 0.0f, 0.5f);
+        BuildFilterTable(m_scaleChromaV, srcScaleH, dstScaleH, eFilter, 0.0f, 0.5f);
+    }
+    else
+    {
+        /// Luma: pixel centers aligned. Chroma: left-sited horizontally, centered vertically
+        BuildFilterTable(m_lumaH, nSrcWidth, nDstWidth, eFilter, 0.5f, 0.5f);
+        BuildFilterTable(m_lumaV, nSrcHeight, nDstHeight, eFilter, 0.5f, 0.5f);
+        BuildFilterTable(m_chromaH, srcChromaW, dstChromaW, eFilter, 0.25f, 0.25f);
+        BuildFilterTable(m_chromaV, srcChromaH, dstChromaH, eFilter, 0.5f, 0.5f);
+        BuildFilterTable(m_scaleChromaH, srcScaleW, dstScaleW, eFilter, 0.25f, 0.25f);
+        BuildFilterTable(m_scaleChromaV, srcScaleH, dstScaleH, eFilter, 0.5f, 0.5f);
+    }
+
+    m_bInit = true;
+    return true;
+}
+
+void CpuResizer::Cleanup()
+{
+    m_lumaH = m_lumaV = m_chromaH = m_chromaV = m_scaleChromaH = m_scaleChromaV = FilterTable();
+    m_vRowV.clear();
+    m_vRowV.shrink_to_fit();
+    m_vRowPad.clear();
+    m_vRowPad.shrink_to_fit();
+    m_nSrcWidth = m_nSrcHeight = m_nDstWidth = m_nDstHeight = 0;
+    m_bInit = false;
+}
+
+bool CpuResizer::Matches(int nSrcWidth, int nSrcHeight, int nDstWidth, int nDstHeight, CpuResizeFilter eFilter, bool bCudaCompat) const
+{
+    return m_bInit && m_nSrcWidth == nSrcWidth && m_nSrcHeight == nSrcHeight && m_nDstWidth == nDstWidth && m_nDstHeight == nDstHeight
+        && m_eFilter == eFilter && m_bCudaCompat == bCudaCompat;
+}
+
+template<typename T>
+void CpuResizer::ResizePlane(const FilterTable &h, const FilterTable &v, const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+    uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight, int nChannels)
+{
+    const float maxVal = (float)((1 << (sizeof(T) * 8)) - 1);
+    const int nRowSamples = nSrcWidth * nChannels;
+    const int nPadded = h.nPadLeft + nSrcWidth + h.nPadRight;
+
+    m_vRowV.resize(nRowSamples);
+    m_vRowPad.resize((size_t)nPadded * nChannels);
+    float *pRowV = m_vRowV.data();
+
+    for (int y = 0; y < nDstHeight; y++)
+    {
+        VerticalPass<T>(v, y, pSrc, nSrcPitch, nSrcHeight, nRowSamples, pRowV);
+        PadChannels(h, pRowV, nSrcWidth, nChannels, nChannels, m_vRowPad.data());
+
+        /// Horizontal pass
+        T *pOut = (T *)(pDst + (size_t)y * nDstPitch);
+        for (int x = 0; x < nDstWidth; x++)
+        {
+            const float *pCoefH = &h.vCoef[(size_t)x * h.nTaps];
+            int start = h.vStart[x] + h.nPadLeft;
+            for (int c = 0; c < nChannels; c++)
+            {
+                float f = Dot(&m_vRowPad[(size_t)c * nPadded + start], pCoefH, h.nTaps);
+                f = std::min(std::max(f + 0.5f, 0.0f), maxVal);
+                pOut[x * nChannels + c] = (T)f;
+            }
+        }
+    }
+}
+
+void CpuResizer::ResizeNv12(uint8_t *pDstNv12, int nDstPitch, const uint8_t *pSrcNv12, int nSrcPitch, uint8_t *pDstNv12UV)
+{
+    uint8_t *pDstUV = pDstNv12UV ? pDstNv12UV : pDstNv12 + (size_t)nDstPitch * m_nDstHeight;
+    const uint8_t *pSrcUV = pSrcNv12 + (size_t)nSrcPitch * m_nSrcHeight;
+    ResizePlane<uint8_t>(m_lumaH, m_lumaV, pSrcNv12, nSrcPitch, m_nSrcWidth, m_nSrcHeight, pDstNv12, nDstPitch, m_nDstWidth, m_nDstHeight, 1);
+    ResizePlane<uint8_t>(m_chromaH, m_chromaV, pSrcUV, nSrcPitch, m_nSrcWidth / 2, m_nSrcHeight / 2, pDstUV, nDstPitch, m_nDstWidth / 2, m_nDstHeight / 2, 2);
+}
+
+void CpuResizer::ResizeP016(uint8_t *pDstP016, int nDstPitch, const uint8_t *pSrcP016, int nSrcPitch, uint8_t *pDstP016UV)
+{
+    uint8_t *pDstUV = pDstP016UV ? pDstP016UV : pDstP016 + (size_t)nDstPitch * m_nDstHeight;
+    const uint8_t *pSrcUV = pSrcP016 + (size_t)nSrcPitch * m_nSrcHeight;
+    ResizePlane<uint16_t>(m_lumaH, m_lumaV, pSrcP016, nSrcPitch, m_nSrcWidth, m_nSrcHeight, pDstP016, nDstPitch, m_nDstWidth, m_nDstHeight, 1);
+    ResizePlane<uint16_t>(m_chromaH, m_chromaV, pSrcUV, nSrcPitch, m_nSrcWidth / 2, m_nSrcHeight / 2, pDstUV, nDstPitch, m_nDstWidth / 2, m_nDstHeight / 2, 2);
+}
+
+void CpuResizer::ScaleYUV420(uint8_t *pDstY, uint8_t *pDstU, uint8_t *pDstV, int nDstPitch, int nDstChromaPitch,
+    const uint8_t *pSrcY, const uint8_t *pSrcU, const uint8_t *pSrcV, int nSrcPitch, int nSrcChromaPitch, bool bSemiplanar)
+{
+    int chromaWidthDst = (m_nDstWidth + 1) / 2;
+    int chromaHeightDst = (m_nDstHeight + 1) / 2;
+    int chromaWidthSrc = (m_nSrcWidth + 1) / 2;
+    int chromaHeightSrc = (m_nSrcHeight + 1) / 2;
+
+    ResizePlane<uint8_t>(m_lumaH, m_lumaV, pSrcY, nSrcPitch, m_nSrcWidth, m_nSrcHeight, pDstY, nDstPitch, m_nDstWidth, m_nDstHeight, 1);
+    if (bSemiplanar)
+    {
+        ResizePlane<uint8_t>(m_scaleChromaH, m_scaleChromaV, pSrcU, nSrcChromaPitch, chromaWidthSrc, chromaHeightSrc,
+            pDstU, nDstChromaPitch, chromaWidthDst, chromaHeightDst, 2);
+    }
+    else
+    {
+        ResizePlane<uint8_t>(m_scaleChromaH, m_scaleChromaV, pSrcU, nSrcChromaPitch, chromaWidthSrc, chromaHeightSrc,
+            pDstU, nDstChromaPitch, chromaWidthDst, chromaHeightDst, 1);
+        ResizePlane<uint8_t>(m_scaleChromaH, m_scaleChromaV, pSrcV, nSrcChromaPitch, chromaWidthSrc, chromaHeightSrc,
+            pDstV, nDstChromaPitch, chromaWidthDst, chromaHeightDst, 1);
+    }
+}
+
+void ResizeNv12Cpu(uint8_t *pDstNv12, int nDstPitch, int nDstWidth, int nDstHeight, const uint8_t *pSrcNv12, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+    CpuResizeFilter eFilter, uint8_t *pDstNv12UV)
+{
+    CpuResizer resizer;
+    if (resizer.Init(nSrcWidth, nSrcHeight, nDstWidth, nDstHeight, eFilter))
+    {
+        resizer.ResizeNv12(pDstNv12, nDstPitch, pSrcNv12, nSrcPitch, pDstNv12UV);
+    }
+}
+
+void ResizeP016Cpu(uint8_t *pDstP016, int nDstPitch, int nDstWidth, int nDstHeight, const uint8_t *pSrcP016, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+    CpuResizeFilter eFilter, uint8_t *pDstP016UV)
+{
+    CpuResizer resizer;
+    if (resizer.Init(nSrcWidth, nSrcHeight, nDstWidth, nDstHeight, eFilter))
+    {
+        resizer.ResizeP016(pDstP016, nDstPitch, pSrcP016, nSrcPitch, pDstP016UV);
+    }
+}
+
+bool CpuBgraToNv12Scaler::Init(int nSrcWidth, int nSrcHeight, int nDstWidth, int nDstHeight, CpuResizeFilter eFilter)
+{
+    if (nSrcWidth <= 0 || nSrcHeight <= 0 || nDstWidth <= 0 || nDstHeight <= 0 || (nDstWidth & 1) || (nDstHeight & 1))
+    {
+        return false;
+    }
+    m_nSrcWidth = nSrcWidth;
+    m_nSrcHeight = nSrcHeight;
+    m_nDstWidth = nDstWidth;
+    m_nDstHeight = nDstHeight;
+    CpuResizer::BuildFilterTable(m_h, nSrcWidth, nDstWidth, eFilter, 0.5f, 0.5f);
+    CpuResizer::BuildFilterTable(m_v, nSrcHeight, nDstHeight, eFilter, 0.5f, 0.5f);
+    m_vRowV.resize((size_t)nSrcWidth * 4);
+    m_vRowPad.resize((size_t)(m_h.nPadLeft + nSrcWidth + m_h.nPadRight) * 3);
+    m_vU.resize(nDstWidth / 2);
+    m_vV.resize(nDstWidth / 2);
+    return true;
+}
+
+void CpuBgraToNv12Scaler::Convert(const uint8_t *pBgra, int nSrcPitch, uint8_t *pDstNv12, int nDstPitch, uint8_t *pDstNv12UV)
+{
+    uint8_t *pDstUV = pDstNv12UV ? pDstNv12UV : pDstNv12 + (size_t)nDstPitch * m_nDstHeight;
+    const int nPadded = m_h.nPadLeft + m_nSrcWidth + m_h.nPadRight;
+    const float *pB = m_vRowPad.data();
+    const float *pG = pB + nPadded;
+    const float *pR = pG + nPadded;
+
+    for (int y = 0; y < m_nDstHeight; y++)
+    {
+        VerticalPass<uint8_t>(m_v, y, pBgra, nSrcPitch, m_nSrcHeight, m_nSrcWidth * 4, m_vRowV.data());
+        PadChannels(m_h, m_vRowV.data(), m_nSrcWidth, 4, 3, m_vRowPad.data());
+
+        if (!(y & 1))
+        {
+            std::fill(m_vU.begin(), m_vU.end(), 0.0f);
+            std::fill(m_vV.begin(), m_vV.end(), 0.0f);
+        }
+
+        uint8_t *pY = pDstNv12 + (size_t)y * nDstPitch;
+        for (int x = 0; x < m_nDstWidth; x++)
+        {
+            const float *pCoef = &m_h.vCoef[(size_t)x * m_h.nTaps];
+            int start = m_h.vStart[x] + m_h.nPadLeft;
+            float b = Dot(pB + start, pCoef, m_h.nTaps);
+            float g = Dot(pG + start, pCoef, m_h.nTaps);
+            float r = Dot(pR + start, pCoef, m_h.nTaps);
+            /// Same BT.601 limited range matrix as BGRA2NV12Scaled
+            float fy = 0.257f * r + 0.504f * g + 0.098f * b + 16.0f;
+            pY[x] = (uint8_t)std::min(std::max(fy + 0.5f, 0.0f), 255.0f);
+            m_vU[x >> 1] += -0.148f * r - 0.291f * g + 0.439f * b + 128.0f;
+            m_vV[x >> 1] += 0.439f * r - 0.368f * g - 0.071f * b + 128.0f;
+        }
+
+        if (y & 1)
+        {
+            uint8_t *pUV = pDstUV + (size_t)(y >> 1) * nDstPitch;
+            for (int i = 0; i < m_nDstWidth / 2; i++)
+            {
+                pUV[2 * i] = (uint8_t)std::min(std::max(m_vU[i] * 0.25f + 0.5f, 0.0f), 255.0f);
+                pUV[2 * i + 1] = (uint8_t)std::min(std::max(m_vV[i] * 0.25f + 0.5f, 0.0f), 255.0f);
+            }
+        }
+    }
+}
@@ -0,0 +1,301 @@
+#include "Crc32.hpp"
+#include <emmintrin.h>
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#include <smmintrin.h>
+/// MSVC emits any intrinsic without per-function opt-in
+#define CRC_TARGET(x)
+#else
+#include <cpuid.h>
+#include <x86intrin.h>
+#define CRC_TARGET(x) __attribute__((target(x)))
+#endif
+
+namespace
+{
+    /// Slice-by-8 tables for both polynomials
+    struct CrcTables
+    {
+        uint32_t t[2][8][256];
+
+        CrcTables()
+        {
+            const uint32_t poly[2] = { 0xEDB88320, 0x82F63B78 };
+            for (int p = 0; p < 2; p++)
+            {
+                for (uint32_t i = 0; i < 256; i++)
+                {
+                    uint32_t crc = i;
+                    for (int j = 0; j < 8; j++)
+                    {
+                        crc = (crc >> 1) ^ ((crc & 1) ? poly[p] : 0);
+                    }
+                    t[p][0][i] = crc;
+                }
+                for (uint32_t i = 0; i < 256; i++)
+                {
+                    for (int k = 1; k < 8; k++)
+                    {
+                        t[p][k][i] = (t[p][k - 1][i] >> 8) ^ t[p][0][t[p][k - 1][i] & 0xFF];
+                    }
+                }
+            }
+        }
+    };
+    const CrcTables g_tables;
+
+    /// All implementations work on the inverted register, the public functions do the ~ on both ends
+    uint32_t CrcTable(int p, uint32_t crc, const uint8_t *pData, size_t nSize)
+    {
+        const uint32_t (*t)[256] = g_tables.t[p];
+        for (; nSize >= 8; nSize -= 8, pData += 8)
+        {
+            uint32_t lo, hi;
+            memcpy(&lo, pData, 4);
+            memcpy(&hi, pData + 4, 4);
+            lo ^= crc;
+            crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+                  t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        }
+        for (; nSize; nSize--, pData++)
+        {
+            crc = (crc >> 8) ^ t[0][(crc ^ *pData) & 0xFF];
+        }
+        return crc;
+    }
+
+    uint32_t Crc32Table(uint32_t crc, const uint8_t *pData, size_t nSize) { return CrcTable(0, crc, pData, nSize); }
+    uint32_t Crc32CTable(uint32_t crc, const uint8_t *pData, size_t nSize) { return CrcTable(1, crc, pData, nSize); }
+
+    CRC_TARGET("sse4.2")
+    uint32_t Crc32CSse42(uint32_t crc, const uint8_t *pData, size_t nSize)
+    {
+        for (; nSize && ((uintptr_t)pData & 7); nSize--, pData++)
+        {
+            crc = _mm_crc32_u8(crc, *pData);
+        }
+#if defined(_M_X64) || defined(__x86_64__)
+        uint64_t crc64 = crc;
+        for (; nSize >= 8; nSize -= 8, pData += 8)
+        {
+            crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)pData);
+        }
+        crc = (uint32_t)crc64;
+#endif
+        for (; nSize >= 4; nSize -= 4, pData += 4)
+        {
+            crc = _mm_crc32_u32(crc, *(const uint32_t *)pData);
+        }
+        for (; nSize; nSize--, pData++)
+        {
+            crc = _mm_crc32_u8(crc, *pData);
+        }
+        return crc;
+    }
+
+    /// CRC32 by folding 4 x 128 bits at a time with carry-less multiplies, then Barrett reduction.
+    /// Constants for the reflected 0x04C11DB7 polynomial from Intel's "Fast CRC Computation for Generic
+    /// Polynomials Using PCLMULQDQ Instruction"
+    CRC_TARGET("sse4.1,pclmul")
+    uint32_t Crc32Pclmul(uint32_t crc, const uint8_t *pData, size_t nSize)
+    {
+        if (nSize < 64)
+        {
+            return Crc32Table(crc, pData, nSize);
+        }
+
+        alignas(16) static const uint64_t k1k2[2] = { 0x0154442bd4, 0x01c6e41596 };
+        alignas(16) static const uint64_t k3k4[2] = { 0x01751997d0, 0x00ccaa009e };
+        alignas(16) static const uint64_t k5k0[2] = { 0x0163cd6124, 0x0000000000 };
+        alignas(16) static const uint64_t poly[2] = { 0x01db710641, 0x01f7011641 };
+
+        size_t nTail = nSize & 15;
+        nSize -= nTail;
+
+        __m128i x1 = _mm_loadu_si128((const __m128i *)(pData + 0x00));
+        __m128i x2 = _mm_loadu_si128((const __m128i *)(pData + 0x10));
+        __m128i x3 = _mm_loadu_si128((const __m128i *)(pData + 0x20));
+        __m128i x4 = _mm_loadu_si128((const __m128i *)(pData + 0x30));
+        x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+        __m128i k = _mm_load_si128((const __m128i *)k1k2);
+        pData += 64;
+        nSize -= 64;
+
+        /// Fold 512 bits per iteration
+        for (; nSize >= 64; nSize -= 64, pData += 64)
+        {
+            __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+            __m128i x6 = _mm_clmulepi64_si128(x2, k, 0x00);
+            __m128i x7 = _mm_clmulepi64_si128(x3, k, 0x00);
+            __m128i x8 = _mm_clmulepi64_si128(x4, k, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+            x2 = _mm_clmulepi64_si128(x2, k, 0x11);
+            x3 = _mm_clmulepi64_si128(x3, k, 0x11);
+            x4 = _mm_clmulepi64_si128(x4, k, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(pData + 0x00)));
+            x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(pData + 0x10)));
+            x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(pData + 0x20)));
+            x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(pData + 0x30)));
+        }
+
+        /// Fold the four lanes into one
+        k = _mm_load_si128((const __m128i *)k3k4);
+        __m128i lanes[3] = { x2, x3, x4 };
+        for (__m128i next : lanes)
+        {
+            __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, next), x5);
+        }
+
+        /// Fold the remaining 16 byte blocks
+        for (; nSize >= 16; nSize -= 16, pData += 16)
+        {
+            __m128i x5 = _mm_clmulepi64_si128(x1, k, 0x00);
+            x1 = _mm_clmulepi64_si128(x1, k, 0x11);
+            x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)pData)), x5);
+        }
+
+        /// 128 -> 64 bits
+        __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+        __m128i x2r = _mm_clmulepi64_si128(x1, k, 0x10);
+        x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2r);
+        k = _mm_loadl_epi64((const __m128i *)k5k0);
+        x2r = _mm_srli_si128(x1, 4);
+        x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x00);
+        x1 = _mm_xor_si128(x1, x2r);
+
+        /// Barrett reduction to 32 bits
+        k = _mm_load_si128((const __m128i *)poly);
+        x2r = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), k, 0x10);
+        x2r = _mm_clmulepi64_si128(_mm_and_si128(x2r, mask32), k, 0x00);
+        x1 = _mm_xor_si128(x1, x2r);
+        crc = (uint32_t)_mm_extract_epi32(x1, 1);
+
+        return Crc32Table(crc, pData, nTail);
+    }
+
+    /// Four CRC32C streams at once over their common length
+    CRC_TARGET("sse4.2")
+    void Crc32CSse42x4(const uint8_t *p[4], size_t n[4], uint32_t crc[4])
+    {
+        size_t nCommon = n[0];
+        for (int i = 1; i < 4; i++)
+        {
+            nCommon = n[i] < nCommon ? n[i] : nCommon;
+        }
+        nCommon &= ~(size_t)7;
+#if defined(_M_X64) || defined(__x86_64__)
+        uint64_t c0 = crc[0], c1 = crc[1], c2 = crc[2], c3 = crc[3];
+        for (size_t o = 0; o < nCommon; o += 8)
+        {
+            uint64_t v0, v1, v2, v3;
+            memcpy(&v0, p[0] + o, 8);
+            memcpy(&v1, p[1] + o, 8);
+            memcpy(&v2, p[2] + o, 8);
+            memcpy(&v3, p[3] + o, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+            c3 = _mm_crc32_u64(c3, v3);
+        }
+        crc[0] = (uint32_t)c0;
+        crc[1] = (uint32_t)c1;
+        crc[2] = (uint32_t)c2;
+        crc[3] = (uint32_t)c3;
+#else
+        nCommon = 0;
+#endif
+        for (int i = 0; i < 4; i++)
+        {
+            crc[i] = Crc32CSse42(crc[i], p[i] + nCommon, n[i] - nCommon);
+        }
+    }
+
+    typedef uint32_t (*CrcFunc)(uint32_t crc, const uint8_t *pData, size_t nSize);
+
+    struct CrcDispatch
+    {
+        CrcFunc pfn[2] = { Crc32Table, Crc32CTable };
+        const char *szName[2] = { "table", "table" };
+        bool bSse42 = false;
+
+        CrcDispatch()
+        {
+            int regs[4] = { 0 };
+#if defined(_MSC_VER)
+            __cpuid(regs, 1);
+#else
+            unsigned a, b, c, d;
+            if (__get_cpuid(1, &a, &b, &c, &d))
+            {
+                regs[2] = (int)c;
+            }
+#endif
+            /// ECX bit 1: PCLMULQDQ, bit 19: SSE4.1, bit 20: SSE4.2
+            bool bPclmul = (regs[2] & (1 << 1)) && (regs[2] & (1 << 19));
+            bSse42 = (regs[2] & (1 << 20)) != 0;
+            if (bPclmul)
+            {
+                pfn[0] = Crc32Pclmul;
+                szName[0] = "pclmulqdq";
+            }
+            if (bSse42)
+            {
+                pfn[1] = Crc32CSse42;
+                szName[1] = "sse4.2";
+            }
+        }
+    };
+
+    const CrcDispatch &GetDispatch()
+    {
+        static const CrcDispatch dispatch;
+        return dispatch;
+    }
+}
+
+uint32_t CrcUpdate(CrcType eType, uint32_t crc, const void *pData, size_t nSize)
+{
+    return ~GetDispatch().pfn[(int)eType](~crc, (const uint8_t *)pData, nSize);
+}
+
+void CrcUpdateMulti(CrcType eType, const void *const *ppData, const size_t *pSize, uint32_t *pCrc, int nBuffers)
+{
+    const CrcDispatch &dispatch = GetDispatch();
+    int i = 0;
+    if (eType == CrcType::Crc32C && dispatch.bSse42)
+    {
+        for (; i + 4 <= nBuffers; i += 4)
+        {
+            const uint8_t *p[4];
+            size_t n[4];
+            uint32_t crc[4];
+            for (int j = 0; j < 4; j++)
+            {
+                p[j] = (const uint8_t *)ppData[i + j];
+                n[j] = pSize[i + j];
+                crc[j] = ~pCrc[i + j];
+            }
+            Crc32CSse42x4(p, n, crc);
+            for (int j = 0; j < 4; j++)
+            {
+                pCrc[i + j] = ~crc[j];
+            }
+        }
+    }
+    /// CRC32 folding is throughput bound already, one buffer at a time is as fast
+    for (; i < nBuffers; i++)
+    {
+        pCrc[i] = CrcUpdate(eType, pCrc[i], ppData[i], pSize[i]);
+    }
+}
+
+const char *CrcGetImplName(CrcType eType)
+{
+    return GetDispatch().szName[(int)eType];
+}
@@ -0,0 +1,166 @@
+#include "CrcIndex.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <future>
+#include <chrono>
+#include <algorithm>
+
+namespace
+{
+    const char CRC_INDEX_MAGIC[4] = { 'C', 'R', 'C', 'I' };
+    /// Read size of the verifier. Two of these are in flight
+    const size_t VERIFY_CHUNK = 8 << 20;
+}
+
+bool CrcIndexWriter::Open(const std::string &dataPath, CrcType eType)
+{
+    Close();
+    m_eType = eType;
+    m_nOffset = 0;
+    m_fp.open(dataPath + ".crc", std::ios::out | std::ios::binary);
+    if (!m_fp)
+    {
+        return false;
+    }
+    CrcIndexHeader header;
+    memcpy(header.magic, CRC_INDEX_MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.type = (uint32_t)eType;
+    header.reserved = 0;
+    m_fp.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    return true;
+}
+
+void CrcIndexWriter::Add(const void *pData, size_t nSize)
+{
+    if (!m_fp.is_open())
+    {
+        return;
+    }
+    CrcIndexEntry entry;
+    entry.offset = m_nOffset;
+    entry.size = (uint32_t)nSize;
+    entry.crc = CrcUpdate(m_eType, 0, pData, nSize);
+    m_fp.write(reinterpret_cast<const char *>(&entry), sizeof(entry));
+    m_nOffset += nSize;
+}
+
+void CrcIndexWriter::Close()
+{
+    if (m_fp.is_open())
+    {
+        m_fp.close();
+    }
+}
+
+bool VerifyCrcIndex(const std::string &dataPath, CrcVerifyResult &result, bool bVerbose)
+{
+    result = CrcVerifyResult();
+    auto start = std::chrono::steady_clock::now();
+
+    std::ifstream fpIndex(dataPath + ".crc", std::ios::in | std::ios::binary);
+    CrcIndexHeader header;
+    if (!fpIndex || !fpIndex.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        memcmp(header.magic, CRC_INDEX_MAGIC, sizeof(header.magic)) || header.version != CrcIndexWriter::VERSION || header.type > (uint32_t)CrcType::Crc32C)
+    {
+        fprintf(stderr, "%s: Unable to read index %s.crc\n", __FUNCTION__, dataPath.c_str());
+        return false;
+    }
+    CrcType eType = (CrcType)header.type;
+    std::vector<CrcIndexEntry> vEntries;
+    CrcIndexEntry entry;
+    while (fpIndex.read(reinterpret_cast<char *>(&entry), sizeof(entry)))
+    {
+        vEntries.push_back(entry);
+    }
+    result.nEntries = vEntries.size();
+
+    std::ifstream fpData(dataPath, std::ios::in | std::ios::binary);
+    if (!fpData)
+    {
+        fprintf(stderr, "%s: Unable to open %s\n", __FUNCTION__, dataPath.c_str());
+        return false;
+    }
+
+    auto check = [&](size_t i, uint32_t crc) {
+        if (crc != vEntries[i].crc)
+        {
+            result.nBad++;
+            if (bVerbose)
+            {
+                printf("record %zu at offset %llu size %u: crc 0x%08x expected 0x%08x\n", i, (unsigned long long)vEntries[i].offset,
+                    vEntries[i].size, crc, vEntries[i].crc);
+            }
+        }
+    };
+
+    /// Double buffered: the next chunk is read on another thread while this one checksums the current one
+    std::vector<uint8_t> vBuf[2] = { std::vector<uint8_t>(VERIFY_CHUNK), std::vector<uint8_t>(VERIFY_CHUNK) };
+    auto read = [&fpData, &vBuf](int i) -> size_t {
+        fpData.read(reinterpret_cast<char *>(vBuf[i].data()), VERIFY_CHUNK);
+        return (size_t)fpData.gcount();
+    };
+    std::future<size_t> pending = std::async(std::launch::async, read, 0);
+
+    /// File offset of the current chunk, index of the current record and how much of it was checksummed
+    uint64_t nBase = 0;
+    size_t iEntry = 0;
+    uint64_t nDone = 0;
+    uint32_t crc = 0;
+    for (int cur = 0;; cur ^= 1)
+    {
+        size_t n = pending.get();
+        if (n == 0)
+        {
+            break;
+        }
+        pending = std::async(std::launch::async, read, cur ^ 1);
+
+        while (iEntry < vEntries.size())
+        {
+            const CrcIndexEntry &e = vEntries[iEntry];
+            uint64_t pos = e.offset + nDone;
+            if (pos < nBase || pos >= nBase + n)
+            {
+                if (pos < nBase)
+                {
+                    /// Overlapping or unsorted record, cannot be checked in a single pass
+                    check(iEntry, ~e.crc);
+                    iEntry++;
+                    nDone = 0;
+                    crc = 0;
+                    continue;
+                }
+                break;
+            }
+            size_t nTake = (size_t)std::min<uint64_t>(e.size - nDone, nBase + n - pos);
+            crc = CrcUpdate(eType, crc, vBuf[cur].data() + (pos - nBase), nTake);
+            nDone += nTake;
+            if (nDone < e.size)
+            {
+                break;
+            }
+            check(iEntry, crc);
+            iEntry++;
+            nDone = 0;
+            crc = 0;
+        }
+        nBase += n;
+    }
+    result.nBytes = nBase;
+
+    /// Zero sized records at the very end never see a chunk
+    for (; iEntry < vEntries.size() && vEntries[iEntry].size == 0 && vEntries[iEntry].offset <= nBase; iEntry++)
+    {
+        check(iEntry, 0);
+    }
+    result.nMissing = vEntries.size() - iEntry;
+    if (result.nMissing && bVerbose)
+    {
+        printf("%llu records past the end of %s (truncated file?)\n", (unsigned long long)result.nMissing, dataPath.c_str());
+    }
+
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result.nBad == 0 && result.nMissing == 0;
+}
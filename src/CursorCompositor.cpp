@@ -0,0 +1,236 @@
+#include "CursorCompositor.hpp"
+#include <algorithm>
+
+namespace
+{
+    /// x / 255 for x in [0, 255 * 255], rounded
+    inline int Div255(int x)
+    {
+        x += 128;
+        return (x + (x >> 8)) >> 8;
+    }
+
+    inline uint8_t Clamp255(int x)
+    {
+        return (uint8_t)std::min(std::max(x, 0), 255);
+    }
+}
+
+void CursorCompositor::Decode(CursorShapeType eType, int width, int height, int pitch, const uint8_t *pBuffer, Shape &shape)
+{
+    /// Monochrome shapes stack the AND and XOR masks vertically
+    int h = eType == CursorShapeType::Monochrome ? height / 2 : height;
+    shape.width = width;
+    shape.height = h;
+    shape.vBlend.assign((size_t)width * h, 0);
+    shape.vXor.assign((size_t)width * h, 0);
+    shape.bHasXor = false;
+
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            uint32_t blend = 0, xorValue = 0;
+            switch (eType)
+            {
+            case CursorShapeType::Monochrome:
+            {
+                uint8_t bit = (uint8_t)(0x80 >> (x & 7));
+                bool andBit = (pBuffer[y * pitch + x / 8] & bit) != 0;
+                bool xorBit = (pBuffer[(y + h) * pitch + x / 8] & bit) != 0;
+                if (!andBit)
+                {
+                    /// Opaque black or white
+                    blend = xorBit ? 0xFFFFFFFF : 0xFF000000;
+                }
+                else if (xorBit)
+                {
+                    /// Invert the screen
+                    xorValue = 0x00FFFFFF;
+                }
+                break;
+            }
+            case CursorShapeType::Color:
+            {
+                const uint8_t *p = pBuffer + y * pitch + x * 4;
+                uint32_t a = p[3];
+                blend = (uint32_t)Div255(p[0] * a) | ((uint32_t)Div255(p[1] * a) << 8) | ((uint32_t)Div255(p[2] * a) << 16) | (a << 24);
+                break;
+            }
+            case CursorShapeType::MaskedColor:
+            {
+                uint32_t c = *(const uint32_t *)(pBuffer + y * pitch + x * 4);
+                if ((c >> 24) == 0)
+                {
+                    blend = c | 0xFF000000;
+                }
+                else
+                {
+                    xorValue = c & 0x00FFFFFF;
+                }
+                break;
+            }
+            }
+            shape.vBlend[(size_t)y * width + x] = blend;
+            shape.vXor[(size_t)y * width + x] = xorValue;
+            shape.bHasXor |= xorValue != 0;
+        }
+    }
+}
+
+void CursorCompositor::UpdatePosition(int x, int y, bool bVisible)
+{
+    m_x = x;
+    m_y = y;
+    m_bVisible = bVisible;
+}
+
+void CursorCompositor::UpdateShape(CursorShapeType eType, int width, int height, int pitch, int hotX, int hotY, const uint8_t *pBuffer, uint32_t nBufferSize)
+{
+    /// FNV-1a over the shape description and buffer is the shape ID
+    uint64_t id = 1469598103934665603ULL;
+    auto mix = [&id](uint8_t b) { id = (id ^ b) * 1099511628211ULL; };
+    int header[4] = { (int)eType, width, height, pitch };
+    for (size_t i = 0; i < sizeof(header); i++)
+        mix(((const uint8_t *)header)[i]);
+    for (uint32_t i = 0; i < nBufferSize; i++)
+        mix(pBuffer[i]);
+
+    auto it = m_shapeCache.find(id);
+    if (it == m_shapeCache.end())
+    {
+        if (m_shapeCache.size() >= MAX_CACHED_SHAPES)
+        {
+            m_shapeCache.clear();
+        }
+        Shape shape;
+        Decode(eType, width, height, pitch, pBuffer, shape);
+        it = m_shapeCache.emplace(id, std::move(shape)).first;
+    }
+    it->second.hotX = hotX;
+    it->second.hotY = hotY;
+    m_pShape = &it->second;
+    m_shapeId = id;
+}
+
+void CursorCompositor::Follow(const CursorCompositor &src, int originX, int originY, int divisor)
+{
+    m_x = (src.m_x + originX) / divisor;
+    m_y = (src.m_y + originY) / divisor;
+    m_bVisible = src.m_bVisible;
+    if (!src.m_pShape || src.m_shapeId == m_shapeId)
+    {
+        return;
+    }
+    auto it = m_shapeCache.find(src.m_shapeId);
+    if (it == m_shapeCache.end())
+    {
+        if (m_shapeCache.size() >= MAX_CACHED_SHAPES)
+        {
+            m_shapeCache.clear();
+        }
+        it = m_shapeCache.emplace(src.m_shapeId, *src.m_pShape).first;
+    }
+    /// The hot spot is updated in place, not part of the ID
+    it->second.hotX = src.m_pShape->hotX;
+    it->second.hotY = src.m_pShape->hotY;
+    m_pShape = &it->second;
+    m_shapeId = src.m_shapeId;
+}
+
+bool CursorCompositor::GetRect(int width, int height, int rc[4]) const
+{
+    if (!IsVisible())
+    {
+        return false;
+    }
+    rc[0] = std::max(m_x, 0);
+    rc[1] = std::max(m_y, 0);
+    rc[2] = std::min(m_x + m_pShape->width, width);
+    rc[3] = std::min(m_y + m_pShape->height, height);
+    return rc[0] < rc[2] && rc[1] < rc[3];
+}
+
+void CursorCompositor::AddDamage(DamageMap &damage) const
+{
+    int rc[4];
+    if (GetRect(damage.GetWidth(), damage.GetHeight(), rc))
+    {
+        damage.AddRect(rc[0], rc[1], rc[2], rc[3]);
+    }
+    damage.AddRect(m_prevRect[0], m_prevRect[1], m_prevRect[2], m_prevRect[3]);
+}
+
+void CursorCompositor::EndFrame(int width, int height)
+{
+    if (!GetRect(width, height, m_prevRect))
+    {
+        m_prevRect[0] = m_prevRect[1] = m_prevRect[2] = m_prevRect[3] = 0;
+    }
+}
+
+void CursorCompositor::CompositeNv12(uint8_t *pY, int nPitchY, uint8_t *pUV, int nPitchUV, int originX, int originY, int regionWidth, int regionHeight)
+{
+    int rc[4];
+    if (!GetRect(originX + regionWidth, originY + regionHeight, rc))
+    {
+        return;
+    }
+    rc[0] = std::max(rc[0], originX) & ~1;
+    rc[1] = std::max(rc[1], originY) & ~1;
+    rc[2] = std::min((rc[2] + 1) & ~1, originX + regionWidth);
+    rc[3] = std::min((rc[3] + 1) & ~1, originY + regionHeight);
+
+    const Shape &shape = *m_pShape;
+    auto pixel = [&](int x, int y, uint32_t &blend, uint32_t &xorValue) {
+        int sx = x - m_x, sy = y - m_y;
+        if (sx < 0 || sy < 0 || sx >= shape.width || sy >= shape.height)
+        {
+            blend = xorValue = 0;
+            return;
+        }
+        blend = shape.vBlend[(size_t)sy * shape.width + sx];
+        xorValue = shape.vXor[(size_t)sy * shape.width + sx];
+    };
+
+    /// BT.601 limited range on premultiplied color: the offsets scale with alpha
+    for (int y = rc[1]; y < rc[3]; y += 2)
+    {
+        for (int x = rc[0]; x < rc[2]; x += 2)
+        {
+            int sumA = 0, sumU = 0, sumV = 0, nXor = 0;
+            for (int dy = 0; dy < 2; dy++)
+            {
+                for (int dx = 0; dx < 2; dx++)
+                {
+                    uint32_t s, xorValue;
+                    pixel(x + dx, y + dy, s, xorValue);
+                    int b = s & 0xFF, g = (s >> 8) & 0xFF, r = (s >> 16) & 0xFF, a = s >> 24;
+                    uint8_t &luma = pY[(size_t)(y + dy - originY) * nPitchY + (x + dx - originX)];
+                    int ys = (66 * r + 129 * g + 25 * b + 16 * 256 * a / 255 + 128) >> 8;
+                    int yv = ys + Div255(luma * (255 - a));
+                    if (xorValue)
+                    {
+                        yv = 251 - yv;
+                        nXor++;
+                    }
+                    luma = Clamp255(yv);
+                    sumA += a;
+                    sumU += -38 * r - 74 * g + 112 * b + 128 * 256 * a / 255;
+                    sumV += 112 * r - 94 * g - 18 * b + 128 * 256 * a / 255;
+                }
+            }
+            uint8_t *pChroma = pUV + (size_t)((y - originY) / 2) * nPitchUV + (x - originX);
+            int a = (sumA + 2) / 4;
+            int u = ((sumU / 4 + 128) >> 8) + Div255(pChroma[0] * (255 - a));
+            int v = ((sumV / 4 + 128) >> 8) + Div255(pChroma[1] * (255 - a));
+            if (nXor >= 2)
+            {
+                u = 256 - u;
+                v = 256 - v;
+            }
+            pChroma[0] = Clamp255(u);
+            pChroma[1] = Clamp255(v);
+        }
+    }
+}
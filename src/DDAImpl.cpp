@@ -28,6 +28,7 @@
 
 #include "Defs.hpp"
 #include "DDAImpl.hpp"
+#include "BinaryLog.hpp"
 #include <iomanip>
 
 /// Initialize DDA
@@ -60,12 +61,19 @@ HRESULT DDAImpl::Init()
         CLEAN_RETURN(hr);
     }
     /// Once we have the DXGI Adapter, we enumerate the attached display outputs, and select which one we want to capture
-    /// This sample application always captures the primary display output, enumerated at index 0.
-    if (FAILED(hr = pAdapter->EnumOutputs(0, &pOutput)))
+    /// The primary display output is enumerated at index 0.
+    if (FAILED(hr = pAdapter->EnumOutputs(outputIndex, &pOutput)))
     {
         CLEAN_RETURN(hr);
     }
 
+    DXGI_OUTPUT_DESC outputDesc;
+    ZeroMemory(&outputDesc, sizeof(outputDesc));
+    if (SUCCEEDED(pOutput->GetDesc(&outputDesc)))
+    {
+        desktopRect = outputDesc.DesktopCoordinates;
+    }
+
     if (FAILED(hr = pOutput->QueryInterface(__uuidof(IDXGIOutput1), (void**)&pOut1)))
     {
         CLEAN_RETURN(hr);
@@ -82,9 +90,142 @@ HRESULT DDAImpl::Init()
 
     height = outDesc.ModeDesc.Height;
     width = outDesc.ModeDesc.Width;
+    damage.Init(width, height);
+    bFirstFrame = true;
     CLEAN_RETURN(hr);
 }
 
+/// List every output of every adapter
+HRESULT DDAImpl::EnumerateOutputs(std::vector<DisplayOutput> &vOutputs)
+{
+    IDXGIFactory1 *pFactory = nullptr;
+    HRESULT hr = CreateDXGIFactory1(__uuidof(IDXGIFactory1), (void**)&pFactory);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    vOutputs.clear();
+    IDXGIAdapter1 *pAdapter = nullptr;
+    for (UINT a = 0; pFactory->EnumAdapters1(a, &pAdapter) != DXGI_ERROR_NOT_FOUND; a++)
+    {
+        DXGI_ADAPTER_DESC1 adapterDesc;
+        ZeroMemory(&adapterDesc, sizeof(adapterDesc));
+        pAdapter->GetDesc1(&adapterDesc);
+        IDXGIOutput *pOutput = nullptr;
+        for (UINT o = 0; pAdapter->EnumOutputs(o, &pOutput) != DXGI_ERROR_NOT_FOUND; o++)
+        {
+            DXGI_OUTPUT_DESC outputDesc;
+            ZeroMemory(&outputDesc, sizeof(outputDesc));
+            pOutput->GetDesc(&outputDesc);
+            DisplayOutput display;
+            display.adapter = a;
+            display.output = o;
+            display.adapterName = adapterDesc.Description;
+            display.outputName = outputDesc.DeviceName;
+            display.desktopRect = outputDesc.DesktopCoordinates;
+            display.rotation = outputDesc.Rotation;
+            vOutputs.push_back(display);
+            SAFE_RELEASE(pOutput);
+        }
+        SAFE_RELEASE(pAdapter);
+    }
+    SAFE_RELEASE(pFactory);
+    return S_OK;
+}
+
+/// Release the duplication and duplicate the output again on the same device
+HRESULT DDAImpl::Reacquire()
+{
+    if (pResource)
+    {
+        pDup->ReleaseFrame();
+        SAFE_RELEASE(pResource);
+    }
+    SAFE_RELEASE(pDup);
+    vMoveRects.clear();
+    return Init();
+}
+
+/// Fill the damage map from the dirty and move rects of the acquired frame
+void DDAImpl::UpdateDamage(const DXGI_OUTDUPL_FRAME_INFO &frameInfo)
+{
+    damage.Clear();
+    vMoveRects.clear();
+    if (frameInfo.AccumulatedFrames == 0)
+    {
+        /// Pointer only update, the desktop image did not change
+        return;
+    }
+    if (bFirstFrame || frameInfo.TotalMetadataBufferSize == 0)
+    {
+        /// First frame, or DDA did not report what changed
+        damage.MarkAll();
+        return;
+    }
+
+    if (vMetaData.size() < frameInfo.TotalMetadataBufferSize)
+    {
+        vMetaData.resize(frameInfo.TotalMetadataBufferSize);
+    }
+
+    UINT moveBytes = 0;
+    HRESULT hr = pDup->GetFrameMoveRects((UINT)vMetaData.size(), (DXGI_OUTDUPL_MOVE_RECT *)vMetaData.data(), &moveBytes);
+    if (FAILED(hr))
+    {
+        damage.MarkAll();
+        return;
+    }
+    const DXGI_OUTDUPL_MOVE_RECT *pMove = (const DXGI_OUTDUPL_MOVE_RECT *)vMetaData.data();
+    vMoveRects.assign(pMove, pMove + moveBytes / sizeof(DXGI_OUTDUPL_MOVE_RECT));
+    for (const DXGI_OUTDUPL_MOVE_RECT &move : vMoveRects)
+    {
+        /// Only the destination changes, the source is either unchanged or covered by a dirty rect
+        damage.AddRect(move.DestinationRect.left, move.DestinationRect.top, move.DestinationRect.right, move.DestinationRect.bottom);
+    }
+
+    UINT dirtyBytes = 0;
+    hr = pDup->GetFrameDirtyRects((UINT)vMetaData.size(), (RECT *)vMetaData.data(), &dirtyBytes);
+    if (FAILED(hr))
+    {
+        damage.MarkAll();
+        return;
+    }
+    const RECT *pDirty = (const RECT *)vMetaData.data();
+    for (UINT i = 0; i < dirtyBytes / sizeof(RECT); i++)
+    {
+        damage.AddRect(pDirty[i].left, pDirty[i].top, pDirty[i].right, pDirty[i].bottom);
+    }
+}
+
+/// Track pointer position and fetch the pointer shape when DDA reports a new one
+void DDAImpl::UpdatePointer(const DXGI_OUTDUPL_FRAME_INFO &frameInfo)
+{
+    if (frameInfo.LastMouseUpdateTime.QuadPart != 0)
+    {
+        cursor.UpdatePosition(frameInfo.PointerPosition.Position.x, frameInfo.PointerPosition.Position.y, frameInfo.PointerPosition.Visible != FALSE);
+    }
+    if (frameInfo.PointerShapeBufferSize == 0)
+    {
+        return;
+    }
+
+    if (vPointerShape.size() < frameInfo.PointerShapeBufferSize)
+    {
+        vPointerShape.resize(frameInfo.PointerShapeBufferSize);
+    }
+    UINT shapeBytes = 0;
+    DXGI_OUTDUPL_POINTER_SHAPE_INFO shapeInfo;
+    ZeroMemory(&shapeInfo, sizeof(shapeInfo));
+    HRESULT hr = pDup->GetFramePointerShape((UINT)vPointerShape.size(), vPointerShape.data(), &shapeBytes, &shapeInfo);
+    if (FAILED(hr))
+    {
+        printf("%s: %d : GetFramePointerShape failed 0x%x\n", __FUNCTION__, frameno, hr);
+        return;
+    }
+    cursor.UpdateShape((CursorShapeType)shapeInfo.Type, shapeInfo.Width, shapeInfo.Height, shapeInfo.Pitch,
+        shapeInfo.HotSpot.x, shapeInfo.HotSpot.y, vPointerShape.data(), shapeBytes);
+}
+
 /// Acquire a new frame from DDA, and return it as a Texture2D object.
 /// 'wait' specifies the time in milliseconds that DDA shoulo wait for a new screen update.
 HRESULT DDAImpl::GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait)
@@ -95,7 +236,9 @@ HRESULT DDAImpl::GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait)
     int acquired = 0;
     
 
-#define RETURN_ERR(x) {printf("%s: %d : Line %d return 0x%x\n", __FUNCTION__, frameno, __LINE__, x);return x;}
+/// Timeouts are the normal case when nothing changed, they go to the binary log
+#define RETURN_ERR(x) {if ((x) == DXGI_ERROR_WAIT_TIMEOUT) BINLOG_EVERY_MS(1000, BinaryLogLevel::Trace, "%s: %d : Line %d return 0x%x", __FUNCTION__, frameno, __LINE__, (unsigned)(x)); \
+    else printf("%s: %d : Line %d return 0x%x\n", __FUNCTION__, frameno, __LINE__, x); return x;}
 
     if (pResource)
     {
@@ -109,7 +252,7 @@ HRESULT DDAImpl::GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait)
     {
         if (hr == DXGI_ERROR_WAIT_TIMEOUT)
         {
-            printf("%s: %d : Wait for %d ms timed out\n", __FUNCTION__, frameno, wait);
+            BINLOG_EVERY_MS(1000, BinaryLogLevel::Trace, "%s: %d : Wait for %d ms timed out", __FUNCTION__, frameno, wait);
         }
         if (hr == DXGI_ERROR_INVALID_CALL)
         {
@@ -121,11 +264,31 @@ HRESULT DDAImpl::GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait)
         }
         RETURN_ERR(hr);
     }
-    if (frameInfo.AccumulatedFrames == 0 || frameInfo.LastPresentTime.QuadPart == 0)
+    UpdatePointer(frameInfo);
+
+    bool bMouseOnly = frameInfo.AccumulatedFrames == 0 || frameInfo.LastPresentTime.QuadPart == 0;
+    if (bMouseOnly)
     {
         // No image update, only cursor moved.
-        ofs << "frameNo: " << frameno << " | Accumulated: " << frameInfo.AccumulatedFrames << "MouseOnly?" << frameInfo.LastMouseUpdateTime.QuadPart << std::endl;
-        RETURN_ERR(DXGI_ERROR_WAIT_TIMEOUT);
+        BINLOG(BinaryLogLevel::Trace, "Output %u frame %d: pointer only, accumulated %u, pointer time %lld", outputIndex, frameno,
+            frameInfo.AccumulatedFrames, frameInfo.LastMouseUpdateTime.QuadPart);
+        /// Without compositing, or before the first desktop image, there is nothing new to encode
+        if (!bCompositeCursor || bFirstFrame || frameInfo.LastMouseUpdateTime.QuadPart == 0)
+        {
+            RETURN_ERR(DXGI_ERROR_WAIT_TIMEOUT);
+        }
+    }
+
+    /// Both are QPC values. A pointer only update shows an older image, but the pointer moved now
+    presentTime = bMouseOnly ? frameInfo.LastMouseUpdateTime.QuadPart : frameInfo.LastPresentTime.QuadPart;
+    UpdateDamage(frameInfo);
+    if (!bMouseOnly)
+    {
+        bFirstFrame = false;
+    }
+    if (bCompositeCursor)
+    {
+        cursor.AddDamage(damage);
     }
 
     if (!pResource)
@@ -140,11 +303,16 @@ HRESULT DDAImpl::GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait)
     }
 
 
+    if (bMouseOnly)
+    {
+        return hr;
+    }
+
     LARGE_INTEGER pts = frameInfo.LastPresentTime;  MICROSEC_TIME(pts, qpcFreq);
     LONGLONG interval = pts.QuadPart - lastPTS.QuadPart;
 
-    printf("%s: %d : Accumulated Frames %u PTS Interval %lld PTS %lld\n", __FUNCTION__, frameno, frameInfo.AccumulatedFrames,  interval * 1000, frameInfo.LastPresentTime.QuadPart);
-    ofs << "frameNo: " << frameno << " | Accumulated: "<< frameInfo.AccumulatedFrames <<" | PTS: " << frameInfo.LastPresentTime.QuadPart << " | PTSInterval: "<< (interval)*1000<<std::endl;
+    BINLOG(BinaryLogLevel::Info, "Output %u frame %d: accumulated %u, PTS %lld, PTS interval %lld us", outputIndex, frameno,
+        frameInfo.AccumulatedFrames, frameInfo.LastPresentTime.QuadPart, interval);
     lastPTS = pts; // store microsec value
     frameno += frameInfo.AccumulatedFrames;
 
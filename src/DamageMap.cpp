@@ -0,0 +1,70 @@
+#include "DamageMap.hpp"
+#include <algorithm>
+
+void DamageMap::Init(int nWidth, int nHeight)
+{
+    m_nWidth = nWidth;
+    m_nHeight = nHeight;
+    m_nTilesX = (nWidth + TILE_SIZE - 1) / TILE_SIZE;
+    m_nTilesY = (nHeight + TILE_SIZE - 1) / TILE_SIZE;
+    m_vTiles.assign((size_t)m_nTilesX * m_nTilesY, 0);
+    m_nDirty = 0;
+}
+
+void DamageMap::Clear()
+{
+    std::fill(m_vTiles.begin(), m_vTiles.end(), (uint8_t)0);
+    m_nDirty = 0;
+}
+
+void DamageMap::MarkAll()
+{
+    std::fill(m_vTiles.begin(), m_vTiles.end(), (uint8_t)1);
+    m_nDirty = (int)m_vTiles.size();
+}
+
+void DamageMap::AddRect(int left, int top, int right, int bottom)
+{
+    left = std::max(left, 0);
+    top = std::max(top, 0);
+    right = std::min(right, m_nWidth);
+    bottom = std::min(bottom, m_nHeight);
+    if (left >= right || top >= bottom)
+    {
+        return;
+    }
+    for (int ty = top / TILE_SIZE; ty <= (bottom - 1) / TILE_SIZE; ty++)
+    {
+        for (int tx = left / TILE_SIZE; tx <= (right - 1) / TILE_SIZE; tx++)
+        {
+            SetDirty(tx, ty);
+        }
+    }
+}
+
+void DamageMap::SetDirty(int tx, int ty)
+{
+    uint8_t &tile = m_vTiles[ty * m_nTilesX + tx];
+    if (!tile)
+    {
+        tile = 1;
+        m_nDirty++;
+    }
+}
+
+void DamageMap::Merge(const DamageMap &other)
+{
+    if (other.m_vTiles.size() != m_vTiles.size())
+    {
+        MarkAll();
+        return;
+    }
+    for (size_t i = 0; i < m_vTiles.size(); i++)
+    {
+        if (other.m_vTiles[i] && !m_vTiles[i])
+        {
+            m_vTiles[i] = 1;
+            m_nDirty++;
+        }
+    }
+}
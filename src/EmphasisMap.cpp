@@ -0,0 +1,98 @@
+#include "EmphasisMap.hpp"
+#include <emmintrin.h>
+#include <stdlib.h>
+#include <algorithm>
+
+int EmphasisMap::CountStrongEdges(const uint8_t *pBlock, int nPitch, int nPairs, int h, uint8_t threshold)
+{
+    const __m128i thr = _mm_set1_epi8((char)threshold);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i zero = _mm_setzero_si128();
+    /// Byte counters; a 64x64 block adds at most 32 rows x 4 vectors to a lane, well below 255
+    __m128i acc = zero;
+    int count = 0;
+    for (int y = 0; y < h; y += 2)
+    {
+        const uint8_t *p = pBlock + (size_t)y * nPitch;
+        int x = 0;
+        for (; x + 16 <= nPairs; x += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(p + x));
+            __m128i b = _mm_loadu_si128((const __m128i *)(p + x + 1));
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(a, b), _mm_subs_epu8(b, a));
+            /// Non-zero where diff > threshold
+            __m128i weak = _mm_cmpeq_epi8(_mm_subs_epu8(diff, thr), zero);
+            acc = _mm_add_epi8(acc, _mm_andnot_si128(weak, one));
+        }
+        for (; x < nPairs; x++)
+        {
+            count += abs(p[x] - p[x + 1]) > threshold;
+        }
+    }
+    __m128i sum = _mm_sad_epu8(acc, zero);
+    return count + _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+}
+
+void EmphasisMap::Init(int nWidth, int nHeight, int nBlockSize, const EmphasisConfig &cfg)
+{
+    m_cfg = cfg;
+    m_nWidth = nWidth;
+    m_nHeight = nHeight;
+    m_nBlockSize = nBlockSize;
+    m_nBlocksX = (nWidth + nBlockSize - 1) / nBlockSize;
+    m_nBlocksY = (nHeight + nBlockSize - 1) / nBlockSize;
+    size_t nBlocks = (size_t)m_nBlocksX * m_nBlocksY;
+    m_vMap.assign(nBlocks, 0);
+    m_vText.assign(nBlocks, 0);
+    m_vMotionRun.assign(nBlocks, 0);
+    m_nText = m_nMotion = 0;
+}
+
+void EmphasisMap::Update(const uint8_t *pLuma, int nPitch, const DamageMap &damage)
+{
+    if (damage.GetWidth() != m_nWidth || damage.GetHeight() != m_nHeight)
+    {
+        return;
+    }
+    const int B = m_nBlockSize;
+    const int nBlocksPerTile = DamageMap::TILE_SIZE / B;
+    m_nText = m_nMotion = 0;
+    for (int by = 0; by < m_nBlocksY; by++)
+    {
+        int ty = by / nBlocksPerTile;
+        int y0 = by * B;
+        int h = std::min(B, m_nHeight - y0);
+        for (int bx = 0; bx < m_nBlocksX; bx++)
+        {
+            size_t i = (size_t)by * m_nBlocksX + bx;
+            if (damage.IsDirty(bx / nBlocksPerTile, ty))
+            {
+                int x0 = bx * B;
+                int w = std::min(B, m_nWidth - x0);
+                /// The pair partner of the last column lies in the next block, except at the right edge
+                int nPairs = x0 + w < m_nWidth ? w : w - 1;
+                int nSamples = nPairs * ((h + 1) / 2);
+                int nEdges = CountStrongEdges(pLuma + (size_t)y0 * nPitch + x0, nPitch, nPairs, h, m_cfg.edgeThreshold);
+                m_vText[i] = nSamples > 0 && nEdges >= m_cfg.textDensity * nSamples;
+                m_vMotionRun[i] = (uint8_t)std::min(m_vMotionRun[i] + 1, 255);
+            }
+            else
+            {
+                m_vMotionRun[i] = 0;
+            }
+
+            int8_t delta = 0;
+            if (m_vText[i])
+            {
+                delta = m_cfg.textDelta;
+                m_nText++;
+            }
+            else if (m_vMotionRun[i] >= m_cfg.motionFrames)
+            {
+                delta = m_cfg.motionDelta;
+                m_nMotion++;
+            }
+            m_vMap[i] = delta;
+        }
+    }
+}
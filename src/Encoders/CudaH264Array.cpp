@@ -5,9 +5,27 @@
 #include "d3dcompiler.h"
 #include <d3d11.h>
 #include <fstream>
+#include <algorithm>
 #include <winrt/base.h>
 
 #include <cuda_runtime_api.h>
+#include "RGBToNV12.h"
+#include "PipelineTrace.hpp"
+#include "Metrics.hpp"
+#include "BinaryLog.hpp"
+
+/// Live metrics of the pipeline, see MetricsRegistry
+static MetricCounter g_framesCaptured("frames_captured_total", "Frames the capture source returned");
+static MetricCounter g_captureTimeouts("capture_timeouts_total", "Capture waits that returned no new frame");
+static MetricCounter g_framesDroppedBackpressure("frames_dropped_total", "Captured frames that were not encoded", "reason=\"backpressure\"");
+static MetricCounter g_framesDroppedNoSurface("frames_dropped_total", "Captured frames that were not encoded", "reason=\"no_surface\"");
+static MetricCounter g_framesRepeated("frames_repeated_total", "Previous frames encoded again in place of a captured one");
+static MetricCounter g_packetsWritten("packets_written_total", "Encoded packets written to the output");
+static MetricCounter g_bytesWritten("bytes_written_total", "Bytes of encoded packets written to the output");
+static MetricGauge g_encoderBacklog("encoder_backlog_frames", "Frames submitted to the encoder whose packets were not written yet");
+static MetricHistogram g_recoveryTime("capture_recovery_microseconds", "Time from a capture failure to the next encoded frame");
+static MetricCounter g_rateReconfigs("rate_reconfigs_total", "Bitrate changes of the adaptive rate control");
+static MetricGauge g_targetBitrate("target_bitrate_bps", "Average bitrate the adaptive rate control configured the encoder for");
 
 CudaH264Array::CudaH264Array(int _argc, char *_argv[])
 try : argc(_argc), argv(_argv), fpOut("out.h264", std::ios::out | std::ios::binary), iGpu(0)
@@ -25,6 +43,10 @@ try : argc(_argc), argv(_argv), fpOut("out.h264", std::ios::out | std::ios::bina
     {
         std::cout << "GPU ordinal out of range. Should be within [" << 0 << ", " << nGpu - 1 << "]" << std::endl;
     }
+    SetEncoderOptions("");
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    m_latency.Init(freq.QuadPart);
 }
 catch (...)
 {
@@ -36,6 +58,12 @@ CudaH264Array::~CudaH264Array()
 {
     Cleanup(true);
 }
+
+void CudaH264Array::SetEncoderOptions(const std::string &options)
+{
+    /// Later tokens win, so the options given override the default tuning
+    encodeCLIOptions = NvEncoderInitParam(("-tuninginfo ultralowlatency " + options).c_str(), nullptr, true);
+}
 HRESULT CudaH264Array::Init()
 {
     HRESULT hr = S_OK;
@@ -65,6 +93,7 @@ HRESULT CudaH264Array::SaveFrameToFile(const void *pBuffer, int width, int heigh
 
     // Write frame data to the output file
     fpOut.write(reinterpret_cast<const char *>(pBuffer), frameSize);
+    m_crcIndex.Add(pBuffer, frameSize);
 
     return S_OK;
 }
@@ -125,16 +154,77 @@ HRESULT CudaH264Array::InitDXGI()
 HRESULT CudaH264Array::InitDup()
 {
     HRESULT hr = S_OK;
-    if (!pDDAWrapper)
+    if (!pCapture)
     {
-        pDDAWrapper = new DDAImpl(pD3DDev, pCtx);
-        hr = pDDAWrapper->Init();
+        if (m_outputMode != OutputMode::Single)
+        {
+            m_pDisplays = new MultiOutputCapture(pD3DDev, pCtx);
+            AddDisplays(m_pDisplays);
+            pCapture = m_pDisplays;
+        }
+        else if (!m_replayPath.empty())
+        {
+            ReplayCaptureSource *pReplay = new ReplayCaptureSource(pD3DDev, pCtx, m_replayPath, m_replayWidth, m_replayHeight);
+            pReplay->setFaultInjection(m_replayInjectEvery);
+            pReplay->setScroll(m_replayScroll);
+            pCapture = pReplay;
+        }
+        else
+        {
+            pCapture = new DDAImpl(pD3DDev, pCtx, m_captureOutput);
+        }
+        pCapture->setCompositeCursor(m_bCompositeCursor);
+        hr = pCapture->Init();
         returnIfError(hr);
     }
 
     return hr;
 }
 
+void CudaH264Array::AddDisplays(MultiOutputCapture *pDisplays)
+{
+    if (!m_replayPath.empty())
+    {
+        for (UINT i = 0; i < std::max(m_syntheticOutputs, 1u); i++)
+        {
+            ReplayCaptureSource *pReplay = new ReplayCaptureSource(pD3DDev, pCtx, m_replayPath, m_replayWidth, m_replayHeight);
+            pReplay->setFaultInjection(m_replayInjectEvery);
+            pReplay->setScroll(m_replayScroll);
+            pReplay->setOrigin((LONG)(i * m_replayWidth), 0);
+            pDisplays->addSource(pReplay);
+        }
+        return;
+    }
+
+    /// The device is created on the default adapter, which can only duplicate its own outputs
+    std::vector<DisplayOutput> vOutputs;
+    if (FAILED(DDAImpl::EnumerateOutputs(vOutputs)))
+    {
+        vOutputs.clear();
+    }
+    UINT nOther = 0;
+    for (const DisplayOutput &display : vOutputs)
+    {
+        if (display.adapter == 0)
+        {
+            pDisplays->addSource(new DDAImpl(pD3DDev, pCtx, display.output));
+        }
+        else
+        {
+            nOther++;
+        }
+    }
+    if (vOutputs.empty())
+    {
+        /// Enumeration failed, the primary display can still be captured
+        pDisplays->addSource(new DDAImpl(pD3DDev, pCtx, 0));
+    }
+    if (nOther)
+    {
+        printf("%s: %u displays on other adapters are not captured\n", __FUNCTION__, nOther);
+    }
+}
+
 HRESULT CudaH264Array::InitOutFile()
 {
     if (!fpOut)
@@ -143,13 +233,18 @@ HRESULT CudaH264Array::InitOutFile()
         err << "Unable to open output file: out.bgra" << std::endl;
         throw std::invalid_argument(err.str());
     }
+    /// fpOut lives as long as this object, so the index is opened once and survives re-Init()
+    if (!m_crcIndex.IsOpen() && !m_crcIndex.Open("out.h264"))
+    {
+        std::cerr << "Unable to open checksum index: out.h264.crc" << std::endl;
+    }
     return S_OK;
 }
 HRESULT CudaH264Array::InitEnc()
 {
     HRESULT hr = S_OK;
-    DWORD w = pDDAWrapper->getWidth();
-    DWORD h = pDDAWrapper->getHeight();
+    DWORD w = pCapture->getWidth();
+    DWORD h = pCapture->getHeight();
 
     char szDeviceName[80];
     cuDeviceGet(&cuDevice, iGpu);
@@ -163,8 +258,62 @@ HRESULT CudaH264Array::InitEnc()
         err << "Unable to create CUDA context" << std::endl;
         throw std::invalid_argument(err.str());
     }
+    if (m_pDisplays && m_outputMode == OutputMode::Separate)
+    {
+        if (m_partition.count > 1 || m_bQpMap || m_bMotionHints || m_bAdaptiveRate || m_intraRefresh.period || m_bAsyncOutput)
+        {
+            printf("%s: Partitioning, QP maps, motion hints, adaptive bitrate, intra refresh and async output apply to a single session, ignored with separate displays\n", __FUNCTION__);
+        }
+        m_partitioned = std::make_unique<PartitionedEncoder>(cuContext);
+        hr = InitDisplayEncoders();
+        returnIfError(hr);
+    }
+    else if (m_partition.count > 1 && m_partition.output == PartitionOutput::Streams)
+    {
+        if (m_bQpMap || m_bMotionHints || m_bAdaptiveRate || m_intraRefresh.period || m_bAsyncOutput)
+        {
+            printf("%s: QP maps, motion hints, adaptive bitrate, intra refresh and async output apply to a single session, ignored with stripes\n", __FUNCTION__);
+        }
+        m_partitioned = std::make_unique<PartitionedEncoder>(cuContext);
+        hr = m_partitioned->Init(m_partition, encodeCLIOptions, w, h);
+        returnIfError(hr);
+    }
+    else
+    {
+        DWORD encodeW, encodeH;
+        GetEncodeSize(w, h, encodeW, encodeH);
+        hr = CreateEncoder(encodeW, encodeH);
+        returnIfError(hr);
+    }
+    if (m_bBackpressure && m_backpressure.GetConfig().strategy == BackpressureStrategy::LowerResolution &&
+        (m_partitioned || m_bQpMap || m_bMotionHints || !m_vRenditions.empty()))
+    {
+        /// Damage, move rects and renditions are in captured coordinates
+        printf("%s: Lower resolution back-pressure needs a single session without QP maps, motion hints or simulcast, lowering the frame rate instead\n", __FUNCTION__);
+        BackpressureConfig cfg = m_backpressure.GetConfig();
+        cfg.strategy = BackpressureStrategy::LowerFrameRate;
+        m_backpressure.Init(cfg);
+    }
+
+    m_textureConverter = std::make_unique<D3D11TextureConverter>(pD3DDev, pCtx);
+    m_textureConverter->init();
+    /// For the desktop format; Capture() rebuilds the pool if the frames come in another one
+    hr = InitFramePool(w, h, DXGI_FORMAT_B8G8R8A8_UNORM);
+    returnIfError(hr);
+
+    if (!m_vRenditions.empty())
+    {
+        m_simulcast = std::make_unique<Simulcast>(pD3DDev, pCtx, cuContext);
+        hr = m_simulcast->Init(m_vRenditions, encodeCLIOptions, w, h);
+        returnIfError(hr);
+    }
+
+    return hr;
+}
+
+HRESULT CudaH264Array::CreateEncoder(DWORD w, DWORD h)
+{
     //NV_ENC_BUFFER_FORMAT eFormat = NV_ENC_BUFFER_FORMAT_ARGB;
-    int iGpu = 0;
     try
     {
         //pEnc = new NvEnc(cuContext, w, h, eFormat); // TODO Error management
@@ -174,6 +323,7 @@ HRESULT CudaH264Array::InitEnc()
     catch (std::exception &error)
     {
         std::cerr << error.what() << std::endl;
+        return E_FAIL;
     }
 
     NV_ENC_INITIALIZE_PARAMS initializeParams = {NV_ENC_INITIALIZE_PARAMS_VER};
@@ -183,15 +333,308 @@ HRESULT CudaH264Array::InitEnc()
     initializeParams.encodeConfig = &encodeConfig;
     initializeParams.encodeWidth = w;
     initializeParams.encodeHeight = h;
-    NV_ENC_TUNING_INFO tuningInfo = NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY;
-    pEnc->CreateDefaultEncoderParams(&initializeParams, NV_ENC_CODEC_H264_GUID, NV_ENC_PRESET_P3_GUID, tuningInfo);
+    pEnc->CreateDefaultEncoderParams(&initializeParams, encodeCLIOptions.GetEncodeGUID(), encodeCLIOptions.GetPresetGUID(),
+        encodeCLIOptions.GetTuningInfo());
+    try
+    {
+        /// Rate control, GOP, profile... from the command line or profile, on top of the preset
+        encodeCLIOptions.SetInitParams(&initializeParams, m_pixelFormat);
+    }
+    catch (std::exception &error)
+    {
+        std::cerr << error.what() << std::endl;
+        return E_FAIL;
+    }
+    ConfigureStreaming(initializeParams);
+    if (m_partition.count > 1 && m_partition.output == PartitionOutput::Split)
+    {
+        ConfigureSplitEncode(initializeParams);
+    }
+    if (m_bQpMap)
+    {
+        /// One delta per MB for H.264, per CTB for HEVC (NVENC only does 32x32), per superblock for AV1
+        encodeConfig.rcParams.qpMapMode = NV_ENC_QP_MAP_DELTA;
+        m_nQpBlockSize = encodeCLIOptions.IsCodecH264() ? 16 : encodeCLIOptions.IsCodecHEVC() ? 32 : 64;
+        m_emphasis.Init(w, h, m_nQpBlockSize);
+    }
 
-    pEnc->CreateEncoder(&initializeParams);
+    m_bMotionHintsActive = false;
+    if (m_bMotionHints && encodeConfig.frameIntervalP > 1)
+    {
+        /// Move rects are relative to the previous frame, which is not the reference of a B frame
+        printf("%s: Motion hints need a stream without B frames, disabled\n", __FUNCTION__);
+    }
+    else if (m_bMotionHints)
+    {
+        /// A single candidate per macroblock (H.264, HEVC) or superblock (AV1) in L0
+        initializeParams.enableExternalMEHints = 1;
+        bool bAV1 = initializeParams.encodeGUID == NV_ENC_CODEC_AV1_GUID;
+        if (bAV1)
+        {
+            initializeParams.maxMEHintCountsPerBlock[0].numCandsPerSb = 1;
+        }
+        else
+        {
+            initializeParams.maxMEHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+        }
+        m_motionHints.Init(w, h, bAV1);
+        m_bMotionHintsActive = true;
+    }
 
-    m_textureConverter = std::make_unique<D3D11TextureConverter>(pD3DDev, pCtx);
-    m_textureConverter->init();
+    if (m_bAdaptiveRate)
+    {
+        /// Start in the middle of the range, CBR so every reconfiguration takes effect right away.
+        /// A recreated session keeps the bitrate the controller had settled on
+        if (!m_rateController.GetCurrentBitrate())
+        {
+            m_rateConfig.fps = (double)initializeParams.frameRateNum / initializeParams.frameRateDen;
+            m_rateController.Init(m_rateConfig, m_rateConfig.minBitrate / 2 + m_rateConfig.maxBitrate / 2);
+        }
+        RateDecision decision = m_rateController.MakeDecision(m_rateController.GetCurrentBitrate());
+        g_targetBitrate.Set(decision.averageBitRate);
+        NV_ENC_RC_PARAMS &rc = encodeConfig.rcParams;
+        rc.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+        rc.averageBitRate = decision.averageBitRate;
+        rc.maxBitRate = decision.maxBitRate;
+        rc.vbvBufferSize = decision.vbvBufferSize;
+        rc.vbvInitialDelay = decision.vbvInitialDelay;
+    }
 
-    return hr;
+    if (m_bAsyncOutput)
+    {
+        pEnc->SetOutputCallback([this](std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info) { WritePacket(packet, info.outputTimeStamp, info.pictureType); });
+    }
+
+    try
+    {
+        pEnc->CreateEncoder(&initializeParams);
+    }
+    catch (std::exception &error)
+    {
+        std::cerr << error.what() << std::endl;
+        return E_FAIL;
+    }
+    std::cout << encodeCLIOptions.MainParamToString(&initializeParams) << std::endl;
+    m_nEncoderSessions++;
+    m_nFramesSubmitted = m_nPacketsReceived = 0;
+    /// A new session starts with an IDR frame
+    m_nLastIdr = m_nFrameNumber;
+    return S_OK;
+}
+
+void CudaH264Array::ConfigureSplitEncode(NV_ENC_INITIALIZE_PARAMS &params)
+{
+    if (params.encodeGUID == NV_ENC_CODEC_H264_GUID)
+    {
+        printf("%s: Split frame encoding needs HEVC or AV1, encoding in one piece\n", __FUNCTION__);
+        return;
+    }
+    int nEngines = pEnc->GetCapabilityValue(params.encodeGUID, NV_ENC_CAPS_NUM_ENCODER_ENGINES);
+    if (nEngines < 2)
+    {
+        printf("%s: The GPU has %d NVENC engine, encoding in one piece\n", __FUNCTION__, nEngines);
+        return;
+    }
+    /// The driver cuts the frame into horizontal strips; only two and three are forced explicitly
+    params.splitEncodeMode = m_partition.count == 2 ? NV_ENC_SPLIT_TWO_FORCED_MODE
+        : m_partition.count == 3 ? NV_ENC_SPLIT_THREE_FORCED_MODE : NV_ENC_SPLIT_AUTO_FORCED_MODE;
+    if (params.encodeGUID == NV_ENC_CODEC_AV1_GUID)
+    {
+        /// Uniform tiles in the partition direction, the driver rounds the count down to a power of two
+        NV_ENC_CONFIG_AV1 &av1Config = params.encodeConfig->encodeCodecConfig.av1Config;
+        if (m_partition.orientation == PartitionOrientation::Vertical)
+        {
+            av1Config.numTileColumns = m_partition.count;
+        }
+        else
+        {
+            av1Config.numTileRows = m_partition.count;
+        }
+    }
+    printf("%s: Splitting frames across %d NVENC engines (mode %u)\n", __FUNCTION__, nEngines, (unsigned)params.splitEncodeMode);
+}
+
+/// Reference frames kept in the DPB, so invalidation has older frames to fall back to.
+/// A loss older than this has been built upon too long to be repaired by invalidation
+static const uint32_t STREAMING_REF_FRAMES = 4;
+
+/// Fields common to the H.264, HEVC and AV1 configurations
+template<typename T>
+static void EnableIntraRefresh(T &codecConfig, const IntraRefreshConfig &cfg)
+{
+    codecConfig.enableIntraRefresh = 1;
+    codecConfig.intraRefreshPeriod = cfg.period;
+    codecConfig.intraRefreshCnt = cfg.frames;
+    codecConfig.idrPeriod = NVENC_INFINITE_GOPLENGTH;
+}
+
+void CudaH264Array::ConfigureStreaming(NV_ENC_INITIALIZE_PARAMS &params)
+{
+    NV_ENC_CONFIG &config = *params.encodeConfig;
+    bool bH264 = params.encodeGUID == NV_ENC_CODEC_H264_GUID;
+    bool bHEVC = params.encodeGUID == NV_ENC_CODEC_HEVC_GUID;
+
+    m_bRefInvalidation = pEnc->GetCapabilityValue(params.encodeGUID, NV_ENC_CAPS_SUPPORT_REF_PIC_INVALIDATION) != 0;
+    if (m_bRefInvalidation)
+    {
+        if (bH264)
+        {
+            config.encodeCodecConfig.h264Config.maxNumRefFrames = STREAMING_REF_FRAMES;
+        }
+        else if (bHEVC)
+        {
+            config.encodeCodecConfig.hevcConfig.maxNumRefFramesInDPB = STREAMING_REF_FRAMES;
+        }
+        else
+        {
+            config.encodeCodecConfig.av1Config.maxNumRefFramesInDPB = STREAMING_REF_FRAMES;
+        }
+    }
+
+    m_bIntraRefreshActive = false;
+    if (!m_intraRefresh.period)
+    {
+        return;
+    }
+    if (!pEnc->GetCapabilityValue(params.encodeGUID, NV_ENC_CAPS_SUPPORT_INTRA_REFRESH))
+    {
+        printf("%s: Intra refresh is not supported by this GPU, keeping the IDR GOP\n", __FUNCTION__);
+        return;
+    }
+    if (config.frameIntervalP > 1)
+    {
+        printf("%s: Intra refresh cannot be used with B frames, keeping the IDR GOP\n", __FUNCTION__);
+        return;
+    }
+
+    /// No IDR after the first frame, the waves take over
+    config.gopLength = NVENC_INFINITE_GOPLENGTH;
+    if (bH264)
+    {
+        EnableIntraRefresh(config.encodeCodecConfig.h264Config, m_intraRefresh);
+        /// Tells a decoder joining mid stream where a wave completes
+        config.encodeCodecConfig.h264Config.outputRecoveryPointSEI = 1;
+    }
+    else if (bHEVC)
+    {
+        EnableIntraRefresh(config.encodeCodecConfig.hevcConfig, m_intraRefresh);
+        config.encodeCodecConfig.hevcConfig.outputRecoveryPointSEI = 1;
+    }
+    else
+    {
+        EnableIntraRefresh(config.encodeCodecConfig.av1Config, m_intraRefresh);
+    }
+    m_bIntraRefreshActive = true;
+    printf("%s: Intra refresh over %u frames every %u frames\n", __FUNCTION__, m_intraRefresh.frames, m_intraRefresh.period);
+}
+
+void CudaH264Array::InvalidateFrames(UINT64 firstFrame, UINT64 lastFrame)
+{
+    std::lock_guard<std::mutex> lock(m_lossMutex);
+    if (lastFrame >= firstFrame && lastFrame - firstFrame >= STREAMING_REF_FRAMES)
+    {
+        /// Longer than the DPB, invalidation cannot repair it
+        m_bRecoveryRequested = true;
+        return;
+    }
+    for (UINT64 frame = firstFrame; frame <= lastFrame; frame++)
+    {
+        m_vInvalidFrames.push_back(frame);
+    }
+}
+
+void CudaH264Array::ForceRecovery()
+{
+    std::lock_guard<std::mutex> lock(m_lossMutex);
+    m_bRecoveryRequested = true;
+}
+
+void CudaH264Array::ApplyLossReports(NV_ENC_PIC_PARAMS &picParams, FrameVector<UINT64> &vInvalidFrames)
+{
+    bool bRecovery = false;
+    {
+        /// Copied rather than swapped, m_vInvalidFrames keeps its capacity for the next reports
+        std::lock_guard<std::mutex> lock(m_lossMutex);
+        vInvalidFrames.assign(m_vInvalidFrames.begin(), m_vInvalidFrames.end());
+        m_vInvalidFrames.clear();
+        bRecovery = m_bRecoveryRequested;
+        m_bRecoveryRequested = false;
+    }
+
+    for (UINT64 frame : vInvalidFrames)
+    {
+        if (frame < m_nLastIdr || frame >= m_nFrameNumber)
+        {
+            /// Nothing refers to frames before the last IDR, and frames not encoded yet cannot be lost
+            continue;
+        }
+        if (!m_bRefInvalidation || m_nFrameNumber - frame > STREAMING_REF_FRAMES)
+        {
+            bRecovery = true;
+            continue;
+        }
+        try
+        {
+            pEnc->InvalidateRefFrames(frame);
+            m_nInvalidations++;
+        }
+        catch (std::exception &error)
+        {
+            std::cerr << error.what() << std::endl;
+            bRecovery = true;
+        }
+    }
+    if (!bRecovery)
+    {
+        return;
+    }
+
+    m_nForcedRecoveries++;
+    if (m_bIntraRefreshActive)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_outputMutex);
+            m_nRefreshRecoveryFrame = m_nFrameNumber;
+        }
+        /// A wave right away, still without a size spike
+        if (encodeCLIOptions.IsCodecH264())
+        {
+            picParams.codecPicParams.h264PicParams.forceIntraRefreshWithFrameCnt = m_intraRefresh.frames;
+        }
+        else if (encodeCLIOptions.IsCodecHEVC())
+        {
+            picParams.codecPicParams.hevcPicParams.forceIntraRefreshWithFrameCnt = m_intraRefresh.frames;
+        }
+        else
+        {
+            picParams.codecPicParams.av1PicParams.forceIntraRefreshWithFrameCnt = m_intraRefresh.frames;
+        }
+    }
+    else
+    {
+        picParams.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+        m_nLastIdr = m_nFrameNumber;
+    }
+    printf("%s: Frame %llu: recovery point (%u forced, %u frames invalidated so far)\n", __FUNCTION__,
+        (unsigned long long)m_nFrameNumber, m_nForcedRecoveries, m_nInvalidations);
+}
+
+bool CudaH264Array::ParseIntraRefresh(const char *szArg, IntraRefreshConfig &cfg)
+{
+    unsigned period = 0, frames = 0;
+    int n = sscanf(szArg, "%u:%u", &period, &frames);
+    if (n == 1)
+    {
+        frames = period / 2;
+    }
+    if (n < 1 || frames == 0 || frames >= period)
+    {
+        printf("%s: Invalid intra refresh '%s', expected period[:frames] with 0 < frames < period\n", __FUNCTION__, szArg);
+        return false;
+    }
+    cfg.period = period;
+    cfg.frames = frames;
+    return true;
 }
 
 HRESULT CudaH264Array::Encode()
@@ -202,7 +645,7 @@ HRESULT CudaH264Array::Encode()
 
     winrt::com_ptr<ID3D11DeviceContext> contex;
     pD3DDev->GetImmediateContext(contex.put());
-    contex->CopyResource(dstTexture, m_pEncBuf);
+    contex->CopyResource(dstTexture, m_frame.GetTexture());
 
     try
     {
@@ -216,8 +659,12 @@ HRESULT CudaH264Array::Encode()
     return hr;
 }
 
-HRESULT CudaH264Array::Encode(CUarray cuArray)
+HRESULT CudaH264Array::Encode(CUarray cuArray, FrameMetadata *pMetadata)
 {
+    if (m_partitioned)
+    {
+        return EncodePartitioned(cuArray);
+    }
     HRESULT hr = S_OK;
     const NvEncInputFrame *encoderInputFrame = pEnc->GetNextInputFrame();
 
@@ -242,8 +689,6 @@ HRESULT CudaH264Array::Encode(CUarray cuArray)
 #endif
 
     uint32_t srcPitch = NvEncoder::GetWidthInBytes(m_pixelFormat, desc.Width);
-    std::vector<uint32_t> srcChromaOffsets;
-    NvEncoder::GetChromaSubPlaneOffsets(m_pixelFormat, srcPitch, desc.Height, srcChromaOffsets);
     uint32_t chromaHeight = NvEncoder::GetChromaHeight(m_pixelFormat, desc.Height);
     uint32_t destChromaPitch = NvEncoder::GetChromaPitch(m_pixelFormat, encoderInputFrame->pitch);
     uint32_t srcChromaPitch = NvEncoder::GetChromaPitch(m_pixelFormat, srcPitch);
@@ -251,47 +696,104 @@ HRESULT CudaH264Array::Encode(CUarray cuArray)
 
 	CUresult cudaStatus = CUDA_SUCCESS;
 
-    CUDA_MEMCPY2D copyParam;
-    memset(&copyParam, 0, sizeof(CUDA_MEMCPY2D));
-    copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
-    copyParam.srcArray = cuArray;
-    copyParam.dstMemoryType = CU_MEMORYTYPE_DEVICE;
-    copyParam.dstDevice = (CUdeviceptr)encoderInputFrame->inputPtr;
-    copyParam.dstPitch = encoderInputFrame->pitch;
-    copyParam.WidthInBytes = desc.Width * desc.NumChannels;
-    copyParam.Height = desc.Height;
-
-	cudaStatus = cuMemcpy2D(&copyParam);
-	if (cudaStatus != CUDA_SUCCESS) {
-		std::cerr << "Failed to copy CUDA array to device memory. : cudaError : " << cudaStatus << std::endl;
-	}
-
-    for (uint32_t i = 0; i < encoderInputFrame->numChromaPlanes; ++i)
+    if (m_bFusedActive)
     {
-        if (chromaHeight)
-		{
-			memset(&copyParam, 0, sizeof(CUDA_MEMCPY2D));
-			copyParam.srcY = desc.Height;
-			copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
-            copyParam.srcArray = cuArray;
-			copyParam.srcPitch = srcChromaPitch;
-
-            copyParam.dstMemoryType = CU_MEMORYTYPE_DEVICE;
-			copyParam.dstDevice = (CUdeviceptr)((uint8_t*)encoderInputFrame->inputPtr + encoderInputFrame->chromaOffsets[i]);
-			copyParam.dstPitch = destChromaPitch;
-			copyParam.WidthInBytes = chromaWidthInBytes;
-			copyParam.Height = chromaHeight;
-            cudaStatus = cuMemcpy2D(&copyParam);
-			if (cudaStatus != CUDA_SUCCESS) {
-				std::cerr << "Failed to copy CUDA array to device memory. : cudaError : " << cudaStatus << std::endl;
-			}
-		}
+        /// BGRA at the captured size in, NV12 at the encoder size out
+        cudaError_t cudaErr = BGRA2NV12Scaled((cudaArray_t)cuArray, desc.Width, desc.Height, (uint8_t *)encoderInputFrame->inputPtr,
+            encoderInputFrame->pitch, pEnc->GetEncodeWidth(), pEnc->GetEncodeHeight(), (cudaStream_t)m_stream,
+            (uint8_t *)encoderInputFrame->inputPtr + encoderInputFrame->chromaOffsets[0]);
+        if (cudaErr != cudaSuccess || (cudaStatus = cuStreamSynchronize(m_stream)) != CUDA_SUCCESS)
+        {
+            std::cerr << "Failed to convert the captured frame. : cudaError : " << (cudaErr != cudaSuccess ? (int)cudaErr : (int)cudaStatus) << std::endl;
+            return E_FAIL;
+        }
+    }
+    else
+    {
+        CUDA_MEMCPY2D copyParam;
+        memset(&copyParam, 0, sizeof(CUDA_MEMCPY2D));
+        copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+        copyParam.srcArray = cuArray;
+        copyParam.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+        copyParam.dstDevice = (CUdeviceptr)encoderInputFrame->inputPtr;
+        copyParam.dstPitch = encoderInputFrame->pitch;
+        copyParam.WidthInBytes = desc.Width * desc.NumChannels;
+        copyParam.Height = desc.Height;
+
+        cudaStatus = cuMemcpy2D(&copyParam);
+        if (cudaStatus != CUDA_SUCCESS) {
+            std::cerr << "Failed to copy CUDA array to device memory. : cudaError : " << cudaStatus << std::endl;
+        }
+
+        for (uint32_t i = 0; i < encoderInputFrame->numChromaPlanes; ++i)
+        {
+            if (chromaHeight)
+            {
+                memset(&copyParam, 0, sizeof(CUDA_MEMCPY2D));
+                copyParam.srcY = desc.Height;
+                copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+                copyParam.srcArray = cuArray;
+                copyParam.srcPitch = srcChromaPitch;
+
+                copyParam.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+                copyParam.dstDevice = (CUdeviceptr)((uint8_t*)encoderInputFrame->inputPtr + encoderInputFrame->chromaOffsets[i]);
+                copyParam.dstPitch = destChromaPitch;
+                copyParam.WidthInBytes = chromaWidthInBytes;
+                copyParam.Height = chromaHeight;
+                cudaStatus = cuMemcpy2D(&copyParam);
+                if (cudaStatus != CUDA_SUCCESS) {
+                    std::cerr << "Failed to copy CUDA array to device memory. : cudaError : " << cudaStatus << std::endl;
+                }
+            }
+        }
     }
     
     try
     {
-        pEnc->EncodeFrame(vPacket);
+        if (m_bQpMap)
+        {
+            hr = UpdateQpMap(cuArray, encPicParams);
+            returnIfError(hr);
+        }
+        /// Per frame lists come from the frame's arena, the heap only serves frames from outside the pool
+        FrameVector<UINT64> vLocalInvalidFrames;
+        ApplyLossReports(encPicParams, pMetadata ? pMetadata->vInvalidFrames : vLocalInvalidFrames);
+        if (m_bMotionHintsActive)
+        {
+            if (pMetadata)
+            {
+                ApplyMotionHints(encPicParams, pMetadata->vMoveRects.data(), pMetadata->vMoveRects.size());
+            }
+            else
+            {
+                const std::vector<DXGI_OUTDUPL_MOVE_RECT> &vMoves = pCapture->getMoveRects();
+                ApplyMotionHints(encPicParams, vMoves.data(), vMoves.size());
+            }
+        }
+        encPicParams.inputTimeStamp = m_nFrameNumber;
+        {
+            std::lock_guard<std::mutex> lock(m_outputMutex);
+            m_nFramesSubmitted++;
+            g_encoderBacklog.Set((int64_t)(m_nFramesSubmitted - m_nPacketsReceived));
+        }
+        /// Before submitting, in async output mode the packet may come back before EncodeFrame() returns
+        FrameTiming timing = m_captureTiming;
+        timing.frameNumber = m_nFrameNumber;
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        timing.submitted = now.QuadPart;
+        m_latency.Submit(timing);
+        {
+            /// Holds the bitstream locks of earlier frames in synchronous output mode
+            TraceSpan submitSpan("submit", m_nFrameNumber);
+            pEnc->EncodeFrame(vPacket, &encPicParams);
+        }
         WriteEncOutput();
+        m_nFrameNumber++;
+        if (m_bAdaptiveRate)
+        {
+            UpdateRateControl();
+        }
     }
     catch (...)
     {
@@ -300,79 +802,537 @@ HRESULT CudaH264Array::Encode(CUarray cuArray)
     return hr;
 }
 
+HRESULT CudaH264Array::EncodePartitioned(CUarray cuArray)
+{
+    /// The stripes are encoded without reference invalidation, a loss is repaired by an IDR in all of them
+    bool bForceIdr = false;
+    {
+        std::lock_guard<std::mutex> lock(m_lossMutex);
+        bForceIdr = m_bRecoveryRequested;
+        for (UINT64 frame : m_vInvalidFrames)
+        {
+            bForceIdr |= frame >= m_nLastIdr && frame < m_nFrameNumber;
+        }
+        m_vInvalidFrames.clear();
+        m_bRecoveryRequested = false;
+    }
+    HRESULT hr = m_partitioned->Encode(cuArray, m_nFrameNumber, bForceIdr);
+    returnIfError(hr);
+    if (bForceIdr)
+    {
+        m_nForcedRecoveries++;
+        m_nLastIdr = m_nFrameNumber;
+    }
+    m_nFrameNumber++;
+    return hr;
+}
+
+HRESULT CudaH264Array::InitDisplayEncoders()
+{
+    std::vector<RECT> vRegions;
+    for (size_t i = 0; i < m_pDisplays->getOutputCount(); i++)
+    {
+        vRegions.push_back(m_pDisplays->getOutputRect(i));
+    }
+    return m_partitioned->InitRegions(vRegions, encodeCLIOptions, m_pDisplays->getWidth(), m_pDisplays->getHeight());
+}
+
+void CudaH264Array::ApplyMotionHints(NV_ENC_PIC_PARAMS &picParams, const DXGI_OUTDUPL_MOVE_RECT *pMoves, size_t nMoves)
+{
+    if (!nMoves)
+    {
+        return;
+    }
+    int w = (int)pEnc->GetEncodeWidth();
+    int h = (int)pEnc->GetEncodeHeight();
+    if (m_motionHints.GetWidth() != w || m_motionHints.GetHeight() != h)
+    {
+        /// The capture size changed, the encoder was reconfigured to it
+        m_motionHints.Init(w, h, m_motionHints.IsSuperblocks());
+    }
+    if (!m_motionHints.Update(pMoves, nMoves))
+    {
+        return;
+    }
+    if (m_motionHints.IsSuperblocks())
+    {
+        picParams.meHintCountsPerBlock[0].numCandsPerSb = 1;
+        picParams.meExternalSbHints = m_motionHints.GetSbHints();
+        picParams.meSbHintsCount = m_motionHints.GetBlockCount();
+    }
+    else
+    {
+        picParams.meHintCountsPerBlock[0].numCandsPerBlk16x16 = 1;
+        picParams.meExternalHints = m_motionHints.GetHints();
+    }
+    m_nHintedFrames++;
+}
+
+void CudaH264Array::UpdateRateControl()
+{
+    size_t nBytes;
+    int nBacklog;
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        nBytes = m_nPendingBytes;
+        m_nPendingBytes = 0;
+        nBacklog = (int)(m_nFramesSubmitted - m_nPacketsReceived);
+    }
+    double damage = pCapture->getDamage().GetDirtyFraction();
+    if (m_rateTrace.is_open())
+    {
+        m_rateTrace << damage << ' ' << nBytes << ' ' << m_rateController.GetCurrentBitrate() << '\n';
+    }
+    RateDecision decision;
+    if (!m_rateController.OnFrame(damage, nBytes, nBacklog, decision))
+    {
+        return;
+    }
+
+    NV_ENC_CONFIG config = { NV_ENC_CONFIG_VER };
+    NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    reconfigureParams.reInitEncodeParams.encodeConfig = &config;
+    pEnc->GetInitializeParams(&reconfigureParams.reInitEncodeParams);
+    config.rcParams.averageBitRate = decision.averageBitRate;
+    config.rcParams.maxBitRate = decision.maxBitRate;
+    config.rcParams.vbvBufferSize = decision.vbvBufferSize;
+    config.rcParams.vbvInitialDelay = decision.vbvInitialDelay;
+    /// Rate changes apply from the next frame, no IDR needed
+    reconfigureParams.resetEncoder = 0;
+    reconfigureParams.forceIDR = 0;
+    pEnc->Reconfigure(&reconfigureParams);
+    g_rateReconfigs.Add();
+    g_targetBitrate.Set(decision.averageBitRate);
+    BINLOG(BinaryLogLevel::Info, "Rate control: damage %.3f, measured %.0f kbps, backlog %d -> average %u kbps, vbv %u bits",
+        m_rateController.GetSmoothedDamage(), m_rateController.GetMeasuredBitrate() / 1000, nBacklog, decision.averageBitRate / 1000,
+        decision.vbvBufferSize);
+}
+
 void CudaH264Array::Cleanup(bool bDelete)
 {
-    if (pDDAWrapper)
+    if (pCapture)
     {
-        pDDAWrapper->Cleanup();
-        delete pDDAWrapper;
-        pDDAWrapper = nullptr;
+        pCapture->Cleanup();
+        delete pCapture;
+        pCapture = nullptr;
+        m_pDisplays = nullptr;
     }
     SAFE_RELEASE(pDupTex2D);
     if (bDelete)
     {
+        /// Flushes and destroys the rendition encoders
+        m_simulcast.reset();
+        /// Flushes and destroys the stripe encoders
+        m_partitioned.reset();
         if (pEnc)
         {
             pEnc->EndEncode(vPacket);
             WriteEncOutput();
-            m_pEncBuf->Release();
             pEnc->DestroyEncoder();
+            delete pEnc;
+            pEnc = nullptr;
             ZeroMemory(&initializeParams, sizeof(NV_ENC_INITIALIZE_PARAMS));
             ZeroMemory(&encodeConfig, sizeof(NV_ENC_CONFIG));
         }
-        SAFE_RELEASE(m_pEncBuf);
+    }
+
+    /// Releases the frame pool and the converter
+    ReleaseConversion();
+
+    if (m_stream)
+    {
+        cuStreamDestroy(m_stream);
+        m_stream = 0;
+    }
+
+    if (bDelete)
+    {
         SAFE_RELEASE(pCtx);
+        if (cuContext)
+        {
+            cuCtxDestroy(cuContext);
+            cuContext = nullptr;
+        }
     }
+}
 
-	if (m_textureConverter) {
-		m_textureConverter->cleanup();
-        m_textureConverter.reset();
-	}
+HRESULT CudaH264Array::InitFramePool(UINT width, UINT height, DXGI_FORMAT captureFormat)
+{
+    m_framePool = std::make_unique<FramePool>(pD3DDev, cuContext);
+    /// The fused kernel reads the pointer-free captured frame as it is, it cannot feed the NV12 consumers
+    m_bFusedActive = m_bFusedConversion && captureFormat == DXGI_FORMAT_B8G8R8A8_UNORM && m_pixelFormat == NV_ENC_BUFFER_FORMAT_NV12 &&
+        !m_bCompositeCursor && !m_bQpMap && m_vRenditions.empty() && !m_partitioned;
+    /// Otherwise the converter scales the captured frame to the surfaces
+    DWORD encodeW, encodeH;
+    GetEncodeSize(width, height, encodeW, encodeH);
+    HRESULT hr = m_bFusedActive ? m_framePool->Init(FRAME_POOL_SIZE, width, height, captureFormat) :
+        m_framePool->Init(FRAME_POOL_SIZE, encodeW, encodeH, m_pixelFormat == NV_ENC_BUFFER_FORMAT_NV12 ? DXGI_FORMAT_NV12 : captureFormat);
+    if (FAILED(hr))
+    {
+        m_framePool.reset();
+        return hr;
+    }
+    ZeroMemory(&m_captureDesc, sizeof(m_captureDesc));
+    m_captureDesc.Width = width;
+    m_captureDesc.Height = height;
+    m_captureDesc.Format = captureFormat;
+    return hr;
+}
 
-    auto cudaStatus = cuGraphicsUnregisterResource(m_cuResource);
-    if (cudaStatus != CUDA_SUCCESS)
+void CudaH264Array::ReleaseConversion()
+{
+    /// The surfaces are unregistered and released with the last handle
+    m_frame.Release();
+    m_lastFrame.Release();
+    m_framePool.reset();
+    /// The converter caches output views by texture pointer, they must not outlive the surfaces.
+    /// Its destructor releases everything
+    m_textureConverter.reset();
+    ZeroMemory(&m_captureDesc, sizeof(m_captureDesc));
+}
+
+HRESULT CudaH264Array::ResizeEncoder(DWORD w, DWORD h)
+{
+    HRESULT hr = S_OK;
+    if (m_partitioned)
+    {
+        /// New sessions with the cuts of the new size, or the new places of the displays, starting with an IDR
+        hr = m_pDisplays && m_outputMode == OutputMode::Separate ? InitDisplayEncoders() : m_partitioned->Init(m_partition, encodeCLIOptions, w, h);
+        returnIfError(hr);
+        m_nLastIdr = m_nFrameNumber;
+        return hr;
+    }
+    NV_ENC_CONFIG config = { NV_ENC_CONFIG_VER };
+    NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+    NV_ENC_INITIALIZE_PARAMS &params = reconfigureParams.reInitEncodeParams;
+    params.encodeConfig = &config;
+    pEnc->GetInitializeParams(&params);
+
+    bool bReconfigured = false;
+    if (w <= params.maxEncodeWidth && h <= params.maxEncodeHeight)
     {
-        std::cerr << "Failed to unregister D3D11 resource from CUDA. Error code: " << cudaStatus << std::endl;
+        /// Same session, new sequence
+        params.encodeWidth = params.darWidth = w;
+        params.encodeHeight = params.darHeight = h;
+        reconfigureParams.resetEncoder = 1;
+        reconfigureParams.forceIDR = 1;
+        try
+        {
+            pEnc->EndEncode(vPacket);
+            WriteEncOutput();
+            bReconfigured = pEnc->Reconfigure(&reconfigureParams);
+        }
+        catch (std::exception &error)
+        {
+            std::cerr << error.what() << std::endl;
+        }
     }
 
-    cudaStreamDestroy(m_stream);
+    if (!bReconfigured)
+    {
+        /// Larger than the session was created for: new session on the same CUDA context and output file
+        try
+        {
+            pEnc->EndEncode(vPacket);
+            WriteEncOutput();
+            pEnc->DestroyEncoder();
+        }
+        catch (std::exception &error)
+        {
+            std::cerr << error.what() << std::endl;
+        }
+        delete pEnc;
+        pEnc = nullptr;
+        hr = CreateEncoder(w, h);
+        returnIfError(hr);
+    }
+    m_nFramesSubmitted = m_nPacketsReceived = 0;
+    m_nLastIdr = m_nFrameNumber;
+
+    if (m_simulcast)
+    {
+        m_simulcast = std::make_unique<Simulcast>(pD3DDev, pCtx, cuContext);
+        if (FAILED(m_simulcast->Init(m_vRenditions, encodeCLIOptions, w, h)))
+        {
+            /// Renditions larger than the new mode are rejected; keep recording the main stream
+            printf("%s: Simulcast disabled for %ux%u\n", __FUNCTION__, w, h);
+            m_simulcast.reset();
+        }
+    }
+    return hr;
+}
+
+double CudaH264Array::GetTimeSinceLoss() const
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return (now.QuadPart - m_lossStart.QuadPart) * 1000.0 / freq.QuadPart;
+}
+
+HRESULT CudaH264Array::Recover(HRESULT hrCapture)
+{
+    if (!m_bRecovering)
+    {
+        m_bRecovering = true;
+        m_lastRecoveryLevel = RecoveryLevel::Capture;
+        QueryPerformanceCounter(&m_lossStart);
+    }
+
+    HRESULT hr = S_OK;
+    if (hrCapture == DXGI_ERROR_DEVICE_REMOVED || hrCapture == DXGI_ERROR_DEVICE_RESET || !pCapture)
+    {
+        /// Nothing on the old device can be reused
+        m_lastRecoveryLevel = RecoveryLevel::Restart;
+        Cleanup(true);
+        return Init();
+    }
+
+    DWORD oldW = pCapture->getWidth();
+    DWORD oldH = pCapture->getHeight();
+    SAFE_RELEASE(pDupTex2D);
+    hr = pCapture->Reacquire();
+    if (FAILED(hr))
+    {
+        /// E.g. E_ACCESSDENIED while the secure desktop is up. The caller retries
+        return hr;
+    }
+
+    DWORD w = pCapture->getWidth();
+    DWORD h = pCapture->getHeight();
+    if (w != oldW || h != oldH)
+    {
+        printf("%s: Mode change %ux%u -> %ux%u\n", __FUNCTION__, oldW, oldH, w, h);
+        m_lastRecoveryLevel = RecoveryLevel::Encoder;
+        ReleaseConversion();
+        DWORD encodeW, encodeH;
+        GetEncodeSize(w, h, encodeW, encodeH);
+        hr = ResizeEncoder(encodeW, encodeH);
+        if (FAILED(hr))
+        {
+            m_lastRecoveryLevel = RecoveryLevel::Restart;
+            Cleanup(true);
+            hr = Init();
+        }
+    }
+    return hr;
 }
 
+
 HRESULT CudaH264Array::Capture(int wait)
 {
-    HRESULT hr = pDDAWrapper->GetCapturedFrame(&pDupTex2D, wait);
+    /// Drop the reference to the previous frame, it would keep an old capture session alive
+    SAFE_RELEASE(pDupTex2D);
+    TraceSpan acquireSpan("acquire", m_nFrameNumber);
+    HRESULT hr = pCapture->GetCapturedFrame(&pDupTex2D, wait);
+    acquireSpan.End();
     if (FAILED(hr))
         failCount++;
+    if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+    {
+        g_captureTimeouts.Add();
+    }
 
-	if (!m_pEncBuf && pDupTex2D) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    m_captureTiming = FrameTiming();
+    if (pDupTex2D)
+    {
+        m_captureTiming.present = pCapture->getPresentTime();
+        m_captureTiming.acquired = now.QuadPart;
+        g_framesCaptured.Add();
+    }
 
-		D3D11_TEXTURE2D_DESC targetDesc;
-		ZeroMemory(&targetDesc, sizeof(targetDesc));
-		pDupTex2D->GetDesc(&targetDesc);
-		targetDesc.MiscFlags = 0;
-        
-		if (m_pixelFormat == NV_ENC_BUFFER_FORMAT_NV12) {
-			targetDesc.Format = DXGI_FORMAT_NV12;
-		}
+    if (pDupTex2D && m_bBackpressure)
+    {
+        FrameAction action = FrameAction::Encode;
+        if (FAILED(hr = ApplyBackpressure(action)))
+        {
+            return hr;
+        }
+        if (action == FrameAction::Drop)
+        {
+            g_framesDroppedBackpressure.Add();
+            SAFE_RELEASE(pDupTex2D);
+            return DXGI_ERROR_WAIT_TIMEOUT;
+        }
+        if (action == FrameAction::Repeat && m_lastFrame)
+        {
+            /// The previous surface again, unconverted; it has no motion of its own
+            g_framesRepeated.Add();
+            m_frame.Release();
+            m_frame = m_lastFrame;
+            m_frame.GetMetadata()->vMoveRects.clear();
+            QueryPerformanceCounter(&now);
+            m_captureTiming.converted = now.QuadPart;
+            return hr;
+        }
+    }
 
-		hr = pD3DDev->CreateTexture2D(&targetDesc, nullptr, &m_pEncBuf);
-	}
+    if (m_framePool && pDupTex2D)
+    {
+        /// A format switch (e.g. HDR toggled) invalidates the conversion resources but not the encoder
+        D3D11_TEXTURE2D_DESC desc;
+        pDupTex2D->GetDesc(&desc);
+        if (desc.Format != m_captureDesc.Format || desc.Width != m_captureDesc.Width || desc.Height != m_captureDesc.Height)
+        {
+            ReleaseConversion();
+            if (m_bRecovering && (int)m_lastRecoveryLevel < (int)RecoveryLevel::Conversion)
+            {
+                m_lastRecoveryLevel = RecoveryLevel::Conversion;
+            }
+        }
+    }
+
+    if (!m_framePool && pDupTex2D)
+    {
+        D3D11_TEXTURE2D_DESC desc;
+        pDupTex2D->GetDesc(&desc);
+        if (FAILED(hr = InitFramePool(desc.Width, desc.Height, desc.Format)))
+        {
+            return hr;
+        }
+    }
+
+    if (pDupTex2D)
+    {
+        /// A frame that was never encoded goes back first
+        m_frame.Release();
+        /// A surface frees up as soon as the frame it held was encoded. The pool only runs dry if a
+        /// stage holds on to frames; the dropped frame's image is in the next one, only its damage is lost
+        m_frame = m_framePool->Acquire(wait);
+        if (!m_frame)
+        {
+            printf("%s: No free frame surface, frame dropped\n", __FUNCTION__);
+            g_framesDroppedNoSurface.Add();
+            SAFE_RELEASE(pDupTex2D);
+            return DXGI_ERROR_WAIT_TIMEOUT;
+        }
+        if (m_bMotionHintsActive)
+        {
+            /// The move rects travel with the frame, the source reports the next frame's while this one is encoded
+            const std::vector<DXGI_OUTDUPL_MOVE_RECT> &vMoves = pCapture->getMoveRects();
+            m_frame.GetMetadata()->vMoveRects.assign(vMoves.begin(), vMoves.end());
+        }
+    }
+
+    if (!m_textureConverter && pDupTex2D && !m_bFusedActive)
+    {
+        m_textureConverter = std::make_unique<D3D11TextureConverter>(pD3DDev, pCtx);
+        m_textureConverter->init();
+    }
 
-    if (pDupTex2D && m_textureConverter)
+    if (pDupTex2D && m_bFusedActive)
+    {
+        /// Converted and scaled by Encode()
+        TraceSpan convertSpan("convert", m_nFrameNumber);
+        pCtx->CopyResource(m_frame.GetTexture(), pDupTex2D);
+        convertSpan.End();
+        QueryPerformanceCounter(&now);
+        m_captureTiming.converted = now.QuadPart;
+    }
+    else if (pDupTex2D && m_textureConverter)
 	{
-        m_textureConverter->convert(pDupTex2D, m_pEncBuf);
+        TraceSpan convertSpan("convert", m_nFrameNumber);
+        m_textureConverter->convert(pDupTex2D, m_frame.GetTexture());
+        convertSpan.End();
+        QueryPerformanceCounter(&now);
+        m_captureTiming.converted = now.QuadPart;
 	}
 
 	return hr;
 }
 
-/// Write encoded video output to file
+HRESULT CudaH264Array::ApplyBackpressure(FrameAction &action)
+{
+    int nBacklog;
+    double latencyMs = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_outputMutex);
+        nBacklog = (int)(m_nFramesSubmitted - m_nPacketsReceived);
+        if (m_lastPacketAge > 0)
+        {
+            LARGE_INTEGER freq;
+            QueryPerformanceFrequency(&freq);
+            latencyMs = m_lastPacketAge * 1000.0 / freq.QuadPart;
+        }
+    }
+    if (m_sinkBacklog && !BackpressureController::IsQueueBounded(m_backpressure.GetConfig().strategy))
+    {
+        nBacklog += (int)m_sinkBacklog();
+    }
+    action = m_backpressure.OnFrame(nBacklog, latencyMs);
+    if (!m_backpressure.IsScaleChanged())
+    {
+        return S_OK;
+    }
+
+    /// New surfaces at the new size on the next frame, the encoder starts a new sequence
+    m_nScaleDivisor = m_backpressure.GetScaleDivisor();
+    ReleaseConversion();
+    DWORD encodeW, encodeH;
+    GetEncodeSize(pCapture->getWidth(), pCapture->getHeight(), encodeW, encodeH);
+    return ResizeEncoder(encodeW, encodeH);
+}
+
+void CudaH264Array::GetEncodeSize(DWORD w, DWORD h, DWORD &encodeW, DWORD &encodeH) const
+{
+    /// 4:2:0 needs even sizes
+    encodeW = m_nScaleDivisor > 1 ? w / m_nScaleDivisor & ~1u : w;
+    encodeH = m_nScaleDivisor > 1 ? h / m_nScaleDivisor & ~1u : h;
+}
+
+/// Write encoded video output to file. Empty in async output mode, the packets were written already
 void CudaH264Array::WriteEncOutput()
 {
-    for (std::vector<uint8_t> &packet : vPacket)
+    const std::vector<uint64_t> &vTimeStamps = pEnc->GetOutputTimeStamps();
+    const std::vector<NV_ENC_PIC_TYPE> &vPictureTypes = pEnc->GetOutputPictureTypes();
+    for (size_t i = 0; i < vPacket.size(); i++)
     {
-        fpOut.write(reinterpret_cast<char *>(packet.data()), packet.size());
-        fpOut.flush();
+        WritePacket(vPacket[i], i < vTimeStamps.size() ? vTimeStamps[i] : 0, i < vPictureTypes.size() ? vPictureTypes[i] : NV_ENC_PIC_TYPE_UNKNOWN);
+    }
+}
+
+void CudaH264Array::WritePacket(const std::vector<uint8_t> &packet, uint64_t timeStamp, NV_ENC_PIC_TYPE pictureType)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    FrameTiming timing;
+    if (!m_latency.Find(timeStamp, timing))
+    {
+        /// E.g. frames encoded through Encode(), which are not tracked
+        timing = FrameTiming();
+        timing.frameNumber = timeStamp;
+    }
+    timing.ready = now.QuadPart;
+
+    std::lock_guard<std::mutex> lock(m_outputMutex);
+    timing.bRecoveryPoint = pictureType == NV_ENC_PIC_TYPE_IDR || timeStamp == m_nRefreshRecoveryFrame;
+    TraceSpan writeSpan("write", timeStamp);
+    fpOut.write(reinterpret_cast<const char *>(packet.data()), packet.size());
+    m_crcIndex.Add(packet.data(), packet.size());
+    fpOut.flush();
+    writeSpan.End();
+    QueryPerformanceCounter(&now);
+    timing.written = now.QuadPart;
+    m_latency.Complete(timing);
+    if (timing.present)
+    {
+        m_lastPacketAge = timing.written - timing.present;
+    }
+    if (m_packetSink)
+    {
+        TraceSpan muxSpan("mux", timeStamp);
+        m_packetSink(packet, timing);
+    }
+    m_nPacketsReceived++;
+    m_nPendingBytes += packet.size();
+    g_packetsWritten.Add();
+    g_bytesWritten.Add(packet.size());
+    g_encoderBacklog.Set((int64_t)(m_nFramesSubmitted - m_nPacketsReceived));
+    if (!packet.empty())
+    {
+        m_packetStats.Add(packet.size());
     }
 }
 
@@ -382,14 +1342,11 @@ HRESULT CudaH264Array::Preproc()
     size_t size;
 
 #if 1
-    static bool isFirst = true;
-
     CUarray cuArray;
 
     CUresult cudaStatus = CUDA_SUCCESS;
 
-	if (isFirst) {
-		isFirst = false;
+	if (!m_stream) {
 		// Create CUDA stream
 		cudaStatus = cuStreamCreate(&m_stream, CU_STREAM_DEFAULT);
 		if (cudaStatus != CUDA_SUCCESS)
@@ -397,51 +1354,233 @@ HRESULT CudaH264Array::Preproc()
 			std::cerr << "Failed to create CUDA stream. Error code: " << cudaStatus << std::endl;
 			return E_FAIL;
 		}
-
-        
-        D3D11_TEXTURE2D_DESC desc;
-        m_pEncBuf->GetDesc(&desc);
-		cudaStatus = cuGraphicsD3D11RegisterResource(&m_cuResource, m_pEncBuf, CU_GRAPHICS_REGISTER_FLAGS_NONE);
-		if (cudaStatus != CUDA_SUCCESS)
-		{
-			std::cerr << "Failed to register D3D11 resource with CUDA. : cudaError : " << cudaStatus << std::endl;
-			return E_FAIL;
-		}
 	}
 
+    /// This stage's reference to the frame; the surface was registered with CUDA when the pool was created
+    FrameHandle frame = m_frame;
+    m_frame.Release();
+    if (!frame)
+    {
+        return E_UNEXPECTED;
+    }
+    CUgraphicsResource cuResource = frame.GetCudaResource();
+
     // Map the resource for access by CUDA
-    cudaStatus = cuGraphicsMapResources(1, &m_cuResource, m_stream);
+    cudaStatus = cuGraphicsMapResources(1, &cuResource, m_stream);
     if (cudaStatus != CUDA_SUCCESS)
     {
         std::cerr << "Failed to map D3D11 resource to CUDA. Error code: " << cudaStatus << std::endl;
-        cuGraphicsUnregisterResource(m_cuResource); // Cleanup before exit
         return E_FAIL;
     }
     CUresult result = CUDA_SUCCESS;
     // Get the CUDA array from the D3D11 resource
     unsigned int subResourceIndex = 0; // Typically 0 for the first subresource
-    result = cuGraphicsSubResourceGetMappedArray(&cuArray, m_cuResource, subResourceIndex, 0);
+    result = cuGraphicsSubResourceGetMappedArray(&cuArray, cuResource, subResourceIndex, 0);
     if (result != CUDA_SUCCESS)
     {
         // Handle error
         std::cerr << "Failed to get CUDA array from D3D11 resource. : cudaError : " << result << std::endl;
+        hr = E_FAIL;
     }
 
     /*CUdeviceptr pDevPtr;
     size_t pSize;
-    result = cuGraphicsResourceGetMappedPointer(&pDevPtr, &pSize, m_cuResource);*/
+    result = cuGraphicsResourceGetMappedPointer(&pDevPtr, &pSize, cuResource);*/
 
-    Encode(cuArray);
-    cudaStatus = cuGraphicsUnmapResources(1, &m_cuResource, m_stream);
+    /// Composite before the copy so the simulcast renditions get the pointer as well. A repeated
+    /// frame has it already, where it was
+    bool bRepeated = m_lastFrame && frame.GetTexture() == m_lastFrame.GetTexture();
+    if (SUCCEEDED(hr) && m_bCompositeCursor && !bRepeated && FAILED(hr = CompositeCursor(cuArray)))
+    {
+        PRINTERR(hr, "CompositeCursor");
+    }
+    if (SUCCEEDED(hr) && FAILED(hr = Encode(cuArray, frame.GetMetadata())))
+    {
+        PRINTERR(hr, "Encode");
+    }
+    if (SUCCEEDED(hr) && m_bBackpressure && m_backpressure.GetConfig().strategy == BackpressureStrategy::Repeat)
+    {
+        m_lastFrame = frame;
+    }
+    /// Unmapped on the error paths as well, the pool maps the surface again for the next frame
+    cudaStatus = cuGraphicsUnmapResources(1, &cuResource, m_stream);
     if (cudaStatus != CUDA_SUCCESS)
     {
         std::cerr << "Failed to unmap D3D11 resource from CUDA. Error code: " << cudaStatus << std::endl;
         return E_FAIL;
     }
+    returnIfError(hr);
+
+    /// Fan the converted frame out to the scaled renditions
+    if (m_simulcast)
+    {
+        hr = m_simulcast->Process(frame.GetTexture(), m_stream);
+    }
     
     returnIfError(hr);
+
+    /// First frame out after a capture loss: that is the time to first frame
+    if (m_bRecovering)
+    {
+        m_bRecovering = false;
+        m_lastRecoveryMs = GetTimeSinceLoss();
+        m_maxRecoveryMs = std::max(m_maxRecoveryMs, m_lastRecoveryMs);
+        m_nRecoveries++;
+        g_recoveryTime.Observe((int64_t)(m_lastRecoveryMs * 1000));
+        printf("%s: Time to first frame after capture loss %.1f ms (level %d, worst %.1f ms, %u recoveries)\n", __FUNCTION__,
+            m_lastRecoveryMs, (int)m_lastRecoveryLevel, m_maxRecoveryMs, m_nRecoveries);
+    }
 #else
     Encode();
 #endif
     return hr;
-}
\ No newline at end of file
+}
+
+HRESULT CudaH264Array::UpdateQpMap(CUarray cuArray, NV_ENC_PIC_PARAMS &picParams)
+{
+    const DamageMap &damage = pCapture->getDamage();
+    int w = damage.GetWidth();
+    int h = damage.GetHeight();
+    if (m_emphasis.GetWidth() != w || m_emphasis.GetHeight() != h)
+    {
+        /// The capture size changed, the encoder was reconfigured to it
+        m_emphasis.Init(w, h, m_nQpBlockSize);
+    }
+    if (!m_luma.Allocate((size_t)w * h))
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    /// One copy per tile row, spanning its dirty tiles
+    const int tile = DamageMap::TILE_SIZE;
+    for (int ty = 0; ty < damage.GetTilesY(); ty++)
+    {
+        int tx0 = 0;
+        int tx1 = damage.GetTilesX() - 1;
+        while (tx0 <= tx1 && !damage.IsDirty(tx0, ty))
+        {
+            tx0++;
+        }
+        while (tx1 >= tx0 && !damage.IsDirty(tx1, ty))
+        {
+            tx1--;
+        }
+        if (tx0 > tx1)
+        {
+            continue;
+        }
+        int x0 = tx0 * tile;
+        int y0 = ty * tile;
+        CUDA_MEMCPY2D copyParam;
+        memset(&copyParam, 0, sizeof(copyParam));
+        copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+        copyParam.srcArray = cuArray;
+        copyParam.srcXInBytes = x0;
+        copyParam.srcY = y0;
+        copyParam.dstMemoryType = CU_MEMORYTYPE_HOST;
+        copyParam.dstHost = m_luma.GetData() + (size_t)y0 * w + x0;
+        copyParam.dstPitch = w;
+        copyParam.WidthInBytes = std::min((tx1 + 1) * tile, w) - x0;
+        copyParam.Height = std::min(tile, h - y0);
+        CUresult cudaStatus = cuMemcpy2D(&copyParam);
+        if (cudaStatus != CUDA_SUCCESS)
+        {
+            std::cerr << "Failed to read back luma for the QP map. : cudaError : " << cudaStatus << std::endl;
+            return E_FAIL;
+        }
+    }
+
+    m_emphasis.Update(m_luma.GetData(), w, damage);
+    picParams.qpDeltaMap = const_cast<int8_t *>(m_emphasis.GetMap());
+    picParams.qpDeltaMapSize = m_emphasis.GetMapSize();
+    return S_OK;
+}
+
+HRESULT CudaH264Array::CompositeCursor(CUarray cuArray)
+{
+    CursorCompositor *pCursor = &pCapture->getCursor();
+    DWORD encodeW, encodeH;
+    GetEncodeSize(pCapture->getWidth(), pCapture->getHeight(), encodeW, encodeH);
+    if (m_nScaleDivisor > 1)
+    {
+        m_scaledCursor.Follow(*pCursor, 0, 0, m_nScaleDivisor);
+        pCursor = &m_scaledCursor;
+    }
+    CursorCompositor &cursor = *pCursor;
+    int w = (int)encodeW;
+    int h = (int)encodeH;
+    int rc[4];
+    if (!cursor.GetRect(w, h, rc))
+    {
+        cursor.EndFrame(w, h);
+        return S_OK;
+    }
+
+    /// Round the pointer rect out to whole damage tiles
+    const int tile = DamageMap::TILE_SIZE;
+    int x0 = rc[0] / tile * tile;
+    int y0 = rc[1] / tile * tile;
+    int x1 = std::min((rc[2] + tile - 1) / tile * tile, w);
+    int y1 = std::min((rc[3] + tile - 1) / tile * tile, h);
+    int regionW = x1 - x0;
+    int regionH = y1 - y0;
+    m_vCursorRegion.resize((size_t)regionW * regionH * 3 / 2);
+    uint8_t *pY = m_vCursorRegion.data();
+    uint8_t *pUV = pY + (size_t)regionW * regionH;
+
+    /// Luma rows start at 0 and chroma rows at h in the NV12 array, as in Encode()
+    CUDA_MEMCPY2D copyParam[2];
+    memset(copyParam, 0, sizeof(copyParam));
+    for (int i = 0; i < 2; i++)
+    {
+        copyParam[i].srcMemoryType = CU_MEMORYTYPE_ARRAY;
+        copyParam[i].srcArray = cuArray;
+        copyParam[i].srcXInBytes = x0;
+        copyParam[i].dstMemoryType = CU_MEMORYTYPE_HOST;
+        copyParam[i].dstPitch = regionW;
+        copyParam[i].WidthInBytes = regionW;
+    }
+    copyParam[0].srcY = y0;
+    copyParam[0].dstHost = pY;
+    copyParam[0].Height = regionH;
+    copyParam[1].srcY = h + y0 / 2;
+    copyParam[1].dstHost = pUV;
+    copyParam[1].Height = regionH / 2;
+
+    for (CUDA_MEMCPY2D &param : copyParam)
+    {
+        CUresult cudaStatus = cuMemcpy2D(&param);
+        if (cudaStatus != CUDA_SUCCESS)
+        {
+            std::cerr << "Failed to read back pointer region. : cudaError : " << cudaStatus << std::endl;
+            return E_FAIL;
+        }
+    }
+
+    cursor.CompositeNv12(pY, regionW, pUV, regionW, x0, y0, regionW, regionH);
+
+    /// Same region, opposite direction
+    for (CUDA_MEMCPY2D &param : copyParam)
+    {
+        param.dstMemoryType = CU_MEMORYTYPE_ARRAY;
+        param.dstArray = cuArray;
+        param.dstXInBytes = param.srcXInBytes;
+        param.dstY = param.srcY;
+        param.srcMemoryType = CU_MEMORYTYPE_HOST;
+        param.srcHost = param.dstHost;
+        param.srcPitch = param.dstPitch;
+        param.srcArray = nullptr;
+        param.srcXInBytes = param.srcY = 0;
+        param.dstHost = nullptr;
+        param.dstPitch = 0;
+        CUresult cudaStatus = cuMemcpy2D(&param);
+        if (cudaStatus != CUDA_SUCCESS)
+        {
+            std::cerr << "Failed to upload pointer region. : cudaError : " << cudaStatus << std::endl;
+            return E_FAIL;
+        }
+    }
+
+    cursor.EndFrame(w, h);
+    return S_OK;
+}
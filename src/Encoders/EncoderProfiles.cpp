@@ -0,0 +1,211 @@
+#include "EncoderProfiles.hpp"
+#include "nvEncodeAPI.h"
+#include "NvEncoderCLIOptions.h"
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <algorithm>
+
+/// Built-in profiles. The capture input is always NV12 at desktop resolution
+static const EncoderProfile s_builtinProfiles[] = {
+    /// Interactive streaming: one frame in, one packet out. CBR with a single frame VBV keeps every
+    /// packet close to the average size, so a frame never queues behind a large I frame
+    { "lowlatency", "-codec h264 -preset p3 -tuninginfo ultralowlatency -rc cbr -bitrate 8M -vbvbufsize 133k -vbvinit 133k", "built-in" },
+    /// Recording to disk: latency does not matter. B frames, lookahead and a quality target
+    /// spend the bits where the content needs them; HEVC halves the file size of H.264
+    { "archival", "-codec hevc -preset p6 -tuninginfo hq -rc vbr -cq 24 -maxbitrate 40M -bf 3 -gop 600 -lookahead 16 -multipass qres", "built-in" },
+    /// Text and UI: mostly static frames with sharp edges. A quality target with a QP ceiling keeps
+    /// glyphs readable while idle frames cost almost nothing; low latency without B frames
+    { "screentext", "-codec h264 -preset p5 -tuninginfo lowlatency -rc vbr -cq 20 -bitrate 6M -maxbitrate 20M -qmax 30", "built-in" },
+};
+
+/// Value lists of the options NvEncoderInitParam only logs, instead of rejecting, when they are wrong
+static const char *s_codecNames[] = { "h264", "hevc", "av1" };
+static const char *s_presetNames[] = { "p1", "p2", "p3", "p4", "p5", "p6", "p7" };
+static const char *s_tuningNames[] = { "hq", "lowlatency", "ultralowlatency", "lossless" };
+
+template<size_t N>
+static bool IsOneOf(const std::string &value, const char *(&names)[N])
+{
+    return std::find(names, names + N, value) != names + N;
+}
+
+EncoderProfiles::EncoderProfiles()
+{
+    for (const EncoderProfile &profile : s_builtinProfiles)
+    {
+        m_vProfiles.push_back(profile);
+    }
+}
+
+bool EncoderProfiles::Validate(const std::string &options, std::string &error)
+{
+    std::string lower = options;
+    std::transform(lower.begin(), lower.end(), lower.begin(), tolower);
+    std::istringstream ss(lower);
+    std::vector<std::string> tokens{ std::istream_iterator<std::string>(ss), std::istream_iterator<std::string>() };
+
+    std::string tuning;
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        bool bHasValue = i + 1 < tokens.size();
+        if ((tokens[i] == "-codec" && !(bHasValue && IsOneOf(tokens[i + 1], s_codecNames))) ||
+            (tokens[i] == "-preset" && !(bHasValue && IsOneOf(tokens[i + 1], s_presetNames))) ||
+            (tokens[i] == "-tuninginfo" && !(bHasValue && IsOneOf(tokens[i + 1], s_tuningNames))))
+        {
+            error = "Invalid value for " + tokens[i] + (bHasValue ? ": " + tokens[i + 1] : "");
+            return false;
+        }
+        if (tokens[i] == "-tuninginfo")
+        {
+            tuning = tokens[i + 1];
+        }
+    }
+
+    /// Let the encoder's own parser run over scratch parameters, it throws on anything it does not accept
+    NvEncoderInitParam param(options.c_str());
+    NV_ENC_INITIALIZE_PARAMS params = { NV_ENC_INITIALIZE_PARAMS_VER };
+    NV_ENC_CONFIG config = { NV_ENC_CONFIG_VER };
+    params.encodeConfig = &config;
+    params.encodeGUID = param.GetEncodeGUID();
+    params.presetGUID = param.GetPresetGUID();
+    params.tuningInfo = param.GetTuningInfo();
+    params.frameRateNum = 60;
+    params.frameRateDen = 1;
+    config.frameIntervalP = 1;
+    /// 4:2:0, as the preset would set it
+    if (param.IsCodecH264())
+    {
+        config.encodeCodecConfig.h264Config.chromaFormatIDC = 1;
+    }
+    else if (param.IsCodecHEVC())
+    {
+        config.encodeCodecConfig.hevcConfig.chromaFormatIDC = 1;
+    }
+    else
+    {
+        config.encodeCodecConfig.av1Config.chromaFormatIDC = 1;
+    }
+    try
+    {
+        param.SetInitParams(&params, NV_ENC_BUFFER_FORMAT_NV12);
+    }
+    catch (std::exception &e)
+    {
+        error = e.what();
+        return false;
+    }
+
+    if (std::find(tokens.begin(), tokens.end(), "-444") != tokens.end())
+    {
+        error = "-444 has no effect: the captured frames are converted to NV12 (4:2:0) before encoding";
+        return false;
+    }
+    bool bLowLatency = tuning.empty() || tuning == "lowlatency" || tuning == "ultralowlatency";
+    if (bLowLatency && config.frameIntervalP > 1)
+    {
+        error = "-bf needs frame reordering, use -tuninginfo hq (the default tuning is ultralowlatency)";
+        return false;
+    }
+    if (bLowLatency && config.rcParams.enableLookahead)
+    {
+        error = "-lookahead delays every frame, use -tuninginfo hq (the default tuning is ultralowlatency)";
+        return false;
+    }
+    return true;
+}
+
+bool EncoderProfiles::Add(const EncoderProfile &profile, std::string &error)
+{
+    if (profile.name.empty() || profile.name.find_first_of(" \t") != std::string::npos)
+    {
+        error = "Invalid profile name '" + profile.name + "'";
+        return false;
+    }
+    if (!Validate(profile.options, error))
+    {
+        return false;
+    }
+    for (EncoderProfile &existing : m_vProfiles)
+    {
+        if (existing.name == profile.name)
+        {
+            existing = profile;
+            return true;
+        }
+    }
+    m_vProfiles.push_back(profile);
+    return true;
+}
+
+bool EncoderProfiles::LoadFile(const std::string &path)
+{
+    std::ifstream fp(path);
+    if (!fp)
+    {
+        printf("%s: Unable to open %s\n", __FUNCTION__, path.c_str());
+        return false;
+    }
+
+    bool bOk = true;
+    std::string line;
+    for (int nLine = 1; std::getline(fp, line); nLine++)
+    {
+        line = line.substr(0, line.find('#'));
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+        {
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (eq == std::string::npos)
+        {
+            printf("%s:%d: Expected 'name = options'\n", path.c_str(), nLine);
+            bOk = false;
+            continue;
+        }
+
+        auto trim = [](const std::string &s) {
+            size_t first = s.find_first_not_of(" \t\r");
+            return first == std::string::npos ? std::string() : s.substr(first, s.find_last_not_of(" \t\r") - first + 1);
+        };
+        EncoderProfile profile;
+        profile.name = trim(line.substr(0, eq));
+        profile.options = trim(line.substr(eq + 1));
+        profile.origin = path + ":" + std::to_string(nLine);
+        std::string error;
+        if (!Add(profile, error))
+        {
+            printf("%s: Profile '%s': %s\n", profile.origin.c_str(), profile.name.c_str(), error.c_str());
+            bOk = false;
+        }
+    }
+    return bOk;
+}
+
+const EncoderProfile *EncoderProfiles::Find(const std::string &name) const
+{
+    for (const EncoderProfile &profile : m_vProfiles)
+    {
+        if (profile.name == name)
+        {
+            return &profile;
+        }
+    }
+    return nullptr;
+}
+
+std::string EncoderProfiles::GetHelpMessage()
+{
+    std::ostringstream oss;
+    oss << "Encoder options, passed through to NVENC (default: -codec h264 -preset p3 -tuninginfo ultralowlatency):" << std::endl
+        << NvEncoderInitParam().GetHelpMessage(false, false, true) << std::endl
+        << "-encprofile   Name of a profile whose options are applied first, options given on the command line override them" << std::endl
+        << "-encprofiles  File of 'name = options' lines adding to or replacing the built-in profiles" << std::endl
+        << "Built-in profiles:" << std::endl;
+    for (const EncoderProfile &profile : s_builtinProfiles)
+    {
+        oss << "  " << profile.name << " = " << profile.options << std::endl;
+    }
+    return oss.str();
+}
@@ -0,0 +1,172 @@
+#include "FramePool.hpp"
+#include "cudad3d11.h"
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+/// Constructor
+FramePool::FramePool(ID3D11Device *pDev, CUcontext cuContext)
+    : m_pDev(pDev)
+    , m_cuContext(cuContext)
+{
+    m_pDev->AddRef();
+}
+
+FramePoolShared::~FramePoolShared()
+{
+    cuCtxPushCurrent(cuContext);
+    for (FrameSurface &surface : vSurfaces)
+    {
+        if (surface.cuResource)
+        {
+            CUresult cuStatus = cuGraphicsUnregisterResource(surface.cuResource);
+            if (cuStatus != CUDA_SUCCESS)
+            {
+                std::cerr << "Failed to unregister frame surface from CUDA. Error code: " << cuStatus << std::endl;
+            }
+        }
+        SAFE_RELEASE(surface.pTex);
+    }
+    CUcontext ctx = nullptr;
+    cuCtxPopCurrent(&ctx);
+}
+
+void FramePoolShared::Release()
+{
+    if (nRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        delete this;
+    }
+}
+
+void FrameHandle::Release()
+{
+    FrameSurface *pSurface = m_pSurface;
+    m_pSurface = nullptr;
+    if (!pSurface || pSurface->nRefs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    {
+        return;
+    }
+    /// The frame retired: its metadata goes in one step, the surface returns to the pool
+    FramePoolShared *pPool = pSurface->pPool;
+    pSurface->metadata.reset();
+    pSurface->pArena->Reset();
+    {
+        std::lock_guard<std::mutex> guard(pPool->mutex);
+        pPool->vFree.push_back(pSurface->index);
+        pPool->released.notify_one();
+    }
+    /// The surface's reference to the pool state, the last one if the pool was cleaned up meanwhile
+    pPool->Release();
+}
+
+HRESULT FramePool::Init(UINT count, UINT width, UINT height, DXGI_FORMAT format)
+{
+    HRESULT hr = S_OK;
+    Cleanup();
+    std::unique_ptr<FramePoolShared> pShared = std::make_unique<FramePoolShared>();
+    pShared->cuContext = m_cuContext;
+    pShared->vSurfaces = std::vector<FrameSurface>(count);
+    /// Room for every index, so returning a surface never grows it
+    pShared->vFree.reserve(count);
+
+    D3D11_TEXTURE2D_DESC desc;
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = format;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    /// Output of the video processor
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+    for (UINT i = 0; i < count; i++)
+    {
+        FrameSurface &surface = pShared->vSurfaces[i];
+        surface.index = i;
+        surface.pPool = pShared.get();
+        surface.pArena = std::make_unique<FrameArena>(ARENA_BYTES);
+        if (FAILED(hr = m_pDev->CreateTexture2D(&desc, nullptr, &surface.pTex)))
+        {
+            PRINTERR(hr, "CreateTexture2D");
+            return hr;
+        }
+        CUresult cuStatus = cuGraphicsD3D11RegisterResource(&surface.cuResource, surface.pTex, CU_GRAPHICS_REGISTER_FLAGS_NONE);
+        if (cuStatus != CUDA_SUCCESS)
+        {
+            std::cerr << "Failed to register frame surface with CUDA. : cudaError : " << cuStatus << std::endl;
+            return E_FAIL;
+        }
+        pShared->vFree.push_back(i);
+    }
+
+    m_pShared = pShared.release();
+    m_nWidth = width;
+    m_nHeight = height;
+    m_format = format;
+    return hr;
+}
+
+FrameHandle FramePool::Acquire(int waitMs)
+{
+    if (!m_pShared)
+    {
+        return FrameHandle();
+    }
+    FramePoolShared *pShared = m_pShared;
+    std::unique_lock<std::mutex> lock(pShared->mutex);
+    if (pShared->vFree.empty())
+    {
+        m_nExhausted++;
+        if (!pShared->released.wait_for(lock, std::chrono::milliseconds(std::max(waitMs, 0)), [pShared] { return !pShared->vFree.empty(); }))
+        {
+            return FrameHandle();
+        }
+    }
+    UINT index = pShared->vFree.back();
+    pShared->vFree.pop_back();
+    lock.unlock();
+    /// The surface keeps the pool state alive while it is out, even past Cleanup()
+    pShared->AddRef();
+    FrameSurface *pSurface = &pShared->vSurfaces[index];
+    pSurface->metadata.emplace(pSurface->pArena.get());
+    pSurface->nRefs.store(1, std::memory_order_relaxed);
+    return FrameHandle(pSurface);
+}
+
+UINT FramePool::GetFreeCount()
+{
+    if (!m_pShared)
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(m_pShared->mutex);
+    return (UINT)m_pShared->vFree.size();
+}
+
+UINT64 FramePool::GetArenaHeapAllocations()
+{
+    if (!m_pShared)
+    {
+        return 0;
+    }
+    std::lock_guard<std::mutex> lock(m_pShared->mutex);
+    UINT64 nAllocations = 0;
+    for (const FrameSurface &surface : m_pShared->vSurfaces)
+    {
+        nAllocations += surface.pArena ? surface.pArena->GetHeapAllocations() : 0;
+    }
+    return nAllocations;
+}
+
+void FramePool::Cleanup()
+{
+    if (m_pShared)
+    {
+        m_pShared->Release();
+        m_pShared = nullptr;
+    }
+    m_nWidth = m_nHeight = 0;
+    m_format = DXGI_FORMAT_UNKNOWN;
+}
@@ -0,0 +1,67 @@
+#include "PacketStats.hpp"
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+void PacketStats::Add(size_t nBytes)
+{
+    m_sizes.Add((int64_t)nBytes);
+    m_sumSquares += (double)nBytes * nBytes;
+}
+
+void PacketStats::Reset()
+{
+    m_sizes.Reset();
+    m_sumSquares = 0;
+}
+
+double PacketStats::GetMean() const
+{
+    return m_sizes.GetMean();
+}
+
+double PacketStats::GetStdDev() const
+{
+    if (m_sizes.GetCount() < 2)
+    {
+        return 0;
+    }
+    double mean = GetMean();
+    return sqrt(std::max(m_sumSquares / m_sizes.GetCount() - mean * mean, 0.0));
+}
+
+double PacketStats::GetCoefficientOfVariation() const
+{
+    double mean = GetMean();
+    return mean > 0 ? GetStdDev() / mean : 0;
+}
+
+uint32_t PacketStats::GetPercentile(double percentile) const
+{
+    return (uint32_t)std::min(m_sizes.GetPercentile(percentile), m_sizes.GetMax());
+}
+
+uint32_t PacketStats::GetMax() const
+{
+    return (uint32_t)m_sizes.GetMax();
+}
+
+size_t PacketStats::GetCountAbove(double factor) const
+{
+    /// Whole buckets above the limit
+    double limit = GetMean() * factor;
+    uint64_t n = 0;
+    for (int bucket = LatencyHistogram::BUCKETS - 1; bucket >= 0 && LatencyHistogram::GetBucketStart(bucket) > limit; bucket--)
+    {
+        n += m_sizes.GetBucketCount(bucket);
+    }
+    return (size_t)n;
+}
+
+void PacketStats::Print(const char *szLabel) const
+{
+    double mean = GetMean();
+    printf("%s: %zu frames, mean %.0f B, stddev %.0f B (cv %.2f), p50 %u B, p99 %u B, max %u B (%.1fx mean), %zu frames > 2x mean\n",
+        szLabel, GetCount(), mean, GetStdDev(), GetCoefficientOfVariation(), GetPercentile(50), GetPercentile(99),
+        GetMax(), mean > 0 ? GetMax() / mean : 0.0, GetCountAbove(2));
+}
@@ -0,0 +1,72 @@
+#include "PartitionLayout.hpp"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <cstdio>
+
+bool PartitionLayout::ParseConfig(const char *szArg, PartitionConfig &cfg)
+{
+    unsigned count = 0;
+    char szRest[16] = { 0 };
+    int n = sscanf(szArg ? szArg : "", "%u%15s", &count, szRest);
+    std::string rest = n == 2 ? szRest : "";
+    cfg.orientation = PartitionOrientation::Horizontal;
+    if (!rest.empty() && (rest[0] == 'h' || rest[0] == 'v'))
+    {
+        cfg.orientation = rest[0] == 'v' ? PartitionOrientation::Vertical : PartitionOrientation::Horizontal;
+        rest.erase(0, 1);
+    }
+    cfg.output = PartitionOutput::Streams;
+    if (rest == ":split")
+    {
+        cfg.output = PartitionOutput::Split;
+        rest.clear();
+    }
+    if (n < 1 || count < 2 || count > 8 || !rest.empty())
+    {
+        std::cerr << "Invalid partitioning '" << (szArg ? szArg : "") << "', expected N[h|v][:split] with 2 <= N <= 8" << std::endl;
+        return false;
+    }
+    cfg.count = count;
+    return true;
+}
+
+void PartitionLayout::ComputeCuts(uint32_t length, uint32_t align, const std::vector<double> &vCost, uint32_t minSize, uint32_t maxSize,
+    std::vector<uint32_t> &vSize)
+{
+    const uint32_t n = (uint32_t)vSize.size();
+    std::vector<double> vPrefix(vCost.size() + 1, 0);
+    for (size_t b = 0; b < vCost.size(); b++)
+    {
+        vPrefix[b + 1] = vPrefix[b] + std::max(vCost[b], 0.0);
+    }
+    const double total = vPrefix.back();
+
+    uint32_t start = 0;
+    for (uint32_t i = 0; i + 1 < n; i++)
+    {
+        /// The boundary nearest an equal share of the length, so the rounding does not pile up in the last part.
+        /// With costs, the first band boundary at which the cost reaches an equal share, or the nearer of the two around it
+        uint32_t end = (uint32_t)(((uint64_t)length * (i + 1) / n + align / 2) / align * align);
+        if (total > 0)
+        {
+            double target = total * (i + 1) / n;
+            size_t b = std::lower_bound(vPrefix.begin(), vPrefix.end(), target) - vPrefix.begin();
+            if (b > 0 && target - vPrefix[b - 1] < vPrefix[std::min(b, vPrefix.size() - 1)] - target)
+            {
+                b--;
+            }
+            end = (uint32_t)std::min<size_t>(b * align, length);
+        }
+        /// Leave room for the remaining parts within their limits
+        uint32_t nRest = n - 1 - i;
+        uint32_t lo = std::max(start + minSize, length > nRest * maxSize ? length - nRest * maxSize : 0);
+        uint32_t hi = std::min(start + maxSize, length - nRest * minSize);
+        lo = (lo + align - 1) / align * align;
+        hi = hi / align * align;
+        end = std::max(std::min(end / align * align, hi), lo);
+        vSize[i] = end - start;
+        start = end;
+    }
+    vSize[n - 1] = length - start;
+}
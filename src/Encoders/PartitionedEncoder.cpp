@@ -0,0 +1,556 @@
+#include "PartitionedEncoder.hpp"
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <cstdio>
+
+/// Frames between bitrate share updates, half a second at 60 fps
+static const UINT RATE_INTERVAL = 30;
+/// Weight of the measured complexity against the previous share. Smooths out single busy frames
+static const double RATE_SMOOTHING = 0.5;
+/// Smallest share of a stripe relative to an equal share, so a static stripe can still absorb a sudden change
+static const double MIN_RATE_SHARE = 0.1;
+/// Shares closer than this to the current one are not worth a reconfiguration
+static const double RATE_HYSTERESIS = 0.05;
+/// The slowest stripe must be this much slower than the average for a new layout, which costs an IDR frame
+static const double BALANCE_THRESHOLD = 1.15;
+/// Frames in flight per stripe whose submission time is kept
+static const size_t SUBMIT_HISTORY = 64;
+
+/// Constructor
+PartitionedEncoder::PartitionedEncoder(CUcontext cuContext)
+    : m_cuContext(cuContext)
+{
+    QueryPerformanceFrequency(&m_qpcFreq);
+}
+
+HRESULT PartitionedEncoder::Init(const PartitionConfig &cfg, const NvEncoderInitParam &options, UINT width, UINT height)
+{
+    HRESULT hr = S_OK;
+    Cleanup();
+    m_cfg = cfg;
+    m_options = options;
+    m_nWidth = width;
+    m_nHeight = height;
+    m_bAV1 = m_options.IsCodecAV1();
+    m_bRegions = false;
+
+    UINT length = GetLength();
+    UINT equal = (length / cfg.count + m_nAlign - 1) / m_nAlign * m_nAlign;
+    m_nMinSize = std::max(equal / 2 / m_nAlign * m_nAlign, m_nAlign);
+    /// Room for the cuts to move by half a stripe without a new session
+    m_nMaxSize = std::min((equal * 3 / 2 + m_nAlign - 1) / m_nAlign * m_nAlign, length);
+    if (cfg.count < 2 || (UINT64)m_nMinSize * cfg.count > length)
+    {
+        printf("%s: %ux%u is too small for %u stripes\n", __FUNCTION__, width, height, cfg.count);
+        return E_INVALIDARG;
+    }
+
+    std::vector<UINT> vSize(cfg.count);
+    PartitionLayout::ComputeCuts(length, m_nAlign, std::vector<double>(), m_nMinSize, m_nMaxSize, vSize);
+    UINT offset = 0;
+    for (UINT i = 0; i < cfg.count; i++)
+    {
+        std::unique_ptr<Stripe> s = std::make_unique<Stripe>();
+        s->offset = offset;
+        s->size = vSize[i];
+        s->rateShare = (double)vSize[i] / length;
+        s->vSubmitTime.resize(SUBMIT_HISTORY);
+        offset += vSize[i];
+        /// Added before init so Cleanup() also releases a partially initialized stripe
+        m_vStripes.push_back(std::move(s));
+        if (FAILED(hr = InitStripe(*m_vStripes.back(), i)))
+        {
+            PRINTERR(hr, "InitStripe");
+            Cleanup();
+            return hr;
+        }
+    }
+
+    m_layoutFile.open("out.partition", std::ios::out);
+    WriteLayout(0);
+    printf("%s: %u %s stripes of %ux%u, shared bitrate %u kbps\n", __FUNCTION__, cfg.count,
+        cfg.orientation == PartitionOrientation::Horizontal ? "horizontal" : "vertical", width, height, m_totalBitrate / 1000);
+    return hr;
+}
+
+HRESULT PartitionedEncoder::InitRegions(const std::vector<RECT> &vRegions, const NvEncoderInitParam &options, UINT width, UINT height)
+{
+    HRESULT hr = S_OK;
+    Cleanup();
+    m_cfg = PartitionConfig();
+    m_cfg.count = (UINT)vRegions.size();
+    /// Regions are where the displays are, there are no cuts to move
+    m_cfg.balanceInterval = 0;
+    m_options = options;
+    m_nWidth = width;
+    m_nHeight = height;
+    m_bAV1 = m_options.IsCodecAV1();
+    m_bRegions = true;
+
+    /// NV12 chroma is subsampled in both directions, so regions start and end on even coordinates
+    std::vector<RECT> vEven;
+    UINT64 area = 0;
+    for (const RECT &rc : vRegions)
+    {
+        RECT even = { (rc.left + 1) & ~1, (rc.top + 1) & ~1, std::min(rc.right, (LONG)width) & ~1, std::min(rc.bottom, (LONG)height) & ~1 };
+        if (even.left < 0 || even.top < 0 || even.right - even.left < (LONG)m_nAlign || even.bottom - even.top < (LONG)m_nAlign)
+        {
+            printf("%s: Region %ld,%ld-%ld,%ld does not fit a %ux%u frame\n", __FUNCTION__, rc.left, rc.top, rc.right, rc.bottom, width, height);
+            return E_INVALIDARG;
+        }
+        area += (UINT64)(even.right - even.left) * (even.bottom - even.top);
+        vEven.push_back(even);
+    }
+
+    for (UINT i = 0; i < (UINT)vEven.size(); i++)
+    {
+        std::unique_ptr<Stripe> s = std::make_unique<Stripe>();
+        s->region = vEven[i];
+        s->rateShare = (double)(vEven[i].right - vEven[i].left) * (vEven[i].bottom - vEven[i].top) / area;
+        s->vSubmitTime.resize(SUBMIT_HISTORY);
+        m_vStripes.push_back(std::move(s));
+        if (FAILED(hr = InitStripe(*m_vStripes.back(), i)))
+        {
+            PRINTERR(hr, "InitStripe");
+            Cleanup();
+            return hr;
+        }
+    }
+
+    m_layoutFile.open("out.displays", std::ios::out);
+    WriteLayout(0);
+    printf("%s: %zu regions of %ux%u, shared bitrate %u kbps\n", __FUNCTION__, m_vStripes.size(), width, height, m_totalBitrate / 1000);
+    return hr;
+}
+
+UINT PartitionedEncoder::GetStripeX(const Stripe &s) const
+{
+    if (m_bRegions)
+    {
+        return (UINT)s.region.left;
+    }
+    return m_cfg.orientation == PartitionOrientation::Horizontal ? 0 : s.offset;
+}
+
+UINT PartitionedEncoder::GetStripeY(const Stripe &s) const
+{
+    if (m_bRegions)
+    {
+        return (UINT)s.region.top;
+    }
+    return m_cfg.orientation == PartitionOrientation::Horizontal ? s.offset : 0;
+}
+
+UINT PartitionedEncoder::GetStripeWidth(const Stripe &s) const
+{
+    if (m_bRegions)
+    {
+        return (UINT)(s.region.right - s.region.left);
+    }
+    return m_cfg.orientation == PartitionOrientation::Horizontal ? m_nWidth : s.size;
+}
+
+UINT PartitionedEncoder::GetStripeHeight(const Stripe &s) const
+{
+    if (m_bRegions)
+    {
+        return (UINT)(s.region.bottom - s.region.top);
+    }
+    return m_cfg.orientation == PartitionOrientation::Horizontal ? s.size : m_nHeight;
+}
+
+HRESULT PartitionedEncoder::InitStripe(Stripe &s, UINT index)
+{
+    bool bHorizontal = m_cfg.orientation == PartitionOrientation::Horizontal;
+    try
+    {
+        /// Input buffers for the largest size the stripe can be given by a new layout. Regions keep their size
+        UINT maxWidth = m_bRegions ? GetStripeWidth(s) : bHorizontal ? m_nWidth : m_nMaxSize;
+        UINT maxHeight = m_bRegions ? GetStripeHeight(s) : bHorizontal ? m_nMaxSize : m_nHeight;
+        s.pEnc = std::make_unique<NvEncoderCuda>(m_cuContext, maxWidth, maxHeight, NV_ENC_BUFFER_FORMAT_NV12);
+
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        s.pEnc->CreateDefaultEncoderParams(&initializeParams, m_options.GetEncodeGUID(), m_options.GetPresetGUID(), m_options.GetTuningInfo());
+        m_options.SetInitParams(&initializeParams, NV_ENC_BUFFER_FORMAT_NV12);
+        initializeParams.encodeWidth = initializeParams.darWidth = GetStripeWidth(s);
+        initializeParams.encodeHeight = initializeParams.darHeight = GetStripeHeight(s);
+
+        NV_ENC_RC_PARAMS &rc = encodeConfig.rcParams;
+        if (index == 0)
+        {
+            /// Without a bitrate every session gets the driver default for its own size, which is already proportional
+            bool bShared = rc.rateControlMode != NV_ENC_PARAMS_RC_CONSTQP && rc.averageBitRate;
+            m_totalBitrate = bShared ? rc.averageBitRate : 0;
+            m_totalMaxBitrate = bShared ? rc.maxBitRate : 0;
+            m_totalVbvSize = bShared ? rc.vbvBufferSize : 0;
+        }
+        SetStripeRate(s, rc);
+
+        s.pEnc->SetOutputCallback([this, &s](std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info) { OnPacket(s, packet, info); });
+        s.pEnc->CreateEncoder(&initializeParams);
+    }
+    catch (std::exception &error)
+    {
+        std::cerr << error.what() << std::endl;
+        return E_FAIL;
+    }
+
+    std::string outFile = (m_bRegions ? "out_display" : "out_stripe") + std::to_string(index) + (m_bAV1 ? ".av1" : m_options.IsCodecHEVC() ? ".hevc" : ".h264");
+    s.fpOut.open(outFile, std::ios::out | std::ios::binary);
+    if (!s.fpOut)
+    {
+        std::cerr << "Unable to open output file: " << outFile << std::endl;
+        return E_FAIL;
+    }
+    if (!s.crcIndex.Open(outFile))
+    {
+        std::cerr << "Unable to open checksum index: " << outFile << ".crc" << std::endl;
+    }
+    return S_OK;
+}
+
+void PartitionedEncoder::SetStripeRate(const Stripe &s, NV_ENC_RC_PARAMS &rc) const
+{
+    if (!m_totalBitrate)
+    {
+        return;
+    }
+    rc.averageBitRate = (uint32_t)(m_totalBitrate * s.rateShare);
+    rc.maxBitRate = (uint32_t)(m_totalMaxBitrate * s.rateShare);
+    rc.vbvBufferSize = (uint32_t)(m_totalVbvSize * s.rateShare);
+    rc.vbvInitialDelay = rc.vbvBufferSize;
+}
+
+CUresult PartitionedEncoder::CopyStripe(CUarray cuArray, const Stripe &s)
+{
+    const NvEncInputFrame *pInput = s.pEnc->GetNextInputFrame();
+    UINT x = GetStripeX(s);
+    UINT y = GetStripeY(s);
+    UINT w = GetStripeWidth(s);
+    UINT h = GetStripeHeight(s);
+
+    /// Luma rows start at 0 and chroma rows at the frame height in the NV12 array. Offsets are even,
+    /// so one column of interleaved UV pairs is one byte per luma column
+    CUDA_MEMCPY2D copyParam;
+    memset(&copyParam, 0, sizeof(copyParam));
+    copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+    copyParam.srcArray = cuArray;
+    copyParam.srcXInBytes = x;
+    copyParam.srcY = y;
+    copyParam.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+    copyParam.dstDevice = (CUdeviceptr)pInput->inputPtr;
+    copyParam.dstPitch = pInput->pitch;
+    copyParam.WidthInBytes = NvEncoder::GetWidthInBytes(NV_ENC_BUFFER_FORMAT_NV12, w);
+    copyParam.Height = h;
+    CUresult status = cuMemcpy2D(&copyParam);
+    if (status != CUDA_SUCCESS)
+    {
+        return status;
+    }
+
+    copyParam.srcY = m_nHeight + y / 2;
+    copyParam.dstDevice = (CUdeviceptr)((uint8_t *)pInput->inputPtr + pInput->chromaOffsets[0]);
+    copyParam.dstPitch = NvEncoder::GetChromaPitch(NV_ENC_BUFFER_FORMAT_NV12, pInput->pitch);
+    copyParam.WidthInBytes = NvEncoder::GetChromaWidthInBytes(NV_ENC_BUFFER_FORMAT_NV12, w);
+    copyParam.Height = NvEncoder::GetChromaHeight(NV_ENC_BUFFER_FORMAT_NV12, h);
+    return cuMemcpy2D(&copyParam);
+}
+
+HRESULT PartitionedEncoder::Encode(CUarray cuArray, UINT64 frameNumber, bool bForceIdr)
+{
+    if (m_cfg.balanceInterval && m_nFrames && m_nFrames % m_cfg.balanceInterval == 0 && Rebalance(frameNumber))
+    {
+        /// ApplyLayout() already made this an IDR frame in every stripe
+        bForceIdr = false;
+    }
+    else if (m_totalBitrate && m_nFrames && m_nFrames % RATE_INTERVAL == 0)
+    {
+        UpdateRateShares();
+    }
+
+    /// Submit every stripe before waiting on any: the sessions run on the NVENC engines in parallel
+    for (std::unique_ptr<Stripe> &pStripe : m_vStripes)
+    {
+        Stripe &s = *pStripe;
+        CUresult cuStatus = CopyStripe(cuArray, s);
+        if (cuStatus != CUDA_SUCCESS)
+        {
+            std::cerr << "Failed to copy stripe to encoder. : cudaError : " << cuStatus << std::endl;
+            return E_FAIL;
+        }
+
+        NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+        picParams.inputTimeStamp = frameNumber;
+        if (bForceIdr)
+        {
+            picParams.encodePicFlags = NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+        }
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        {
+            std::lock_guard<std::mutex> lock(m_statsMutex);
+            s.vSubmitTime[frameNumber % SUBMIT_HISTORY] = now.QuadPart;
+        }
+        try
+        {
+            s.pEnc->EncodeFrame(s.vPacket, &picParams);
+        }
+        catch (std::exception &error)
+        {
+            std::cerr << error.what() << std::endl;
+            return E_FAIL;
+        }
+    }
+    m_nFrames++;
+    return S_OK;
+}
+
+void PartitionedEncoder::OnPacket(Stripe &s, const std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info)
+{
+    /// Only this stripe's retrieval thread writes its file
+    s.fpOut.write(reinterpret_cast<const char *>(packet.data()), packet.size());
+    s.crcIndex.Add(packet.data(), packet.size());
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    /// Quantizer step doubles every 6 QP. AV1 reports a 0-255 q index, roughly 5 times the H.264 scale
+    double qp = m_bAV1 ? info.frameAvgQP * 51.0 / 255 : info.frameAvgQP;
+    double complexity = packet.size() * 8.0 * std::pow(2.0, (qp - 12) / 6);
+
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    LONGLONG submitted = s.vSubmitTime[info.outputTimeStamp % SUBMIT_HISTORY];
+    if (submitted)
+    {
+        UINT64 us = (UINT64)((now.QuadPart - submitted) * 1000000 / m_qpcFreq.QuadPart);
+        s.encodeUs += us;
+        s.totalEncodeUs += us;
+        s.nTimedFrames++;
+    }
+    s.complexity += complexity;
+    s.framesEncoded++;
+    s.bytesEncoded += packet.size();
+}
+
+void PartitionedEncoder::UpdateRateShares()
+{
+    std::vector<double> vComplexity;
+    {
+        std::lock_guard<std::mutex> lock(m_statsMutex);
+        for (std::unique_ptr<Stripe> &s : m_vStripes)
+        {
+            vComplexity.push_back(s->complexity);
+            s->complexity = 0;
+        }
+    }
+    double total = 0;
+    for (double c : vComplexity)
+    {
+        total += c;
+    }
+    if (total <= 0)
+    {
+        return;
+    }
+
+    const double n = (double)m_vStripes.size();
+    std::vector<double> vShare(m_vStripes.size());
+    double sum = 0;
+    for (size_t i = 0; i < m_vStripes.size(); i++)
+    {
+        double measured = vComplexity[i] / total;
+        vShare[i] = std::max(RATE_SMOOTHING * measured + (1 - RATE_SMOOTHING) * m_vStripes[i]->rateShare, MIN_RATE_SHARE / n);
+        sum += vShare[i];
+    }
+
+    for (size_t i = 0; i < m_vStripes.size(); i++)
+    {
+        Stripe &s = *m_vStripes[i];
+        double share = vShare[i] / sum;
+        if (std::fabs(share - s.rateShare) < RATE_HYSTERESIS * s.rateShare)
+        {
+            continue;
+        }
+        s.rateShare = share;
+        NV_ENC_CONFIG config = { NV_ENC_CONFIG_VER };
+        NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+        reconfigureParams.reInitEncodeParams.encodeConfig = &config;
+        s.pEnc->GetInitializeParams(&reconfigureParams.reInitEncodeParams);
+        SetStripeRate(s, config.rcParams);
+        /// Rate changes apply from the next frame, no IDR needed
+        reconfigureParams.resetEncoder = 0;
+        reconfigureParams.forceIDR = 0;
+        try
+        {
+            s.pEnc->Reconfigure(&reconfigureParams);
+        }
+        catch (std::exception &error)
+        {
+            std::cerr << error.what() << std::endl;
+        }
+    }
+}
+
+bool PartitionedEncoder::Rebalance(UINT64 frameNumber)
+{
+    const UINT length = GetLength();
+    const UINT nBands = (length + m_nAlign - 1) / m_nAlign;
+    std::vector<double> vCost(nBands, 0);
+    double sumUs = 0;
+    double maxUs = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_statsMutex);
+        for (std::unique_ptr<Stripe> &s : m_vStripes)
+        {
+            if (!s->nTimedFrames)
+            {
+                return false;
+            }
+            double us = (double)s->encodeUs / s->nTimedFrames;
+            sumUs += us;
+            maxUs = std::max(maxUs, us);
+            /// Cuts are aligned, so every band but the last lies in one stripe
+            for (UINT b = s->offset / m_nAlign; b < nBands && b * m_nAlign < s->offset + s->size; b++)
+            {
+                UINT bandSize = std::min(m_nAlign, length - b * m_nAlign);
+                vCost[b] = us * bandSize / s->size;
+            }
+            s->encodeUs = 0;
+            s->nTimedFrames = 0;
+        }
+    }
+    if (maxUs <= BALANCE_THRESHOLD * sumUs / m_vStripes.size())
+    {
+        return false;
+    }
+
+    std::vector<UINT> vSize(m_vStripes.size());
+    PartitionLayout::ComputeCuts(length, m_nAlign, vCost, m_nMinSize, m_nMaxSize, vSize);
+    bool bChanged = false;
+    for (size_t i = 0; i < vSize.size(); i++)
+    {
+        bChanged |= vSize[i] != m_vStripes[i]->size;
+    }
+    if (!bChanged)
+    {
+        return false;
+    }
+
+    UINT offset = 0;
+    for (size_t i = 0; i < vSize.size(); i++)
+    {
+        m_vStripes[i]->offset = offset;
+        m_vStripes[i]->size = vSize[i];
+        offset += vSize[i];
+    }
+    if (FAILED(ApplyLayout()))
+    {
+        return false;
+    }
+    m_nRebalances++;
+    WriteLayout(frameNumber);
+    printf("%s: Frame %llu: slowest stripe %.2f ms, average %.2f ms, cuts moved\n", __FUNCTION__,
+        (unsigned long long)frameNumber, maxUs / 1000, sumUs / m_vStripes.size() / 1000);
+    return true;
+}
+
+HRESULT PartitionedEncoder::ApplyLayout()
+{
+    HRESULT hr = S_OK;
+    for (std::unique_ptr<Stripe> &pStripe : m_vStripes)
+    {
+        Stripe &s = *pStripe;
+        NV_ENC_CONFIG config = { NV_ENC_CONFIG_VER };
+        NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+        NV_ENC_INITIALIZE_PARAMS &params = reconfigureParams.reInitEncodeParams;
+        params.encodeConfig = &config;
+        s.pEnc->GetInitializeParams(&params);
+        params.encodeWidth = params.darWidth = GetStripeWidth(s);
+        params.encodeHeight = params.darHeight = GetStripeHeight(s);
+        /// Same session, new sequence; every stripe starts it with the same frame
+        reconfigureParams.resetEncoder = 1;
+        reconfigureParams.forceIDR = 1;
+        try
+        {
+            s.pEnc->EndEncode(s.vPacket);
+            s.pEnc->Reconfigure(&reconfigureParams);
+        }
+        catch (std::exception &error)
+        {
+            std::cerr << error.what() << std::endl;
+            hr = E_FAIL;
+        }
+    }
+    return hr;
+}
+
+void PartitionedEncoder::WriteLayout(UINT64 frameNumber)
+{
+    if (!m_layoutFile)
+    {
+        return;
+    }
+    if (m_bRegions)
+    {
+        m_layoutFile << frameNumber << " r";
+        for (std::unique_ptr<Stripe> &s : m_vStripes)
+        {
+            m_layoutFile << " " << GetStripeX(*s) << "," << GetStripeY(*s) << ":" << GetStripeWidth(*s) << "x" << GetStripeHeight(*s);
+        }
+        m_layoutFile << std::endl;
+        return;
+    }
+    m_layoutFile << frameNumber << (m_cfg.orientation == PartitionOrientation::Horizontal ? " h" : " v");
+    for (std::unique_ptr<Stripe> &s : m_vStripes)
+    {
+        m_layoutFile << " " << s->offset << ":" << s->size;
+    }
+    m_layoutFile << std::endl;
+}
+
+void PartitionedEncoder::PrintStats()
+{
+    std::lock_guard<std::mutex> lock(m_statsMutex);
+    for (size_t i = 0; i < m_vStripes.size(); i++)
+    {
+        Stripe &s = *m_vStripes[i];
+        printf("%s %zu: %u,%u %ux%u, %llu frames, %.1f KB/frame, encode %.2f ms, bitrate share %.2f\n", m_bRegions ? "Display" : "Stripe",
+            i, GetStripeX(s), GetStripeY(s), GetStripeWidth(s), GetStripeHeight(s),
+            (unsigned long long)s.framesEncoded, s.framesEncoded ? s.bytesEncoded / 1024.0 / s.framesEncoded : 0,
+            s.framesEncoded ? s.totalEncodeUs / 1000.0 / s.framesEncoded : 0, s.rateShare);
+    }
+    if (!m_bRegions)
+    {
+        printf("%u layout changes\n", m_nRebalances);
+    }
+}
+
+void PartitionedEncoder::Cleanup()
+{
+    for (std::unique_ptr<Stripe> &pStripe : m_vStripes)
+    {
+        Stripe &s = *pStripe;
+        if (s.pEnc)
+        {
+            try
+            {
+                /// Waits for the retrieval thread to write the remaining packets
+                s.pEnc->EndEncode(s.vPacket);
+                s.pEnc->DestroyEncoder();
+            }
+            catch (std::exception &error)
+            {
+                std::cerr << error.what() << std::endl;
+            }
+            s.pEnc.reset();
+        }
+    }
+    m_vStripes.clear();
+    if (m_layoutFile.is_open())
+    {
+        m_layoutFile.close();
+    }
+    m_nFrames = 0;
+}
@@ -14,9 +14,7 @@ __device__ float rgb2v(uchar4 c) {
 	return 0.439f * c.x - 0.368f * c.y - 0.071f * c.z + 128.0f;
 }
 
-texture<uchar4, cudaTextureType2D, cudaReadModeElementType> texRef;
-
-__global__ void RGBA2NV12_kernel(uint8_t *dstImage, size_t destPitch,
+__global__ void RGBA2NV12_kernel(cudaTextureObject_t tex, uint8_t *dstImage, size_t destPitch,
 	uint32_t width, uint32_t height)
 {
 	// Pad borders with duplicate pixels, and we multiply by 2 because we process 2 pixels per thread
@@ -32,10 +30,10 @@ __global__ void RGBA2NV12_kernel(uint8_t *dstImage, size_t destPitch,
 	if (y1 >= height)
 		return; // y = height - 1;
 
-	uchar4 c00 = tex2D(texRef, x, y);
-	uchar4 c01 = tex2D(texRef, x1, y);
-	uchar4 c10 = tex2D(texRef, x, y1);
-	uchar4 c11 = tex2D(texRef, x1, y1);
+	uchar4 c00 = tex2D<uchar4>(tex, x, y);
+	uchar4 c01 = tex2D<uchar4>(tex, x1, y);
+	uchar4 c10 = tex2D<uchar4>(tex, x, y1);
+	uchar4 c11 = tex2D<uchar4>(tex, x1, y1);
 
 	uint8_t y00 = (uint8_t)(rgb2y(c00) + 0.5f);
 	uint8_t y01 = (uint8_t)(rgb2y(c01) + 0.5f);
@@ -61,17 +59,23 @@ __global__ void RGBA2NV12_kernel(uint8_t *dstImage, size_t destPitch,
 extern "C"
 cudaError_t RGBA2NV12(cudaArray *srcImage,
 	uint8_t *dstImage, size_t destPitch,
-	uint32_t width, uint32_t height)
+	uint32_t width, uint32_t height, cudaStream_t stream)
 {
-	cudaChannelFormatDesc channelDesc = cudaCreateChannelDesc(8, 8, 8, 8, cudaChannelFormatKindUnsigned);
-
-	// Set texture parameters
-	texRef.addressMode[0] = cudaAddressModeWrap;
-	texRef.addressMode[1] = cudaAddressModeWrap;
-	texRef.filterMode = cudaFilterModePoint;
-	texRef.normalized = false;
-
-	cudaError_t cudaStatus = cudaBindTextureToArray(texRef, srcImage, channelDesc);
+	/// A texture object, texture references are gone from CUDA 12
+	cudaResourceDesc resDesc = {};
+	resDesc.resType = cudaResourceTypeArray;
+	resDesc.res.array.array = srcImage;
+
+	// Set texture parameters. Unnormalized coordinates cannot wrap, the kernel stays inside the image anyway
+	cudaTextureDesc texDesc = {};
+	texDesc.addressMode[0] = cudaAddressModeClamp;
+	texDesc.addressMode[1] = cudaAddressModeClamp;
+	texDesc.filterMode = cudaFilterModePoint;
+	texDesc.readMode = cudaReadModeElementType;
+	texDesc.normalizedCoords = 0;
+
+	cudaTextureObject_t tex = 0;
+	cudaError_t cudaStatus = cudaCreateTextureObject(&tex, &resDesc, &texDesc, NULL);
 	if (cudaStatus != cudaSuccess) {
 		return cudaStatus;
 	}
@@ -79,10 +83,115 @@ cudaError_t RGBA2NV12(cudaArray *srcImage,
 	dim3 block(32, 16, 1);
 	dim3 grid((width + (2 * block.x - 1)) / (2 * block.x), (height + (2 * block.y - 1)) / (2 * block.y), 1);
 
-	RGBA2NV12_kernel<<<grid, block>>>(dstImage, destPitch, width, height);
+	RGBA2NV12_kernel<<<grid, block, 0, stream>>>(tex, dstImage, destPitch, width, height);
+
+	cudaStreamSynchronize(stream);
+
+	cudaStatus = cudaGetLastError();
+	cudaDestroyTextureObject(tex);
+	return cudaStatus;
+}
+
+/// BT.601 limited range, BGRA channel order (DDA output) in [0, 255]
+__device__ inline float bgra2y(float4 c) {
+	return 0.257f * c.z + 0.504f * c.y + 0.098f * c.x + 16.0f;
+}
+
+__device__ inline float bgra2u(float4 c) {
+	return -0.148f * c.z - 0.291f * c.y + 0.439f * c.x + 128.0f;
+}
+
+__device__ inline float bgra2v(float4 c) {
+	return 0.439f * c.z - 0.368f * c.y - 0.071f * c.x + 128.0f;
+}
+
+/// Area filter over the source footprint of one output pixel centered on (cx, cy), with the weights of the
+/// CpuResizeFilter::Area tables of CpuBgraToNv12Scaler: every source pixel counts with the part of it the
+/// footprint covers, so no source pixel is skipped at any ratio. The footprint is sx by sy source pixels,
+/// at least one pixel when upscaling. 4 taps at 2:1, 16 at 4:1
+__device__ inline float4 SampleFootprint(cudaTextureObject_t tex, float cx, float cy, float sx, float sy)
+{
+	float x0 = cx - 0.5f * fmaxf(sx, 1.0f), x1 = cx + 0.5f * fmaxf(sx, 1.0f);
+	float y0 = cy - 0.5f * fmaxf(sy, 1.0f), y1 = cy + 0.5f * fmaxf(sy, 1.0f);
+	float4 sum = make_float4(0.0f, 0.0f, 0.0f, 0.0f);
+	float weights = 0.0f;
+	for (int iy = (int)floorf(y0); iy < y1; iy++)
+	{
+		float wy = fminf(iy + 1.0f, y1) - fmaxf((float)iy, y0);
+		for (int ix = (int)floorf(x0); ix < x1; ix++)
+		{
+			float w = wy * (fminf(ix + 1.0f, x1) - fmaxf((float)ix, x0));
+			/// Pixel centers, clamped to the edge like the replicated edges of the CPU tables
+			float4 c = tex2D<float4>(tex, ix + 0.5f, iy + 0.5f);
+			sum.x += w * c.x;
+			sum.y += w * c.y;
+			sum.z += w * c.z;
+			weights += w;
+		}
+	}
+	const float k = 255.0f / weights;
+	return make_float4(sum.x * k, sum.y * k, sum.z * k, 0.0f);
+}
+
+/// Filter, downsample and convert in one pass. Each thread writes a 2x2 luma block and one UV pair
+__global__ void BGRA2NV12Scaled_kernel(cudaTextureObject_t tex, uint8_t *dstImage, uint8_t *dstImageUV, size_t destPitch,
+	uint32_t width, uint32_t height, float sx, float sy)
+{
+	int32_t x = (blockIdx.x * blockDim.x + threadIdx.x) << 1;
+	int32_t y = (blockIdx.y * blockDim.y + threadIdx.y) << 1;
+
+	if (x + 1 >= width || y + 1 >= height)
+		return;
+
+	float u = 0.0f, v = 0.0f;
+	for (int dy = 0; dy < 2; dy++)
+	{
+		for (int dx = 0; dx < 2; dx++)
+		{
+			float4 c = SampleFootprint(tex, (x + dx + 0.5f) * sx, (y + dy + 0.5f) * sy, sx, sy);
+			dstImage[destPitch * (y + dy) + x + dx] = (uint8_t)(bgra2y(c) + 0.5f);
+			u += bgra2u(c);
+			v += bgra2v(c);
+		}
+	}
+
+	uint8_t *pUV = dstImageUV + destPitch * (y >> 1) + x;
+	pUV[0] = (uint8_t)(u * 0.25f + 0.5f);
+	pUV[1] = (uint8_t)(v * 0.25f + 0.5f);
+}
 
-	cudaThreadSynchronize();
+/// Fused BGRA -> scaled NV12. Reads the source once and writes only the target resolution,
+/// instead of RGBA2NV12 at full resolution followed by ResizeNv12. The UV plane follows the luma plane
+/// unless dstImageUV is given, as in ResizeNv12
+extern "C"
+cudaError_t BGRA2NV12Scaled(cudaArray *srcImage, uint32_t srcWidth, uint32_t srcHeight,
+	uint8_t *dstImage, size_t destPitch, uint32_t dstWidth, uint32_t dstHeight, cudaStream_t stream, uint8_t *dstImageUV)
+{
+	cudaResourceDesc resDesc = {};
+	resDesc.resType = cudaResourceTypeArray;
+	resDesc.res.array.array = srcImage;
+
+	cudaTextureDesc texDesc = {};
+	texDesc.addressMode[0] = cudaAddressModeClamp;
+	texDesc.addressMode[1] = cudaAddressModeClamp;
+	texDesc.filterMode = cudaFilterModePoint;
+	texDesc.readMode = cudaReadModeNormalizedFloat;
+	texDesc.normalizedCoords = 0;
+
+	cudaTextureObject_t tex = 0;
+	cudaError_t cudaStatus = cudaCreateTextureObject(&tex, &resDesc, &texDesc, NULL);
+	if (cudaStatus != cudaSuccess) {
+		return cudaStatus;
+	}
+
+	dim3 block(32, 8, 1);
+	dim3 grid((dstWidth / 2 + block.x - 1) / block.x, (dstHeight / 2 + block.y - 1) / block.y, 1);
+
+	BGRA2NV12Scaled_kernel<<<grid, block, 0, stream>>>(tex, dstImage,
+		dstImageUV ? dstImageUV : dstImage + destPitch * dstHeight, destPitch, dstWidth, dstHeight,
+		(float)srcWidth / dstWidth, (float)srcHeight / dstHeight);
 
 	cudaStatus = cudaGetLastError();
+	cudaDestroyTextureObject(tex);
 	return cudaStatus;
-}
\ No newline at end of file
+}
@@ -1,8 +1,14 @@
 #pragma once
 
 #include <cuda.h>
+#include <cuda_runtime.h>
 
 extern "C"
 cudaError_t RGBA2NV12(cudaArray *srcImage,
 	uint8_t *dstImage, size_t destPitch,
-	uint32_t width, uint32_t height);
\ No newline at end of file
+	uint32_t width, uint32_t height, cudaStream_t stream = 0);
+
+extern "C"
+cudaError_t BGRA2NV12Scaled(cudaArray *srcImage, uint32_t srcWidth, uint32_t srcHeight,
+	uint8_t *dstImage, size_t destPitch, uint32_t dstWidth, uint32_t dstHeight, cudaStream_t stream = 0,
+	uint8_t *dstImageUV = nullptr);
@@ -0,0 +1,93 @@
+#include "RateController.hpp"
+#include <stdio.h>
+#include <math.h>
+#include <algorithm>
+
+void RateController::Init(const RateControlConfig &cfg, uint32_t nInitialBitrate)
+{
+    m_cfg = cfg;
+    m_cfg.windowFrames = std::max(m_cfg.windowFrames, 1);
+    m_vDamage.assign(m_cfg.windowFrames, 0.0);
+    m_vBytes.assign(m_cfg.windowFrames, 0);
+    m_nPos = m_nFilled = 0;
+    m_damageSum = 0;
+    m_bytesSum = 0;
+    m_nMinBacklog = -1;
+    m_nCurrent = std::min(std::max(nInitialBitrate, m_cfg.minBitrate), m_cfg.maxBitrate);
+    m_nSinceChange = 0;
+    m_nReconfigs = 0;
+}
+
+RateDecision RateController::MakeDecision(uint32_t nAverageBitrate) const
+{
+    RateDecision decision;
+    decision.averageBitRate = nAverageBitrate;
+    decision.maxBitRate = (uint32_t)(nAverageBitrate * m_cfg.peakRatio);
+    decision.vbvBufferSize = (uint32_t)(nAverageBitrate / m_cfg.fps * m_cfg.vbvFrames);
+    decision.vbvInitialDelay = decision.vbvBufferSize;
+    return decision;
+}
+
+bool RateController::OnFrame(double damageFraction, size_t nPacketBytes, int nBacklog, RateDecision &decision)
+{
+    /// Slide the window
+    m_damageSum += damageFraction - m_vDamage[m_nPos];
+    m_bytesSum += nPacketBytes - m_vBytes[m_nPos];
+    m_vDamage[m_nPos] = damageFraction;
+    m_vBytes[m_nPos] = nPacketBytes;
+    m_nPos = (m_nPos + 1) % m_cfg.windowFrames;
+    m_nFilled = std::min(m_nFilled + 1, m_cfg.windowFrames);
+    m_nSinceChange++;
+
+    if (m_nMinBacklog < 0 || nBacklog < m_nMinBacklog)
+    {
+        m_nMinBacklog = nBacklog;
+    }
+    bool bCongested = nBacklog - m_nMinBacklog > m_cfg.maxBacklog;
+    if (m_nFilled < m_cfg.windowFrames && !bCongested)
+    {
+        return false;
+    }
+
+    /// Damage sets the base target
+    double busy = std::max(m_cfg.busyDamage, m_cfg.idleDamage + 1e-6);
+    double t = std::min(std::max((GetSmoothedDamage() - m_cfg.idleDamage) / (busy - m_cfg.idleDamage), 0.0), 1.0);
+    double target = m_cfg.minBitrate + (m_cfg.maxBitrate - (double)m_cfg.minBitrate) * t;
+
+    /// The encoder is using up its budget: the content needs more than the damage suggests
+    if (GetMeasuredBitrate() > 0.9 * m_nCurrent)
+    {
+        target = std::max(target, m_nCurrent * 1.25);
+    }
+    /// The output cannot keep up: back off regardless of content
+    if (bCongested)
+    {
+        target = std::min(target, m_nCurrent * 0.7);
+    }
+    target = std::min(std::max(target, (double)m_cfg.minBitrate), (double)m_cfg.maxBitrate);
+
+    int nHold = bCongested ? std::max(m_cfg.holdFrames / 4, 1) : m_cfg.holdFrames;
+    if (m_nSinceChange < nHold || fabs(target - m_nCurrent) <= m_cfg.hysteresis * m_nCurrent)
+    {
+        return false;
+    }
+
+    m_nCurrent = (uint32_t)target;
+    m_nSinceChange = 0;
+    m_nReconfigs++;
+    decision = MakeDecision(m_nCurrent);
+    return true;
+}
+
+bool RateController::ParseLimits(const char *szArg, RateControlConfig &cfg)
+{
+    unsigned minKbps = 0, maxKbps = 0;
+    if (sscanf(szArg, "%u:%u", &minKbps, &maxKbps) != 2 || minKbps == 0 || minKbps > maxKbps)
+    {
+        printf("%s: Invalid bitrate range '%s', expected minKbps:maxKbps\n", __FUNCTION__, szArg);
+        return false;
+    }
+    cfg.minBitrate = minKbps * 1000;
+    cfg.maxBitrate = maxKbps * 1000;
+    return true;
+}
@@ -0,0 +1,402 @@
+#include "Simulcast.hpp"
+#include "cudad3d11.h"
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+
+namespace
+{
+    /// Copy a mapped NV12 CUDA array into the encoder input frame. Same layout handling as CudaH264Array::Encode(CUarray)
+    CUresult CopyArrayToInputFrame(CUarray cuArray, const NvEncInputFrame *pInput, NV_ENC_BUFFER_FORMAT eFormat)
+    {
+        CUDA_ARRAY_DESCRIPTOR desc;
+        memset(&desc, 0, sizeof(desc));
+        CUresult status = cuArrayGetDescriptor(&desc, cuArray);
+        if (status != CUDA_SUCCESS)
+            return status;
+
+        uint32_t srcPitch = NvEncoder::GetWidthInBytes(eFormat, (uint32_t)desc.Width);
+        uint32_t chromaHeight = NvEncoder::GetChromaHeight(eFormat, (uint32_t)desc.Height);
+        uint32_t destChromaPitch = NvEncoder::GetChromaPitch(eFormat, pInput->pitch);
+        uint32_t srcChromaPitch = NvEncoder::GetChromaPitch(eFormat, srcPitch);
+        uint32_t chromaWidthInBytes = NvEncoder::GetChromaWidthInBytes(eFormat, (uint32_t)desc.Width);
+
+        CUDA_MEMCPY2D copyParam;
+        memset(&copyParam, 0, sizeof(copyParam));
+        copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+        copyParam.srcArray = cuArray;
+        copyParam.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+        copyParam.dstDevice = (CUdeviceptr)pInput->inputPtr;
+        copyParam.dstPitch = pInput->pitch;
+        copyParam.WidthInBytes = desc.Width * desc.NumChannels;
+        copyParam.Height = desc.Height;
+        if ((status = cuMemcpy2D(&copyParam)) != CUDA_SUCCESS)
+            return status;
+
+        for (uint32_t i = 0; i < pInput->numChromaPlanes && chromaHeight; ++i)
+        {
+            memset(&copyParam, 0, sizeof(copyParam));
+            copyParam.srcY = desc.Height;
+            copyParam.srcMemoryType = CU_MEMORYTYPE_ARRAY;
+            copyParam.srcArray = cuArray;
+            copyParam.srcPitch = srcChromaPitch;
+            copyParam.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+            copyParam.dstDevice = (CUdeviceptr)((uint8_t *)pInput->inputPtr + pInput->chromaOffsets[i]);
+            copyParam.dstPitch = destChromaPitch;
+            copyParam.WidthInBytes = chromaWidthInBytes;
+            copyParam.Height = chromaHeight;
+            if ((status = cuMemcpy2D(&copyParam)) != CUDA_SUCCESS)
+                return status;
+        }
+        return CUDA_SUCCESS;
+    }
+}
+
+/// Constructor
+Simulcast::Simulcast(ID3D11Device *pDev, ID3D11DeviceContext *pCtx, CUcontext cuContext)
+    : m_pDev(pDev)
+    , m_pCtx(pCtx)
+    , m_cuContext(cuContext)
+{
+    m_pDev->AddRef();
+    m_pCtx->AddRef();
+    QueryPerformanceFrequency(&m_qpcFreq);
+}
+
+bool Simulcast::ParseRenditions(const char *szArg, std::vector<RenditionConfig> &vConfig)
+{
+    std::istringstream ss(szArg ? szArg : "");
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        RenditionConfig cfg;
+        int nSize = 0;
+        bool bValid = sscanf(item.c_str(), "%ux%u%n", &cfg.width, &cfg.height, &nSize) == 2 && cfg.width && cfg.height;
+        const char *p = item.c_str() + nSize;
+        char *pEnd = nullptr;
+        if (bValid && *p == '@')
+        {
+            cfg.maxFps = strtod(p + 1, &pEnd);
+            bValid = pEnd != p + 1 && cfg.maxFps > 0;
+            p = pEnd;
+        }
+        if (bValid && *p == ':')
+        {
+            cfg.averageBitRate = (uint32_t)strtoul(p + 1, &pEnd, 10) * 1000;
+            bValid = pEnd != p + 1 && cfg.averageBitRate;
+            p = pEnd;
+            if (bValid && *p == ':')
+            {
+                cfg.maxBitRate = (uint32_t)strtoul(p + 1, &pEnd, 10) * 1000;
+                bValid = pEnd != p + 1 && cfg.maxBitRate >= cfg.averageBitRate;
+                p = pEnd;
+            }
+        }
+        if (!bValid || *p)
+        {
+            std::cerr << "Invalid rendition '" << item << "', expected WxH[@fps][:kbps[:maxKbps]]" << std::endl;
+            return false;
+        }
+        vConfig.push_back(cfg);
+    }
+    return !vConfig.empty();
+}
+
+HRESULT Simulcast::Init(const std::vector<RenditionConfig> &vConfig, const NvEncoderInitParam &options, UINT srcWidth, UINT srcHeight)
+{
+    HRESULT hr = S_OK;
+    Cleanup();
+    m_options = options;
+    m_srcWidth = srcWidth;
+    m_srcHeight = srcHeight;
+
+    std::vector<RenditionConfig> vSorted = vConfig;
+    std::stable_sort(vSorted.begin(), vSorted.end(), [](const RenditionConfig &a, const RenditionConfig &b) {
+        return (UINT64)a.width * a.height > (UINT64)b.width * b.height;
+    });
+
+    for (const RenditionConfig &cfg : vSorted)
+    {
+        if (cfg.width > srcWidth || cfg.height > srcHeight || (cfg.width & 1) || (cfg.height & 1))
+        {
+            printf("%s: Skipping rendition %ux%u, must be even and not larger than %ux%u\n", __FUNCTION__, cfg.width, cfg.height, srcWidth, srcHeight);
+            continue;
+        }
+        std::unique_ptr<Rendition> r = std::make_unique<Rendition>();
+        r->cfg = cfg;
+        if (r->cfg.outFile.empty())
+        {
+            r->cfg.outFile = "out_" + std::to_string(cfg.width) + "x" + std::to_string(cfg.height) +
+                (m_options.IsCodecAV1() ? ".av1" : m_options.IsCodecHEVC() ? ".hevc" : ".h264");
+        }
+        /// Cascade from the previous (next larger) branch when it can contain this one
+        if (!m_vRenditions.empty())
+        {
+            const RenditionConfig &prev = m_vRenditions.back()->cfg;
+            if (prev.width >= cfg.width && prev.height >= cfg.height)
+            {
+                r->parent = (int)m_vRenditions.size() - 1;
+            }
+        }
+        /// Added before init so Cleanup() also releases a partially initialized branch
+        m_vRenditions.push_back(std::move(r));
+        if (FAILED(hr = InitRendition(*m_vRenditions.back())))
+        {
+            PRINTERR(hr, "InitRendition");
+            Cleanup();
+            return hr;
+        }
+    }
+    return m_vRenditions.empty() ? E_INVALIDARG : S_OK;
+}
+
+HRESULT Simulcast::InitRendition(Rendition &r)
+{
+    HRESULT hr = S_OK;
+    D3D11_TEXTURE2D_DESC desc;
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width = r.cfg.width;
+    desc.Height = r.cfg.height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_NV12;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET;
+    if (FAILED(hr = m_pDev->CreateTexture2D(&desc, nullptr, &r.pTex)))
+    {
+        return hr;
+    }
+
+    r.scaler = std::make_unique<D3D11TextureConverter>(m_pDev, m_pCtx);
+    if (FAILED(hr = r.scaler->init()))
+    {
+        return hr;
+    }
+
+    /// Register once here instead of lazily on the first frame
+    CUresult cuStatus = cuGraphicsD3D11RegisterResource(&r.cuResource, r.pTex, CU_GRAPHICS_REGISTER_FLAGS_NONE);
+    if (cuStatus != CUDA_SUCCESS)
+    {
+        std::cerr << "Failed to register rendition texture with CUDA. : cudaError : " << cuStatus << std::endl;
+        return E_FAIL;
+    }
+
+    try
+    {
+        r.pEnc = std::make_unique<NvEncoderCuda>(m_cuContext, r.cfg.width, r.cfg.height, NV_ENC_BUFFER_FORMAT_NV12);
+        NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+        NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+        initializeParams.encodeConfig = &encodeConfig;
+        r.pEnc->CreateDefaultEncoderParams(&initializeParams, m_options.GetEncodeGUID(), m_options.GetPresetGUID(), m_options.GetTuningInfo());
+        m_options.SetInitParams(&initializeParams, NV_ENC_BUFFER_FORMAT_NV12);
+        NV_ENC_RC_PARAMS &rc = encodeConfig.rcParams;
+        if (!r.cfg.averageBitRate && rc.averageBitRate)
+        {
+            /// A -bitrate given for the main stream is scaled down by the pixel count of the branch
+            double scale = (double)r.cfg.width * r.cfg.height / ((double)m_srcWidth * m_srcHeight);
+            rc.averageBitRate = (uint32_t)(rc.averageBitRate * scale);
+            rc.maxBitRate = (uint32_t)(rc.maxBitRate * scale);
+            rc.vbvBufferSize = (uint32_t)(rc.vbvBufferSize * scale);
+            rc.vbvInitialDelay = (uint32_t)(rc.vbvInitialDelay * scale);
+        }
+        if (r.cfg.maxFps > 0)
+        {
+            initializeParams.frameRateNum = (uint32_t)(r.cfg.maxFps * 1000);
+            initializeParams.frameRateDen = 1000;
+        }
+        if (r.cfg.averageBitRate)
+        {
+            /// The rendition's own rate, with the single frame VBV of the low latency main stream
+            if (rc.rateControlMode == NV_ENC_PARAMS_RC_CONSTQP)
+            {
+                rc.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+            }
+            rc.averageBitRate = r.cfg.averageBitRate;
+            rc.maxBitRate = r.cfg.maxBitRate ? r.cfg.maxBitRate : r.cfg.averageBitRate;
+            rc.vbvBufferSize = (uint32_t)((uint64_t)rc.averageBitRate * initializeParams.frameRateDen / initializeParams.frameRateNum);
+            rc.vbvInitialDelay = rc.vbvBufferSize;
+        }
+        r.pEnc->CreateEncoder(&initializeParams);
+    }
+    catch (std::exception &error)
+    {
+        std::cerr << error.what() << std::endl;
+        return E_FAIL;
+    }
+
+    r.fpOut.open(r.cfg.outFile, std::ios::out | std::ios::binary);
+    if (!r.fpOut)
+    {
+        std::cerr << "Unable to open output file: " << r.cfg.outFile << std::endl;
+        return E_FAIL;
+    }
+    if (!r.crcIndex.Open(r.cfg.outFile))
+    {
+        std::cerr << "Unable to open checksum index: " << r.cfg.outFile << ".crc" << std::endl;
+    }
+    return hr;
+}
+
+bool Simulcast::WantsFrame(Rendition &r, LARGE_INTEGER now)
+{
+    if (r.lastEncode.QuadPart == 0)
+    {
+        return true;
+    }
+    LARGE_INTEGER elapsed;
+    elapsed.QuadPart = now.QuadPart - r.lastEncode.QuadPart;
+    MICROSEC_TIME(elapsed, m_qpcFreq);
+
+    LONGLONG budgetUs = r.cfg.maxFps > 0 ? (LONGLONG)(1000000.0 / r.cfg.maxFps) : 0;
+    /// 10% slack so capture jitter does not halve the rate of a branch running at half the capture rate
+    if (elapsed.QuadPart * 10 < budgetUs * 9)
+    {
+        /// Rate limited, not counted as a drop
+        return false;
+    }
+    if (r.cfg.dropPolicy == RenditionDropPolicy::DropIfLate && budgetUs > 0 && r.lastCostUs > budgetUs)
+    {
+        /// The branch overran its budget last time. Give it one frame to catch up
+        r.lastCostUs = 0;
+        r.framesDropped++;
+        return false;
+    }
+    return true;
+}
+
+HRESULT Simulcast::EncodeRendition(Rendition &r, CUstream stream)
+{
+    HRESULT hr = S_OK;
+    CUresult cuStatus = cuGraphicsMapResources(1, &r.cuResource, stream);
+    if (cuStatus != CUDA_SUCCESS)
+    {
+        std::cerr << "Failed to map rendition texture to CUDA. Error code: " << cuStatus << std::endl;
+        return E_FAIL;
+    }
+
+    CUarray cuArray = nullptr;
+    cuStatus = cuGraphicsSubResourceGetMappedArray(&cuArray, r.cuResource, 0, 0);
+    if (cuStatus == CUDA_SUCCESS)
+    {
+        cuStatus = CopyArrayToInputFrame(cuArray, r.pEnc->GetNextInputFrame(), NV_ENC_BUFFER_FORMAT_NV12);
+    }
+    cuGraphicsUnmapResources(1, &r.cuResource, stream);
+    if (cuStatus != CUDA_SUCCESS)
+    {
+        std::cerr << "Failed to copy rendition frame to encoder. : cudaError : " << cuStatus << std::endl;
+        return E_FAIL;
+    }
+
+    try
+    {
+        r.pEnc->EncodeFrame(r.vPacket);
+        for (std::vector<uint8_t> &packet : r.vPacket)
+        {
+            r.fpOut.write(reinterpret_cast<char *>(packet.data()), packet.size());
+            r.crcIndex.Add(packet.data(), packet.size());
+        }
+    }
+    catch (std::exception &error)
+    {
+        std::cerr << error.what() << std::endl;
+        hr = E_FAIL;
+    }
+    return hr;
+}
+
+HRESULT Simulcast::Process(ID3D11Texture2D *pFullResNv12, CUstream stream)
+{
+    HRESULT hr = S_OK;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+
+    /// Decide up front which branches take this frame. A branch must still be scaled
+    /// when a later branch cascades from it, even if it does not encode the frame itself
+    std::vector<bool> vEncode(m_vRenditions.size());
+    std::vector<bool> vScale(m_vRenditions.size());
+    for (size_t i = 0; i < m_vRenditions.size(); i++)
+    {
+        vEncode[i] = WantsFrame(*m_vRenditions[i], now);
+    }
+    for (size_t i = m_vRenditions.size(); i-- > 0;)
+    {
+        if (vEncode[i] || vScale[i])
+        {
+            vScale[i] = true;
+            if (m_vRenditions[i]->parent >= 0)
+            {
+                vScale[m_vRenditions[i]->parent] = true;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < m_vRenditions.size(); i++)
+    {
+        Rendition &r = *m_vRenditions[i];
+        if (!vScale[i])
+        {
+            continue;
+        }
+        LARGE_INTEGER start, end;
+        QueryPerformanceCounter(&start);
+
+        ID3D11Texture2D *pSrc = r.parent >= 0 ? m_vRenditions[r.parent]->pTex : pFullResNv12;
+        if (FAILED(hr = r.scaler->convert(pSrc, r.pTex)))
+        {
+            PRINTERR(hr, "Rendition scale");
+            return hr;
+        }
+        if (vEncode[i])
+        {
+            if (FAILED(hr = EncodeRendition(r, stream)))
+            {
+                return hr;
+            }
+            r.framesEncoded++;
+            r.lastEncode = now;
+            QueryPerformanceCounter(&end);
+            end.QuadPart -= start.QuadPart;
+            MICROSEC_TIME(end, m_qpcFreq);
+            r.lastCostUs = end.QuadPart;
+        }
+    }
+    return hr;
+}
+
+void Simulcast::Cleanup()
+{
+    /// Release in reverse order, children reference their parent's texture
+    while (!m_vRenditions.empty())
+    {
+        Rendition &r = *m_vRenditions.back();
+        if (r.pEnc)
+        {
+            try
+            {
+                r.pEnc->EndEncode(r.vPacket);
+                for (std::vector<uint8_t> &packet : r.vPacket)
+                {
+                    r.fpOut.write(reinterpret_cast<char *>(packet.data()), packet.size());
+                    r.crcIndex.Add(packet.data(), packet.size());
+                }
+                r.pEnc->DestroyEncoder();
+            }
+            catch (std::exception &error)
+            {
+                std::cerr << error.what() << std::endl;
+            }
+            r.pEnc.reset();
+        }
+        if (r.cuResource)
+        {
+            cuGraphicsUnregisterResource(r.cuResource);
+            r.cuResource = nullptr;
+        }
+        /// The converter destructor releases its views and devices
+        r.scaler.reset();
+        SAFE_RELEASE(r.pTex);
+        m_vRenditions.pop_back();
+    }
+}
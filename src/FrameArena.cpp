@@ -0,0 +1,86 @@
+#include "FrameArena.hpp"
+#include <algorithm>
+#include <new>
+
+FrameArena::FrameArena(size_t nBlockBytes)
+    : m_nBlockBytes(std::max(nBlockBytes, (size_t)64))
+{
+}
+
+FrameArena::~FrameArena()
+{
+    FreeBlocks();
+}
+
+size_t FrameArena::GetCapacity() const
+{
+    size_t nCapacity = 0;
+    for (const Block &block : m_vBlocks)
+    {
+        nCapacity += block.nSize;
+    }
+    return nCapacity;
+}
+
+void FrameArena::AddBlock(size_t nMinBytes)
+{
+    Block block;
+    block.nSize = std::max(m_nBlockBytes, nMinBytes);
+    block.pData = static_cast<uint8_t *>(::operator new(block.nSize));
+    m_vBlocks.push_back(block);
+    m_nHeapAllocations++;
+}
+
+void FrameArena::FreeBlocks()
+{
+    for (Block &block : m_vBlocks)
+    {
+        ::operator delete(block.pData);
+    }
+    m_vBlocks.clear();
+}
+
+void *FrameArena::do_allocate(size_t bytes, size_t alignment)
+{
+    for (;;)
+    {
+        if (m_iBlock < m_vBlocks.size())
+        {
+            Block &block = m_vBlocks[m_iBlock];
+            uintptr_t base = (uintptr_t)block.pData;
+            size_t offset = (size_t)(((base + m_nOffset + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base);
+            if (offset + bytes <= block.nSize)
+            {
+                m_nOffset = offset + bytes;
+                m_nUsed += bytes;
+                return block.pData + offset;
+            }
+            if (m_iBlock + 1 < m_vBlocks.size())
+            {
+                m_iBlock++;
+                m_nOffset = 0;
+                continue;
+            }
+        }
+        /// Room for the request at any alignment
+        AddBlock(bytes + alignment);
+        m_iBlock = m_vBlocks.size() - 1;
+        m_nOffset = 0;
+    }
+}
+
+void FrameArena::Reset()
+{
+    m_nHighWater = std::max(m_nHighWater, m_nUsed);
+    if (m_vBlocks.size() > 1)
+    {
+        /// One block for what the busiest frame so far needed
+        size_t nCapacity = GetCapacity();
+        FreeBlocks();
+        m_nBlockBytes = std::max(m_nBlockBytes, nCapacity);
+        AddBlock(m_nBlockBytes);
+    }
+    m_iBlock = 0;
+    m_nOffset = 0;
+    m_nUsed = 0;
+}
@@ -0,0 +1,192 @@
+#include "FrameLatency.hpp"
+#include "Metrics.hpp"
+#include <stdio.h>
+#include <algorithm>
+#include <bit>
+
+namespace
+{
+    /// Every tracker's stages, in LatencyStage order
+    MetricHistogram g_stageLatency[] = {
+        { "stage_latency_microseconds", "Time frames spend in each stage of the pipeline", "stage=\"capture\"" },
+        { "stage_latency_microseconds", "Time frames spend in each stage of the pipeline", "stage=\"convert\"" },
+        { "stage_latency_microseconds", "Time frames spend in each stage of the pipeline", "stage=\"prepare\"" },
+        { "stage_latency_microseconds", "Time frames spend in each stage of the pipeline", "stage=\"encode\"" },
+        { "stage_latency_microseconds", "Time frames spend in each stage of the pipeline", "stage=\"write\"" },
+        { "stage_latency_microseconds", "Time frames spend in each stage of the pipeline", "stage=\"total\"" },
+    };
+    static_assert(sizeof(g_stageLatency) / sizeof(g_stageLatency[0]) == (size_t)LatencyStage::Count, "a histogram per stage");
+}
+
+int LatencyHistogram::GetBucket(int64_t us)
+{
+    if (us < SUB_BUCKETS)
+    {
+        return (int)std::max<int64_t>(us, 0);
+    }
+    int e = std::bit_width((uint64_t)us) - 1;
+    /// The SUB_BUCKET_BITS bits below the leading one select the sub-bucket
+    int bucket = (e - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + (int)((us >> (e - SUB_BUCKET_BITS)) - SUB_BUCKETS);
+    return std::min(bucket, BUCKETS - 1);
+}
+
+int64_t LatencyHistogram::GetBucketStart(int bucket)
+{
+    if (bucket < SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    int e = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    return (int64_t)(SUB_BUCKETS + bucket % SUB_BUCKETS) << (e - SUB_BUCKET_BITS);
+}
+
+void LatencyHistogram::Add(int64_t us)
+{
+    m_buckets[GetBucket(us)]++;
+    m_nCount++;
+    m_sum += us;
+    m_max = std::max(m_max, us);
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        m_buckets[i] += other.m_buckets[i];
+    }
+    m_nCount += other.m_nCount;
+    m_sum += other.m_sum;
+    m_max = std::max(m_max, other.m_max);
+}
+
+void LatencyHistogram::Merge(const uint64_t (&buckets)[BUCKETS], int64_t sum, int64_t max)
+{
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        m_buckets[i] += buckets[i];
+        m_nCount += buckets[i];
+    }
+    m_sum += sum;
+    m_max = std::max(m_max, max);
+}
+
+void LatencyHistogram::Reset()
+{
+    std::fill(m_buckets, m_buckets + BUCKETS, 0);
+    m_nCount = 0;
+    m_sum = 0;
+    m_max = 0;
+}
+
+int64_t LatencyHistogram::GetPercentile(double percentile) const
+{
+    if (!m_nCount)
+    {
+        return 0;
+    }
+    uint64_t rank = std::min((uint64_t)(percentile / 100 * (m_nCount - 1) + 0.5), m_nCount - 1);
+    uint64_t seen = 0;
+    for (int b = 0; b < BUCKETS; b++)
+    {
+        seen += m_buckets[b];
+        if (seen > rank)
+        {
+            int64_t start = GetBucketStart(b);
+            int64_t width = GetBucketStart(b + 1) - start;
+            return std::min(start + width / 2, m_max);
+        }
+    }
+    return m_max;
+}
+
+void LatencyHistogram::Print(const char *szLabel) const
+{
+    printf("%s: %llu frames, mean %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", szLabel,
+        (unsigned long long)m_nCount, GetMean() / 1000, GetPercentile(50) / 1000.0, GetPercentile(90) / 1000.0,
+        GetPercentile(99) / 1000.0, m_max / 1000.0);
+}
+
+void LatencyTracker::Init(int64_t frequency)
+{
+    m_frequency = frequency;
+    Reset();
+}
+
+void LatencyTracker::Submit(const FrameTiming &timing)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t i = timing.frameNumber % MAX_IN_FLIGHT;
+    m_vRecords[i] = timing;
+    m_vOpen[i] = true;
+}
+
+bool LatencyTracker::Find(uint64_t frameNumber, FrameTiming &timing)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t i = frameNumber % MAX_IN_FLIGHT;
+    if (!m_vOpen[i] || m_vRecords[i].frameNumber != frameNumber)
+    {
+        return false;
+    }
+    timing = m_vRecords[i];
+    return true;
+}
+
+void LatencyTracker::Complete(const FrameTiming &timing)
+{
+    /// A stage is only counted when both of its ends were reached
+    const int64_t *pEnds[] = { &timing.present, &timing.acquired, &timing.converted, &timing.submitted, &timing.ready, &timing.written };
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (int s = 0; s < (int)LatencyStage::Total; s++)
+    {
+        if (*pEnds[s] && *pEnds[s + 1])
+        {
+            int64_t us = ToMicroseconds(*pEnds[s + 1] - *pEnds[s]);
+            m_stages[s].Add(us);
+            g_stageLatency[s].Observe(us);
+        }
+    }
+    if (timing.present && timing.written)
+    {
+        int64_t us = ToMicroseconds(timing.written - timing.present);
+        m_stages[(int)LatencyStage::Total].Add(us);
+        g_stageLatency[(int)LatencyStage::Total].Observe(us);
+    }
+    size_t i = timing.frameNumber % MAX_IN_FLIGHT;
+    if (m_vRecords[i].frameNumber == timing.frameNumber)
+    {
+        m_vOpen[i] = false;
+    }
+}
+
+void LatencyTracker::Reset()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::fill(m_vOpen.begin(), m_vOpen.end(), false);
+    for (LatencyHistogram &histogram : m_stages)
+    {
+        histogram.Reset();
+    }
+}
+
+LatencyHistogram LatencyTracker::GetHistogram(LatencyStage stage)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_stages[(int)stage];
+}
+
+const char *LatencyTracker::GetStageName(LatencyStage stage)
+{
+    static const char *s_names[] = { "Capture", "Convert", "Prepare", "Encode", "Write", "Total" };
+    return s_names[(int)stage];
+}
+
+void LatencyTracker::Print()
+{
+    for (int s = 0; s < (int)LatencyStage::Count; s++)
+    {
+        char szLabel[32];
+        snprintf(szLabel, sizeof(szLabel), "%-8s", GetStageName((LatencyStage)s));
+        GetHistogram((LatencyStage)s).Print(szLabel);
+    }
+}
@@ -0,0 +1,233 @@
+#include "LargePageBuffer.hpp"
+#include <stdio.h>
+#include <atomic>
+#include <utility>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    const size_t SMALL_PAGE = 4096;
+
+    /// Live bytes per PageKind and fallbacks, for GetStats()
+    std::atomic<uint64_t> g_nBytes[4];
+    std::atomic<uint64_t> g_nFallbacks{ 0 };
+    std::atomic<bool> g_bWarned{ false };
+
+    size_t RoundUp(size_t n, size_t align)
+    {
+        return (n + align - 1) / align * align;
+    }
+
+#if defined(_WIN32)
+    /// Large pages are only granted to processes that enabled SeLockMemoryPrivilege in their token
+    bool EnableLockMemoryPrivilege()
+    {
+        HANDLE hToken = nullptr;
+        if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &hToken))
+        {
+            return false;
+        }
+        TOKEN_PRIVILEGES tp;
+        tp.PrivilegeCount = 1;
+        tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+        bool bOk = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &tp.Privileges[0].Luid)
+            && AdjustTokenPrivileges(hToken, FALSE, &tp, 0, nullptr, nullptr)
+            /// Succeeds with ERROR_NOT_ALL_ASSIGNED when the account does not hold the right
+            && GetLastError() == ERROR_SUCCESS;
+        CloseHandle(hToken);
+        return bOk;
+    }
+
+    void *MapLarge(size_t nBytes)
+    {
+        static const bool s_bPrivilege = EnableLockMemoryPrivilege();
+        if (!s_bPrivilege)
+        {
+            return nullptr;
+        }
+        return VirtualAlloc(nullptr, nBytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    }
+
+    /// Windows has no transparent huge pages
+    void *MapTransparent(size_t)
+    {
+        return nullptr;
+    }
+
+    void *MapSmall(size_t nBytes)
+    {
+        return VirtualAlloc(nullptr, nBytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    }
+
+    void Unmap(void *p, size_t)
+    {
+        VirtualFree(p, 0, MEM_RELEASE);
+    }
+
+    const char *FALLBACK_HINT = "grant \"Lock pages in memory\" to the account and log on again";
+#else
+    void *MapLarge(size_t nBytes)
+    {
+        void *p = mmap(nullptr, nBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    /// Huge page aligned 4 KB mapping, advised for promotion to huge pages
+    void *MapTransparent(size_t nBytes)
+    {
+        const size_t align = LargePageBuffer::GetLargePageSize();
+        size_t nMap = nBytes + align;
+        void *pMap = mmap(nullptr, nMap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pMap == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        uint8_t *p = static_cast<uint8_t *>(pMap);
+        uint8_t *pAligned = (uint8_t *)(((uintptr_t)p + align - 1) & ~(uintptr_t)(align - 1));
+        if (pAligned > p)
+        {
+            munmap(p, pAligned - p);
+        }
+        munmap(pAligned + nBytes, p + nMap - (pAligned + nBytes));
+        if (madvise(pAligned, nBytes, MADV_HUGEPAGE) != 0)
+        {
+            munmap(pAligned, nBytes);
+            return nullptr;
+        }
+        return pAligned;
+    }
+
+    void *MapSmall(size_t nBytes)
+    {
+        void *p = mmap(nullptr, nBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    void Unmap(void *p, size_t nBytes)
+    {
+        munmap(p, nBytes);
+    }
+
+    const char *FALLBACK_HINT = "reserve huge pages with vm.nr_hugepages";
+#endif
+}
+
+LargePageBuffer::LargePageBuffer(LargePageBuffer &&other) noexcept
+    : m_pData(std::exchange(other.m_pData, nullptr))
+    , m_nSize(std::exchange(other.m_nSize, 0))
+    , m_nMapped(std::exchange(other.m_nMapped, 0))
+    , m_eKind(std::exchange(other.m_eKind, PageKind::None))
+{
+}
+
+LargePageBuffer &LargePageBuffer::operator=(LargePageBuffer &&other) noexcept
+{
+    if (this != &other)
+    {
+        Free();
+        m_pData = std::exchange(other.m_pData, nullptr);
+        m_nSize = std::exchange(other.m_nSize, 0);
+        m_nMapped = std::exchange(other.m_nMapped, 0);
+        m_eKind = std::exchange(other.m_eKind, PageKind::None);
+    }
+    return *this;
+}
+
+size_t LargePageBuffer::GetLargePageSize()
+{
+#if defined(_WIN32)
+    return GetLargePageMinimum();
+#else
+    /// x86-64 huge page
+    return 2 << 20;
+#endif
+}
+
+bool LargePageBuffer::Allocate(size_t nBytes, bool bLargePages)
+{
+    if (m_pData && nBytes == m_nSize)
+    {
+        return true;
+    }
+    Free();
+    if (nBytes == 0)
+    {
+        return true;
+    }
+
+    void *p = nullptr;
+    PageKind eKind = PageKind::Small;
+    size_t nLargePage = GetLargePageSize();
+    if (bLargePages && nLargePage && nBytes >= nLargePage)
+    {
+        m_nMapped = RoundUp(nBytes, nLargePage);
+        if ((p = MapLarge(m_nMapped)) != nullptr)
+        {
+            eKind = PageKind::Large;
+        }
+        else
+        {
+            g_nFallbacks.fetch_add(1);
+            if ((p = MapTransparent(m_nMapped)) != nullptr)
+            {
+                eKind = PageKind::Transparent;
+            }
+            if (!g_bWarned.exchange(true))
+            {
+                printf("%s: No large pages, using %s; %s\n", __FUNCTION__, p ? "transparent huge pages" : "4 KB pages", FALLBACK_HINT);
+            }
+        }
+    }
+    if (!p)
+    {
+        m_nMapped = RoundUp(nBytes, SMALL_PAGE);
+        p = MapSmall(m_nMapped);
+    }
+    if (!p)
+    {
+        printf("%s: Unable to allocate %zu bytes\n", __FUNCTION__, nBytes);
+        m_nMapped = 0;
+        return false;
+    }
+    m_pData = static_cast<uint8_t *>(p);
+    m_nSize = nBytes;
+    m_eKind = eKind;
+    g_nBytes[(int)eKind].fetch_add(m_nMapped);
+    return true;
+}
+
+void LargePageBuffer::Free()
+{
+    if (!m_pData)
+    {
+        return;
+    }
+    g_nBytes[(int)m_eKind].fetch_sub(m_nMapped);
+    Unmap(m_pData, m_nMapped);
+    m_pData = nullptr;
+    m_nSize = 0;
+    m_nMapped = 0;
+    m_eKind = PageKind::None;
+}
+
+LargePageBuffer::Stats LargePageBuffer::GetStats()
+{
+    Stats stats;
+    stats.nLargeBytes = g_nBytes[(int)PageKind::Large].load();
+    stats.nTransparentBytes = g_nBytes[(int)PageKind::Transparent].load();
+    stats.nSmallBytes = g_nBytes[(int)PageKind::Small].load();
+    stats.nFallbacks = g_nFallbacks.load();
+    return stats;
+}
+
+void LargePageBuffer::PrintStats()
+{
+    Stats stats = GetStats();
+    printf("Frame buffers: %.1f MB large pages, %.1f MB transparent huge pages, %.1f MB 4 KB pages, %llu fallbacks\n",
+        stats.nLargeBytes / 1048576.0, stats.nTransparentBytes / 1048576.0, stats.nSmallBytes / 1048576.0,
+        (unsigned long long)stats.nFallbacks);
+}
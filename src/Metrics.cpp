@@ -0,0 +1,568 @@
+#include "Metrics.hpp"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <filesystem>
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+typedef int SOCKET;
+#define INVALID_SOCKET (-1)
+#define closesocket close
+#endif
+
+namespace
+{
+    struct HistogramShard
+    {
+        std::atomic<uint64_t> buckets[LatencyHistogram::BUCKETS];
+        std::atomic<int64_t> sum{ 0 };
+        std::atomic<int64_t> max{ 0 };
+    };
+
+    /// Metrics updated by one thread, written by it only. Outlives the thread, its counts stay in the totals
+    struct Shard
+    {
+        std::atomic<uint64_t> counters[MetricsRegistry::MAX_COUNTERS];
+        /// Allocated by the thread on its first Observe() of the histogram
+        std::atomic<HistogramShard *> histograms[MetricsRegistry::MAX_HISTOGRAMS];
+    };
+
+    struct ExportState
+    {
+        std::thread thread;
+        std::atomic<bool> bStop{ false };
+        std::string path;
+        int intervalMs = 1000;
+        SOCKET listener = INVALID_SOCKET;
+    };
+
+    struct MetricsState
+    {
+        std::mutex mutex;
+        std::vector<Metric *> vMetrics;
+        std::vector<std::unique_ptr<Shard>> vShards;
+        int nCounters = 0;
+        int nGauges = 0;
+        int nHistograms = 0;
+        ExportState exporter;
+    };
+
+    /// Never destroyed: metrics are statics of other modules and may be updated during their destruction
+    MetricsState &GetState()
+    {
+        static MetricsState *s_pState = new MetricsState();
+        return *s_pState;
+    }
+
+    thread_local Shard *t_pShard = nullptr;
+
+    Shard &GetShard()
+    {
+        if (!t_pShard)
+        {
+            MetricsState &state = GetState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.vShards.push_back(std::make_unique<Shard>());
+            t_pShard = state.vShards.back().get();
+        }
+        return *t_pShard;
+    }
+
+    /// Add to a value only the calling thread writes: a plain load and store, no locked instruction
+    template <typename T>
+    void AddOwned(std::atomic<T> &value, T n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    /// Histogram of every shard. Called with the state locked
+    LatencyHistogram SumHistogram(const MetricsState &state, int id)
+    {
+        LatencyHistogram histogram;
+        uint64_t buckets[LatencyHistogram::BUCKETS];
+        for (const std::unique_ptr<Shard> &pShard : state.vShards)
+        {
+            const HistogramShard *p = pShard->histograms[id].load(std::memory_order_acquire);
+            if (!p)
+            {
+                continue;
+            }
+            for (int b = 0; b < LatencyHistogram::BUCKETS; b++)
+            {
+                buckets[b] = p->buckets[b].load(std::memory_order_relaxed);
+            }
+            histogram.Merge(buckets, p->sum.load(std::memory_order_relaxed), p->max.load(std::memory_order_relaxed));
+        }
+        return histogram;
+    }
+
+    uint64_t SumCounter(const MetricsState &state, int id)
+    {
+        uint64_t value = 0;
+        for (const std::unique_ptr<Shard> &pShard : state.vShards)
+        {
+            value += pShard->counters[id].load(std::memory_order_relaxed);
+        }
+        return value;
+    }
+
+    const char *GetTypeName(MetricType type)
+    {
+        static const char *s_names[] = { "counter", "gauge", "histogram" };
+        return s_names[(int)type];
+    }
+
+    void Append(std::string &s, const char *szFormat, ...)
+    {
+        char sz[512];
+        va_list args;
+        va_start(args, szFormat);
+        int n = vsnprintf(sz, sizeof(sz), szFormat, args);
+        va_end(args);
+        s.append(sz, std::min<size_t>(n > 0 ? n : 0, sizeof(sz) - 1));
+    }
+
+    /// Prometheus labels, name="value",..., as JSON members, "name":"value",...
+    void AppendJsonLabels(std::string &s, const char *szLabels)
+    {
+        s += '{';
+        for (const char *p = szLabels; *p;)
+        {
+            const char *szEquals = strchr(p, '=');
+            if (!szEquals)
+            {
+                break;
+            }
+            const char *szValue = szEquals + 1;
+            const char *szEnd = *szValue == '"' ? strchr(szValue + 1, '"') : nullptr;
+            if (!szEnd)
+            {
+                break;
+            }
+            if (p != szLabels)
+            {
+                s += ',';
+            }
+            s += '"';
+            s.append(p, szEquals);
+            s += "\":";
+            s.append(szValue, szEnd + 1);
+            p = szEnd + 1;
+            if (*p == ',')
+            {
+                p++;
+            }
+        }
+        s += '}';
+    }
+
+    /// name{labels,extra} with either part possibly empty
+    void AppendSeries(std::string &s, const char *szName, const char *szSuffix, const char *szLabels, const char *szExtra)
+    {
+        s += szName;
+        s += szSuffix;
+        if (*szLabels || *szExtra)
+        {
+            s += '{';
+            s += szLabels;
+            if (*szLabels && *szExtra)
+            {
+                s += ',';
+            }
+            s += szExtra;
+            s += '}';
+        }
+    }
+
+    bool SendAll(SOCKET s, const std::string &data)
+    {
+        size_t sent = 0;
+        while (sent < data.size())
+        {
+            int n = send(s, data.data() + sent, (int)std::min<size_t>(data.size() - sent, 1 << 20), 0);
+            if (n <= 0)
+            {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    /// One HTTP request: GET /metrics for Prometheus text, GET /metrics.json for JSON
+    void Serve(SOCKET client)
+    {
+        /// A client that connects and sends nothing does not hold up the file or StopExport() for long
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(client, &readable);
+        timeval timeout = { 1, 0 };
+        if (select((int)client + 1, &readable, nullptr, nullptr, &timeout) <= 0)
+        {
+            return;
+        }
+        char szRequest[1024];
+        int n = recv(client, szRequest, sizeof(szRequest) - 1, 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        szRequest[n] = 0;
+        std::string response;
+        if (!strncmp(szRequest, "GET /metrics.json ", 18))
+        {
+            std::string body = MetricsRegistry::ToJson(MetricsRegistry::Snapshot());
+            Append(response, "HTTP/1.0 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+            response += body;
+        }
+        else if (!strncmp(szRequest, "GET /metrics ", 13) || !strncmp(szRequest, "GET / ", 6))
+        {
+            std::string body = MetricsRegistry::ToPrometheus(MetricsRegistry::Snapshot());
+            Append(response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body.size());
+            response += body;
+        }
+        else
+        {
+            response = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+        SendAll(client, response);
+    }
+
+    void ExportProc(ExportState &exporter)
+    {
+        auto next = std::chrono::steady_clock::now();
+        while (!exporter.bStop.load())
+        {
+            auto now = std::chrono::steady_clock::now();
+            if (!exporter.path.empty() && now >= next)
+            {
+                MetricsRegistry::WriteFile(exporter.path.c_str());
+                next = now + std::chrono::milliseconds(exporter.intervalMs);
+            }
+            if (exporter.listener == INVALID_SOCKET)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(std::min(exporter.intervalMs, 100)));
+                continue;
+            }
+            /// Wake up regularly to write the file and notice StopExport()
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(exporter.listener, &readable);
+            timeval timeout = { 0, 100000 };
+            if (select((int)exporter.listener + 1, &readable, nullptr, nullptr, &timeout) <= 0)
+            {
+                continue;
+            }
+            SOCKET client = accept(exporter.listener, nullptr, nullptr);
+            if (client == INVALID_SOCKET)
+            {
+                continue;
+            }
+            Serve(client);
+            closesocket(client);
+        }
+    }
+}
+
+Metric::Metric(MetricType _type, const char *_szName, const char *_szHelp, const char *_szLabels)
+    : type(_type)
+    , szName(_szName)
+    , szHelp(_szHelp)
+    , szLabels(_szLabels)
+    , id(MetricsRegistry::RegisterMetric(this))
+{
+}
+
+int MetricsRegistry::RegisterMetric(Metric *pMetric)
+{
+    MetricsState &state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    int id = -1;
+    switch (pMetric->type)
+    {
+    case MetricType::Counter:
+        id = state.nCounters < MAX_COUNTERS ? state.nCounters++ : -1;
+        break;
+    case MetricType::Gauge:
+        id = state.nGauges++;
+        break;
+    case MetricType::Histogram:
+        id = state.nHistograms < MAX_HISTOGRAMS ? state.nHistograms++ : -1;
+        break;
+    }
+    if (id < 0)
+    {
+        printf("%s: Too many metrics, %s is not recorded\n", __FUNCTION__, pMetric->szName);
+        return -1;
+    }
+    state.vMetrics.push_back(pMetric);
+    return id;
+}
+
+void MetricCounter::Add(uint64_t n)
+{
+    if (id >= 0)
+    {
+        AddOwned(GetShard().counters[id], n);
+    }
+}
+
+uint64_t MetricCounter::GetValue() const
+{
+    if (id < 0)
+    {
+        return 0;
+    }
+    MetricsState &state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return SumCounter(state, id);
+}
+
+void MetricHistogram::Observe(int64_t us)
+{
+    if (id < 0)
+    {
+        return;
+    }
+    Shard &shard = GetShard();
+    HistogramShard *p = shard.histograms[id].load(std::memory_order_relaxed);
+    if (!p)
+    {
+        p = new HistogramShard();
+        shard.histograms[id].store(p, std::memory_order_release);
+    }
+    AddOwned(p->buckets[LatencyHistogram::GetBucket(us)], (uint64_t)1);
+    AddOwned(p->sum, us);
+    if (us > p->max.load(std::memory_order_relaxed))
+    {
+        p->max.store(us, std::memory_order_relaxed);
+    }
+}
+
+LatencyHistogram MetricHistogram::GetHistogram() const
+{
+    if (id < 0)
+    {
+        return LatencyHistogram();
+    }
+    MetricsState &state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return SumHistogram(state, id);
+}
+
+std::vector<MetricSample> MetricsRegistry::Snapshot()
+{
+    MetricsState &state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    std::vector<MetricSample> vSamples(state.vMetrics.size());
+    for (size_t i = 0; i < state.vMetrics.size(); i++)
+    {
+        const Metric *pMetric = state.vMetrics[i];
+        MetricSample &sample = vSamples[i];
+        sample.pMetric = pMetric;
+        switch (pMetric->type)
+        {
+        case MetricType::Counter:
+            sample.value = (int64_t)SumCounter(state, pMetric->id);
+            break;
+        case MetricType::Gauge:
+            sample.value = static_cast<const MetricGauge *>(pMetric)->GetValue();
+            break;
+        case MetricType::Histogram:
+            sample.histogram = SumHistogram(state, pMetric->id);
+            break;
+        }
+    }
+    return vSamples;
+}
+
+std::string MetricsRegistry::ToJson(const std::vector<MetricSample> &vSamples)
+{
+    std::string s = "{\"metrics\":[\n";
+    for (size_t i = 0; i < vSamples.size(); i++)
+    {
+        const MetricSample &sample = vSamples[i];
+        const Metric &metric = *sample.pMetric;
+        Append(s, "{\"name\":\"%s\",\"type\":\"%s\",\"labels\":", metric.szName, GetTypeName(metric.type));
+        AppendJsonLabels(s, metric.szLabels);
+        if (metric.type == MetricType::Histogram)
+        {
+            const LatencyHistogram &h = sample.histogram;
+            Append(s, ",\"count\":%llu,\"sum_us\":%lld,\"mean_us\":%.1f,\"p50_us\":%lld,\"p90_us\":%lld,\"p99_us\":%lld,\"p999_us\":%lld,\"max_us\":%lld}",
+                (unsigned long long)h.GetCount(), (long long)h.GetSum(), h.GetMean(), (long long)h.GetPercentile(50), (long long)h.GetPercentile(90),
+                (long long)h.GetPercentile(99), (long long)h.GetPercentile(99.9), (long long)h.GetMax());
+        }
+        else
+        {
+            Append(s, ",\"value\":%lld}", (long long)sample.value);
+        }
+        s += i + 1 < vSamples.size() ? ",\n" : "\n";
+    }
+    s += "]}\n";
+    return s;
+}
+
+std::string MetricsRegistry::ToPrometheus(const std::vector<MetricSample> &vSamples)
+{
+    std::string s;
+    std::vector<bool> vDone(vSamples.size());
+    for (size_t i = 0; i < vSamples.size(); i++)
+    {
+        if (vDone[i])
+        {
+            continue;
+        }
+        /// Every series of a name goes under one HELP and TYPE
+        const Metric &first = *vSamples[i].pMetric;
+        Append(s, "# HELP %s %s\n# TYPE %s %s\n", first.szName, first.szHelp, first.szName, GetTypeName(first.type));
+        for (size_t j = i; j < vSamples.size(); j++)
+        {
+            const MetricSample &sample = vSamples[j];
+            const Metric &metric = *sample.pMetric;
+            if (vDone[j] || strcmp(metric.szName, first.szName))
+            {
+                continue;
+            }
+            vDone[j] = true;
+            if (metric.type != MetricType::Histogram)
+            {
+                AppendSeries(s, metric.szName, "", metric.szLabels, "");
+                Append(s, " %lld\n", (long long)sample.value);
+                continue;
+            }
+            /// Cumulative counts up to 2^k - 1 us, up to the maximum: durations are whole microseconds
+            /// and the buckets of LatencyHistogram start at powers of two, so the counts are exact
+            const LatencyHistogram &h = sample.histogram;
+            uint64_t cumulative = 0;
+            int b = 0;
+            for (int64_t edge = 1; h.GetCount() && edge / 2 <= h.GetMax() && b < LatencyHistogram::BUCKETS; edge *= 2)
+            {
+                for (; b < LatencyHistogram::BUCKETS && LatencyHistogram::GetBucketStart(b + 1) <= edge; b++)
+                {
+                    cumulative += h.GetBucketCount(b);
+                }
+                char szLe[32];
+                snprintf(szLe, sizeof(szLe), "le=\"%lld\"", (long long)(edge - 1));
+                AppendSeries(s, metric.szName, "_bucket", metric.szLabels, szLe);
+                Append(s, " %llu\n", (unsigned long long)cumulative);
+            }
+            AppendSeries(s, metric.szName, "_bucket", metric.szLabels, "le=\"+Inf\"");
+            Append(s, " %llu\n", (unsigned long long)h.GetCount());
+            AppendSeries(s, metric.szName, "_sum", metric.szLabels, "");
+            Append(s, " %lld\n", (long long)h.GetSum());
+            AppendSeries(s, metric.szName, "_count", metric.szLabels, "");
+            Append(s, " %llu\n", (unsigned long long)h.GetCount());
+        }
+    }
+    return s;
+}
+
+bool MetricsRegistry::WriteFile(const char *szPath)
+{
+    size_t nLen = strlen(szPath);
+    bool bJson = nLen >= 5 && !strcmp(szPath + nLen - 5, ".json");
+    std::vector<MetricSample> vSamples = Snapshot();
+    std::string data = bJson ? ToJson(vSamples) : ToPrometheus(vSamples);
+
+    /// Write next to the file and rename over it
+    std::string tmpPath = std::string(szPath) + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "wb");
+    if (!fp)
+    {
+        printf("%s: Cannot write %s\n", __FUNCTION__, tmpPath.c_str());
+        return false;
+    }
+    bool bOk = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    bOk = fclose(fp) == 0 && bOk;
+    std::error_code ec;
+    if (bOk)
+    {
+        std::filesystem::rename(tmpPath, szPath, ec);
+    }
+    if (!bOk || ec)
+    {
+        printf("%s: Cannot write %s\n", __FUNCTION__, szPath);
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+    return true;
+}
+
+bool MetricsRegistry::StartExport(const char *szPath, int port, int intervalMs)
+{
+    ExportState &exporter = GetState().exporter;
+    if (exporter.thread.joinable())
+    {
+        return false;
+    }
+    exporter.path = szPath ? szPath : "";
+    exporter.intervalMs = std::max(intervalMs, 1);
+    exporter.bStop = false;
+    if (port > 0)
+    {
+#if defined(_WIN32)
+        WSADATA wsaData;
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData))
+        {
+            printf("%s: WSAStartup failed\n", __FUNCTION__);
+            return false;
+        }
+#endif
+        /// Loopback only, the metrics are not meant for the network
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((unsigned short)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (listener == INVALID_SOCKET || bind(listener, (const sockaddr *)&addr, sizeof(addr)) || listen(listener, 4))
+        {
+            printf("%s: Cannot listen on 127.0.0.1:%d\n", __FUNCTION__, port);
+            if (listener != INVALID_SOCKET)
+            {
+                closesocket(listener);
+            }
+#if defined(_WIN32)
+            WSACleanup();
+#endif
+            return false;
+        }
+        exporter.listener = listener;
+    }
+    exporter.thread = std::thread(ExportProc, std::ref(exporter));
+    return true;
+}
+
+void MetricsRegistry::StopExport()
+{
+    ExportState &exporter = GetState().exporter;
+    if (!exporter.thread.joinable())
+    {
+        return;
+    }
+    exporter.bStop = true;
+    exporter.thread.join();
+    if (exporter.listener != INVALID_SOCKET)
+    {
+        closesocket(exporter.listener);
+        exporter.listener = INVALID_SOCKET;
+#if defined(_WIN32)
+        WSACleanup();
+#endif
+    }
+    if (!exporter.path.empty())
+    {
+        WriteFile(exporter.path.c_str());
+    }
+}
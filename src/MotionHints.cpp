@@ -0,0 +1,109 @@
+#include "MotionHints.hpp"
+#include <string.h>
+#include <algorithm>
+
+/// Ranges of NVENC_EXTERNAL_ME_HINT::mvx (S12.0) and mvy (S10.0). The superblock hint holds the
+/// same ranges in quarter pixels
+static const int MVX_MIN = -2048;
+static const int MVX_MAX = 2047;
+static const int MVY_MIN = -512;
+static const int MVY_MAX = 511;
+
+void MotionHints::Init(int nWidth, int nHeight, bool bSuperblocks)
+{
+    m_nWidth = nWidth;
+    m_nHeight = nHeight;
+    m_bSuperblocks = bSuperblocks;
+    m_nBlockSize = bSuperblocks ? 64 : 16;
+    m_nBlocksX = (nWidth + m_nBlockSize - 1) / m_nBlockSize;
+    m_nBlocksY = (nHeight + m_nBlockSize - 1) / m_nBlockSize;
+    size_t nBlocks = (size_t)m_nBlocksX * m_nBlocksY;
+    m_vMvx.assign(nBlocks, 0);
+    m_vMvy.assign(nBlocks, 0);
+    m_vCoverage.assign(nBlocks, 0);
+    m_vHints.clear();
+    m_vSbHints.clear();
+    if (bSuperblocks)
+    {
+        m_vSbHints.resize(nBlocks);
+    }
+    else
+    {
+        m_vHints.resize(nBlocks);
+    }
+}
+
+int MotionHints::Update(const DXGI_OUTDUPL_MOVE_RECT *pMoves, size_t nMoves)
+{
+    const int B = m_nBlockSize;
+    std::fill(m_vMvx.begin(), m_vMvx.end(), (int16_t)0);
+    std::fill(m_vMvy.begin(), m_vMvy.end(), (int16_t)0);
+    std::fill(m_vCoverage.begin(), m_vCoverage.end(), 0);
+
+    for (size_t i = 0; i < nMoves; i++)
+    {
+        const RECT &dst = pMoves[i].DestinationRect;
+        int mvx = pMoves[i].SourcePoint.x - dst.left;
+        int mvy = pMoves[i].SourcePoint.y - dst.top;
+        if ((mvx == 0 && mvy == 0) || mvx < MVX_MIN || mvx > MVX_MAX || mvy < MVY_MIN || mvy > MVY_MAX)
+        {
+            continue;
+        }
+        int left = std::max((int)dst.left, 0);
+        int top = std::max((int)dst.top, 0);
+        int right = std::min((int)dst.right, m_nWidth);
+        int bottom = std::min((int)dst.bottom, m_nHeight);
+        if (left >= right || top >= bottom)
+        {
+            continue;
+        }
+        for (int by = top / B; by <= (bottom - 1) / B; by++)
+        {
+            int y0 = by * B;
+            int y1 = std::min(y0 + B, m_nHeight);
+            int h = std::min(y1, bottom) - std::max(y0, top);
+            for (int bx = left / B; bx <= (right - 1) / B; bx++)
+            {
+                int x0 = bx * B;
+                int x1 = std::min(x0 + B, m_nWidth);
+                int covered = (std::min(x1, right) - std::max(x0, left)) * h;
+                size_t j = (size_t)by * m_nBlocksX + bx;
+                /// Blocks at the right and bottom edge may be partial, half of what is inside the frame
+                if (covered * 2 >= (x1 - x0) * (y1 - y0) && covered > m_vCoverage[j])
+                {
+                    m_vCoverage[j] = covered;
+                    m_vMvx[j] = (int16_t)mvx;
+                    m_vMvy[j] = (int16_t)mvy;
+                }
+            }
+        }
+    }
+
+    int nMoved = 0;
+    for (size_t j = 0; j < m_vMvx.size(); j++)
+    {
+        nMoved += m_vCoverage[j] > 0;
+        if (m_bSuperblocks)
+        {
+            NVENC_EXTERNAL_ME_SB_HINT &hint = m_vSbHints[j];
+            memset(&hint, 0, sizeof(hint));
+            /// One 64x64 CU at (0, 0) of the superblock, single reference, in quarter pixels
+            hint.cu_size = 3;
+            hint.last_of_cu = 1;
+            hint.last_of_sb = 1;
+            hint.mvx = (int16_t)(m_vMvx[j] * 4);
+            hint.mvy = (int16_t)(m_vMvy[j] * 4);
+        }
+        else
+        {
+            NVENC_EXTERNAL_ME_HINT &hint = m_vHints[j];
+            memset(&hint, 0, sizeof(hint));
+            /// One 16x16 partition, L0, the closest reference
+            hint.mvx = m_vMvx[j];
+            hint.mvy = m_vMvy[j];
+            hint.lastofPart = 1;
+            hint.lastOfMB = 1;
+        }
+    }
+    return nMoved;
+}
@@ -0,0 +1,243 @@
+#include "Defs.hpp"
+#include "MultiOutputCapture.hpp"
+#include <stdio.h>
+#include <algorithm>
+
+MultiOutputCapture::MultiOutputCapture(ID3D11Device *pDev, ID3D11DeviceContext *pDevCtx)
+    : pD3DDev(pDev)
+    , pCtx(pDevCtx)
+{
+    pD3DDev->AddRef();
+    pCtx->AddRef();
+}
+
+HRESULT MultiOutputCapture::Init()
+{
+    HRESULT hr = S_OK;
+    for (ICaptureSource *pSource : vSources)
+    {
+        pSource->setCompositeCursor(bCompositeCursor);
+        if (FAILED(hr = pSource->Init()))
+        {
+            PRINTERR(hr, "Display Init");
+            return hr;
+        }
+    }
+    /// A cloned display shows the same desktop area as the one it clones
+    for (size_t i = 0; i < vSources.size(); i++)
+    {
+        for (size_t j = 0; j < i; j++)
+        {
+            if (OutputLayout::Overlaps(vSources[i]->getDesktopRect(), vSources[j]->getDesktopRect()))
+            {
+                printf("%s: Display %zu overlaps display %zu, skipped\n", __FUNCTION__, i, j);
+                vSources[i]->Cleanup();
+                delete vSources[i];
+                vSources.erase(vSources.begin() + i);
+                i--;
+                break;
+            }
+        }
+    }
+    return InitCanvas();
+}
+
+HRESULT MultiOutputCapture::InitCanvas()
+{
+    SAFE_RELEASE(pCanvas);
+    std::vector<RECT> vRects;
+    for (ICaptureSource *pSource : vSources)
+    {
+        vRects.push_back(pSource->getDesktopRect());
+    }
+    if (!layout.Init(vRects))
+    {
+        printf("%s: No displays, or displays overlap\n", __FUNCTION__);
+        return E_FAIL;
+    }
+    width = layout.GetCanvasWidth();
+    height = layout.GetCanvasHeight();
+    desktopRect = vRects[0];
+    for (const RECT &rc : vRects)
+    {
+        desktopRect.left = std::min(desktopRect.left, rc.left);
+        desktopRect.top = std::min(desktopRect.top, rc.top);
+        desktopRect.right = std::max(desktopRect.right, rc.right);
+        desktopRect.bottom = std::max(desktopRect.bottom, rc.bottom);
+    }
+
+    D3D11_TEXTURE2D_DESC desc;
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    /// Same bind flags as a DDA surface, so the video processor accepts it as input
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+    HRESULT hr = pD3DDev->CreateTexture2D(&desc, nullptr, &pCanvas);
+    if (FAILED(hr))
+    {
+        PRINTERR(hr, "CreateTexture2D");
+        return hr;
+    }
+    /// Gaps between displays of different sizes are never written
+    ID3D11RenderTargetView *pRTV = nullptr;
+    if (SUCCEEDED(pD3DDev->CreateRenderTargetView(pCanvas, nullptr, &pRTV)))
+    {
+        const FLOAT black[4] = { 0, 0, 0, 1 };
+        pCtx->ClearRenderTargetView(pRTV, black);
+        SAFE_RELEASE(pRTV);
+    }
+
+    damage.Init(width, height);
+    vFormatReported.assign(vSources.size(), false);
+    nextSource = 0;
+    printf("%s: %zu displays on a %ux%u canvas\n", __FUNCTION__, vSources.size(), width, height);
+    for (size_t i = 0; i < vSources.size(); i++)
+    {
+        const RECT &rc = layout.GetRect(i);
+        printf("%s: Display %zu at %ld,%ld %ldx%ld\n", __FUNCTION__, i, rc.left, rc.top, rc.right - rc.left, rc.bottom - rc.top);
+    }
+    return S_OK;
+}
+
+HRESULT MultiOutputCapture::Reacquire()
+{
+    HRESULT hr = S_OK;
+    for (ICaptureSource *pSource : vSources)
+    {
+        if (FAILED(hr = pSource->Reacquire()))
+        {
+            return hr;
+        }
+    }
+    /// A mode change or a rearrangement moves the displays on the canvas
+    for (size_t i = 0; i < vSources.size(); i++)
+    {
+        RECT rc = vSources[i]->getDesktopRect();
+        const RECT &old = layout.GetRect(i);
+        if (rc.right - rc.left != old.right - old.left || rc.bottom - rc.top != old.bottom - old.top ||
+            rc.left - desktopRect.left != old.left || rc.top - desktopRect.top != old.top)
+        {
+            return InitCanvas();
+        }
+    }
+    /// The canvas keeps the old pixels, the next frame of each display repaints it
+    return S_OK;
+}
+
+void MultiOutputCapture::CopyToCanvas(size_t i, ID3D11Texture2D *pTex)
+{
+    D3D11_TEXTURE2D_DESC desc;
+    pTex->GetDesc(&desc);
+    const RECT &origin = layout.GetRect(i);
+    if (desc.Format != DXGI_FORMAT_B8G8R8A8_UNORM || (LONG)desc.Width != origin.right - origin.left ||
+        (LONG)desc.Height != origin.bottom - origin.top)
+    {
+        /// E.g. an HDR display delivering FP16. Reacquire() picks up a size change
+        if (!vFormatReported[i])
+        {
+            printf("%s: Display %zu delivers %ux%u format %d, not composited\n", __FUNCTION__, i, desc.Width, desc.Height, (int)desc.Format);
+            vFormatReported[i] = true;
+        }
+        return;
+    }
+
+    ICaptureSource *pSource = vSources[i];
+    OutputLayout::GetDirtyRuns(pSource->getDamage(), vRuns);
+    for (const RECT &run : vRuns)
+    {
+        D3D11_BOX box = { (UINT)run.left, (UINT)run.top, 0, (UINT)run.right, (UINT)run.bottom, 1 };
+        pCtx->CopySubresourceRegion(pCanvas, 0, origin.left + run.left, origin.top + run.top, 0, pTex, 0, &box);
+    }
+    layout.MapDamage(i, vRuns, damage);
+    layout.MapMoveRects(i, pSource->getMoveRects(), vMoveRects);
+}
+
+HRESULT MultiOutputCapture::GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait)
+{
+    damage.Clear();
+    vMoveRects.clear();
+    presentTime = 0;
+    bool bUpdated = false;
+    const size_t n = vSources.size();
+    /// The wait is shared by the displays polled before the first update
+    int waitEach = n ? wait / (int)n : 0;
+    for (size_t k = 0; k < n; k++)
+    {
+        size_t i = (nextSource + k) % n;
+        ID3D11Texture2D *pTex = nullptr;
+        HRESULT hr = vSources[i]->GetCapturedFrame(&pTex, bUpdated ? 0 : waitEach);
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+        {
+            continue;
+        }
+        if (FAILED(hr))
+        {
+            /// Reacquire() recovers all displays
+            SAFE_RELEASE(pTex);
+            return hr;
+        }
+        CopyToCanvas(i, pTex);
+        SAFE_RELEASE(pTex);
+        LONGLONG present = vSources[i]->getPresentTime();
+        presentTime = presentTime ? std::min(presentTime, present) : present;
+        bUpdated = true;
+    }
+    nextSource = n ? (nextSource + 1) % n : 0;
+
+    /// The pointer is drawn on the canvas from the display it is on
+    if (bCompositeCursor)
+    {
+        size_t owner = 0;
+        while (owner < n && !vSources[owner]->getCursor().IsVisible())
+        {
+            owner++;
+        }
+        if (owner < n)
+        {
+            const RECT &origin = layout.GetRect(owner);
+            cursor.Follow(vSources[owner]->getCursor(), origin.left, origin.top);
+        }
+        else
+        {
+            /// Hidden, or on a display that is not captured
+            cursor.UpdatePosition(0, 0, false);
+        }
+        cursor.AddDamage(damage);
+    }
+
+    if (!bUpdated)
+    {
+        return DXGI_ERROR_WAIT_TIMEOUT;
+    }
+    pCanvas->AddRef();
+    *ppTex2D = pCanvas;
+    return S_OK;
+}
+
+void MultiOutputCapture::setCompositeCursor(bool bEnable)
+{
+    bCompositeCursor = bEnable;
+    for (ICaptureSource *pSource : vSources)
+    {
+        pSource->setCompositeCursor(bEnable);
+    }
+}
+
+int MultiOutputCapture::Cleanup()
+{
+    for (ICaptureSource *pSource : vSources)
+    {
+        pSource->Cleanup();
+        delete pSource;
+    }
+    vSources.clear();
+    SAFE_RELEASE(pCanvas);
+    SAFE_RELEASE(pCtx);
+    SAFE_RELEASE(pD3DDev);
+    return 0;
+}
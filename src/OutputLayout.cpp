@@ -0,0 +1,119 @@
+#include "OutputLayout.hpp"
+#include <algorithm>
+
+bool OutputLayout::Overlaps(const RECT &a, const RECT &b)
+{
+    return a.left < b.right && b.left < a.right && a.top < b.bottom && b.top < a.bottom;
+}
+
+bool OutputLayout::Init(const std::vector<RECT> &vDesktopRects)
+{
+    m_vRects.clear();
+    m_nWidth = m_nHeight = 0;
+    if (vDesktopRects.empty())
+    {
+        return false;
+    }
+    LONG minX = vDesktopRects[0].left, minY = vDesktopRects[0].top;
+    LONG maxX = vDesktopRects[0].right, maxY = vDesktopRects[0].bottom;
+    for (size_t i = 0; i < vDesktopRects.size(); i++)
+    {
+        const RECT &rc = vDesktopRects[i];
+        if (rc.right <= rc.left || rc.bottom <= rc.top)
+        {
+            return false;
+        }
+        for (size_t j = 0; j < i; j++)
+        {
+            if (Overlaps(rc, vDesktopRects[j]))
+            {
+                return false;
+            }
+        }
+        minX = std::min(minX, rc.left);
+        minY = std::min(minY, rc.top);
+        maxX = std::max(maxX, rc.right);
+        maxY = std::max(maxY, rc.bottom);
+    }
+    for (const RECT &rc : vDesktopRects)
+    {
+        m_vRects.push_back({ rc.left - minX, rc.top - minY, rc.right - minX, rc.bottom - minY });
+    }
+    m_nWidth = (int)(maxX - minX + 1) & ~1;
+    m_nHeight = (int)(maxY - minY + 1) & ~1;
+    return true;
+}
+
+void OutputLayout::GetDirtyRuns(const DamageMap &damage, FrameVector<RECT> &vRuns)
+{
+    vRuns.clear();
+    const int tile = DamageMap::TILE_SIZE;
+    /// Runs of the previous row, open for merging with an identical run in this row
+    size_t firstOpen = 0;
+    for (int ty = 0; ty < damage.GetTilesY(); ty++)
+    {
+        size_t rowStart = vRuns.size();
+        size_t nextOpen = firstOpen;
+        LONG top = ty * tile;
+        LONG bottom = std::min(top + tile, (LONG)damage.GetHeight());
+        for (int tx = 0; tx < damage.GetTilesX(); tx++)
+        {
+            if (!damage.IsDirty(tx, ty))
+            {
+                continue;
+            }
+            int end = tx;
+            while (end < damage.GetTilesX() && damage.IsDirty(end, ty))
+            {
+                end++;
+            }
+            LONG left = tx * tile;
+            LONG right = std::min(end * tile, damage.GetWidth());
+            tx = end;
+
+            /// Runs are ordered by x, so a matching run of the previous row is at or after nextOpen
+            while (nextOpen < rowStart && vRuns[nextOpen].left < left)
+            {
+                nextOpen++;
+            }
+            if (nextOpen < rowStart && vRuns[nextOpen].left == left && vRuns[nextOpen].right == right && vRuns[nextOpen].bottom == top)
+            {
+                /// Moved to the end, so this row's runs stay ordered and the merged run stays open
+                RECT run = vRuns[nextOpen];
+                run.bottom = bottom;
+                vRuns.erase(vRuns.begin() + nextOpen);
+                rowStart--;
+                vRuns.push_back(run);
+            }
+            else
+            {
+                vRuns.push_back({ left, top, right, bottom });
+            }
+        }
+        firstOpen = rowStart;
+    }
+}
+
+void OutputLayout::MapDamage(size_t i, const FrameVector<RECT> &vRuns, DamageMap &canvas) const
+{
+    const RECT &origin = m_vRects[i];
+    for (const RECT &run : vRuns)
+    {
+        canvas.AddRect(origin.left + run.left, origin.top + run.top, origin.left + run.right, origin.top + run.bottom);
+    }
+}
+
+void OutputLayout::MapMoveRects(size_t i, const std::vector<DXGI_OUTDUPL_MOVE_RECT> &vMoves, std::vector<DXGI_OUTDUPL_MOVE_RECT> &vCanvasMoves) const
+{
+    const RECT &origin = m_vRects[i];
+    for (DXGI_OUTDUPL_MOVE_RECT move : vMoves)
+    {
+        move.SourcePoint.x += origin.left;
+        move.SourcePoint.y += origin.top;
+        move.DestinationRect.left += origin.left;
+        move.DestinationRect.top += origin.top;
+        move.DestinationRect.right += origin.left;
+        move.DestinationRect.bottom += origin.top;
+        vCanvasMoves.push_back(move);
+    }
+}
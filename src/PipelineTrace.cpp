@@ -0,0 +1,462 @@
+#include "PipelineTrace.hpp"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <map>
+#include <fstream>
+#include <algorithm>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    /// QPC on Windows, the steady clock in nanoseconds elsewhere
+    int64_t GetTickFrequency()
+    {
+#if defined(_WIN32)
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        return freq.QuadPart;
+#else
+        return 1000000000;
+#endif
+    }
+
+    uint32_t GetThreadId()
+    {
+#if defined(_WIN32)
+        return GetCurrentThreadId();
+#else
+        return (uint32_t)std::hash<std::thread::id>()(std::this_thread::get_id());
+#endif
+    }
+
+    uint32_t GetProcessId()
+    {
+#if defined(_WIN32)
+        return GetCurrentProcessId();
+#else
+        return (uint32_t)getpid();
+#endif
+    }
+
+    struct Ring
+    {
+        TraceSpanRecord records[PipelineTrace::RING_SIZE];
+        /// Spans recorded by the thread, written by it only
+        std::atomic<uint64_t> head{ 0 };
+        /// Spans before this one were cleared
+        std::atomic<uint64_t> base{ 0 };
+        std::atomic<const char *> szThreadName{ nullptr };
+        uint32_t tid = 0;
+    };
+
+    struct TraceState
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Ring>> vRings;
+    };
+
+    /// Never destroyed, threads may end spans during exit
+    TraceState &GetState()
+    {
+        static TraceState *s_pState = new TraceState();
+        return *s_pState;
+    }
+
+    /// Rings outlive their threads, the spans stay exportable
+    thread_local Ring *t_pRing = nullptr;
+    /// Set before the thread's first span, which allocates the ring
+    thread_local const char *t_szThreadName = nullptr;
+
+    Ring *GetThreadRing()
+    {
+        if (!t_pRing)
+        {
+            TraceState &state = GetState();
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.vRings.push_back(std::make_unique<Ring>());
+            t_pRing = state.vRings.back().get();
+            t_pRing->tid = GetThreadId();
+            t_pRing->szThreadName.store(t_szThreadName, std::memory_order_relaxed);
+        }
+        return t_pRing;
+    }
+
+    struct ThreadSpans
+    {
+        uint32_t tid;
+        std::string name;
+        std::vector<TraceSpanRecord> vSpans;
+    };
+
+    /// Copy what the rings hold. Slots the threads overwrote while they were copied are left out
+    std::vector<ThreadSpans> Snapshot()
+    {
+        TraceState &state = GetState();
+        std::lock_guard<std::mutex> lock(state.mutex);
+        std::vector<ThreadSpans> vThreads;
+        for (std::unique_ptr<Ring> &pRing : state.vRings)
+        {
+            const uint64_t SIZE = PipelineTrace::RING_SIZE;
+            uint64_t head = pRing->head.load(std::memory_order_acquire);
+            uint64_t first = std::max(pRing->base.load(std::memory_order_relaxed), head > SIZE ? head - SIZE : 0);
+            ThreadSpans thread;
+            thread.tid = pRing->tid;
+            const char *szName = pRing->szThreadName.load(std::memory_order_relaxed);
+            thread.name = szName ? szName : "thread " + std::to_string(pRing->tid);
+            for (uint64_t i = first; i < head; i++)
+            {
+                thread.vSpans.push_back(pRing->records[i % SIZE]);
+            }
+            uint64_t newHead = pRing->head.load(std::memory_order_acquire);
+            if (newHead > SIZE && newHead - SIZE > first)
+            {
+                size_t nOverwritten = (size_t)std::min(newHead - SIZE - first, (uint64_t)thread.vSpans.size());
+                thread.vSpans.erase(thread.vSpans.begin(), thread.vSpans.begin() + nOverwritten);
+            }
+            vThreads.push_back(std::move(thread));
+        }
+        return vThreads;
+    }
+
+    int64_t ToNs(int64_t ticks, int64_t freq)
+    {
+        return ticks / freq * 1000000000 + ticks % freq * 1000000000 / freq;
+    }
+
+    std::string EscapeJson(const std::string &s)
+    {
+        std::string escaped;
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+            {
+                escaped += '\\';
+            }
+            escaped += (unsigned char)c < 0x20 ? ' ' : c;
+        }
+        return escaped;
+    }
+
+    /// Position of each span of a frame in time order, for the flow arrows: 0 first, 2 last, 1 between
+    std::map<const TraceSpanRecord *, int> GetFlowSteps(const std::vector<ThreadSpans> &vThreads)
+    {
+        std::map<uint64_t, std::vector<const TraceSpanRecord *>> frames;
+        for (const ThreadSpans &thread : vThreads)
+        {
+            for (const TraceSpanRecord &span : thread.vSpans)
+            {
+                if (span.frame != PipelineTrace::NO_FRAME)
+                {
+                    frames[span.frame].push_back(&span);
+                }
+            }
+        }
+        std::map<const TraceSpanRecord *, int> steps;
+        for (auto &frame : frames)
+        {
+            std::vector<const TraceSpanRecord *> &vSpans = frame.second;
+            if (vSpans.size() < 2)
+            {
+                continue;
+            }
+            std::stable_sort(vSpans.begin(), vSpans.end(), [](const TraceSpanRecord *a, const TraceSpanRecord *b) { return a->start < b->start; });
+            for (size_t i = 0; i < vSpans.size(); i++)
+            {
+                steps[vSpans[i]] = i == 0 ? 0 : i + 1 == vSpans.size() ? 2 : 1;
+            }
+        }
+        return steps;
+    }
+
+    bool WriteChromeJson(const char *szPath, const std::vector<ThreadSpans> &vThreads, int64_t freq, int64_t origin)
+    {
+        std::ofstream fp(szPath, std::ios::out | std::ios::trunc);
+        if (!fp.is_open())
+        {
+            return false;
+        }
+        const unsigned pid = GetProcessId();
+        std::map<const TraceSpanRecord *, int> steps = GetFlowSteps(vThreads);
+        const char *szFlowPhases = "stf";
+        char szLine[512];
+        fp << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+        bool bFirst = true;
+        auto writeLine = [&](const char *sz)
+        {
+            fp << (bFirst ? "" : ",\n") << sz;
+            bFirst = false;
+        };
+        for (const ThreadSpans &thread : vThreads)
+        {
+            snprintf(szLine, sizeof(szLine), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+                pid, thread.tid, EscapeJson(thread.name).c_str());
+            writeLine(szLine);
+            for (const TraceSpanRecord &span : thread.vSpans)
+            {
+                /// Microseconds with nanosecond digits
+                double ts = ToNs(span.start - origin, freq) / 1000.0;
+                double dur = ToNs(span.end - span.start, freq) / 1000.0;
+                std::string name = EscapeJson(span.szName);
+                if (span.frame == PipelineTrace::NO_FRAME)
+                {
+                    snprintf(szLine, sizeof(szLine), "{\"name\":\"%s\",\"cat\":\"pipeline\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u}",
+                        name.c_str(), ts, dur, pid, thread.tid);
+                    writeLine(szLine);
+                    continue;
+                }
+                snprintf(szLine, sizeof(szLine), "{\"name\":\"%s\",\"cat\":\"pipeline\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,\"args\":{\"frame\":%llu}}",
+                    name.c_str(), ts, dur, pid, thread.tid, (unsigned long long)span.frame);
+                writeLine(szLine);
+                auto step = steps.find(&span);
+                if (step != steps.end())
+                {
+                    /// At the start of the span; "bp":"e" binds the last one to the span enclosing it, not the next one
+                    snprintf(szLine, sizeof(szLine), "{\"name\":\"frame\",\"cat\":\"frame\",\"ph\":\"%c\",%s\"id\":%llu,\"ts\":%.3f,\"pid\":%u,\"tid\":%u}",
+                        szFlowPhases[step->second], step->second == 2 ? "\"bp\":\"e\"," : "", (unsigned long long)span.frame, ts, pid, thread.tid);
+                    writeLine(szLine);
+                }
+            }
+        }
+        fp << "\n]}\n";
+        return fp.good();
+    }
+
+    /// Just enough protobuf encoding for perfetto.protos.Trace
+    class ProtoWriter
+    {
+    public:
+        void Varint(int field, uint64_t value)
+        {
+            Tag(field, 0);
+            PutVarint(value);
+        }
+        void Fixed64(int field, uint64_t value)
+        {
+            Tag(field, 1);
+            for (int i = 0; i < 8; i++)
+            {
+                m_data += (char)(value >> (8 * i));
+            }
+        }
+        void Bytes(int field, const std::string &data)
+        {
+            Tag(field, 2);
+            PutVarint(data.size());
+            m_data += data;
+        }
+        void Message(int field, const ProtoWriter &message) { Bytes(field, message.m_data); }
+        const std::string &GetData() const { return m_data; }
+
+    private:
+        std::string m_data;
+        void Tag(int field, int wireType) { PutVarint((uint64_t)field << 3 | wireType); }
+        void PutVarint(uint64_t value)
+        {
+            while (value >= 0x80)
+            {
+                m_data += (char)(value | 0x80);
+                value >>= 7;
+            }
+            m_data += (char)value;
+        }
+    };
+
+    /// Field numbers of perfetto/protos/perfetto/trace
+    namespace Perfetto
+    {
+        const int TRACE_PACKET = 1;
+        const int PACKET_TIMESTAMP = 8;
+        const int PACKET_SEQUENCE_ID = 10;
+        const int PACKET_TRACK_EVENT = 11;
+        const int PACKET_SEQUENCE_FLAGS = 13;
+        const int PACKET_TRACK_DESCRIPTOR = 60;
+        const int SEQ_INCREMENTAL_STATE_CLEARED = 1;
+        const int TRACK_UUID = 1;
+        const int TRACK_PROCESS = 3;
+        const int TRACK_THREAD = 4;
+        const int PROCESS_PID = 1;
+        const int PROCESS_NAME = 6;
+        const int THREAD_PID = 1;
+        const int THREAD_TID = 2;
+        const int THREAD_NAME = 5;
+        const int EVENT_TYPE = 9;
+        const int EVENT_TRACK_UUID = 11;
+        const int EVENT_CATEGORIES = 22;
+        const int EVENT_NAME = 23;
+        const int EVENT_FLOW_IDS = 47;
+        const int EVENT_TERMINATING_FLOW_IDS = 48;
+        const int TYPE_SLICE_BEGIN = 1;
+        const int TYPE_SLICE_END = 2;
+        const uint32_t SEQUENCE_ID = 1;
+    }
+
+    bool WritePerfetto(const char *szPath, const std::vector<ThreadSpans> &vThreads, int64_t freq, int64_t origin)
+    {
+        using namespace Perfetto;
+        std::ofstream fp(szPath, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!fp.is_open())
+        {
+            return false;
+        }
+        const uint32_t pid = GetProcessId();
+        const uint64_t PROCESS_UUID = 1;
+        auto writePacket = [&fp](ProtoWriter &packet)
+        {
+            packet.Varint(PACKET_SEQUENCE_ID, SEQUENCE_ID);
+            ProtoWriter trace;
+            trace.Message(TRACE_PACKET, packet);
+            fp.write(trace.GetData().data(), trace.GetData().size());
+        };
+
+        ProtoWriter process, processTrack, packet;
+        process.Varint(PROCESS_PID, pid);
+        process.Bytes(PROCESS_NAME, "nvEncDXGIOutputDuplicationSample");
+        processTrack.Varint(TRACK_UUID, PROCESS_UUID);
+        processTrack.Message(TRACK_PROCESS, process);
+        packet.Message(PACKET_TRACK_DESCRIPTOR, processTrack);
+        packet.Varint(PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED);
+        writePacket(packet);
+
+        struct Event
+        {
+            int64_t ts;
+            bool bBegin;
+            size_t iThread;
+            const TraceSpanRecord *pSpan;
+        };
+        std::vector<Event> vEvents;
+        for (size_t i = 0; i < vThreads.size(); i++)
+        {
+            ProtoWriter thread, threadTrack, threadPacket;
+            thread.Varint(THREAD_PID, pid);
+            thread.Varint(THREAD_TID, vThreads[i].tid);
+            thread.Bytes(THREAD_NAME, vThreads[i].name);
+            threadTrack.Varint(TRACK_UUID, PROCESS_UUID + 1 + i);
+            threadTrack.Message(TRACK_THREAD, thread);
+            threadPacket.Message(PACKET_TRACK_DESCRIPTOR, threadTrack);
+            writePacket(threadPacket);
+            for (const TraceSpanRecord &span : vThreads[i].vSpans)
+            {
+                vEvents.push_back({ span.start, true, i, &span });
+                vEvents.push_back({ span.end, false, i, &span });
+            }
+        }
+        /// In time order; at equal times ends before begins, outer spans begin first and end last
+        std::stable_sort(vEvents.begin(), vEvents.end(), [](const Event &a, const Event &b)
+        {
+            if (a.ts != b.ts)
+            {
+                return a.ts < b.ts;
+            }
+            if (a.bBegin != b.bBegin)
+            {
+                return !a.bBegin;
+            }
+            return a.bBegin ? a.pSpan->end > b.pSpan->end : a.pSpan->start > b.pSpan->start;
+        });
+
+        std::map<const TraceSpanRecord *, int> steps = GetFlowSteps(vThreads);
+        for (const Event &event : vEvents)
+        {
+            ProtoWriter trackEvent, eventPacket;
+            trackEvent.Varint(EVENT_TYPE, event.bBegin ? TYPE_SLICE_BEGIN : TYPE_SLICE_END);
+            trackEvent.Varint(EVENT_TRACK_UUID, PROCESS_UUID + 1 + event.iThread);
+            if (event.bBegin)
+            {
+                trackEvent.Bytes(EVENT_CATEGORIES, "pipeline");
+                trackEvent.Bytes(EVENT_NAME, event.pSpan->szName);
+                auto step = steps.find(event.pSpan);
+                if (step != steps.end())
+                {
+                    /// Ids of 0 are not flows
+                    trackEvent.Fixed64(step->second == 2 ? EVENT_TERMINATING_FLOW_IDS : EVENT_FLOW_IDS, event.pSpan->frame + 1);
+                }
+            }
+            eventPacket.Varint(PACKET_TIMESTAMP, (uint64_t)ToNs(event.ts - origin, freq));
+            eventPacket.Message(PACKET_TRACK_EVENT, trackEvent);
+            writePacket(eventPacket);
+        }
+        return fp.good();
+    }
+}
+
+std::atomic<bool> PipelineTrace::s_bEnabled{ false };
+
+int64_t PipelineTrace::GetTicks()
+{
+#if defined(_WIN32)
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void PipelineTrace::Record(const char *szName, int64_t start, int64_t end, uint64_t frame)
+{
+    Ring *pRing = GetThreadRing();
+    uint64_t head = pRing->head.load(std::memory_order_relaxed);
+    TraceSpanRecord &record = pRing->records[head % RING_SIZE];
+    record.start = start;
+    record.end = end;
+    record.szName = szName;
+    record.frame = frame;
+    pRing->head.store(head + 1, std::memory_order_release);
+}
+
+void PipelineTrace::SetThreadName(const char *szName)
+{
+    t_szThreadName = szName;
+    if (t_pRing)
+    {
+        t_pRing->szThreadName.store(szName, std::memory_order_relaxed);
+    }
+}
+
+void PipelineTrace::Clear()
+{
+    TraceState &state = GetState();
+    std::lock_guard<std::mutex> lock(state.mutex);
+    for (std::unique_ptr<Ring> &pRing : state.vRings)
+    {
+        pRing->base.store(pRing->head.load(std::memory_order_acquire), std::memory_order_relaxed);
+    }
+}
+
+int64_t PipelineTrace::Export(const char *szPath)
+{
+    std::vector<ThreadSpans> vThreads = Snapshot();
+    int64_t nSpans = 0;
+    int64_t origin = INT64_MAX;
+    for (const ThreadSpans &thread : vThreads)
+    {
+        nSpans += thread.vSpans.size();
+        for (const TraceSpanRecord &span : thread.vSpans)
+        {
+            origin = std::min(origin, span.start);
+        }
+    }
+    const int64_t freq = GetTickFrequency();
+    size_t nLen = strlen(szPath);
+    bool bJson = nLen >= 5 && !strcmp(szPath + nLen - 5, ".json");
+    bool bOk = bJson ? WriteChromeJson(szPath, vThreads, freq, nSpans ? origin : 0)
+        : WritePerfetto(szPath, vThreads, freq, nSpans ? origin : 0);
+    if (!bOk)
+    {
+        printf("%s: Unable to write %s\n", __FUNCTION__, szPath);
+        return -1;
+    }
+    return nSpans;
+}
@@ -0,0 +1,149 @@
+#include "Defs.hpp"
+#include "ReplayCaptureSource.hpp"
+#include <stdio.h>
+#include <algorithm>
+
+ReplayCaptureSource::ReplayCaptureSource(ID3D11Device *pDev, ID3D11DeviceContext *pDevCtx, const std::string &_path, DWORD _width, DWORD _height)
+    : pD3DDev(pDev)
+    , pCtx(pDevCtx)
+    , path(_path)
+    , width(_width)
+    , height(_height)
+{
+    pD3DDev->AddRef();
+    pCtx->AddRef();
+}
+
+HRESULT ReplayCaptureSource::Init()
+{
+    fp.open(path, std::ios::in | std::ios::binary);
+    if (!fp)
+    {
+        printf("%s: Unable to open %s\n", __FUNCTION__, path.c_str());
+        return E_FAIL;
+    }
+
+    D3D11_TEXTURE2D_DESC desc;
+    ZeroMemory(&desc, sizeof(desc));
+    desc.Width = width;
+    desc.Height = height;
+    desc.MipLevels = 1;
+    desc.ArraySize = 1;
+    desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+    desc.SampleDesc.Count = 1;
+    desc.Usage = D3D11_USAGE_DEFAULT;
+    /// Same bind flags as a DDA surface, so the video processor accepts it as input
+    desc.BindFlags = D3D11_BIND_RENDER_TARGET | D3D11_BIND_SHADER_RESOURCE;
+    HRESULT hr = pD3DDev->CreateTexture2D(&desc, nullptr, &pTex);
+    if (FAILED(hr))
+    {
+        PRINTERR(hr, "CreateTexture2D");
+        return hr;
+    }
+
+    pitch = LargePageBuffer::GetPitch((size_t)width * 4);
+    if (!frame.Allocate(pitch * height))
+    {
+        return E_OUTOFMEMORY;
+    }
+    hasher.Init(width, height);
+    damage.Init(width, height);
+    framesSinceInject = 0;
+    bLost = false;
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::Reacquire()
+{
+    /// The file position is kept, playback continues where the loss happened
+    bLost = false;
+    framesSinceInject = 0;
+    hasher.Reset();
+    return S_OK;
+}
+
+HRESULT ReplayCaptureSource::GetCapturedFrame(ID3D11Texture2D **ppTex2D, int wait)
+{
+    if (bLost)
+    {
+        return injectError;
+    }
+    if (injectEvery && ++framesSinceInject > injectEvery)
+    {
+        printf("%s: %llu : Injecting error 0x%x\n", __FUNCTION__, (unsigned long long)frameno, injectError);
+        bLost = true;
+        return injectError;
+    }
+
+    vMoveRects.clear();
+    if (scrollStep && frameno > 0)
+    {
+        /// Rows leaving at the top come back at the bottom, so the page never ends
+        UINT step = scrollStep % height;
+        uint8_t *pFrame = frame.GetData();
+        std::rotate(pFrame, pFrame + step * pitch, pFrame + pitch * height);
+        DXGI_OUTDUPL_MOVE_RECT move;
+        move.SourcePoint.x = 0;
+        move.SourcePoint.y = step;
+        move.DestinationRect = { 0, 0, (LONG)width, (LONG)(height - step) };
+        vMoveRects.push_back(move);
+    }
+    else if (!readFrame())
+    {
+        /// Loop
+        fp.clear();
+        fp.seekg(0);
+        if (!readFrame())
+        {
+            printf("%s: %s holds no complete %ux%u frame\n", __FUNCTION__, path.c_str(), width, height);
+            return E_FAIL;
+        }
+    }
+
+    hasher.Process(frame.GetData(), (int)pitch, damage);
+    if (damage.Empty())
+    {
+        /// Same as DDA when the desktop did not change
+        return DXGI_ERROR_WAIT_TIMEOUT;
+    }
+
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    presentTime = now.QuadPart;
+    pCtx->UpdateSubresource(pTex, 0, nullptr, frame.GetData(), (UINT)pitch, 0);
+    pTex->AddRef();
+    *ppTex2D = pTex;
+    frameno++;
+    return S_OK;
+}
+
+bool ReplayCaptureSource::readFrame()
+{
+    size_t rowBytes = (size_t)width * 4;
+    if (pitch == rowBytes)
+    {
+        return (bool)fp.read(reinterpret_cast<char *>(frame.GetData()), rowBytes * height);
+    }
+    for (DWORD y = 0; y < height; y++)
+    {
+        if (!fp.read(reinterpret_cast<char *>(frame.GetData() + y * pitch), rowBytes))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int ReplayCaptureSource::Cleanup()
+{
+    if (fp.is_open())
+    {
+        fp.close();
+    }
+    hasher.Cleanup();
+    frame.Free();
+    SAFE_RELEASE(pTex);
+    SAFE_RELEASE(pCtx);
+    SAFE_RELEASE(pD3DDev);
+    return 0;
+}
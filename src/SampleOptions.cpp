@@ -0,0 +1,304 @@
+#include "SampleOptions.hpp"
+#include "EncoderProfiles.hpp"
+#include <cstring>
+
+bool SampleOptions::Parse(int argc, char *argv[])
+{
+    std::string profileName;
+    EncoderProfiles profiles;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-nocursor"))
+        {
+            bNoCursor = true;
+        }
+        else if (!strcmp(argv[i], "-qpmap"))
+        {
+            bQpMap = true;
+        }
+        else if (!strcmp(argv[i], "-asyncoutput"))
+        {
+            bAsyncOutput = true;
+        }
+        else if (!strcmp(argv[i], "-coroutines"))
+        {
+            bCoroutines = true;
+        }
+        else if (!strcmp(argv[i], "-motionhints"))
+        {
+            bMotionHints = true;
+        }
+        else if (!strcmp(argv[i], "-replay") && i + 2 < argc)
+        {
+            unsigned w = 0, h = 0;
+            if (sscanf(argv[i + 1], "%ux%u", &w, &h) != 2)
+            {
+                printf("Invalid replay size '%s', expected WxH\n", argv[i + 1]);
+                return false;
+            }
+            replayWidth = w;
+            replayHeight = h;
+            replayPath = argv[i + 2];
+            i += 2;
+        }
+        else if (!strcmp(argv[i], "-injectloss") && i + 1 < argc)
+        {
+            injectEvery = (UINT)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-scroll") && i + 1 < argc)
+        {
+            scrollRows = (UINT)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchhints") && i + 1 < argc)
+        {
+            benchHintFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchrecovery") && i + 1 < argc)
+        {
+            benchRecoveryFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-abr") && i + 1 < argc)
+        {
+            if (!RateController::ParseLimits(argv[++i], rateConfig))
+            {
+                return false;
+            }
+            bAdaptiveBitrate = true;
+        }
+        else if (!strcmp(argv[i], "-abrtrace") && i + 1 < argc)
+        {
+            rateTracePath = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-benchabr") && i + 1 < argc)
+        {
+            benchAbrTrace = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-backpressure") && i + 1 < argc)
+        {
+            BackpressureConfig cfg;
+            if (!BackpressureController::ParseConfig(argv[++i], cfg))
+            {
+                return false;
+            }
+            backpressure = cfg;
+        }
+        else if (!strcmp(argv[i], "-benchbackpressure") && i + 1 < argc)
+        {
+            benchBackpressureFrames = atoi(argv[++i]);
+        }
+        else if ((!strcmp(argv[i], "-log") || !strcmp(argv[i], "-trace") || !strcmp(argv[i], "-metrics") || !strcmp(argv[i], "-metricsport")) && i + 1 < argc)
+        {
+            /// Handled by main()
+            i++;
+        }
+        else if (!strcmp(argv[i], "-benchtrace") && i + 1 < argc)
+        {
+            benchTraceSpans = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchmetrics") && i + 1 < argc)
+        {
+            benchMetricOps = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchlog") && i + 1 < argc)
+        {
+            benchLogRecords = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-partition") && i + 1 < argc)
+        {
+            PartitionConfig cfg;
+            if (!PartitionLayout::ParseConfig(argv[++i], cfg))
+            {
+                return false;
+            }
+            partition = cfg;
+        }
+        else if (!strcmp(argv[i], "-display") && i + 1 < argc)
+        {
+            captureOutput = (UINT)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-displays") && i + 1 < argc)
+        {
+            i++;
+            if (!strcmp(argv[i], "composite"))
+            {
+                outputMode = OutputMode::Composite;
+            }
+            else if (!strcmp(argv[i], "separate"))
+            {
+                outputMode = OutputMode::Separate;
+            }
+            else
+            {
+                printf("Invalid display mode '%s', expected composite or separate\n", argv[i]);
+                return false;
+            }
+        }
+        else if (!strcmp(argv[i], "-synthdisplays") && i + 1 < argc)
+        {
+            syntheticOutputs = (UINT)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-listdisplays"))
+        {
+            bListDisplays = true;
+            return true;
+        }
+        else if (!strcmp(argv[i], "-simulcast") && i + 1 < argc)
+        {
+            std::vector<RenditionConfig> vParsed;
+            if (!Simulcast::ParseRenditions(argv[++i], vParsed))
+            {
+                return false;
+            }
+            vRenditions = vParsed;
+        }
+        else if (!strcmp(argv[i], "-intrarefresh") && i + 1 < argc)
+        {
+            if (!CudaH264Array::ParseIntraRefresh(argv[++i], refresh))
+            {
+                return false;
+            }
+        }
+        else if (!strcmp(argv[i], "-reportloss") && i + 1 < argc)
+        {
+            reportLossEvery = (UINT)atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchrefresh") && i + 1 < argc)
+        {
+            benchRefreshFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchpages") && i + 1 < argc)
+        {
+            benchPagesFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-fusedconvert"))
+        {
+            bFusedConversion = true;
+        }
+        else if (!strcmp(argv[i], "-benchfused") && i + 1 < argc)
+        {
+            benchFusedFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchalloc") && i + 1 < argc)
+        {
+            benchAllocFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchsched") && i + 1 < argc)
+        {
+            benchSchedFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-benchhash") && i + 1 < argc)
+        {
+            benchHashFrames = atoi(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "-encprofile") && i + 1 < argc)
+        {
+            profileName = argv[++i];
+        }
+        else if (!strcmp(argv[i], "-encprofiles") && i + 1 < argc)
+        {
+            if (!profiles.LoadFile(argv[++i]))
+            {
+                return false;
+            }
+        }
+        else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "-help"))
+        {
+            bHelp = true;
+            return true;
+        }
+        else
+        {
+            encoderOptions += std::string(" ") + argv[i];
+        }
+    }
+    if (!profileName.empty())
+    {
+        const EncoderProfile *pProfile = profiles.Find(profileName);
+        if (!pProfile)
+        {
+            printf("Unknown encoder profile '%s'. Available:\n", profileName.c_str());
+            for (const EncoderProfile &profile : profiles.GetProfiles())
+            {
+                printf("  %s (%s)\n", profile.name.c_str(), profile.origin.c_str());
+            }
+            return false;
+        }
+        printf("Encoder profile %s: %s\n", pProfile->name.c_str(), pProfile->options.c_str());
+        encoderOptions = pProfile->options + encoderOptions;
+    }
+    std::string error;
+    if (!EncoderProfiles::Validate(encoderOptions, error))
+    {
+        printf("Invalid encoder options '%s': %s\nRun with -h for the list of options.\n", encoderOptions.c_str(), error.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool SampleOptions::Apply(CudaH264Array &encoder) const
+{
+    if (bNoCursor)
+    {
+        encoder.SetCompositeCursor(false);
+    }
+    if (bQpMap)
+    {
+        encoder.SetQpMap(true);
+    }
+    if (bAsyncOutput)
+    {
+        encoder.SetAsyncOutput(true);
+    }
+    if (bMotionHints)
+    {
+        encoder.SetMotionHints(true);
+    }
+    if (bFusedConversion)
+    {
+        encoder.SetFusedConversion(true);
+    }
+    if (captureOutput)
+    {
+        encoder.SetCaptureOutput(*captureOutput);
+    }
+    if (outputMode)
+    {
+        encoder.SetOutputMode(*outputMode);
+    }
+    if (syntheticOutputs)
+    {
+        encoder.SetSyntheticOutputs(*syntheticOutputs);
+    }
+    if (partition)
+    {
+        encoder.SetPartition(*partition);
+    }
+    if (backpressure)
+    {
+        encoder.SetBackpressure(*backpressure);
+    }
+    if (!vRenditions.empty())
+    {
+        encoder.SetRenditions(vRenditions);
+    }
+    if (refresh.period)
+    {
+        encoder.SetIntraRefresh(refresh);
+    }
+    if (bAdaptiveBitrate)
+    {
+        encoder.SetRateControl(rateConfig);
+    }
+    if (!rateTracePath.empty() && !encoder.SetRateTrace(rateTracePath.c_str()))
+    {
+        printf("Cannot write rate trace %s\n", rateTracePath.c_str());
+        return false;
+    }
+    if (!replayPath.empty())
+    {
+        encoder.SetReplay(replayPath, replayWidth, replayHeight, injectEvery);
+        encoder.SetReplayScroll(scrollRows);
+    }
+    encoder.SetEncoderOptions(encoderOptions);
+    return true;
+}
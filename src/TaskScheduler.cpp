@@ -0,0 +1,367 @@
+#include "TaskScheduler.hpp"
+#include "PipelineTrace.hpp"
+#include <algorithm>
+#include <chrono>
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace
+{
+    /// Scheduler and index of the worker running on this thread, so Submit() from a task queues locally
+    thread_local TaskScheduler *t_pScheduler = nullptr;
+    thread_local int t_workerIndex = -1;
+}
+
+/// State of one ParallelFor() call, shared with its helper tasks. A helper that starts after every
+/// index was taken returns without touching the function, whose captures may be gone by then. Counted
+/// by the call and its helpers; the last one returns it to the scheduler for the next call
+struct TaskScheduler::ForState
+{
+    std::atomic<int> next{ 0 };
+    std::atomic<int> done{ 0 };
+    int count = 0;
+    void (*pfnCall)(void *, int) = nullptr;
+    void *pFn = nullptr;
+    std::atomic<int> nRefs{ 0 };
+    std::mutex mutex;
+    std::condition_variable cvDone;
+
+    void Work()
+    {
+        int i;
+        while ((i = next.fetch_add(1)) < count)
+        {
+            pfnCall(pFn, i);
+            if (done.fetch_add(1) + 1 == count)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                cvDone.notify_all();
+            }
+        }
+    }
+};
+
+void TaskScheduler::TaskRing::push_back(Task &&task)
+{
+    if (count == vTasks.size())
+    {
+        /// Unroll into a larger ring, oldest first
+        std::vector<Task> vLarger(std::max<size_t>(vTasks.size() * 2, 16));
+        for (size_t i = 0; i < count; i++)
+        {
+            vLarger[i] = std::move(vTasks[(head + i) % vTasks.size()]);
+        }
+        vTasks.swap(vLarger);
+        head = 0;
+    }
+    vTasks[(head + count) % vTasks.size()] = std::move(task);
+    count++;
+}
+
+TaskScheduler::Task TaskScheduler::TaskRing::pop_back()
+{
+    count--;
+    return std::move(vTasks[(head + count) % vTasks.size()]);
+}
+
+TaskScheduler::Task TaskScheduler::TaskRing::pop_front()
+{
+    Task task = std::move(vTasks[head]);
+    head = (head + 1) % vTasks.size();
+    count--;
+    return task;
+}
+
+TaskScheduler::TaskScheduler(int nWorkers, bool bPinThreads)
+{
+    if (nWorkers <= 0)
+    {
+        nWorkers = std::max((int)std::thread::hardware_concurrency() - 1, 1);
+    }
+    for (std::atomic<int> &queued : m_nQueued)
+    {
+        queued = 0;
+    }
+    m_nMaxBackground = std::max(nWorkers / 2, 1);
+    /// All deques exist before the first worker looks for work in them
+    for (int i = 0; i < nWorkers; i++)
+    {
+        m_vWorkers.push_back(std::make_unique<Worker>());
+    }
+    for (int i = 0; i < nWorkers; i++)
+    {
+        m_vWorkers[i]->thread = std::thread(&TaskScheduler::WorkerProc, this, i, bPinThreads);
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+        m_bQuit = true;
+    }
+    m_cvWork.notify_all();
+    for (std::unique_ptr<Worker> &pWorker : m_vWorkers)
+    {
+        pWorker->thread.join();
+    }
+    for (ForState *pState : m_vFreeForStates)
+    {
+        delete pState;
+    }
+}
+
+TaskScheduler &TaskScheduler::GetShared()
+{
+    static TaskScheduler s_scheduler;
+    return s_scheduler;
+}
+
+void TaskScheduler::Submit(std::function<void()> fn, TaskPriority priority, int affinity, TaskGroup *pGroup)
+{
+    Task task;
+    task.fn = std::move(fn);
+    task.priority = priority;
+    task.pGroup = pGroup;
+    if (pGroup)
+    {
+        pGroup->m_nPending.fetch_add(1);
+    }
+
+    const int n = (int)m_vWorkers.size();
+    int target;
+    if (affinity >= 0)
+    {
+        target = affinity % n;
+    }
+    else if (t_pScheduler == this && t_workerIndex >= 0)
+    {
+        target = t_workerIndex;
+    }
+    else
+    {
+        target = (int)(m_nNextWorker.fetch_add(1) % (unsigned)n);
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_vWorkers[target]->mutex);
+        m_vWorkers[target]->lanes[(int)priority].push_back(std::move(task));
+    }
+    m_nQueued[(int)priority].fetch_add(1);
+    {
+        /// Pairs with the check in WorkerProc(), so a worker going to sleep cannot miss the task
+        std::lock_guard<std::mutex> lock(m_sleepMutex);
+    }
+    m_cvWork.notify_one();
+}
+
+bool TaskScheduler::PopLane(int worker, int lane, bool bBack, Task &task)
+{
+    Worker &w = *m_vWorkers[worker];
+    std::lock_guard<std::mutex> lock(w.mutex);
+    TaskRing &ring = w.lanes[lane];
+    if (ring.empty())
+    {
+        return false;
+    }
+    task = bBack ? ring.pop_back() : ring.pop_front();
+    m_nQueued[lane].fetch_sub(1);
+    return true;
+}
+
+bool TaskScheduler::Take(int self, Task &task)
+{
+    const int n = (int)m_vWorkers.size();
+    for (int lane = 0; lane < (int)TaskPriority::Count; lane++)
+    {
+        if (m_nQueued[lane].load() == 0)
+        {
+            continue;
+        }
+        bool bBackground = lane == (int)TaskPriority::Background;
+        if (bBackground && m_nBackgroundRunning.fetch_add(1) >= m_nMaxBackground)
+        {
+            m_nBackgroundRunning.fetch_sub(1);
+            continue;
+        }
+        if (self >= 0 && PopLane(self, lane, true, task))
+        {
+            return true;
+        }
+        for (int k = 0; k < n; k++)
+        {
+            int victim = (self + 1 + k) % n;
+            if (victim != self && PopLane(victim, lane, false, task))
+            {
+                if (self >= 0)
+                {
+                    m_nStolen.fetch_add(1);
+                }
+                return true;
+            }
+        }
+        if (bBackground)
+        {
+            m_nBackgroundRunning.fetch_sub(1);
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::Run(Task &task)
+{
+    task.fn();
+    m_nExecuted.fetch_add(1);
+    if (task.priority == TaskPriority::Background)
+    {
+        m_nBackgroundRunning.fetch_sub(1);
+        if (m_nQueued[(int)TaskPriority::Background].load() > 0)
+        {
+            /// A background task may have been left queued for lack of a slot
+            std::lock_guard<std::mutex> lock(m_sleepMutex);
+            m_cvWork.notify_one();
+        }
+    }
+    if (task.pGroup)
+    {
+        /// Under the group's mutex, so Wait() cannot return and destroy the group before notify_all()
+        TaskGroup &group = *task.pGroup;
+        std::lock_guard<std::mutex> lock(group.m_mutex);
+        if (group.m_nPending.fetch_sub(1) == 1)
+        {
+            group.m_cvDone.notify_all();
+        }
+    }
+}
+
+bool TaskScheduler::HasWork()
+{
+    for (int lane = 0; lane < (int)TaskPriority::Count; lane++)
+    {
+        if (m_nQueued[lane].load() > 0 && (lane != (int)TaskPriority::Background || m_nBackgroundRunning.load() < m_nMaxBackground))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TaskScheduler::WorkerProc(int index, bool bPin)
+{
+    t_pScheduler = this;
+    t_workerIndex = index;
+    PipelineTrace::SetThreadName("scheduler worker");
+#if defined(_WIN32)
+    if (bPin)
+    {
+        SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << (index % (8 * sizeof(DWORD_PTR))));
+    }
+#else
+    (void)bPin;
+#endif
+    for (;;)
+    {
+        Task task;
+        if (Take(index, task))
+        {
+            Run(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_sleepMutex);
+        m_cvWork.wait(lock, [this] { return m_bQuit || HasWork(); });
+        if (m_bQuit && !HasWork())
+        {
+            return;
+        }
+    }
+}
+
+void TaskScheduler::Wait(TaskGroup &group)
+{
+    int self = t_pScheduler == this ? t_workerIndex : -1;
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lock(group.m_mutex);
+            if (group.m_nPending.load() == 0)
+            {
+                return;
+            }
+        }
+        Task task;
+        if (Take(self, task))
+        {
+            Run(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(group.m_mutex);
+        /// Bounded, tasks the group waits for may submit more work this thread could help with
+        group.m_cvDone.wait_for(lock, std::chrono::milliseconds(1), [&group] { return group.m_nPending.load() == 0; });
+    }
+}
+
+TaskScheduler::ForState *TaskScheduler::AcquireForState()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_forStateMutex);
+        if (!m_vFreeForStates.empty())
+        {
+            ForState *pState = m_vFreeForStates.back();
+            m_vFreeForStates.pop_back();
+            return pState;
+        }
+    }
+    /// One per ParallelFor() in flight at once, allocated the first time that many run
+    ForState *pState = new ForState();
+    std::lock_guard<std::mutex> lock(m_forStateMutex);
+    /// Room for every state, so releasing one never allocates
+    m_vFreeForStates.reserve(++m_nForStates);
+    return pState;
+}
+
+void TaskScheduler::ReleaseForState(ForState *pState)
+{
+    if (pState->nRefs.fetch_sub(1) == 1)
+    {
+        std::lock_guard<std::mutex> lock(m_forStateMutex);
+        m_vFreeForStates.push_back(pState);
+    }
+}
+
+void TaskScheduler::ParallelFor(int count, void (*pfnCall)(void *, int), void *pFn, TaskPriority priority, int maxParallel)
+{
+    if (count <= 0)
+    {
+        return;
+    }
+    int nThreads = maxParallel > 0 ? maxParallel : GetWorkerCount() + 1;
+    int nHelpers = std::min(std::min(nThreads, count) - 1, GetWorkerCount());
+    if (nHelpers <= 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            pfnCall(pFn, i);
+        }
+        return;
+    }
+
+    ForState *pState = AcquireForState();
+    pState->next = 0;
+    pState->done = 0;
+    pState->count = count;
+    pState->pfnCall = pfnCall;
+    pState->pFn = pFn;
+    pState->nRefs = 1 + nHelpers;
+    for (int h = 0; h < nHelpers; h++)
+    {
+        /// A pointer fits the small buffer of std::function, the task is not allocated either
+        Submit([this, pState] { pState->Work(); ReleaseForState(pState); }, priority);
+    }
+    pState->Work();
+    /// Only indices already taken are waited for, so helpers still queued behind a busy worker cannot block this
+    {
+        std::unique_lock<std::mutex> lock(pState->mutex);
+        pState->cvDone.wait(lock, [pState] { return pState->done.load() == pState->count; });
+    }
+    ReleaseForState(pState);
+}
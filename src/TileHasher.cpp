@@ -0,0 +1,196 @@
+#include "TileHasher.hpp"
+#include <emmintrin.h>
+#include <string.h>
+#include <algorithm>
+
+namespace
+{
+    const uint64_t PRIME32_1 = 0x9E3779B1ULL;
+    const uint64_t PRIME64_1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+
+    /// Stripe = 64 bytes = four 128-bit lanes; accumulators are scrambled every STRIPES_PER_BLOCK stripes
+    const int STRIPE_BYTES = 64;
+    const int STRIPES_PER_BLOCK = 16;
+
+    /// Pseudo random secret. Stripe n reads 64 bytes at offset 8 * n, the scramble key follows
+    struct Secret
+    {
+        alignas(16) uint64_t v[(STRIPE_BYTES + 8 * STRIPES_PER_BLOCK + 16) / 8];
+
+        Secret()
+        {
+            /// splitmix64
+            uint64_t x = PRIME64_2;
+            for (uint64_t &s : v)
+            {
+                uint64_t z = (x += PRIME64_1);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                s = z ^ (z >> 31);
+            }
+        }
+    };
+    const Secret g_secret;
+
+    inline void AccumulateStripe(__m128i acc[4], const uint8_t *p, int nStripe)
+    {
+        const uint8_t *pKey = (const uint8_t *)g_secret.v + 8 * nStripe;
+        for (int i = 0; i < 4; i++)
+        {
+            __m128i d = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            __m128i dk = _mm_xor_si128(d, _mm_loadu_si128((const __m128i *)(pKey + 16 * i)));
+            /// lo32 * hi32 of every 64-bit lane, plus the lane-swapped input so no bit is lost to the multiply
+            __m128i prod = _mm_mul_epu32(dk, _mm_srli_epi64(dk, 32));
+            acc[i] = _mm_add_epi64(acc[i], _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc[i] = _mm_add_epi64(acc[i], prod);
+        }
+    }
+
+    inline void Scramble(__m128i acc[4])
+    {
+        const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+        const uint8_t *pKey = (const uint8_t *)g_secret.v + STRIPE_BYTES + 8 * STRIPES_PER_BLOCK - 48;
+        for (int i = 0; i < 4; i++)
+        {
+            __m128i a = _mm_xor_si128(acc[i], _mm_srli_epi64(acc[i], 47));
+            a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(pKey + 16 * i)));
+            /// 64 x 32 bit multiply
+            __m128i lo = _mm_mul_epu32(a, prime);
+            __m128i hi = _mm_mul_epu32(_mm_srli_epi64(a, 32), prime);
+            acc[i] = _mm_add_epi64(lo, _mm_slli_epi64(hi, 32));
+        }
+    }
+
+    inline uint64_t Avalanche(uint64_t h)
+    {
+        h ^= h >> 37;
+        h *= 0x165667919E3779F9ULL;
+        return h ^ (h >> 32);
+    }
+}
+
+uint64_t TileHasher::HashTile(const uint8_t *pTile, int nPitch, int w, int h)
+{
+    __m128i acc[4];
+    for (int i = 0; i < 4; i++)
+    {
+        acc[i] = _mm_loadu_si128((const __m128i *)g_secret.v + i);
+    }
+
+    int nRowBytes = w * 4;
+    int nStripe = 0;
+    for (int y = 0; y < h; y++)
+    {
+        const uint8_t *pRow = pTile + (size_t)y * nPitch;
+        int x = 0;
+        for (; x + STRIPE_BYTES <= nRowBytes; x += STRIPE_BYTES)
+        {
+            AccumulateStripe(acc, pRow + x, nStripe);
+            if (++nStripe == STRIPES_PER_BLOCK)
+            {
+                Scramble(acc);
+                nStripe = 0;
+            }
+        }
+        if (x < nRowBytes)
+        {
+            /// Partial stripe at the right edge of the frame, zero padded
+            alignas(16) uint8_t tail[STRIPE_BYTES] = { 0 };
+            memcpy(tail, pRow + x, nRowBytes - x);
+            AccumulateStripe(acc, tail, nStripe);
+            if (++nStripe == STRIPES_PER_BLOCK)
+            {
+                Scramble(acc);
+                nStripe = 0;
+            }
+        }
+    }
+
+    alignas(16) uint64_t lanes[8];
+    for (int i = 0; i < 4; i++)
+    {
+        _mm_store_si128((__m128i *)lanes + i, acc[i]);
+    }
+    uint64_t result = (uint64_t)(nRowBytes * h) * PRIME64_1;
+    for (int i = 0; i < 8; i++)
+    {
+        result = (result ^ (lanes[i] * PRIME64_2)) * PRIME64_1;
+        result = (result << 31) | (result >> 33);
+    }
+    return Avalanche(result);
+}
+
+void TileHasher::Init(int nWidth, int nHeight, int nThreads, TaskScheduler *pScheduler)
+{
+    Cleanup();
+    m_nWidth = nWidth;
+    m_nHeight = nHeight;
+    m_nTilesX = (nWidth + DamageMap::TILE_SIZE - 1) / DamageMap::TILE_SIZE;
+    m_nTilesY = (nHeight + DamageMap::TILE_SIZE - 1) / DamageMap::TILE_SIZE;
+    m_vHash.assign((size_t)m_nTilesX * m_nTilesY, 0);
+    m_vPrevHash.assign((size_t)m_nTilesX * m_nTilesY, 0);
+    m_bHavePrev = false;
+
+    m_pScheduler = pScheduler ? pScheduler : &TaskScheduler::GetShared();
+    if (nThreads <= 0)
+    {
+        nThreads = m_pScheduler->GetWorkerCount() + 1;
+    }
+    /// No point in more threads than tile rows
+    m_nThreads = std::max(std::min(nThreads, m_nTilesY), 1);
+}
+
+void TileHasher::Cleanup()
+{
+    m_vHash.clear();
+    m_vPrevHash.clear();
+    m_bHavePrev = false;
+}
+
+void TileHasher::HashRow(const uint8_t *pFrame, int nPitch, int ty)
+{
+    const int tile = DamageMap::TILE_SIZE;
+    int h = std::min(tile, m_nHeight - ty * tile);
+    const uint8_t *pRow = pFrame + (size_t)ty * tile * nPitch;
+    for (int tx = 0; tx < m_nTilesX; tx++)
+    {
+        int w = std::min(tile, m_nWidth - tx * tile);
+        m_vHash[(size_t)ty * m_nTilesX + tx] = HashTile(pRow + (size_t)tx * tile * 4, nPitch, w, h);
+    }
+}
+
+void TileHasher::Process(const uint8_t *pFrame, int nPitch, DamageMap &damage)
+{
+    if (damage.GetWidth() != m_nWidth || damage.GetHeight() != m_nHeight)
+    {
+        damage.Init(m_nWidth, m_nHeight);
+    }
+    else
+    {
+        damage.Clear();
+    }
+
+    m_pScheduler->ParallelFor(m_nTilesY, [&](int ty) { HashRow(pFrame, nPitch, ty); }, TaskPriority::Critical, m_nThreads);
+
+    if (!m_bHavePrev)
+    {
+        damage.MarkAll();
+    }
+    else
+    {
+        for (int ty = 0; ty < m_nTilesY; ty++)
+        {
+            for (int tx = 0; tx < m_nTilesX; tx++)
+            {
+                size_t i = (size_t)ty * m_nTilesX + tx;
+                if (m_vHash[i] != m_vPrevHash[i])
+                {
+                    damage.SetDirty(tx, ty);
+                }
+            }
+        }
+    }
+    m_vHash.swap(m_vPrevHash);
+    m_bHavePrev = true;
+}
@@ -30,14 +30,203 @@
 #include "Preproc.hpp"
 #include "CudaH264.hpp"
 #include "CudaH264Array.hpp"
+#include "EncoderProfiles.hpp"
+#include "SampleOptions.hpp"
+#include "Bench.hpp"
+#include "AsyncPipeline.hpp"
+#include "CrcIndex.hpp"
+#include "LargePageBuffer.hpp"
+#include "Backpressure.hpp"
+#include "BinaryLog.hpp"
+#include "PipelineTrace.hpp"
+#include "Metrics.hpp"
+#include "NvCodecUtils.h"
 #include <memory>
+#include <cstring>
+
+/// Durations of the capture loop's calls, each frame's are also in the binary log
+static MetricHistogram g_captureCall("capture_call_microseconds", "Duration of CudaH264Array::Capture(), waiting for a frame included");
+static MetricHistogram g_preprocCall("preproc_call_microseconds", "Duration of CudaH264Array::Preproc(), conversion and encoding of a frame");
+
+/// Used by the NVIDIA utility headers. Warnings and errors only, CudaH264Array prints the applied encoder settings
+simplelogger::Logger *logger = simplelogger::LoggerFactory::CreateConsoleLogger(WARNING);
+
+/// Encoder statistics printed at the end of a capture run
+static void PrintEncoderStats(CudaH264Array *pEncoder)
+{
+    pEncoder->GetPacketStats().Print("Encoded frames");
+    if (PartitionedEncoder *pPartitioned = pEncoder->GetPartitionedEncoder())
+    {
+        pPartitioned->PrintStats();
+    }
+    printf("Latency from present to packet written:\n");
+    pEncoder->GetLatency().Print();
+    if (pEncoder->IsBackpressureEnabled())
+    {
+        pEncoder->GetBackpressure().PrintStats();
+    }
+    LargePageBuffer::PrintStats();
+}
+
+/// The capture loop of Grab60FPS() as a coroutine. Waiting for a screen update or for recovery suspends
+/// the session instead of holding a thread
+static AsyncTask<int> CaptureSession(PipelineExecutor &executor, CudaH264Array &encoder, int nFrames, UINT reportLossEvery)
+{
+    const int WAIT_BASE = 17;
+    const double MAX_RECOVERY_MS = 10000;
+    int capturedFrames = 0;
+    while (capturedFrames <= nFrames)
+    {
+        /// Any worker may resume the session, the encoder's CUDA context is pushed around each step
+        HRESULT hr = co_await executor.Poll([&encoder]
+        {
+            cuCtxPushCurrent(encoder.GetCudaContext());
+            HRESULT hrCapture = encoder.Capture(0);
+            cuCtxPopCurrent(nullptr);
+            return hrCapture;
+        }, WAIT_BASE);
+        if (hr == DXGI_ERROR_WAIT_TIMEOUT)
+        {
+            continue;
+        }
+        cuCtxPushCurrent(encoder.GetCudaContext());
+        if (FAILED(hr))
+        {
+            printf("Capture failed with error 0x%08x. Recovering.\n", hr);
+            hr = encoder.Recover(hr);
+            cuCtxPopCurrent(nullptr);
+            if (FAILED(hr))
+            {
+                if (encoder.GetTimeSinceLoss() > MAX_RECOVERY_MS)
+                {
+                    printf("Failed to recover capture, return error 0x%08x\n", hr);
+                    co_return -1;
+                }
+                co_await executor.Delay(WAIT_BASE);
+            }
+            continue;
+        }
+        hr = encoder.Preproc();
+        cuCtxPopCurrent(nullptr);
+        if (FAILED(hr))
+        {
+            printf("Preproc failed with error 0x%08x\n", hr);
+            co_return -1;
+        }
+        capturedFrames++;
+        if (reportLossEvery && capturedFrames % reportLossEvery == 0)
+        {
+            UINT64 lost = encoder.GetFrameNumber() - 1;
+            encoder.InvalidateFrames(lost, lost);
+        }
+    }
+    co_return 0;
+}
+
+/// Await every encoded packet and append it to 'writer', as a muxer would
+static AsyncTask<void> WritePackets(PacketChannel &packets, AsyncFileWriter &writer)
+{
+    while (std::optional<EncodedPacket> packet = co_await packets.Receive())
+    {
+        if (!co_await writer.Write(std::move(packet->data)))
+        {
+            printf("Writing out.async.h264 failed\n");
+            co_return;
+        }
+    }
+}
+
+/// Grab60FPS() on a PipelineExecutor: one session captures and encodes, another writes a copy of the
+/// stream to out.async.h264 from the packets it awaits
+static int GrabAsync(std::unique_ptr<CudaH264Array> &pEncoder, int nFrames, UINT reportLossEvery)
+{
+    PipelineExecutor executor;
+    PacketChannel packets(executor);
+    AsyncFileWriter writer(executor);
+    if (!writer.Open("out.async.h264"))
+    {
+        printf("Unable to open out.async.h264\n");
+        return -1;
+    }
+    pEncoder->SetPacketSink([&packets](const std::vector<uint8_t> &packet, const FrameTiming &timing) { packets.Push(packet, timing); });
+    if (pEncoder->IsBackpressureEnabled())
+    {
+        const BackpressureConfig &cfg = pEncoder->GetBackpressure().GetConfig();
+        CudaH264Array *pRecover = pEncoder.get();
+        packets.SetLimit(cfg.strategy, cfg.maxQueuedPackets, [pRecover] { pRecover->ForceRecovery(); });
+        pEncoder->SetSinkBacklog([&packets] { return packets.GetSize(); });
+    }
+    HRESULT hr = pEncoder->Init();
+    if (FAILED(hr))
+    {
+        printf("Initialization failed with error 0x%08x\n", hr);
+        pEncoder.reset();
+        return -1;
+    }
+    executor.Spawn(WritePackets(packets, writer), 1, TaskPriority::Normal);
+    int ret = executor.SyncWait(CaptureSession(executor, *pEncoder, nFrames, reportLossEvery), 0);
+    PrintEncoderStats(pEncoder.get());
+    /// Flushes the encoder, the last packets go through the channel too
+    pEncoder.reset();
+    packets.Close();
+    executor.Join();
+    printf("%llu bytes written to out.async.h264, %llu packets dropped\n", (unsigned long long)writer.GetBytesWritten(),
+        (unsigned long long)packets.GetDropped());
+    return ret;
+}
+
+/// -listdisplays: the displays of every adapter
+static int ListDisplays()
+{
+    std::vector<DisplayOutput> vOutputs;
+    HRESULT hr = DDAImpl::EnumerateOutputs(vOutputs);
+    if (FAILED(hr))
+    {
+        printf("Display enumeration failed with error 0x%08x\n", hr);
+        return -1;
+    }
+    for (const DisplayOutput &display : vOutputs)
+    {
+        printf("Adapter %u display %u: %ls on %ls, %ld,%ld %ldx%ld%s\n", display.adapter, display.output, display.outputName.c_str(),
+            display.adapterName.c_str(), display.desktopRect.left, display.desktopRect.top,
+            display.desktopRect.right - display.desktopRect.left, display.desktopRect.bottom - display.desktopRect.top,
+            display.adapter ? " (not capturable)" : "");
+    }
+    return 0;
+}
 
 /// Demo 60 FPS (approx.) capture
 int Grab60FPS(int nFrames, int argc, char *argv[])
 {
+    SampleOptions options;
+    if (!options.Parse(argc, argv))
+    {
+        return -1;
+    }
+    if (options.bHelp)
+    {
+        std::cout << EncoderProfiles::GetHelpMessage();
+        return 0;
+    }
+    if (options.bListDisplays)
+    {
+        return ListDisplays();
+    }
+    int benchResult = 0;
+    if (RunBench(options, argc, argv, benchResult))
+    {
+        return benchResult;
+    }
     //std::unique_ptr<CudaH264> Cudah264 = std::make_unique<CudaH264>(argc, argv);
     std::unique_ptr<CudaH264Array> Cudah264 = std::make_unique<CudaH264Array>(argc, argv);
+    if (!options.Apply(*Cudah264))
+    {
+        return -1;
+    }
+
     const int WAIT_BASE = 17; // 8 ms = 100 FPS
+    /// Give up when capture could not be recovered for this long
+    const double MAX_RECOVERY_MS = 10000;
     HRESULT hr = S_OK;
     int capturedFrames = 0;
     // for the capture time
@@ -81,6 +270,11 @@ int Grab60FPS(int nFrames, int argc, char *argv[])
     // std::cout << "Wait Time: " << wait2 << " millisecconds" << std::endl;           \
     // std::cout << "Wait Time in Microseconds: " << (int)((WAIT_BASE * 1000) - (INTERVAL.QuadPart)) << " microseconds" << std::endl;
 
+    if (options.bCoroutines)
+    {
+        return GrabAsync(Cudah264, nFrames, options.reportLossEvery);
+    }
+
     /// Initialize Cudah264 app
     hr = Cudah264->Init();
     if (FAILED(hr))
@@ -98,7 +292,8 @@ int Grab60FPS(int nFrames, int argc, char *argv[])
         /// Get a frame from DDA
         hr = Cudah264->Capture(WAIT_BASE);
         RESET_WAIT_TIME(start, end, interval, freq);
-        std::cout << " ---- capture took " << interval.QuadPart / 1000 << " milliseconds" << std::endl;
+        g_captureCall.Observe(interval.QuadPart);
+        BINLOG(BinaryLogLevel::Trace, "Capture took %lld us", (long long)interval.QuadPart);
 
         if (hr == DXGI_ERROR_WAIT_TIMEOUT)
         {
@@ -111,36 +306,46 @@ int Grab60FPS(int nFrames, int argc, char *argv[])
         {
             if (FAILED(hr))
             {
-                /// Re-try with a new DDA object
-                printf("Capture failed with error 0x%08x. Re-create DDA and try again.\n", hr);
-                Cudah264->Cleanup(true);
-                hr = Cudah264->Init();
+                /// Rebuild only what the failure invalidated: the capture session, the conversion resources
+                /// or the encoder. Keep trying while e.g. the secure desktop blocks duplication
+                printf("Capture failed with error 0x%08x. Recovering.\n", hr);
+                hr = Cudah264->Recover(hr);
                 if (FAILED(hr))
                 {
-                    /// Could not initialize DDA, bail out/
-                    printf("Failed to Init Cudah264-> return error 0x%08x\n", hr);
-                    return -1;
+                    if (Cudah264->GetTimeSinceLoss() > MAX_RECOVERY_MS)
+                    {
+                        /// Could not recover, bail out
+                        printf("Failed to recover capture, return error 0x%08x\n", hr);
+                        return -1;
+                    }
+                    Sleep(WAIT_BASE);
                 }
-                RESET_WAIT_TIME(start, end, interval, freq);
-                QueryPerformanceCounter(&start);
-                /// Get a frame from DDA
-                Cudah264->Capture(wait); // - 1 ms
+                continue;
             }
             QueryPerformanceCounter(&START);
             hr = Cudah264->Preproc(); // Encode 1 frame full HD = 2-3 ms // result 1-3 ms
             RESET_WAIT_TIME2(START, END, INTERVAL, freq);
-            std::cout << " ______ Preproc took " << INTERVAL.QuadPart / 1000 << " milliseconds" << std::endl;
-            std::cout << "///////////////////////////////////// " << std::endl;
+            g_preprocCall.Observe(INTERVAL.QuadPart);
+            BINLOG(BinaryLogLevel::Trace, "Preproc took %lld us", (long long)INTERVAL.QuadPart);
             if (FAILED(hr))
             {
                 printf("Preproc failed with error 0x%08x\n", hr);
                 return -1;
             }
             capturedFrames++;
+            if (options.reportLossEvery && capturedFrames % options.reportLossEvery == 0)
+            {
+                /// As a client would, once the last frame did not arrive
+                UINT64 lost = Cudah264->GetFrameNumber() - 1;
+                Cudah264->InvalidateFrames(lost, lost);
+            }
             // Total = 8 ms max
         }
     } while (capturedFrames <= nFrames);
 
+    g_captureCall.GetHistogram().Print("Capture calls");
+    g_preprocCall.GetHistogram().Print("Preproc calls");
+    PrintEncoderStats(Cudah264.get());
     return 0;
 }
 
@@ -151,7 +356,72 @@ int main(int argc, char *argv[])
     int ret = 0;
     bool useNvenc = true;
 
+    /// -verify <file> checks a recording against its .crc sidecar and exits
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (!strcmp(argv[i], "-verify"))
+        {
+            CrcVerifyResult result;
+            bool bOk = VerifyCrcIndex(argv[i + 1], result);
+            printf("%s: %llu records, %llu bad, %llu missing, %.1f MB in %.2f s (%.0f MB/s, %s)\n", argv[i + 1],
+                (unsigned long long)result.nEntries, (unsigned long long)result.nBad, (unsigned long long)result.nMissing,
+                result.nBytes / 1e6, result.seconds, result.seconds > 0 ? result.nBytes / 1e6 / result.seconds : 0.0,
+                CrcGetImplName(CrcType::Crc32C));
+            return bOk ? 0 : 1;
+        }
+        if (!strcmp(argv[i], "-decodelog"))
+        {
+            return BinaryLog::Decode(argv[i + 1], stdout) ? 0 : 1;
+        }
+    }
+
+    const char *szLogPath = "capture.blog";
+    const char *szTracePath = nullptr;
+    const char *szMetricsPath = nullptr;
+    int metricsPort = 0;
+    for (int i = 1; i < argc - 1; i++)
+    {
+        if (!strcmp(argv[i], "-log"))
+        {
+            szLogPath = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-trace"))
+        {
+            szTracePath = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-metrics"))
+        {
+            szMetricsPath = argv[i + 1];
+        }
+        else if (!strcmp(argv[i], "-metricsport"))
+        {
+            metricsPort = atoi(argv[i + 1]);
+        }
+    }
+    BinaryLog::Open(szLogPath);
+    if (szTracePath)
+    {
+        PipelineTrace::SetThreadName("capture");
+        PipelineTrace::Enable(true);
+    }
+    if ((szMetricsPath || metricsPort > 0) && !MetricsRegistry::StartExport(szMetricsPath, metricsPort))
+    {
+        BinaryLog::Close();
+        return -1;
+    }
+
     /// Kick off the demo
     ret = Grab60FPS(nFrames, argc, argv);
+    if (szTracePath)
+    {
+        PipelineTrace::Enable(false);
+        int64_t nSpans = PipelineTrace::Export(szTracePath);
+        if (nSpans >= 0)
+        {
+            printf("%lld spans written to %s\n", (long long)nSpans, szTracePath);
+        }
+    }
+    MetricsRegistry::StopExport();
+    BinaryLog::Close();
     return ret;
 }
\ No newline at end of file
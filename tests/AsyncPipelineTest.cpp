@@ -0,0 +1,279 @@
+#include "AsyncPipeline.hpp"
+#include "Check.hpp"
+#include <atomic>
+#include <stdexcept>
+#include <string.h>
+
+namespace
+{
+    /// Stand-in for an ICaptureSource: GetCapturedFrame() times out nTimeouts times, then returns the frame
+    struct StubTexture
+    {
+        int id;
+    };
+
+    struct StubSource
+    {
+        int nTimeouts = 0;
+        std::atomic<int> nCalls{ 0 };
+        StubTexture frame{ 7 };
+
+        HRESULT GetCapturedFrame(StubTexture **ppTex2D, int wait)
+        {
+            if (wait != 0 || nCalls++ < nTimeouts)
+            {
+                return DXGI_ERROR_WAIT_TIMEOUT;
+            }
+            *ppTex2D = &frame;
+            return 0;
+        }
+    };
+
+    double ElapsedMs(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    AsyncTask<int> Square(PipelineExecutor &executor, int x)
+    {
+        co_await executor.Yield();
+        co_return x * x;
+    }
+
+    AsyncTask<int> SumOfSquares(PipelineExecutor &executor, int n)
+    {
+        int sum = 0;
+        for (int i = 1; i <= n; i++)
+        {
+            sum += co_await Square(executor, i);
+        }
+        co_return sum;
+    }
+
+    AsyncTask<void> Count(PipelineExecutor &executor, std::atomic<int> &nSteps, int n)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            co_await executor.Yield();
+            nSteps++;
+        }
+    }
+
+    AsyncTask<int> Fail(PipelineExecutor &executor)
+    {
+        co_await executor.Yield();
+        throw std::runtime_error("fail");
+    }
+
+    AsyncTask<bool> CatchFailure(PipelineExecutor &executor)
+    {
+        try
+        {
+            co_await Fail(executor);
+        }
+        catch (const std::runtime_error &)
+        {
+            co_return true;
+        }
+        co_return false;
+    }
+
+    /// Spawned sessions all run to the end, Join() returns after the last and every onDone
+    void TestSpawnJoin()
+    {
+        TaskScheduler scheduler(3);
+        PipelineExecutor executor(scheduler);
+        const int SESSIONS = 16, STEPS = 50;
+        std::atomic<int> nSteps{ 0 }, nDone{ 0 };
+        for (int i = 0; i < SESSIONS; i++)
+        {
+            executor.Spawn(Count(executor, nSteps, STEPS), i % 3, i % 2 ? TaskPriority::Normal : TaskPriority::Critical, [&nDone] { nDone++; });
+        }
+        executor.Join();
+        CHECK(nSteps == SESSIONS * STEPS);
+        CHECK(nDone == SESSIONS);
+
+        /// Join() with nothing spawned returns at once; a session that throws still counts as done
+        executor.Join();
+        executor.Spawn([](PipelineExecutor &executor) -> AsyncTask<void> { co_await Fail(executor); }(executor));
+        executor.Join();
+    }
+
+    /// Results and exceptions reach the awaiting coroutine and SyncWait()
+    void TestSyncWait()
+    {
+        TaskScheduler scheduler(2);
+        PipelineExecutor executor(scheduler);
+        CHECK(executor.SyncWait(SumOfSquares(executor, 10)) == 385);
+        CHECK(executor.SyncWait(CatchFailure(executor)));
+
+        bool bThrown = false;
+        try
+        {
+            executor.SyncWait(Fail(executor));
+        }
+        catch (const std::runtime_error &e)
+        {
+            bThrown = strcmp(e.what(), "fail") == 0;
+        }
+        CHECK(bThrown);
+
+        std::atomic<int> nSteps{ 0 };
+        executor.SyncWait(Count(executor, nSteps, 10));
+        CHECK(nSteps == 10);
+    }
+
+    /// Packets pushed from another thread arrive in order, Receive() returns nothing once the channel
+    /// is closed and drained
+    void TestPacketChannel()
+    {
+        TaskScheduler scheduler(2);
+        PipelineExecutor executor(scheduler);
+        PacketChannel channel(executor);
+        std::vector<uint64_t> vReceived;
+        bool bEnded = false;
+        executor.Spawn([](PacketChannel &channel, std::vector<uint64_t> &vReceived, bool &bEnded) -> AsyncTask<void>
+        {
+            while (std::optional<EncodedPacket> packet = co_await channel.Receive())
+            {
+                if (packet->data.size() != 1 || packet->data[0] != (uint8_t)packet->timing.frameNumber)
+                {
+                    co_return;
+                }
+                vReceived.push_back(packet->timing.frameNumber);
+            }
+            bEnded = true;
+        }(channel, vReceived, bEnded));
+        std::thread pusher([&channel]
+        {
+            for (uint64_t i = 0; i < 100; i++)
+            {
+                FrameTiming timing;
+                timing.frameNumber = i;
+                channel.Push({ (uint8_t)i }, timing);
+                if (i % 10 == 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            channel.Close();
+        });
+        pusher.join();
+        executor.Join();
+        CHECK(bEnded && vReceived.size() == 100);
+        for (size_t i = 0; i < vReceived.size(); i++)
+        {
+            CHECK(vReceived[i] == i);
+        }
+        CHECK(channel.GetSize() == 0 && channel.GetDropped() == 0);
+    }
+
+    /// A bounded channel drops the dependents of a queued recovery point and asks for a new one once
+    void TestPacketChannelLimit()
+    {
+        TaskScheduler scheduler(2);
+        PipelineExecutor executor(scheduler);
+        PacketChannel channel(executor);
+        int nRecoveryRequests = 0;
+        channel.SetLimit(BackpressureStrategy::DropOldest, 2, [&nRecoveryRequests] { nRecoveryRequests++; });
+        for (uint64_t i = 0; i < 5; i++)
+        {
+            FrameTiming timing;
+            timing.frameNumber = i;
+            timing.bRecoveryPoint = i == 0 || i == 4;
+            channel.Push({ (uint8_t)i }, timing);
+        }
+        channel.Close();
+        CHECK(nRecoveryRequests == 1);
+        CHECK(channel.GetSize() == 2 && channel.GetDropped() == 3);
+        std::vector<uint64_t> vReceived = executor.SyncWait([](PacketChannel &channel) -> AsyncTask<std::vector<uint64_t>>
+        {
+            std::vector<uint64_t> v;
+            while (std::optional<EncodedPacket> packet = co_await channel.Receive())
+            {
+                v.push_back(packet->timing.frameNumber);
+            }
+            co_return v;
+        }(channel));
+        CHECK(vReceived == std::vector<uint64_t>({ 0, 4 }));
+    }
+
+    /// Delay() suspends at least as long as asked and resumes on the session's worker and lane
+    void TestDelay()
+    {
+        TaskScheduler scheduler(2);
+        PipelineExecutor executor(scheduler);
+        struct Result
+        {
+            double elapsedMs[3];
+            PipelineExecutor::Context context;
+        };
+        Result result = executor.SyncWait([](PipelineExecutor &executor) -> AsyncTask<Result>
+        {
+            Result result;
+            const int DELAYS[3] = { 30, 0, 5 };
+            for (int i = 0; i < 3; i++)
+            {
+                std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+                co_await executor.Delay(DELAYS[i]);
+                result.elapsedMs[i] = ElapsedMs(start);
+            }
+            result.context = PipelineExecutor::GetCurrentContext();
+            co_return result;
+        }(executor), 1, TaskPriority::Background);
+        CHECK(result.elapsedMs[0] >= 30 && result.elapsedMs[2] >= 5);
+        CHECK(result.context.affinity == 1 && result.context.priority == TaskPriority::Background);
+
+        /// Timers due in reverse order of arming fire in order of due time
+        std::mutex mutex;
+        std::vector<int> vOrder;
+        for (int ms : { 60, 40, 20 })
+        {
+            executor.Spawn([](PipelineExecutor &executor, int ms, std::mutex &mutex, std::vector<int> &vOrder) -> AsyncTask<void>
+            {
+                co_await executor.Delay(ms);
+                std::lock_guard<std::mutex> lock(mutex);
+                vOrder.push_back(ms);
+            }(executor, ms, mutex, vOrder));
+        }
+        executor.Join();
+        CHECK(vOrder == std::vector<int>({ 20, 40, 60 }));
+    }
+
+    /// Poll() and AcquireFrame() retry a source that times out until it has a frame or the wait is over
+    void TestPoll()
+    {
+        TaskScheduler scheduler(2);
+        PipelineExecutor executor(scheduler);
+        StubSource source;
+        source.nTimeouts = 3;
+        StubTexture *pTex2D = nullptr;
+        CHECK(executor.SyncWait(AcquireFrame(executor, source, &pTex2D, 1000)) == 0);
+        CHECK(pTex2D == &source.frame && source.nCalls == 4);
+
+        /// A source with nothing new: the last result after waitMs
+        StubSource idle;
+        idle.nTimeouts = INT32_MAX;
+        pTex2D = nullptr;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        CHECK(executor.SyncWait(AcquireFrame(executor, idle, &pTex2D, 30)) == DXGI_ERROR_WAIT_TIMEOUT);
+        CHECK(ElapsedMs(start) >= 30 && !pTex2D && idle.nCalls > 1);
+
+        /// Any other result, success or error, ends the poll at once
+        int nCalls = 0;
+        CHECK(executor.SyncWait(executor.Poll([&nCalls] { nCalls++; return (HRESULT)0x80004005; }, 1000)) == (HRESULT)0x80004005);
+        CHECK(nCalls == 1);
+    }
+}
+
+int main()
+{
+    TestSpawnJoin();
+    TestSyncWait();
+    TestPacketChannel();
+    TestPacketChannelLimit();
+    TestDelay();
+    TestPoll();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
@@ -0,0 +1,186 @@
+#include "Backpressure.hpp"
+#include "Check.hpp"
+#include <vector>
+
+namespace
+{
+    /// Packets are frame numbers; 'R' marks the recovery points in a pattern such as "RPPRP"
+    struct Queue
+    {
+        BoundedPacketQueue<int> queue;
+        int nFrame = 0;
+        int nRecoveryRequests = 0;
+
+        Queue(BackpressureStrategy strategy, size_t nMaxPackets) { queue.Init(strategy, nMaxPackets); }
+
+        void Push(const char *szPattern)
+        {
+            for (const char *p = szPattern; *p; p++)
+            {
+                nRecoveryRequests += queue.Push(nFrame++, *p == 'R') ? 1 : 0;
+            }
+        }
+
+        std::vector<int> Pop(size_t n = SIZE_MAX)
+        {
+            std::vector<int> v;
+            int frame;
+            while (v.size() < n && queue.Pop(frame))
+            {
+                v.push_back(frame);
+            }
+            return v;
+        }
+    };
+
+    /// Block and the throttling strategies queue everything, as does a queue never given a limit
+    void TestUnbounded()
+    {
+        for (BackpressureStrategy strategy : { BackpressureStrategy::Block, BackpressureStrategy::Repeat, BackpressureStrategy::LowerFrameRate })
+        {
+            Queue q(strategy, 2);
+            q.Push("RPPPPPPPPP");
+            CHECK(q.queue.GetSize() == 10 && q.queue.GetDropped() == 0 && q.nRecoveryRequests == 0);
+        }
+        BoundedPacketQueue<int> queue;
+        for (int i = 0; i < 10; i++)
+        {
+            CHECK(!queue.Push(i, false));
+        }
+        CHECK(queue.GetSize() == 10 && queue.GetDropped() == 0);
+    }
+
+    /// DropOldest drops the oldest dependents, up to the next recovery point, and keeps the recovery point
+    void TestDropOldest()
+    {
+        Queue q(BackpressureStrategy::DropOldest, 4);
+        q.Push("RPPRP");
+        CHECK(q.Pop() == std::vector<int>({ 0, 3, 4 }));
+        CHECK(q.queue.GetDropped() == 2 && q.nRecoveryRequests == 0);
+
+        /// Without a recovery point in front, dependents at the front go first
+        q.Push("PPRP");
+        CHECK(q.queue.GetSize() == 4 && q.queue.GetDropped() == 2);
+        q.Push("P");
+        CHECK(q.Pop() == std::vector<int>({ 7, 8, 9 }));
+        CHECK(q.queue.GetDropped() == 4 && q.nRecoveryRequests == 0);
+    }
+
+    /// Recovery points are never dropped, the queue rather goes over its limit, and the dependents
+    /// behind several of them are still dropped
+    void TestRecoveryPointsKept()
+    {
+        Queue q(BackpressureStrategy::DropOldest, 2);
+        q.Push("RRRR");
+        CHECK(q.queue.GetSize() == 4 && q.queue.GetDropped() == 0);
+        q.Push("P");
+        CHECK(q.Pop() == std::vector<int>({ 0, 1, 2, 3 }));
+        CHECK(q.queue.GetDropped() == 1 && q.nRecoveryRequests == 1);
+
+        Queue dropNewest(BackpressureStrategy::DropNewest, 2);
+        dropNewest.Push("RPRRPR");
+        CHECK(dropNewest.Pop() == std::vector<int>({ 0, 1, 2, 3, 5 }));
+    }
+
+    /// Dropping up to the newest packet leaves the queue waiting for a recovery point: later dependents
+    /// are dropped too, and exactly one recovery point is asked for
+    void TestDropOldestGap()
+    {
+        Queue q(BackpressureStrategy::DropOldest, 2);
+        q.Push("RPP");
+        CHECK(q.queue.GetSize() == 1 && q.queue.GetDropped() == 2 && q.nRecoveryRequests == 1);
+        q.Push("PPPP");
+        CHECK(q.queue.GetSize() == 1 && q.queue.GetDropped() == 6 && q.nRecoveryRequests == 1);
+        CHECK(q.Pop() == std::vector<int>({ 0 }));
+        q.Push("RP");
+        CHECK(q.Pop() == std::vector<int>({ 7, 8 }));
+
+        /// A second gap asks again
+        q.Push("RPP");
+        CHECK(q.queue.GetDropped() == 8 && q.nRecoveryRequests == 2);
+    }
+
+    /// DropNewest drops the arriving packet and then waits for a recovery point. It asks for one only
+    /// once the queue has room for it, and only once per gap
+    void TestDropNewest()
+    {
+        Queue q(BackpressureStrategy::DropNewest, 2);
+        q.Push("RPP");
+        CHECK(q.queue.GetSize() == 2 && q.queue.GetDropped() == 1 && q.nRecoveryRequests == 0);
+        /// Still full: a recovery point asked for now would be dropped
+        q.Push("P");
+        CHECK(q.queue.GetDropped() == 2 && q.nRecoveryRequests == 0);
+        CHECK(q.Pop(1) == std::vector<int>({ 0 }));
+        q.Push("PP");
+        CHECK(q.queue.GetSize() == 1 && q.queue.GetDropped() == 4 && q.nRecoveryRequests == 1);
+        CHECK(q.Pop() == std::vector<int>({ 1 }));
+        q.Push("RP");
+        CHECK(q.Pop() == std::vector<int>({ 6, 7 }));
+        CHECK(q.queue.GetDropped() == 4 && q.nRecoveryRequests == 1);
+
+        q.Push("PPP");
+        CHECK(q.queue.GetDropped() == 5);
+        q.Pop();
+        q.Push("P");
+        CHECK(q.nRecoveryRequests == 2);
+    }
+
+    /// Congestion is the backlog above the lowest seen, or the latency above its limit
+    void TestController()
+    {
+        BackpressureConfig cfg;
+        cfg.strategy = BackpressureStrategy::DropNewest;
+        cfg.maxBacklog = 3;
+        cfg.maxLatencyMs = 100;
+        BackpressureController controller;
+        controller.Init(cfg);
+        CHECK(controller.OnFrame(2, 10) == FrameAction::Encode);
+        CHECK(controller.OnFrame(4, 10) == FrameAction::Encode);
+        CHECK(controller.OnFrame(5, 10) == FrameAction::Drop);
+        CHECK(controller.OnFrame(2, 150) == FrameAction::Drop);
+        CHECK(controller.GetStats().nCongested == 2 && controller.GetStats().nEncoded == 2);
+
+        cfg.strategy = BackpressureStrategy::LowerFrameRate;
+        cfg.holdFrames = 4;
+        cfg.recoverFrames = 8;
+        cfg.maxSteps = 1;
+        controller.Init(cfg);
+        controller.OnFrame(0, 0);
+        /// Congested from the start, but the first step waits for holdFrames
+        for (int i = 0; i < 2; i++)
+        {
+            controller.OnFrame(3, 0);
+        }
+        CHECK(controller.GetFrameDivisor() == 1);
+        controller.OnFrame(3, 0);
+        CHECK(controller.GetFrameDivisor() == 2 && controller.GetStats().nStepsDown == 1);
+        /// maxSteps is the floor
+        for (int i = 0; i < 10; i++)
+        {
+            controller.OnFrame(3, 0);
+        }
+        CHECK(controller.GetFrameDivisor() == 2 && controller.GetStats().nStepsDown == 1);
+        for (int i = 0; i < 8; i++)
+        {
+            controller.OnFrame(0, 0);
+        }
+        CHECK(controller.GetFrameDivisor() == 1 && controller.GetStats().nStepsUp == 1);
+
+        CHECK(BackpressureController::ParseConfig("dropoldest:5:50", cfg));
+        CHECK(cfg.strategy == BackpressureStrategy::DropOldest && cfg.maxBacklog == 5 && cfg.maxLatencyMs == 50);
+        CHECK(!BackpressureController::ParseConfig("dropall", cfg));
+        CHECK(!BackpressureController::ParseConfig("fps:0", cfg));
+    }
+}
+
+int main()
+{
+    TestUnbounded();
+    TestDropOldest();
+    TestRecoveryPointsKept();
+    TestDropOldestGap();
+    TestDropNewest();
+    TestController();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdio.h>
+
+/// Failed CHECKs of the test executable; main() returns it, so ctest sees any failure
+inline int g_nFailures = 0;
+
+/// Print the failed condition and carry on with the other checks
+#define CHECK(x)                                                                \
+    do                                                                          \
+    {                                                                           \
+        if (!(x))                                                               \
+        {                                                                       \
+            printf("%s(%d): CHECK failed: %s\n", __FILE__, __LINE__, #x);       \
+            g_nFailures++;                                                      \
+        }                                                                       \
+    } while (0)
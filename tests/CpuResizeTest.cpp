@@ -0,0 +1,225 @@
+#include "CpuResize.hpp"
+#include "Check.hpp"
+#include <math.h>
+#include <stdlib.h>
+#include <algorithm>
+
+namespace
+{
+    /// Interpolation weights of the emulated texture unit: exact, or in fixed point with 8 fractional
+    /// bits as the hardware keeps them
+    bool g_bHardwareWeights = false;
+
+    /// tex2D() on an unnormalized, clamped texture with linear filtering and normalized float reads,
+    /// as the kernels of Utils/Resize.cu use it: texel centres are at integer + 0.5
+    float Tex2D(const uint8_t *pBase, int nPitch, int nWidth, int nHeight, int nChannels, int c, float u, float v)
+    {
+        float xB = u - 0.5f, yB = v - 0.5f;
+        float x0 = floorf(xB), y0 = floorf(yB);
+        float a = xB - x0, b = yB - y0;
+        if (g_bHardwareWeights)
+        {
+            a = roundf(a * 256) / 256;
+            b = roundf(b * 256) / 256;
+        }
+        auto texel = [&](int x, int y) {
+            x = std::min(std::max(x, 0), nWidth - 1);
+            y = std::min(std::max(y, 0), nHeight - 1);
+            return pBase[(size_t)y * nPitch + x * nChannels + c] / 255.0f;
+        };
+        int i = (int)x0, j = (int)y0;
+        return (1 - a) * (1 - b) * texel(i, j) + a * (1 - b) * texel(i + 1, j) + (1 - a) * b * texel(i, j + 1) + a * b * texel(i + 1, j + 1);
+    }
+
+    /// The Resize kernel of ResizeNv12(): luma at x / fxScale, chroma sampled from the whole NV12 buffer
+    /// seen as a uchar2 texture, nHeight + iy rows down and half a row lower. Results are truncated
+    void ResizeNv12Reference(uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight, const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight)
+    {
+        float fxScale = 1.0f * nDstWidth / nSrcWidth, fyScale = 1.0f * nDstHeight / nSrcHeight;
+        uint8_t *pDstUV = pDst + (size_t)nDstPitch * nDstHeight;
+        for (int iy = 0; iy < nDstHeight / 2; iy++)
+        {
+            for (int ix = 0; ix < nDstWidth / 2; ix++)
+            {
+                for (int dy = 0; dy < 2; dy++)
+                {
+                    for (int dx = 0; dx < 2; dx++)
+                    {
+                        int x = ix * 2 + dx, y = iy * 2 + dy;
+                        pDst[(size_t)y * nDstPitch + x] = (uint8_t)(Tex2D(pSrc, nSrcPitch, nSrcWidth, nSrcHeight, 1, 0, x / fxScale, y / fyScale) * 255);
+                    }
+                }
+                for (int c = 0; c < 2; c++)
+                {
+                    float uv = Tex2D(pSrc, nSrcPitch, nSrcWidth / 2, nSrcHeight * 3 / 2, 2, c, ix / fxScale, (nDstHeight + iy) / fyScale + 0.5f);
+                    pDstUV[(size_t)iy * nDstPitch + ix * 2 + c] = (uint8_t)(uv * 255);
+                }
+            }
+        }
+    }
+
+    /// The Scale and Scale_uv kernels of ScaleYUV420(), one plane at x * fxScale
+    void ScalePlaneReference(uint8_t *pDst, int nDstPitch, int nDstWidth, int nDstHeight, const uint8_t *pSrc, int nSrcPitch, int nSrcWidth, int nSrcHeight,
+        int nChannels)
+    {
+        float fxScale = 1.0f * nSrcWidth / nDstWidth, fyScale = 1.0f * nSrcHeight / nDstHeight;
+        for (int y = 0; y < nDstHeight; y++)
+        {
+            for (int x = 0; x < nDstWidth; x++)
+            {
+                for (int c = 0; c < nChannels; c++)
+                {
+                    float f = Tex2D(pSrc, nSrcPitch, nSrcWidth, nSrcHeight, nChannels, c, x * fxScale, y * fyScale);
+                    pDst[(size_t)y * nDstPitch + x * nChannels + c] = (uint8_t)fminf(f * 255.0f, 255.0f);
+                }
+            }
+        }
+    }
+
+    /// Noise, so that a sample position off by a fraction of a pixel shows in the output
+    std::vector<uint8_t> RandomBytes(size_t nSize, uint32_t seed)
+    {
+        std::vector<uint8_t> v(nSize);
+        uint32_t x = seed;
+        for (uint8_t &b : v)
+        {
+            x = x * 1664525 + 1013904223;
+            b = (uint8_t)(x >> 24);
+        }
+        return v;
+    }
+
+    /// Largest difference between two planes, and how many samples the CPU put above or below the GPU
+    struct Diff
+    {
+        int max = 0;
+        size_t nCpuHigher = 0;
+        size_t nCpuLower = 0;
+    };
+
+    void Compare(const uint8_t *pCpu, const uint8_t *pGpu, int nPitch, int nRowBytes, int nRows, Diff &diff)
+    {
+        for (int y = 0; y < nRows; y++)
+        {
+            for (int x = 0; x < nRowBytes; x++)
+            {
+                int d = pCpu[(size_t)y * nPitch + x] - pGpu[(size_t)y * nPitch + x];
+                diff.max = std::max(diff.max, abs(d));
+                diff.nCpuHigher += d > 0;
+                diff.nCpuLower += d < 0;
+            }
+        }
+    }
+
+    /// Output sample j of a table sits on (j + fDstOffset) * nSrc / nDst - fSrcOffset
+    void TestFilterTable()
+    {
+        CpuResizer::FilterTable table;
+        /// Luma with bCudaCompat: 2j - 0.5, half of the replicated edge and half of sample 0 first
+        CpuResizer::BuildFilterTable(table, 8, 4, CpuResizeFilter::Bilinear, 0.0f, 0.5f);
+        CHECK(table.nTaps == 4 && table.vStart[0] == -1 && table.vStart[3] == 5 && table.nPadLeft == 1);
+        CHECK(table.vCoef[0] == 0.5f && table.vCoef[1] == 0.5f && table.vCoef[2] == 0);
+        /// NV12 chroma rows with bCudaCompat: exactly on 2j, one tap
+        CpuResizer::BuildFilterTable(table, 8, 4, CpuResizeFilter::Bilinear, 0.0f, 0.0f);
+        for (int j = 0; j < 4; j++)
+        {
+            CHECK(table.vStart[j] == 2 * j && table.vCoef[(size_t)j * table.nTaps] == 1.0f);
+        }
+        CHECK(table.nPadLeft == 0);
+        /// Centres aligned without it: 2j + 0.5
+        CpuResizer::BuildFilterTable(table, 8, 4, CpuResizeFilter::Bilinear, 0.5f, 0.5f);
+        CHECK(table.vStart[0] == 0 && table.vCoef[0] == 0.5f && table.vCoef[1] == 0.5f && table.nPadLeft == 0);
+        /// Upscaling by 4 with bCudaCompat: j / 4 - 0.5, so sample 2 lands on source 0
+        CpuResizer::BuildFilterTable(table, 4, 16, CpuResizeFilter::Bilinear, 0.0f, 0.5f);
+        CHECK(table.vStart[2] == 0 && table.vCoef[(size_t)2 * table.nTaps] == 1.0f);
+        CHECK(table.vStart[3] == 0 && fabsf(table.vCoef[(size_t)3 * table.nTaps] - 0.75f) < 1e-6f);
+    }
+
+    /// ResizeNv12 with bCudaCompat samples where the Resize kernel does. With exact weights the only
+    /// difference is the rounding: the kernel truncates, the CPU rounds to nearest, so the CPU is the
+    /// same or 1 higher, never lower. The 8-bit weights of the hardware add at most 1 either way.
+    /// Without bCudaCompat chroma sits elsewhere and the noise shows it
+    void TestResizeNv12()
+    {
+        const int SIZES[][4] = { { 320, 180, 192, 108 }, { 96, 64, 160, 100 }, { 64, 48, 40, 30 }, { 200, 120, 200, 120 } };
+        for (const int *s : SIZES)
+        {
+            g_bHardwareWeights = false;
+            int srcW = s[0], srcH = s[1], dstW = s[2], dstH = s[3];
+            int srcPitch = srcW + 32, dstPitch = dstW + 16;
+            std::vector<uint8_t> vSrc = RandomBytes((size_t)srcPitch * srcH * 3 / 2, srcW);
+            std::vector<uint8_t> vGpu((size_t)dstPitch * dstH * 3 / 2), vCpu(vGpu.size());
+            ResizeNv12Reference(vGpu.data(), dstPitch, dstW, dstH, vSrc.data(), srcPitch, srcW, srcH);
+
+            CpuResizer resizer;
+            CHECK(resizer.Init(srcW, srcH, dstW, dstH, CpuResizeFilter::Bilinear, true));
+            resizer.ResizeNv12(vCpu.data(), dstPitch, vSrc.data(), srcPitch);
+            Diff luma, chroma;
+            Compare(vCpu.data(), vGpu.data(), dstPitch, dstW, dstH, luma);
+            Compare(vCpu.data() + (size_t)dstPitch * dstH, vGpu.data() + (size_t)dstPitch * dstH, dstPitch, dstW, dstH / 2, chroma);
+            CHECK(luma.max <= 1 && chroma.max <= 1);
+            CHECK(luma.nCpuLower == 0 && chroma.nCpuLower == 0 && luma.nCpuHigher > 0 && chroma.nCpuHigher > 0);
+
+            g_bHardwareWeights = true;
+            ResizeNv12Reference(vGpu.data(), dstPitch, dstW, dstH, vSrc.data(), srcPitch, srcW, srcH);
+            Diff hardware;
+            Compare(vCpu.data(), vGpu.data(), dstPitch, dstW, dstH * 3 / 2, hardware);
+            CHECK(hardware.max <= 2);
+            g_bHardwareWeights = false;
+            ResizeNv12Reference(vGpu.data(), dstPitch, dstW, dstH, vSrc.data(), srcPitch, srcW, srcH);
+
+            if (srcW != dstW)
+            {
+                CHECK(resizer.Init(srcW, srcH, dstW, dstH, CpuResizeFilter::Bilinear, false));
+                resizer.ResizeNv12(vCpu.data(), dstPitch, vSrc.data(), srcPitch);
+                Diff sited;
+                Compare(vCpu.data() + (size_t)dstPitch * dstH, vGpu.data() + (size_t)dstPitch * dstH, dstPitch, dstW, dstH / 2, sited);
+                CHECK(sited.max > 1);
+            }
+        }
+    }
+
+    /// ScaleYUV420 with bCudaCompat against the Scale/Scale_uv kernels with exact weights, odd sizes included
+    void TestScaleYUV420()
+    {
+        const int SIZES[][4] = { { 101, 75, 64, 47 }, { 64, 48, 97, 71 }, { 320, 180, 192, 108 } };
+        for (const int *s : SIZES)
+        {
+            int srcW = s[0], srcH = s[1], dstW = s[2], dstH = s[3];
+            int srcCW = (srcW + 1) / 2, srcCH = (srcH + 1) / 2, dstCW = (dstW + 1) / 2, dstCH = (dstH + 1) / 2;
+            int srcPitch = srcW + 7, srcCPitch = srcCW * 2 + 3, dstPitch = dstW + 5, dstCPitch = dstCW * 2 + 9;
+            std::vector<uint8_t> vY = RandomBytes((size_t)srcPitch * srcH, 1), vU = RandomBytes((size_t)srcCPitch * srcCH, 2),
+                vV = RandomBytes((size_t)srcCPitch * srcCH, 3);
+            CpuResizer resizer;
+            CHECK(resizer.Init(srcW, srcH, dstW, dstH, CpuResizeFilter::Bilinear, true));
+            for (bool bSemiplanar : { false, true })
+            {
+                std::vector<uint8_t> vGpuY((size_t)dstPitch * dstH), vGpuU((size_t)dstCPitch * dstCH), vGpuV(vGpuU.size());
+                std::vector<uint8_t> vCpuY(vGpuY.size()), vCpuU(vGpuU.size()), vCpuV(vGpuV.size());
+                int nChannels = bSemiplanar ? 2 : 1;
+                ScalePlaneReference(vGpuY.data(), dstPitch, dstW, dstH, vY.data(), srcPitch, srcW, srcH, 1);
+                ScalePlaneReference(vGpuU.data(), dstCPitch, dstCW, dstCH, vU.data(), srcCPitch, srcCW, srcCH, nChannels);
+                if (!bSemiplanar)
+                {
+                    ScalePlaneReference(vGpuV.data(), dstCPitch, dstCW, dstCH, vV.data(), srcCPitch, srcCW, srcCH, 1);
+                }
+                resizer.ScaleYUV420(vCpuY.data(), vCpuU.data(), vCpuV.data(), dstPitch, dstCPitch, vY.data(), vU.data(), vV.data(),
+                    srcPitch, srcCPitch, bSemiplanar);
+                Diff diff;
+                Compare(vCpuY.data(), vGpuY.data(), dstPitch, dstW, dstH, diff);
+                Compare(vCpuU.data(), vGpuU.data(), dstCPitch, dstCW * nChannels, dstCH, diff);
+                Compare(vCpuV.data(), vGpuV.data(), dstCPitch, bSemiplanar ? 0 : dstCW, dstCH, diff);
+                CHECK(diff.max <= 1 && diff.nCpuLower == 0);
+            }
+        }
+    }
+}
+
+int main()
+{
+    TestFilterTable();
+    TestResizeNv12();
+    TestScaleYUV420();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
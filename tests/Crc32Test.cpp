@@ -0,0 +1,199 @@
+#include "CrcIndex.hpp"
+#include "Check.hpp"
+#include <string.h>
+#include <filesystem>
+#include <vector>
+
+namespace
+{
+    /// One bit at a time, the definition both flavours share with zlib's crc32(): reflected, ~0 init and final XOR
+    uint32_t CrcBitwise(CrcType eType, uint32_t crc, const uint8_t *pData, size_t nSize)
+    {
+        const uint32_t poly = eType == CrcType::Crc32 ? 0xEDB88320 : 0x82F63B78;
+        crc = ~crc;
+        for (size_t i = 0; i < nSize; i++)
+        {
+            crc ^= pData[i];
+            for (int j = 0; j < 8; j++)
+            {
+                crc = (crc >> 1) ^ ((crc & 1) ? poly : 0);
+            }
+        }
+        return ~crc;
+    }
+
+    std::vector<uint8_t> RandomBytes(size_t nSize, uint32_t seed)
+    {
+        std::vector<uint8_t> v(nSize);
+        uint32_t x = seed;
+        for (uint8_t &b : v)
+        {
+            x = x * 1664525 + 1013904223;
+            b = (uint8_t)(x >> 24);
+        }
+        return v;
+    }
+
+    const CrcType TYPES[2] = { CrcType::Crc32, CrcType::Crc32C };
+
+    /// Published check values, and zlib's crc32() of a sentence
+    void TestKnownValues()
+    {
+        const char *szDigits = "123456789";
+        CHECK(Crc32(szDigits, 9) == 0xCBF43926);
+        CHECK(Crc32C(szDigits, 9) == 0xE3069283);
+        const char *szFox = "The quick brown fox jumps over the lazy dog";
+        CHECK(Crc32(szFox, strlen(szFox)) == 0x414FA339);
+        CHECK(Crc32(nullptr, 0) == 0 && Crc32C(nullptr, 0) == 0);
+        std::vector<uint8_t> vZeros(32, 0);
+        CHECK(Crc32C(vZeros.data(), vZeros.size()) == 0x8A9136AA);
+        CHECK(CrcBitwise(CrcType::Crc32, 0, (const uint8_t *)szDigits, 9) == 0xCBF43926);
+        CHECK(CrcBitwise(CrcType::Crc32C, 0, (const uint8_t *)szDigits, 9) == 0xE3069283);
+    }
+
+    /// Every length up to past several folding blocks, at every alignment within 16 bytes, plus
+    /// larger sizes around powers of two
+    void TestLengthsAndAlignments()
+    {
+        std::vector<uint8_t> vData = RandomBytes(70000, 1);
+        for (CrcType eType : TYPES)
+        {
+            for (size_t offset = 0; offset < 16; offset++)
+            {
+                for (size_t nSize = 0; nSize <= 600; nSize++)
+                {
+                    const uint8_t *p = vData.data() + offset;
+                    CHECK(CrcUpdate(eType, 0, p, nSize) == CrcBitwise(eType, 0, p, nSize));
+                }
+            }
+            for (size_t nSize : { 1023, 1024, 1025, 4095, 4096, 4097, 65535, 65536, 65537 })
+            {
+                for (size_t offset : { 0, 1, 7, 8, 13 })
+                {
+                    const uint8_t *p = vData.data() + offset;
+                    CHECK(CrcUpdate(eType, 0, p, nSize) == CrcBitwise(eType, 0, p, nSize));
+                }
+            }
+        }
+    }
+
+    /// Continuing from a previous CRC equals one pass over the concatenation
+    void TestSplitUpdates()
+    {
+        std::vector<uint8_t> vData = RandomBytes(3000, 2);
+        for (CrcType eType : TYPES)
+        {
+            uint32_t whole = CrcBitwise(eType, 0, vData.data(), vData.size());
+            for (size_t split = 0; split <= vData.size(); split += split < 200 ? 1 : 97)
+            {
+                uint32_t crc = CrcUpdate(eType, 0, vData.data(), split);
+                CHECK(CrcUpdate(eType, crc, vData.data() + split, vData.size() - split) == whole);
+            }
+            /// Pieces of every size from 1 to 70
+            uint32_t crc = 0;
+            size_t pos = 0;
+            for (size_t n = 1; pos < vData.size(); n = n % 70 + 1)
+            {
+                size_t nTake = std::min(n, vData.size() - pos);
+                crc = CrcUpdate(eType, crc, vData.data() + pos, nTake);
+                pos += nTake;
+            }
+            CHECK(crc == whole);
+        }
+    }
+
+    /// Buffers of different lengths, some continuing a previous CRC, enough for the 4 way path and a tail
+    void TestMulti()
+    {
+        const int BUFFERS = 11;
+        std::vector<uint8_t> vData = RandomBytes(20000, 3);
+        for (CrcType eType : TYPES)
+        {
+            const void *ppData[BUFFERS];
+            size_t pSize[BUFFERS];
+            uint32_t pCrc[BUFFERS], pExpected[BUFFERS];
+            for (int i = 0; i < BUFFERS; i++)
+            {
+                ppData[i] = vData.data() + i * 1009 + i % 3;
+                pSize[i] = (size_t)(i * 731 % 1800) + (i == 4 ? 0 : i);
+                pCrc[i] = i % 2 ? 0 : 0x12345678u * (uint32_t)i;
+                pExpected[i] = CrcBitwise(eType, pCrc[i], (const uint8_t *)ppData[i], pSize[i]);
+            }
+            CrcUpdateMulti(eType, ppData, pSize, pCrc, BUFFERS);
+            for (int i = 0; i < BUFFERS; i++)
+            {
+                CHECK(pCrc[i] == pExpected[i]);
+            }
+        }
+    }
+
+    bool WriteFile(const std::string &path, const std::vector<uint8_t> &vData)
+    {
+        std::ofstream fp(path, std::ios::out | std::ios::binary);
+        fp.write(reinterpret_cast<const char *>(vData.data()), vData.size());
+        return fp.good();
+    }
+
+    /// Records written through CrcIndexWriter verify; a flipped byte is one bad record, a cut file
+    /// misses the records past its end. Some records cross the 8 MB read chunks of the verifier
+    void TestIndexRoundTrip()
+    {
+        const std::string path = "Crc32Test.bin";
+        const size_t SIZES[] = { 1000, 0, 5 << 20, 4 << 20, 17, 0, 123457, 1 };
+        size_t nTotal = 0;
+        for (size_t nSize : SIZES)
+        {
+            nTotal += nSize;
+        }
+        std::vector<uint8_t> vData = RandomBytes(nTotal, 4);
+        for (CrcType eType : TYPES)
+        {
+            CrcIndexWriter writer;
+            CHECK(writer.Open(path, eType));
+            size_t pos = 0;
+            for (size_t nSize : SIZES)
+            {
+                writer.Add(vData.data() + pos, nSize);
+                pos += nSize;
+            }
+            writer.Close();
+            CHECK(WriteFile(path, vData));
+
+            CrcVerifyResult result;
+            CHECK(VerifyCrcIndex(path, result, false));
+            CHECK(result.nEntries == sizeof(SIZES) / sizeof(SIZES[0]) && result.nBad == 0 && result.nMissing == 0);
+            CHECK(result.nBytes == nTotal);
+
+            /// A byte of the record that crosses the first chunk boundary
+            std::vector<uint8_t> vCorrupt = vData;
+            vCorrupt[(8 << 20) + 5] ^= 0x40;
+            CHECK(WriteFile(path, vCorrupt));
+            CHECK(!VerifyCrcIndex(path, result, false));
+            CHECK(result.nBad == 1 && result.nMissing == 0);
+
+            /// Cut inside the second to last record: it and the last one are missing, the rest is good
+            CHECK(WriteFile(path, vData));
+            std::filesystem::resize_file(path, nTotal - 1 - 100);
+            CHECK(!VerifyCrcIndex(path, result, false));
+            CHECK(result.nBad == 0 && result.nMissing == 2);
+        }
+
+        /// No index
+        std::filesystem::remove(path + ".crc");
+        CrcVerifyResult result;
+        CHECK(!VerifyCrcIndex(path, result, false));
+        std::filesystem::remove(path);
+    }
+}
+
+int main()
+{
+    printf("CRC32: %s, CRC32C: %s\n", CrcGetImplName(CrcType::Crc32), CrcGetImplName(CrcType::Crc32C));
+    TestKnownValues();
+    TestLengthsAndAlignments();
+    TestSplitUpdates();
+    TestMulti();
+    TestIndexRoundTrip();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
@@ -0,0 +1,185 @@
+#include "FrameLatency.hpp"
+#include "Check.hpp"
+#include <math.h>
+
+namespace
+{
+    bool InBucket(int64_t us)
+    {
+        int bucket = LatencyHistogram::GetBucket(us);
+        return LatencyHistogram::GetBucketStart(bucket) <= us && (bucket == LatencyHistogram::BUCKETS - 1 || us < LatencyHistogram::GetBucketStart(bucket + 1));
+    }
+
+    /// Exact below 16 us, then 16 buckets per power of two, contiguous and clamped at both ends
+    void TestBuckets()
+    {
+        for (int64_t us = 0; us < LatencyHistogram::SUB_BUCKETS; us++)
+        {
+            CHECK(LatencyHistogram::GetBucket(us) == us && LatencyHistogram::GetBucketStart((int)us) == us);
+        }
+        for (int64_t us = 0; us < 100000; us++)
+        {
+            CHECK(InBucket(us));
+        }
+        for (int e = 4; e < 40; e++)
+        {
+            for (int64_t us : { (int64_t)1 << e, ((int64_t)1 << e) - 1, ((int64_t)1 << e) + 1, ((int64_t)3 << e) / 2 })
+            {
+                CHECK(InBucket(us));
+            }
+        }
+        for (int bucket = 0; bucket + 1 < LatencyHistogram::BUCKETS; bucket++)
+        {
+            int64_t start = LatencyHistogram::GetBucketStart(bucket), next = LatencyHistogram::GetBucketStart(bucket + 1);
+            CHECK(start < next && LatencyHistogram::GetBucket(start) == bucket);
+            /// Width at most 1/16 of the start
+            CHECK(bucket < LatencyHistogram::SUB_BUCKETS || (next - start) * LatencyHistogram::SUB_BUCKETS <= start);
+        }
+        CHECK(LatencyHistogram::GetBucket(-5) == 0);
+        CHECK(LatencyHistogram::GetBucket((int64_t)1 << 40) == LatencyHistogram::BUCKETS - 1);
+        CHECK(LatencyHistogram::GetBucket(INT64_MAX) == LatencyHistogram::BUCKETS - 1);
+    }
+
+    /// A percentile is the middle of the bucket holding it, so within 1/16 of the exact value, never
+    /// above the maximum
+    void TestPercentiles()
+    {
+        LatencyHistogram histogram;
+        CHECK(histogram.GetPercentile(50) == 0 && histogram.GetMean() == 0);
+
+        for (int64_t us = 1; us <= 10000; us++)
+        {
+            histogram.Add(us);
+        }
+        CHECK(histogram.GetCount() == 10000 && histogram.GetSum() == 10000LL * 10001 / 2 && histogram.GetMax() == 10000);
+        CHECK(histogram.GetMean() == 5000.5);
+        for (double percentile : { 0.0, 1.0, 10.0, 50.0, 90.0, 99.0, 99.9, 100.0 })
+        {
+            double exact = 1 + percentile / 100 * 9999;
+            int64_t p = histogram.GetPercentile(percentile);
+            CHECK(fabs(p - exact) <= exact / LatencyHistogram::SUB_BUCKETS + 1);
+            CHECK(p <= histogram.GetMax());
+        }
+        CHECK(histogram.GetPercentile(0) == 1);
+        CHECK(LatencyHistogram::GetBucket(histogram.GetPercentile(100)) == LatencyHistogram::GetBucket(10000));
+
+        /// One slow frame among fast ones: p99 stays fast, the maximum is exact
+        LatencyHistogram tail;
+        for (int i = 0; i < 999; i++)
+        {
+            tail.Add(16000);
+        }
+        tail.Add(250000);
+        CHECK(tail.GetPercentile(99) >= 16000 && tail.GetPercentile(99) < 17000);
+        CHECK(tail.GetPercentile(100) >= 250000 - 250000 / 16 && tail.GetPercentile(100) <= 250000 && tail.GetMax() == 250000);
+
+        /// A single value: every percentile in its bucket
+        LatencyHistogram single;
+        single.Add(1000);
+        CHECK(single.GetPercentile(0) == single.GetPercentile(100));
+        CHECK(LatencyHistogram::GetBucket(single.GetPercentile(50)) == LatencyHistogram::GetBucket(1000));
+    }
+
+    void TestMerge()
+    {
+        LatencyHistogram a, b, all;
+        for (int64_t us = 0; us < 5000; us += 3)
+        {
+            (us % 2 ? a : b).Add(us * 7);
+            all.Add(us * 7);
+        }
+        LatencyHistogram merged = a;
+        merged.Merge(b);
+        CHECK(merged.GetCount() == all.GetCount() && merged.GetSum() == all.GetSum() && merged.GetMax() == all.GetMax());
+        uint64_t buckets[LatencyHistogram::BUCKETS];
+        for (int i = 0; i < LatencyHistogram::BUCKETS; i++)
+        {
+            CHECK(merged.GetBucketCount(i) == all.GetBucketCount(i));
+            buckets[i] = b.GetBucketCount(i);
+        }
+        LatencyHistogram raw = a;
+        raw.Merge(buckets, b.GetSum(), b.GetMax());
+        CHECK(raw.GetCount() == all.GetCount() && raw.GetPercentile(75) == all.GetPercentile(75) && raw.GetMax() == all.GetMax());
+        merged.Reset();
+        CHECK(merged.GetCount() == 0 && merged.GetMax() == 0 && merged.GetBucketCount(LatencyHistogram::GetBucket(7)) == 0);
+    }
+
+    FrameTiming MakeTiming(uint64_t frameNumber, int64_t present)
+    {
+        FrameTiming timing;
+        timing.frameNumber = frameNumber;
+        timing.present = present;
+        timing.acquired = present + 10;
+        timing.converted = present + 30;
+        timing.submitted = present + 60;
+        timing.ready = present + 100;
+        timing.written = present + 150;
+        return timing;
+    }
+
+    /// Records live in a ring of MAX_IN_FLIGHT: a frame that never returns is overwritten by the one
+    /// MAX_IN_FLIGHT later, and completing a stale record does not close the newer one
+    void TestTrackerRing()
+    {
+        const uint64_t N = LatencyTracker::MAX_IN_FLIGHT;
+        LatencyTracker tracker;
+        tracker.Init(1000000);
+        FrameTiming timing;
+        CHECK(!tracker.Find(0, timing));
+        for (uint64_t i = 0; i < N + 10; i++)
+        {
+            tracker.Submit(MakeTiming(i, 1000 + i));
+        }
+        CHECK(!tracker.Find(5, timing));
+        CHECK(tracker.Find(N + 5, timing) && timing.frameNumber == N + 5 && timing.present == 1000 + (int64_t)(N + 5));
+        CHECK(tracker.Find(10, timing) && tracker.Find(N - 1, timing));
+        CHECK(!tracker.Find(N + 10, timing) && !tracker.Find(2 * N + 5, timing));
+
+        /// Completing frame 5, overwritten, leaves frame N + 5 open
+        tracker.Complete(MakeTiming(5, 0));
+        CHECK(tracker.Find(N + 5, timing));
+        tracker.Complete(timing);
+        CHECK(!tracker.Find(N + 5, timing));
+        CHECK(tracker.Find(N + 6, timing));
+
+        tracker.Reset();
+        CHECK(!tracker.Find(N + 6, timing));
+        CHECK(tracker.GetHistogram(LatencyStage::Total).GetCount() == 0);
+    }
+
+    /// Each stage from its two ends, in microseconds; a stage missing an end is not counted
+    void TestTrackerStages()
+    {
+        LatencyTracker tracker;
+        /// QueryPerformanceCounter's usual 10 MHz
+        tracker.Init(10000000);
+        FrameTiming timing = MakeTiming(1, 5000000);
+        tracker.Complete(timing);
+        const int64_t EXPECTED[] = { 1, 2, 3, 4, 5, 15 };
+        for (int s = 0; s < (int)LatencyStage::Count; s++)
+        {
+            LatencyHistogram histogram = tracker.GetHistogram((LatencyStage)s);
+            CHECK(histogram.GetCount() == 1 && histogram.GetMax() == EXPECTED[s]);
+        }
+
+        timing = MakeTiming(2, 5000000);
+        timing.converted = 0;
+        tracker.Complete(timing);
+        CHECK(tracker.GetHistogram(LatencyStage::Capture).GetCount() == 2);
+        CHECK(tracker.GetHistogram(LatencyStage::Convert).GetCount() == 1);
+        CHECK(tracker.GetHistogram(LatencyStage::Prepare).GetCount() == 1);
+        CHECK(tracker.GetHistogram(LatencyStage::Total).GetCount() == 2);
+        CHECK(tracker.ToMicroseconds(25000) == 2500);
+    }
+}
+
+int main()
+{
+    TestBuckets();
+    TestPercentiles();
+    TestMerge();
+    TestTrackerRing();
+    TestTrackerStages();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
@@ -0,0 +1,205 @@
+#include "MotionHints.hpp"
+#include "Check.hpp"
+
+namespace
+{
+    /// Content of the frame at dst came from (sx, sy) in the previous one
+    DXGI_OUTDUPL_MOVE_RECT Move(int sx, int sy, int left, int top, int right, int bottom)
+    {
+        DXGI_OUTDUPL_MOVE_RECT move;
+        move.SourcePoint.x = sx;
+        move.SourcePoint.y = sy;
+        move.DestinationRect.left = left;
+        move.DestinationRect.top = top;
+        move.DestinationRect.right = right;
+        move.DestinationRect.bottom = bottom;
+        return move;
+    }
+
+    int CountMoved(const MotionHints &hints)
+    {
+        int n = 0;
+        for (int by = 0; by < hints.GetBlocksY(); by++)
+        {
+            for (int bx = 0; bx < hints.GetBlocksX(); bx++)
+            {
+                n += hints.GetMvx(bx, by) != 0 || hints.GetMvy(bx, by) != 0;
+            }
+        }
+        return n;
+    }
+
+    /// Blocks on the 16 pixel grid take the vector of a move rect covering at least half of them
+    void TestBlockAlignment()
+    {
+        MotionHints hints;
+        hints.Init(1920, 1080, false);
+        CHECK(hints.GetBlocksX() == 120 && hints.GetBlocksY() == 68 && hints.GetBlockCount() == 120 * 68);
+
+        /// Scroll up by 37 rows: rows 0-1042 come from 37 rows below. Rows of blocks 0-64 are covered,
+        /// row 65 (1040-1055) only by 3 rows
+        DXGI_OUTDUPL_MOVE_RECT scroll = Move(0, 37, 0, 0, 1920, 1080 - 37);
+        CHECK(hints.Update(&scroll, 1) == 120 * 65);
+        CHECK(hints.GetMvx(0, 0) == 0 && hints.GetMvy(0, 0) == 37);
+        CHECK(hints.GetMvy(119, 64) == 37 && hints.GetMvy(0, 65) == 0);
+        const NVENC_EXTERNAL_ME_HINT &hint = hints.GetHints()[0];
+        CHECK(hint.mvx == 0 && hint.mvy == 37 && hint.refidx == 0 && hint.dir == 0 && hint.partType == 0);
+        /// One bit signed fields: set reads back as -1
+        CHECK(hint.lastofPart != 0 && hint.lastOfMB != 0);
+
+        /// A 300x200 window dragged from (400, 500) to (104, 100), off the grid in both directions:
+        /// column 6 (96-111) is covered by 8 of 16 columns, row 6 (96-111) by 12 of 16 rows
+        DXGI_OUTDUPL_MOVE_RECT drag = Move(400, 500, 104, 100, 404, 300);
+        int nMoved = hints.Update(&drag, 1);
+        CHECK(hints.GetMvx(7, 7) == 296 && hints.GetMvy(7, 7) == 400);
+        /// 8 x 12 pixels of 256: no; 16 x 12 or 8 x 16: yes
+        CHECK(hints.GetMvx(6, 6) == 0 && hints.GetMvx(6, 18) == 0 && hints.GetMvx(7, 6) == 296);
+        CHECK(hints.GetMvx(6, 7) == 296);
+        /// Column 25 (400-415) has 4 columns, row 18 (288-303) 12 rows, row 19 none
+        CHECK(hints.GetMvx(24, 7) == 296 && hints.GetMvx(25, 7) == 0);
+        CHECK(hints.GetMvx(7, 18) == 296 && hints.GetMvx(7, 19) == 0);
+        /// Columns 6-24 and rows 6-18 but the corner blocks (6, 6) and (6, 18)
+        CHECK(nMoved == 19 * 13 - 2);
+        CHECK(CountMoved(hints) == nMoved);
+        /// The scroll of the previous frame is gone
+        CHECK(hints.GetMvy(0, 0) == 0);
+
+        /// A frame without move rects has no hints
+        CHECK(hints.Update(nullptr, 0) == 0);
+        CHECK(CountMoved(hints) == 0 && hints.GetHints()[7 * 120 + 7].mvx == 0);
+    }
+
+    /// Move rects reaching outside the frame are clipped to it; the partial blocks at the right and
+    /// bottom edge count the half of their pixels inside the frame
+    void TestEdgeClipping()
+    {
+        MotionHints hints;
+        /// 62.5 x 37.5 blocks: the last column and row are 8 pixels
+        hints.Init(1000, 600, false);
+        CHECK(hints.GetBlocksX() == 63 && hints.GetBlocksY() == 38);
+
+        /// Window dragged partly off the top left corner
+        DXGI_OUTDUPL_MOVE_RECT topLeft = Move(100, 100, -50, -30, 40, 50);
+        int nMoved = hints.Update(&topLeft, 1);
+        CHECK(hints.GetMvx(0, 0) == 150 && hints.GetMvy(0, 0) == 130);
+        /// Columns 0-1 (0-31) full, column 2 (32-47) 8 of 16; rows 0-2 (0-47) full, row 3 (48-63) 2 of 16
+        CHECK(hints.GetMvx(2, 0) == 150 && hints.GetMvx(3, 0) == 0);
+        CHECK(hints.GetMvx(0, 2) == 150 && hints.GetMvx(0, 3) == 0);
+        CHECK(nMoved == 3 * 3);
+
+        /// Past the bottom right corner: the 8 pixel edge blocks are fully covered
+        DXGI_OUTDUPL_MOVE_RECT bottomRight = Move(900, 500, 976, 576, 1100, 700);
+        nMoved = hints.Update(&bottomRight, 1);
+        CHECK(hints.GetMvx(62, 37) == -76 && hints.GetMvy(62, 37) == -76);
+        CHECK(hints.GetMvx(61, 36) == -76 && hints.GetMvx(60, 36) == 0);
+        CHECK(nMoved == 2 * 2);
+
+        /// 4 of the 8 columns of the edge block are half of it
+        DXGI_OUTDUPL_MOVE_RECT edge = Move(900, 0, 996, 0, 1000, 600);
+        CHECK(hints.Update(&edge, 1) == 38);
+        CHECK(hints.GetMvx(62, 10) == -96);
+        /// 3 of 8 are not
+        edge = Move(900, 0, 997, 0, 1000, 600);
+        CHECK(hints.Update(&edge, 1) == 0);
+
+        /// Entirely outside, or empty
+        DXGI_OUTDUPL_MOVE_RECT vOutside[] = { Move(0, 0, 1000, 0, 1100, 100), Move(0, 0, -200, -200, -100, -100),
+            Move(0, 0, 20, 20, 20, 200) };
+        CHECK(hints.Update(vOutside, 3) == 0);
+    }
+
+    /// A block two move rects cover takes the vector of the one covering more of it; on a tie the first
+    /// one keeps it
+    void TestOverlappingRects()
+    {
+        MotionHints hints;
+        hints.Init(1920, 1080, false);
+
+        /// Row 0 (0-15): 6 rows from the first, 10 from the second
+        DXGI_OUTDUPL_MOVE_RECT vTwo[] = { Move(0, 10, 0, 0, 1920, 6), Move(0, 20, 0, 6, 1920, 500) };
+        hints.Update(vTwo, 2);
+        CHECK(hints.GetMvy(0, 0) == 14);
+        CHECK(hints.GetMvy(0, 1) == 14);
+
+        /// The same in the other order
+        DXGI_OUTDUPL_MOVE_RECT vSwapped[] = { vTwo[1], vTwo[0] };
+        hints.Update(vSwapped, 2);
+        CHECK(hints.GetMvy(0, 0) == 14);
+
+        /// 8 rows each
+        DXGI_OUTDUPL_MOVE_RECT vTie[] = { Move(0, 30, 0, 0, 1920, 8), Move(0, 50, 0, 8, 1920, 16) };
+        hints.Update(vTie, 2);
+        CHECK(hints.GetMvy(0, 0) == 30);
+
+        /// A small window dragged over a scrolling page: both cover its blocks fully, so the window goes
+        /// first to keep them. Blocks 10-29 x 10-24
+        DXGI_OUTDUPL_MOVE_RECT vNested[] = { Move(500, 600, 160, 160, 480, 400), Move(0, 40, 0, 0, 1920, 1040) };
+        int nMoved = hints.Update(vNested, 2);
+        CHECK(hints.GetMvy(9, 9) == 40 && hints.GetMvx(10, 10) == 340 && hints.GetMvy(10, 10) == 440);
+        CHECK(hints.GetMvx(29, 24) == 340 && hints.GetMvx(30, 24) == 0 && hints.GetMvy(30, 24) == 40);
+        CHECK(nMoved == 120 * 65);
+    }
+
+    /// Vectors the hint fields cannot hold (x -2048..2047, y -512..511) are dropped, the limits themselves
+    /// survive the bit fields, and a zero vector is no hint
+    void TestRangeLimits()
+    {
+        MotionHints hints;
+        hints.Init(8192, 4096, false);
+        struct
+        {
+            int mvx;
+            int mvy;
+            bool bKept;
+        } vCases[] = { { 2047, 0, true }, { 2048, 0, false }, { -2048, 0, true }, { -2049, 0, false }, { 0, 511, true },
+            { 0, 512, false }, { 0, -512, true }, { 0, -513, false }, { 2047, -512, true }, { -2048, 511, true }, { 0, 0, false } };
+        for (const auto &c : vCases)
+        {
+            /// Destination in the middle, so the source may be on either side
+            DXGI_OUTDUPL_MOVE_RECT move = Move(3072 + c.mvx, 1536 + c.mvy, 3072, 1536, 3072 + 64, 1536 + 64);
+            int nMoved = hints.Update(&move, 1);
+            CHECK(nMoved == (c.bKept ? 16 : 0));
+            const NVENC_EXTERNAL_ME_HINT &hint = hints.GetHints()[(1536 / 16) * hints.GetBlocksX() + 3072 / 16];
+            CHECK(hint.mvx == (c.bKept ? c.mvx : 0) && hint.mvy == (c.bKept ? c.mvy : 0));
+        }
+
+        /// In quarter pixels in the superblock hints
+        hints.Init(8192, 4096, true);
+        DXGI_OUTDUPL_MOVE_RECT vExtremes[] = { Move(3072 + 2047, 1536 - 512, 3072, 1536, 3072 + 64, 1536 + 64),
+            Move(1024 - 2048, 512 + 511, 1024, 512, 1024 + 64, 512 + 64) };
+        CHECK(hints.Update(vExtremes, 2) == 2);
+        const NVENC_EXTERNAL_ME_SB_HINT &first = hints.GetSbHints()[(1536 / 64) * hints.GetBlocksX() + 3072 / 64];
+        const NVENC_EXTERNAL_ME_SB_HINT &second = hints.GetSbHints()[(512 / 64) * hints.GetBlocksX() + 1024 / 64];
+        CHECK(first.mvx == 2047 * 4 && first.mvy == -512 * 4);
+        CHECK(second.mvx == -2048 * 4 && second.mvy == 511 * 4);
+    }
+
+    /// AV1: one 64x64 CU per superblock, vectors in quarter pixels
+    void TestSuperblocks()
+    {
+        MotionHints hints;
+        hints.Init(3840, 2160, true);
+        CHECK(hints.GetBlockSize() == 64 && hints.GetBlocksX() == 60 && hints.GetBlocksY() == 34);
+
+        /// Scroll by 64 rows: rows of superblocks 0-31 covered; row 32 (2048-2111) by 48 rows, row 33
+        /// (2112-2159, 48 rows inside the frame) by none
+        DXGI_OUTDUPL_MOVE_RECT scroll = Move(0, 64, 0, 0, 3840, 2096);
+        CHECK(hints.Update(&scroll, 1) == 60 * 33);
+        const NVENC_EXTERNAL_ME_SB_HINT &hint = hints.GetSbHints()[0];
+        CHECK(hint.mvx == 0 && hint.mvy == 256);
+        CHECK((hint.cu_size & 3) == 3 && hint.last_of_cu && hint.last_of_sb);
+        CHECK(hint.x8 == 0 && hint.y8 == 0 && hint.refidx == 0 && hint.direction == 0 && hint.bi == 0);
+        CHECK(hints.GetSbHints()[33 * 60].mvy == 0);
+    }
+}
+
+int main()
+{
+    TestBlockAlignment();
+    TestEdgeClipping();
+    TestOverlappingRects();
+    TestRangeLimits();
+    TestSuperblocks();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
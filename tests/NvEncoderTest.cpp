@@ -0,0 +1,455 @@
+#include "NvEncoder.h"
+#include "Check.hpp"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+
+/// NvEncoder's output paths against a stand-in NVENC: the function table the driver would provide,
+/// where a "hardware" thread finishes each submitted frame after a random delay (half to all of
+/// maxDelayUs) and nvEncLockBitstream blocks until then, as with the real encoder. No GPU or driver needed
+namespace
+{
+    /// An output bitstream buffer: holds the timestamp of the frame encoded into it once done
+    struct StandInOutput
+    {
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool bBusy = false;
+        bool bDone = false;
+        uint64_t timeStamp = 0;
+        std::vector<uint8_t> data;
+    };
+
+    struct StandInNvenc
+    {
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::deque<StandInOutput *> queue;
+        bool bStop = false;
+        std::thread hardware;
+        int maxDelayUs = 2000;
+        /// Timestamp whose bitstream fails to lock, UINT64_MAX for none
+        uint64_t failLockAt = UINT64_MAX;
+        std::atomic<int> nMapped{ 0 };
+        std::atomic<int> nOutputs{ 0 };
+        /// Frames submitted into an output buffer NvEncoder had not retrieved yet
+        std::atomic<int> nOverwrites{ 0 };
+
+        void Run()
+        {
+            std::mt19937 rng(1);
+            for (;;)
+            {
+                StandInOutput *pOutput;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    condition.wait(lock, [this] { return !queue.empty() || bStop; });
+                    if (queue.empty())
+                    {
+                        return;
+                    }
+                    pOutput = queue.front();
+                    queue.pop_front();
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(maxDelayUs / 2 + rng() % (maxDelayUs / 2 + 1)));
+                std::lock_guard<std::mutex> lock(pOutput->mutex);
+                pOutput->data.resize(sizeof(pOutput->timeStamp));
+                memcpy(pOutput->data.data(), &pOutput->timeStamp, sizeof(pOutput->timeStamp));
+                pOutput->bDone = true;
+                pOutput->condition.notify_all();
+            }
+        }
+    };
+
+    StandInNvenc *g_pNvenc = nullptr;
+
+    NVENCSTATUS NVENCAPI OpenEncodeSessionEx(NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS *, void **pEncoder)
+    {
+        *pEncoder = g_pNvenc;
+        g_pNvenc->hardware = std::thread(&StandInNvenc::Run, g_pNvenc);
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI InitializeEncoder(void *, NV_ENC_INITIALIZE_PARAMS *) { return NV_ENC_SUCCESS; }
+
+    NVENCSTATUS NVENCAPI CreateBitstreamBuffer(void *, NV_ENC_CREATE_BITSTREAM_BUFFER *pParams)
+    {
+        pParams->bitstreamBuffer = new StandInOutput;
+        g_pNvenc->nOutputs++;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI DestroyBitstreamBuffer(void *, NV_ENC_OUTPUT_PTR pBuffer)
+    {
+        /// As the driver does, finish a frame still being encoded into the buffer first
+        StandInOutput *pOutput = (StandInOutput *)pBuffer;
+        {
+            std::unique_lock<std::mutex> lock(pOutput->mutex);
+            pOutput->condition.wait(lock, [pOutput] { return !pOutput->bBusy || pOutput->bDone; });
+        }
+        delete pOutput;
+        g_pNvenc->nOutputs--;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI RegisterResource(void *, NV_ENC_REGISTER_RESOURCE *pParams)
+    {
+        pParams->registeredResource = pParams->resourceToRegister;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI UnregisterResource(void *, NV_ENC_REGISTERED_PTR) { return NV_ENC_SUCCESS; }
+
+    NVENCSTATUS NVENCAPI MapInputResource(void *, NV_ENC_MAP_INPUT_RESOURCE *pParams)
+    {
+        pParams->mappedResource = pParams->registeredResource;
+        g_pNvenc->nMapped++;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI UnmapInputResource(void *, NV_ENC_INPUT_PTR)
+    {
+        g_pNvenc->nMapped--;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI EncodePicture(void *, NV_ENC_PIC_PARAMS *pParams)
+    {
+        if (pParams->encodePicFlags & NV_ENC_PIC_FLAG_EOS)
+        {
+            return NV_ENC_SUCCESS;
+        }
+        StandInOutput *pOutput = (StandInOutput *)pParams->outputBitstream;
+        {
+            std::lock_guard<std::mutex> lock(pOutput->mutex);
+            g_pNvenc->nOverwrites += pOutput->bBusy;
+            pOutput->bBusy = true;
+            pOutput->bDone = false;
+            pOutput->timeStamp = pParams->inputTimeStamp;
+        }
+        {
+            std::lock_guard<std::mutex> lock(g_pNvenc->mutex);
+            g_pNvenc->queue.push_back(pOutput);
+        }
+        g_pNvenc->condition.notify_one();
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI LockBitstream(void *, NV_ENC_LOCK_BITSTREAM *pParams)
+    {
+        StandInOutput *pOutput = (StandInOutput *)pParams->outputBitstream;
+        std::unique_lock<std::mutex> lock(pOutput->mutex);
+        pOutput->condition.wait(lock, [pOutput] { return pOutput->bDone; });
+        if (pOutput->timeStamp == g_pNvenc->failLockAt)
+        {
+            return NV_ENC_ERR_GENERIC;
+        }
+        pParams->bitstreamBufferPtr = pOutput->data.data();
+        pParams->bitstreamSizeInBytes = (uint32_t)pOutput->data.size();
+        pParams->outputTimeStamp = pOutput->timeStamp;
+        pParams->pictureType = NV_ENC_PIC_TYPE_P;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI UnlockBitstream(void *, NV_ENC_OUTPUT_PTR pBuffer)
+    {
+        StandInOutput *pOutput = (StandInOutput *)pBuffer;
+        std::lock_guard<std::mutex> lock(pOutput->mutex);
+        pOutput->bBusy = false;
+        return NV_ENC_SUCCESS;
+    }
+
+    NVENCSTATUS NVENCAPI RegisterAsyncEvent(void *, NV_ENC_EVENT_PARAMS *) { return NV_ENC_SUCCESS; }
+
+    NVENCSTATUS NVENCAPI UnregisterAsyncEvent(void *, NV_ENC_EVENT_PARAMS *) { return NV_ENC_SUCCESS; }
+
+    NVENCSTATUS NVENCAPI DestroyEncoderSession(void *)
+    {
+        {
+            std::lock_guard<std::mutex> lock(g_pNvenc->mutex);
+            g_pNvenc->bStop = true;
+        }
+        g_pNvenc->condition.notify_all();
+        g_pNvenc->hardware.join();
+        return NV_ENC_SUCCESS;
+    }
+
+    const int WIDTH = 64;
+    const int HEIGHT = 64;
+
+    /// NvEncoder with plain host buffers registered as CUDA device pointers; the stand-in never reads them
+    class StandInEncoder : public NvEncoder
+    {
+    public:
+        StandInEncoder() : NvEncoder(NV_ENC_DEVICE_TYPE_CUDA, nullptr, WIDTH, HEIGHT, NV_ENC_BUFFER_FORMAT_NV12, 3, false) {}
+        ~StandInEncoder() { DestroyEncoder(); }
+
+        void Create()
+        {
+            NV_ENC_INITIALIZE_PARAMS initializeParams = { NV_ENC_INITIALIZE_PARAMS_VER };
+            NV_ENC_CONFIG encodeConfig = { NV_ENC_CONFIG_VER };
+            initializeParams.encodeGUID = NV_ENC_CODEC_H264_GUID;
+            initializeParams.encodeConfig = &encodeConfig;
+            initializeParams.encodeWidth = initializeParams.maxEncodeWidth = WIDTH;
+            initializeParams.encodeHeight = initializeParams.maxEncodeHeight = HEIGHT;
+            encodeConfig.frameIntervalP = 1;
+            encodeConfig.gopLength = NVENC_INFINITE_GOPLENGTH;
+            CreateEncoder(&initializeParams);
+        }
+
+    protected:
+        void AllocateInputBuffers(int32_t numInputBuffers) override
+        {
+            std::vector<void *> vFrames;
+            for (int i = 0; i < numInputBuffers; i++)
+            {
+                m_vBuffers.emplace_back(WIDTH * HEIGHT * 3 / 2);
+                vFrames.push_back(m_vBuffers.back().data());
+            }
+            RegisterInputResources(vFrames, NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR, WIDTH, HEIGHT, WIDTH, NV_ENC_BUFFER_FORMAT_NV12);
+        }
+
+        void ReleaseInputBuffers() override
+        {
+            UnregisterInputResources();
+            m_vBuffers.clear();
+        }
+
+    private:
+        std::deque<std::vector<uint8_t>> m_vBuffers;
+    };
+
+    /// Timestamps of the packets in the order they were delivered, checked against their payload
+    struct Delivered
+    {
+        std::mutex mutex;
+        std::vector<uint64_t> vTimeStamps;
+        int nMismatches = 0;
+
+        void Add(const std::vector<uint8_t> &packet, uint64_t timeStamp)
+        {
+            uint64_t payload = UINT64_MAX;
+            if (packet.size() == sizeof(payload))
+            {
+                memcpy(&payload, packet.data(), sizeof(payload));
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            nMismatches += payload != timeStamp;
+            vTimeStamps.push_back(timeStamp);
+        }
+
+        void AddAll(const std::vector<std::vector<uint8_t>> &vPacket, NvEncoder &encoder)
+        {
+            const std::vector<uint64_t> &vOut = encoder.GetOutputTimeStamps();
+            CHECK(vOut.size() == vPacket.size());
+            for (size_t i = 0; i < vPacket.size() && i < vOut.size(); i++)
+            {
+                Add(vPacket[i], vOut[i]);
+            }
+        }
+
+        bool IsInOrder(uint64_t nExpected)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            bool bOk = vTimeStamps.size() == nExpected && !nMismatches;
+            for (size_t i = 0; bOk && i < vTimeStamps.size(); i++)
+            {
+                bOk = vTimeStamps[i] == i + 1;
+            }
+            return bOk;
+        }
+    };
+
+    void Submit(StandInEncoder &encoder, uint64_t timeStamp, std::vector<std::vector<uint8_t>> &vPacket)
+    {
+        encoder.GetNextInputFrame();
+        NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+        picParams.inputTimeStamp = timeStamp;
+        encoder.EncodeFrame(vPacket, &picParams);
+    }
+
+    /// Every frame comes out once, in submission order, whether collected by EncodeFrame() three frames
+    /// later or delivered by the retrieval thread, and no output buffer is reused before it was read
+    void TestInOrder(bool bAsync)
+    {
+        StandInNvenc nvenc;
+        g_pNvenc = &nvenc;
+        Delivered delivered;
+        const uint64_t N = 300;
+        {
+            StandInEncoder encoder;
+            if (bAsync)
+            {
+                encoder.SetOutputCallback([&](std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info) { delivered.Add(packet, info.outputTimeStamp); });
+            }
+            encoder.Create();
+            CHECK(encoder.IsAsyncOutput() == bAsync);
+            std::vector<std::vector<uint8_t>> vPacket;
+            for (uint64_t ts = 1; ts <= N; ts++)
+            {
+                Submit(encoder, ts, vPacket);
+                CHECK(!bAsync || vPacket.empty());
+                delivered.AddAll(vPacket, encoder);
+                /// The capture interval, every third frame, so the encoder sometimes runs ahead and sometimes not
+                if (ts % 3 == 0)
+                {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+            encoder.EndEncode(vPacket);
+            delivered.AddAll(vPacket, encoder);
+        }
+        CHECK(delivered.IsInOrder(N));
+        CHECK(nvenc.nOverwrites == 0);
+        CHECK(nvenc.nMapped == 0);
+        CHECK(nvenc.nOutputs == 0);
+    }
+
+    /// EndEncode() returns only once every submitted frame was delivered
+    void TestEndEncodeDrain(bool bAsync)
+    {
+        StandInNvenc nvenc;
+        nvenc.maxDelayUs = 5000;
+        g_pNvenc = &nvenc;
+        Delivered delivered;
+        const uint64_t N = 3;
+        {
+            StandInEncoder encoder;
+            if (bAsync)
+            {
+                encoder.SetOutputCallback([&](std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info) { delivered.Add(packet, info.outputTimeStamp); });
+            }
+            encoder.Create();
+            std::vector<std::vector<uint8_t>> vPacket;
+            for (uint64_t ts = 1; ts <= N; ts++)
+            {
+                Submit(encoder, ts, vPacket);
+                delivered.AddAll(vPacket, encoder);
+            }
+            /// Fewer frames than the output delay: none has come out yet in sync mode
+            CHECK(bAsync || delivered.vTimeStamps.empty());
+            encoder.EndEncode(vPacket);
+            delivered.AddAll(vPacket, encoder);
+            CHECK(delivered.IsInOrder(N));
+            CHECK(nvenc.nMapped == 0);
+        }
+        CHECK(delivered.IsInOrder(N));
+    }
+
+    /// A failure of the retrieval thread surfaces on the submitting thread, from the next EncodeFrame()
+    /// or EndEncode(), with the status NVENC returned; the frames before it were delivered in order and
+    /// the encoder can still be destroyed
+    void TestAsyncError()
+    {
+        StandInNvenc nvenc;
+        nvenc.failLockAt = 10;
+        g_pNvenc = &nvenc;
+        Delivered delivered;
+        NVENCSTATUS status = NV_ENC_SUCCESS;
+        uint64_t failedAt = 0;
+        {
+            StandInEncoder encoder;
+            encoder.SetOutputCallback([&](std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info) { delivered.Add(packet, info.outputTimeStamp); });
+            encoder.Create();
+            std::vector<std::vector<uint8_t>> vPacket;
+            try
+            {
+                for (uint64_t ts = 1; ts <= 100; ts++)
+                {
+                    failedAt = ts;
+                    Submit(encoder, ts, vPacket);
+                }
+                failedAt = 0;
+                encoder.EndEncode(vPacket);
+            }
+            catch (const NVENCException &e)
+            {
+                status = e.getErrorCode();
+            }
+        }
+        CHECK(status == NV_ENC_ERR_GENERIC);
+        /// Submission blocks once the input buffers are all in flight, so it stops within a few frames
+        CHECK(failedAt >= 10 && failedAt <= 10 + 4);
+        CHECK(delivered.IsInOrder(9));
+        CHECK(nvenc.nMapped == 0);
+        CHECK(nvenc.nOutputs == 0);
+    }
+
+    /// DestroyEncoder() with frames still being encoded waits for them instead of destroying buffers
+    /// NVENC writes to: the retrieval thread delivers them, in sync mode they are flushed and dropped.
+    /// Either way every input is unmapped and every output buffer freed
+    void TestDestroyInFlight(bool bAsync)
+    {
+        StandInNvenc nvenc;
+        nvenc.maxDelayUs = 5000;
+        g_pNvenc = &nvenc;
+        Delivered delivered;
+        const uint64_t N = 10;
+        {
+            StandInEncoder encoder;
+            if (bAsync)
+            {
+                encoder.SetOutputCallback([&](std::vector<uint8_t> &packet, const NV_ENC_LOCK_BITSTREAM &info) { delivered.Add(packet, info.outputTimeStamp); });
+            }
+            encoder.Create();
+            std::vector<std::vector<uint8_t>> vPacket;
+            for (uint64_t ts = 1; ts <= N; ts++)
+            {
+                Submit(encoder, ts, vPacket);
+                delivered.AddAll(vPacket, encoder);
+            }
+            CHECK(nvenc.nMapped > 0);
+            encoder.DestroyEncoder();
+            CHECK(nvenc.nMapped == 0);
+            CHECK(nvenc.nOutputs == 0);
+            CHECK(!encoder.IsAsyncOutput());
+        }
+        CHECK(!bAsync || delivered.IsInOrder(N));
+        CHECK(nvenc.nOverwrites == 0);
+    }
+}
+
+/// The function table of the driver, normally from nvEncodeAPI
+NVENCSTATUS NVENCAPI NvEncodeAPIGetMaxSupportedVersion(uint32_t *pVersion)
+{
+    *pVersion = (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
+    return NV_ENC_SUCCESS;
+}
+
+NVENCSTATUS NVENCAPI NvEncodeAPICreateInstance(NV_ENCODE_API_FUNCTION_LIST *pFunctionList)
+{
+    pFunctionList->nvEncOpenEncodeSession = (PNVENCOPENENCODESESSION)OpenEncodeSessionEx;
+    pFunctionList->nvEncOpenEncodeSessionEx = OpenEncodeSessionEx;
+    pFunctionList->nvEncInitializeEncoder = InitializeEncoder;
+    pFunctionList->nvEncCreateBitstreamBuffer = CreateBitstreamBuffer;
+    pFunctionList->nvEncDestroyBitstreamBuffer = DestroyBitstreamBuffer;
+    pFunctionList->nvEncRegisterResource = RegisterResource;
+    pFunctionList->nvEncUnregisterResource = UnregisterResource;
+    pFunctionList->nvEncMapInputResource = MapInputResource;
+    pFunctionList->nvEncUnmapInputResource = UnmapInputResource;
+    pFunctionList->nvEncEncodePicture = EncodePicture;
+    pFunctionList->nvEncLockBitstream = LockBitstream;
+    pFunctionList->nvEncUnlockBitstream = UnlockBitstream;
+    pFunctionList->nvEncRegisterAsyncEvent = RegisterAsyncEvent;
+    pFunctionList->nvEncUnregisterAsyncEvent = UnregisterAsyncEvent;
+    pFunctionList->nvEncDestroyEncoder = DestroyEncoderSession;
+    return NV_ENC_SUCCESS;
+}
+
+int main()
+{
+    for (bool bAsync : { false, true })
+    {
+        TestInOrder(bAsync);
+        TestEndEncodeDrain(bAsync);
+        TestDestroyInFlight(bAsync);
+    }
+    TestAsyncError();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
@@ -0,0 +1,220 @@
+#include "OutputLayout.hpp"
+#include "Check.hpp"
+#include <string.h>
+
+namespace
+{
+    bool Equal(const RECT &a, LONG left, LONG top, LONG right, LONG bottom)
+    {
+        return a.left == left && a.top == top && a.right == right && a.bottom == bottom;
+    }
+
+    /// Displays are shifted so the top-left corner of the desktop is 0,0; overlapping ones are clones
+    void TestInit()
+    {
+        OutputLayout layout;
+        /// A 1280x1024 display left of the primary and 200 rows higher
+        CHECK(layout.Init({ { 0, 0, 1920, 1080 }, { -1280, -200, 0, 824 } }));
+        CHECK(layout.GetOutputCount() == 2);
+        CHECK(Equal(layout.GetRect(0), 1280, 200, 3200, 1280));
+        CHECK(Equal(layout.GetRect(1), 0, 0, 1280, 1024));
+        CHECK(layout.GetCanvasWidth() == 3200 && layout.GetCanvasHeight() == 1280);
+
+        /// Odd sizes round up to even for NV12
+        CHECK(layout.Init({ { 0, 0, 1366, 767 }, { 1366, 0, 2733, 768 } }));
+        CHECK(layout.GetCanvasWidth() == 2734 && layout.GetCanvasHeight() == 768);
+
+        /// Touching edges are not an overlap
+        CHECK(layout.Init({ { 0, 0, 100, 100 }, { 100, 0, 200, 100 }, { 0, 100, 100, 200 } }));
+        CHECK(layout.GetCanvasWidth() == 200 && layout.GetCanvasHeight() == 200);
+
+        /// A clone, a partial overlap, an empty display and no display at all
+        CHECK(!layout.Init({ { 0, 0, 1920, 1080 }, { 0, 0, 1920, 1080 } }));
+        CHECK(layout.GetOutputCount() == 0 && layout.GetCanvasWidth() == 0);
+        CHECK(!layout.Init({ { 0, 0, 1920, 1080 }, { 1919, 1079, 3839, 2159 } }));
+        CHECK(!layout.Init({ { 0, 0, 1920, 1080 }, { 1920, 0, 1920, 1080 } }));
+        CHECK(!layout.Init({}));
+
+        CHECK(OutputLayout::Overlaps({ 0, 0, 10, 10 }, { 9, 9, 20, 20 }));
+        CHECK(!OutputLayout::Overlaps({ 0, 0, 10, 10 }, { 10, 0, 20, 10 }));
+    }
+
+    /// Runs of dirty tiles in a row, merged downwards with a run of the same columns, clipped to the frame
+    void TestDirtyRuns()
+    {
+        FrameArena arena(1 << 16);
+        FrameVector<RECT> vRuns(&arena);
+        DamageMap damage;
+        /// 5 x 4 tiles, the last column 44 pixels wide, the last row 8 pixels high
+        damage.Init(300, 200);
+        OutputLayout::GetDirtyRuns(damage, vRuns);
+        CHECK(vRuns.empty());
+
+        /// A 2x2 block, a tile at the right edge, a narrower run under the block and one in the last row
+        damage.AddRect(64, 0, 192, 128);
+        damage.SetDirty(4, 0);
+        damage.SetDirty(1, 2);
+        damage.SetDirty(0, 3);
+        OutputLayout::GetDirtyRuns(damage, vRuns);
+        CHECK(vRuns.size() == 4);
+        if (vRuns.size() == 4)
+        {
+            CHECK(Equal(vRuns[0], 256, 0, 300, 64));
+            CHECK(Equal(vRuns[1], 64, 0, 192, 128));
+            CHECK(Equal(vRuns[2], 64, 128, 128, 192));
+            CHECK(Equal(vRuns[3], 0, 192, 64, 200));
+        }
+
+        /// Every tile: one run of the whole frame
+        damage.MarkAll();
+        OutputLayout::GetDirtyRuns(damage, vRuns);
+        CHECK(vRuns.size() == 1 && Equal(vRuns[0], 0, 0, 300, 200));
+
+        /// A checkerboard has nothing to merge
+        damage.Clear();
+        for (int ty = 0; ty < damage.GetTilesY(); ty++)
+        {
+            for (int tx = (ty & 1); tx < damage.GetTilesX(); tx += 2)
+            {
+                damage.SetDirty(tx, ty);
+            }
+        }
+        OutputLayout::GetDirtyRuns(damage, vRuns);
+        CHECK((int)vRuns.size() == damage.GetDirtyCount());
+    }
+
+    void TestMapping()
+    {
+        OutputLayout layout;
+        CHECK(layout.Init({ { 0, 0, 1920, 1080 }, { 1920, 120, 3200, 1144 } }));
+        FrameArena arena(1 << 16);
+        FrameVector<RECT> vRuns(&arena);
+        vRuns.push_back({ 0, 0, 64, 64 });
+        vRuns.push_back({ 128, 64, 256, 192 });
+        DamageMap canvas;
+        canvas.Init(layout.GetCanvasWidth(), layout.GetCanvasHeight());
+        layout.MapDamage(1, vRuns, canvas);
+        /// 1920,120 is in tiles 30,1 and 30,2; the second run covers 2048-2175 x 184-311, tiles 32-33 x 2-4
+        CHECK(canvas.IsDirty(30, 1) && canvas.IsDirty(30, 2) && !canvas.IsDirty(31, 1));
+        CHECK(canvas.IsDirty(32, 2) && canvas.IsDirty(33, 4) && !canvas.IsDirty(34, 2) && !canvas.IsDirty(32, 5));
+        CHECK(canvas.GetDirtyCount() == 2 + 2 * 3);
+
+        std::vector<DXGI_OUTDUPL_MOVE_RECT> vMoves(1);
+        vMoves[0].SourcePoint = { 10, 20 };
+        vMoves[0].DestinationRect = { 0, 0, 100, 50 };
+        std::vector<DXGI_OUTDUPL_MOVE_RECT> vCanvasMoves;
+        layout.MapMoveRects(0, vMoves, vCanvasMoves);
+        layout.MapMoveRects(1, vMoves, vCanvasMoves);
+        CHECK(vCanvasMoves.size() == 2);
+        CHECK(vCanvasMoves[0].SourcePoint.x == 10 && vCanvasMoves[0].SourcePoint.y == 20 && Equal(vCanvasMoves[0].DestinationRect, 0, 0, 100, 50));
+        CHECK(vCanvasMoves[1].SourcePoint.x == 1930 && vCanvasMoves[1].SourcePoint.y == 140);
+        CHECK(Equal(vCanvasMoves[1].DestinationRect, 1920, 120, 2020, 170));
+    }
+
+    /// Synthetic display of one byte per pixel, for the composition below
+    struct Display
+    {
+        RECT desktopRect;
+        int width;
+        int height;
+        std::vector<uint8_t> vPixels;
+        DamageMap damage;
+
+        Display(LONG left, LONG top, int w, int h)
+            : desktopRect{ left, top, left + w, top + h }, width(w), height(h), vPixels((size_t)w * h)
+        {
+            damage.Init(w, h);
+        }
+
+        void Fill(int left, int top, int right, int bottom, uint8_t value)
+        {
+            for (int y = top; y < bottom; y++)
+            {
+                memset(&vPixels[(size_t)y * width + left], value, right - left);
+            }
+            damage.AddRect(left, top, right, bottom);
+        }
+    };
+
+    /// Three synthetic displays of different sizes composited as MultiOutputCapture does, on the CPU:
+    /// the dirty runs of each updated display are copied to its place on the canvas and their damage
+    /// mapped. The canvas then holds every display where the layout puts it, black in the gaps, and the
+    /// canvas damage covers exactly the updated tiles
+    void TestSyntheticOutputs()
+    {
+        std::vector<Display> vDisplays;
+        vDisplays.emplace_back(0, 0, 640, 360);
+        vDisplays.emplace_back(640, -100, 320, 480);
+        vDisplays.emplace_back(-200, 360, 200, 150);
+        std::vector<RECT> vDesktopRects;
+        for (const Display &display : vDisplays)
+        {
+            vDesktopRects.push_back(display.desktopRect);
+        }
+        OutputLayout layout;
+        CHECK(layout.Init(vDesktopRects));
+        CHECK(layout.GetCanvasWidth() == 1160 && layout.GetCanvasHeight() == 610);
+        const int canvasWidth = layout.GetCanvasWidth();
+        std::vector<uint8_t> vCanvas((size_t)canvasWidth * layout.GetCanvasHeight());
+        DamageMap canvasDamage;
+        canvasDamage.Init(canvasWidth, layout.GetCanvasHeight());
+        FrameArena arena(1 << 16);
+        FrameVector<RECT> vRuns(&arena);
+
+        auto composite = [&]()
+        {
+            canvasDamage.Clear();
+            for (size_t i = 0; i < vDisplays.size(); i++)
+            {
+                Display &display = vDisplays[i];
+                const RECT &origin = layout.GetRect(i);
+                OutputLayout::GetDirtyRuns(display.damage, vRuns);
+                for (const RECT &run : vRuns)
+                {
+                    for (LONG y = run.top; y < run.bottom; y++)
+                    {
+                        memcpy(&vCanvas[(size_t)(origin.top + y) * canvasWidth + origin.left + run.left],
+                            &display.vPixels[(size_t)y * display.width + run.left], run.right - run.left);
+                    }
+                }
+                layout.MapDamage(i, vRuns, canvasDamage);
+                display.damage.Clear();
+            }
+        };
+
+        /// First frame: every display fully damaged
+        for (size_t i = 0; i < vDisplays.size(); i++)
+        {
+            vDisplays[i].Fill(0, 0, vDisplays[i].width, vDisplays[i].height, (uint8_t)(i + 1));
+        }
+        composite();
+        size_t nPixels[4] = {};
+        for (uint8_t pixel : vCanvas)
+        {
+            nPixels[pixel]++;
+        }
+        CHECK(nPixels[1] == 640 * 360 && nPixels[2] == 320 * 480 && nPixels[3] == 200 * 150);
+        CHECK(nPixels[0] == vCanvas.size() - 640 * 360 - 320 * 480 - 200 * 150);
+        /// Display 0 is at 200,100 on the canvas, display 1 at 840,0, display 2 at 0,460
+        CHECK(vCanvas[100 * canvasWidth + 200] == 1 && vCanvas[99 * canvasWidth + 200] == 0 && vCanvas[840] == 2);
+        CHECK(vCanvas[460 * canvasWidth] == 3 && vCanvas[459 * canvasWidth] == 0);
+
+        /// Next frame: only a window on display 1 changed
+        vDisplays[1].Fill(10, 200, 110, 260, 9);
+        composite();
+        CHECK(vCanvas[200 * canvasWidth + 850] == 9 && vCanvas[259 * canvasWidth + 949] == 9);
+        CHECK(vCanvas[260 * canvasWidth + 850] == 2 && vCanvas[200 * canvasWidth + 950] == 2);
+        /// Display tiles 0-1 x 3-4 are copied, canvas pixels 840-967 x 192-319: tiles 13-15 x 3-4
+        CHECK(canvasDamage.GetDirtyCount() == 6 && canvasDamage.IsDirty(13, 3) && canvasDamage.IsDirty(15, 4));
+    }
+}
+
+int main()
+{
+    TestInit();
+    TestDirtyRuns();
+    TestMapping();
+    TestSyntheticOutputs();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
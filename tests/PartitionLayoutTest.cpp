@@ -0,0 +1,193 @@
+#include "PartitionLayout.hpp"
+#include "Check.hpp"
+#include <algorithm>
+#include <math.h>
+
+namespace
+{
+    const uint32_t ALIGN = 64;
+
+    /// The limits PartitionedEncoder::Init() derives: half to one and a half aligned equal shares
+    void GetLimits(uint32_t length, uint32_t n, uint32_t &minSize, uint32_t &maxSize)
+    {
+        uint32_t equal = (length / n + ALIGN - 1) / ALIGN * ALIGN;
+        minSize = std::max(equal / 2 / ALIGN * ALIGN, ALIGN);
+        maxSize = std::min((equal * 3 / 2 + ALIGN - 1) / ALIGN * ALIGN, length);
+    }
+
+    /// Every cut on an ALIGN boundary, every part within its limits, and the parts covering the length
+    bool IsValid(const std::vector<uint32_t> &vSize, uint32_t length, uint32_t minSize, uint32_t maxSize)
+    {
+        uint32_t offset = 0;
+        for (size_t i = 0; i < vSize.size(); i++)
+        {
+            offset += vSize[i];
+            if ((i + 1 < vSize.size() && offset % ALIGN) || vSize[i] > maxSize || vSize[i] < minSize)
+            {
+                return false;
+            }
+        }
+        return offset == length;
+    }
+
+    /// Cost of each ALIGN wide band, 'weight' per row (column) of the band, the last band possibly narrower
+    std::vector<double> BandCosts(uint32_t length, double (*weight)(uint32_t))
+    {
+        std::vector<double> vCost((length + ALIGN - 1) / ALIGN, 0);
+        for (uint32_t x = 0; x < length; x++)
+        {
+            vCost[x / ALIGN] += weight(x);
+        }
+        return vCost;
+    }
+
+    /// Without costs, or with the same cost everywhere, every cut is on the boundary nearest its equal share
+    void TestEqualCost()
+    {
+        for (uint32_t length : { 1080u, 1440u, 2160u, 3840u, 7680u })
+        {
+            for (uint32_t n = 2; n <= 8; n++)
+            {
+                uint32_t minSize, maxSize;
+                GetLimits(length, n, minSize, maxSize);
+                if (minSize * n > length)
+                {
+                    continue;
+                }
+                std::vector<uint32_t> vSize(n);
+                PartitionLayout::ComputeCuts(length, ALIGN, std::vector<double>(), minSize, maxSize, vSize);
+                CHECK(IsValid(vSize, length, minSize, maxSize));
+                uint32_t cut = 0;
+                for (uint32_t i = 0; i + 1 < n; i++)
+                {
+                    cut += vSize[i];
+                    CHECK(fabs(cut - (double)length * (i + 1) / n) <= ALIGN / 2);
+                }
+
+                /// A flat cost places the cuts the same
+                std::vector<uint32_t> vFlat(n);
+                PartitionLayout::ComputeCuts(length, ALIGN, BandCosts(length, [](uint32_t) { return 1.0; }), minSize, maxSize, vFlat);
+                CHECK(vFlat == vSize);
+            }
+        }
+
+        /// 3840 wide in 4 is 960 each, a multiple of 64
+        std::vector<uint32_t> vSize(4);
+        uint32_t minSize, maxSize;
+        GetLimits(3840, 4, minSize, maxSize);
+        PartitionLayout::ComputeCuts(3840, ALIGN, std::vector<double>(), minSize, maxSize, vSize);
+        CHECK(vSize == std::vector<uint32_t>({ 960, 960, 960, 960 }));
+    }
+
+    /// Costly rows get smaller parts, each part holds about an equal share of the cost
+    void TestUnequalCost()
+    {
+        const uint32_t length = 2160, n = 3;
+        uint32_t minSize, maxSize;
+        GetLimits(length, n, minSize, maxSize);
+        /// The top third costs twice as much per row
+        std::vector<double> vCost = BandCosts(length, [](uint32_t x) { return x < 720 ? 2.0 : 1.0; });
+        std::vector<uint32_t> vSize(n);
+        PartitionLayout::ComputeCuts(length, ALIGN, vCost, minSize, maxSize, vSize);
+        CHECK(IsValid(vSize, length, minSize, maxSize));
+        CHECK(vSize[0] < 720 && vSize[2] > 720);
+        double total = 0;
+        for (double c : vCost)
+        {
+            total += c;
+        }
+        uint32_t offset = 0;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            double cost = 0;
+            for (uint32_t b = offset / ALIGN; b < (offset + vSize[i] + ALIGN - 1) / ALIGN; b++)
+            {
+                cost += vCost[b];
+            }
+            /// Within one band of the most expensive rows
+            CHECK(fabs(cost - total / n) <= ALIGN * 2.0);
+            offset += vSize[i];
+        }
+
+        /// All the cost in the first band: the first part is as small as allowed, the rest still fit
+        std::vector<double> vSpike(vCost.size(), 0);
+        vSpike[0] = 1000;
+        PartitionLayout::ComputeCuts(length, ALIGN, vSpike, minSize, maxSize, vSize);
+        CHECK(IsValid(vSize, length, minSize, maxSize));
+        CHECK(vSize[0] == minSize);
+
+        /// All the cost in the last band: the last part shrinks, the others stop at their maximum
+        std::vector<double> vTail(vCost.size(), 0);
+        vTail.back() = 1000;
+        PartitionLayout::ComputeCuts(length, ALIGN, vTail, minSize, maxSize, vSize);
+        CHECK(IsValid(vSize, length, minSize, maxSize));
+        CHECK(vSize[0] == maxSize && vSize[2] < 720);
+
+        /// Negative costs count as 0
+        std::vector<double> vNegative(vCost.size(), -1);
+        PartitionLayout::ComputeCuts(length, ALIGN, vNegative, minSize, maxSize, vSize);
+        CHECK(IsValid(vSize, length, minSize, maxSize));
+    }
+
+    /// Random costs never break the alignment or the limits
+    void TestRandomCost()
+    {
+        uint32_t x = 1;
+        for (int round = 0; round < 2000; round++)
+        {
+            x = x * 1664525 + 1013904223;
+            uint32_t length = 1024 + (x >> 20) % 7000;
+            uint32_t n = 2 + (x >> 8) % 7;
+            uint32_t minSize, maxSize;
+            GetLimits(length, n, minSize, maxSize);
+            if (minSize * n > length)
+            {
+                continue;
+            }
+            std::vector<double> vCost((length + ALIGN - 1) / ALIGN);
+            for (double &c : vCost)
+            {
+                x = x * 1664525 + 1013904223;
+                c = (x >> 24) * ((x & 0x100) ? 1 : 50);
+            }
+            std::vector<uint32_t> vSize(n);
+            PartitionLayout::ComputeCuts(length, ALIGN, vCost, minSize, maxSize, vSize);
+            CHECK(IsValid(vSize, length, minSize, maxSize));
+        }
+    }
+
+    void TestParseConfig()
+    {
+        PartitionConfig cfg;
+        cfg.balanceInterval = 120;
+        CHECK(PartitionLayout::ParseConfig("4", cfg));
+        CHECK(cfg.count == 4 && cfg.orientation == PartitionOrientation::Horizontal && cfg.output == PartitionOutput::Streams);
+        CHECK(cfg.balanceInterval == 120);
+        CHECK(PartitionLayout::ParseConfig("3v", cfg));
+        CHECK(cfg.count == 3 && cfg.orientation == PartitionOrientation::Vertical && cfg.output == PartitionOutput::Streams);
+        CHECK(PartitionLayout::ParseConfig("2h:split", cfg));
+        CHECK(cfg.count == 2 && cfg.orientation == PartitionOrientation::Horizontal && cfg.output == PartitionOutput::Split);
+        CHECK(PartitionLayout::ParseConfig("8v:split", cfg));
+        CHECK(cfg.count == 8 && cfg.orientation == PartitionOrientation::Vertical && cfg.output == PartitionOutput::Split);
+        CHECK(PartitionLayout::ParseConfig("2:split", cfg));
+        CHECK(cfg.orientation == PartitionOrientation::Horizontal && cfg.output == PartitionOutput::Split);
+
+        /// Failures leave the count as it was
+        for (const char *szArg : { "", "1", "0", "9", "-2", "v4", "4x", "4vh", "4v:spl", "4:split:2" })
+        {
+            CHECK(!PartitionLayout::ParseConfig(szArg, cfg));
+            CHECK(cfg.count == 2);
+        }
+        CHECK(!PartitionLayout::ParseConfig(nullptr, cfg));
+    }
+}
+
+int main()
+{
+    TestEqualCost();
+    TestUnequalCost();
+    TestRandomCost();
+    TestParseConfig();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
@@ -0,0 +1,165 @@
+#include "RateController.hpp"
+#include "Check.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace
+{
+    struct Change
+    {
+        int frame;
+        uint32_t before;
+        uint32_t after;
+    };
+
+    /// Feeds frames to a controller and keeps every reconfiguration
+    struct Driver
+    {
+        RateControlConfig cfg;
+        RateController controller;
+        std::vector<Change> vChanges;
+        int nFrame = 0;
+
+        explicit Driver(uint32_t nInitial = 11000000) { controller.Init(cfg, nInitial); }
+
+        /// nFrames frames of the given damage, each a fraction of the per-frame budget at the current bitrate
+        void Run(int nFrames, double damage, double budgetFraction, int nBacklog = 0)
+        {
+            for (int i = 0; i < nFrames; i++, nFrame++)
+            {
+                uint32_t before = controller.GetCurrentBitrate();
+                size_t nBytes = (size_t)(before / 8 / cfg.fps * budgetFraction);
+                RateDecision decision;
+                if (controller.OnFrame(damage, nBytes, nBacklog, decision))
+                {
+                    CHECK(decision.averageBitRate == controller.GetCurrentBitrate());
+                    vChanges.push_back({ nFrame, before, decision.averageBitRate });
+                }
+            }
+        }
+
+        /// Every change respects hysteresis, range and, outside congestion, the hold time
+        void CheckContract(int firstCongested = -1) const
+        {
+            int last = -1;
+            for (const Change &change : vChanges)
+            {
+                CHECK(std::fabs((double)change.after - change.before) > cfg.hysteresis * change.before);
+                CHECK(change.after >= cfg.minBitrate && change.after <= cfg.maxBitrate);
+                int hold = firstCongested >= 0 && change.frame >= firstCongested ? cfg.holdFrames / 4 : cfg.holdFrames;
+                CHECK(change.frame - last >= hold);
+                last = change.frame;
+            }
+        }
+    };
+
+    /// Nothing is decided before the window is full, then an idle desktop drops to the minimum
+    void TestIdle()
+    {
+        Driver driver;
+        driver.Run(driver.cfg.windowFrames - 1, 0.0, 0.5);
+        CHECK(driver.vChanges.empty());
+        driver.Run(1, 0.0, 0.5);
+        CHECK(driver.vChanges.size() == 1);
+        CHECK(driver.controller.GetCurrentBitrate() == driver.cfg.minBitrate);
+        driver.Run(300, 0.0, 0.5);
+        CHECK(driver.vChanges.size() == 1);
+        driver.CheckContract();
+    }
+
+    /// A busy desktop climbs to the maximum, one hold time after the other
+    void TestBusy()
+    {
+        Driver driver(2000000);
+        driver.Run(300, 0.5, 0.5);
+        CHECK(!driver.vChanges.empty());
+        CHECK(driver.controller.GetCurrentBitrate() == driver.cfg.maxBitrate);
+        driver.CheckContract();
+
+        /// Back to idle: down again, without passing through every step
+        size_t nBefore = driver.vChanges.size();
+        driver.Run(300, 0.0, 0.5);
+        CHECK(driver.controller.GetCurrentBitrate() == driver.cfg.minBitrate);
+        CHECK(driver.vChanges.size() - nBefore <= 2);
+        driver.CheckContract();
+    }
+
+    /// Damage wobbling around a level settles once and then stays, the wobble is within the hysteresis
+    void TestHysteresis()
+    {
+        Driver driver;
+        for (int i = 0; i < 60; i++)
+        {
+            driver.Run(5, 0.13, 0.5);
+            driver.Run(5, 0.19, 0.5);
+        }
+        CHECK(driver.vChanges.size() <= 1);
+        driver.CheckContract();
+    }
+
+    /// Low damage but the encoder spends its whole budget: step up by at least a quarter
+    void TestBudgetExhausted()
+    {
+        Driver driver(4000000);
+        driver.Run(driver.cfg.windowFrames, 0.0, 0.95);
+        CHECK(driver.vChanges.size() == 1);
+        CHECK(driver.vChanges.size() == 1 && driver.vChanges[0].after >= driver.vChanges[0].before * 1.25 - 1);
+        /// The last step to the maximum may be within the hysteresis
+        driver.Run(300, 0.0, 0.95);
+        CHECK(driver.controller.GetCurrentBitrate() >= driver.cfg.maxBitrate * (1 - driver.cfg.hysteresis));
+        driver.CheckContract();
+    }
+
+    /// A backlog beyond its steady state cuts the bitrate within the short hold, by 30% at a time, down to
+    /// within the hysteresis of the minimum, never up while it lasts, even with busy content
+    void TestCongestion()
+    {
+        Driver driver(2000000);
+        driver.Run(300, 0.5, 0.5, 1);
+        CHECK(driver.controller.GetCurrentBitrate() == driver.cfg.maxBitrate);
+        size_t nBefore = driver.vChanges.size();
+        int firstCongested = driver.nFrame;
+        driver.Run(200, 0.5, 0.5, 1 + driver.cfg.maxBacklog + 1);
+        CHECK(driver.vChanges.size() > nBefore);
+        if (driver.vChanges.size() > nBefore)
+        {
+            const Change &cut = driver.vChanges[nBefore];
+            CHECK(cut.frame - firstCongested < driver.cfg.holdFrames / 4);
+        }
+        for (size_t i = nBefore; i < driver.vChanges.size(); i++)
+        {
+            const Change &change = driver.vChanges[i];
+            CHECK(change.after <= std::max(change.before * 0.7, (double)driver.cfg.minBitrate) + 1);
+        }
+        CHECK(driver.controller.GetCurrentBitrate() <= driver.cfg.minBitrate / (1 - driver.cfg.hysteresis));
+        driver.CheckContract(firstCongested);
+
+        /// The backlog at the threshold is no congestion: the content takes over again
+        driver.Run(300, 0.5, 0.5, 1 + driver.cfg.maxBacklog);
+        CHECK(driver.controller.GetCurrentBitrate() == driver.cfg.maxBitrate);
+    }
+
+    void TestParseLimits()
+    {
+        RateControlConfig cfg;
+        CHECK(RateController::ParseLimits("1000:8000", cfg));
+        CHECK(cfg.minBitrate == 1000000 && cfg.maxBitrate == 8000000);
+        CHECK(!RateController::ParseLimits("8000:1000", cfg));
+        CHECK(!RateController::ParseLimits("0:1000", cfg));
+        CHECK(!RateController::ParseLimits("8000", cfg));
+        CHECK(cfg.minBitrate == 1000000 && cfg.maxBitrate == 8000000);
+    }
+}
+
+int main()
+{
+    TestIdle();
+    TestBusy();
+    TestHysteresis();
+    TestBudgetExhausted();
+    TestCongestion();
+    TestParseLimits();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}
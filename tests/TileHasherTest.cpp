@@ -0,0 +1,171 @@
+#include "TileHasher.hpp"
+#include "Check.hpp"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <unordered_set>
+
+namespace
+{
+    struct Random
+    {
+        uint64_t state = 0x853C49E6748FEA9BULL;
+        uint64_t Next()
+        {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state;
+        }
+    };
+
+    void Fill(std::vector<uint8_t> &v, Random &rng)
+    {
+        for (uint8_t &b : v)
+        {
+            b = (uint8_t)rng.Next();
+        }
+    }
+
+    int CountDirty(const DamageMap &damage)
+    {
+        int n = 0;
+        for (int ty = 0; ty < damage.GetTilesY(); ty++)
+        {
+            for (int tx = 0; tx < damage.GetTilesX(); tx++)
+            {
+                n += damage.IsDirty(tx, ty) ? 1 : 0;
+            }
+        }
+        return n;
+    }
+
+    /// Any byte of a tile, including the partial tiles at the right and bottom edges, marks that tile and no other
+    void TestDetection()
+    {
+        const int W = 1000, H = 600, PITCH = W * 4 + 32;
+        const int TILE = DamageMap::TILE_SIZE;
+        Random rng;
+        std::vector<uint8_t> vFrame((size_t)PITCH * H);
+        Fill(vFrame, rng);
+        TileHasher hasher;
+        hasher.Init(W, H, 2);
+        DamageMap damage;
+        hasher.Process(vFrame.data(), PITCH, damage);
+        CHECK(CountDirty(damage) == damage.GetTilesX() * damage.GetTilesY());
+        hasher.Process(vFrame.data(), PITCH, damage);
+        CHECK(CountDirty(damage) == 0);
+
+        const int vPixels[][2] = { { 0, 0 }, { TILE - 1, TILE - 1 }, { TILE, 0 }, { W - 1, H - 1 }, { 517, 301 }, { W - 1, 0 } };
+        for (const int *p : vPixels)
+        {
+            /// Every byte of the pixel, one at a time
+            for (int c = 0; c < 4; c++)
+            {
+                vFrame[(size_t)p[1] * PITCH + p[0] * 4 + c] ^= 0x01;
+                hasher.Process(vFrame.data(), PITCH, damage);
+                CHECK(CountDirty(damage) == 1 && damage.IsDirty(p[0] / TILE, p[1] / TILE));
+            }
+        }
+        /// The padding past the width is not part of the image
+        vFrame[(size_t)10 * PITCH + W * 4] ^= 0xFF;
+        hasher.Process(vFrame.data(), PITCH, damage);
+        CHECK(CountDirty(damage) == 0);
+    }
+
+    /// Flipping any input bit flips every output bit with probability 1/2
+    void TestAvalanche()
+    {
+        const int TILE = DamageMap::TILE_SIZE;
+        const int BYTES = TILE * TILE * 4;
+        Random rng;
+        std::vector<uint8_t> vTile(BYTES);
+        Fill(vTile, rng);
+        int vFlips[64] = {};
+        int nTrials = 0;
+        double sumFlipped = 0;
+        /// Every 13th bit of two tiles, a random one and an all-zero one (flat desktop areas)
+        for (int tile = 0; tile < 2; tile++)
+        {
+            if (tile == 1)
+            {
+                std::fill(vTile.begin(), vTile.end(), 0);
+            }
+            uint64_t base = TileHasher::HashTile(vTile.data(), TILE * 4, TILE, TILE);
+            for (int bit = 0; bit < BYTES * 8; bit += 13)
+            {
+                vTile[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+                uint64_t diff = base ^ TileHasher::HashTile(vTile.data(), TILE * 4, TILE, TILE);
+                vTile[bit / 8] ^= (uint8_t)(1 << (bit % 8));
+                CHECK(diff != 0);
+                sumFlipped += std::popcount(diff);
+                for (int o = 0; o < 64; o++)
+                {
+                    vFlips[o] += (int)(diff >> o & 1);
+                }
+                nTrials++;
+            }
+        }
+        double meanFlipped = sumFlipped / nTrials;
+        double worstBias = 0;
+        for (int o = 0; o < 64; o++)
+        {
+            worstBias = std::max(worstBias, std::fabs((double)vFlips[o] / nTrials - 0.5));
+        }
+        printf("Avalanche: %d single bit flips, %.2f of 64 output bits flip on average, worst output bit bias %.4f\n", nTrials, meanFlipped, worstBias);
+        /// 20166 trials: the standard deviation of a fair bit's rate is 0.0035, of the mean 0.03 bits
+        CHECK(std::fabs(meanFlipped - 32) < 0.25);
+        CHECK(worstBias < 0.025);
+    }
+
+    /// Tiles that differ in one pixel, the common desktop change, hash to distinct values, and any 24 bits
+    /// of the hashes collide as often as random numbers would (birthday bound)
+    void TestCollisions()
+    {
+        const int TILE = DamageMap::TILE_SIZE;
+        const int N = 1 << 18;
+        Random rng;
+        std::vector<uint8_t> vTile(TILE * TILE * 4);
+        Fill(vTile, rng);
+        std::vector<uint64_t> vHashes;
+        vHashes.reserve(N);
+        for (int i = 0; i < N; i++)
+        {
+            /// Pixel i % 4096 set to one of 64 values, the rest unchanged
+            uint32_t *pPixel = (uint32_t *)vTile.data() + (i % (TILE * TILE));
+            uint32_t old = *pPixel;
+            *pPixel = old ^ (uint32_t)(1 + i / (TILE * TILE)) * 0x01010101u;
+            vHashes.push_back(TileHasher::HashTile(vTile.data(), TILE * 4, TILE, TILE));
+            *pPixel = old;
+        }
+        std::unordered_set<uint64_t> unique(vHashes.begin(), vHashes.end());
+        CHECK((int)unique.size() == N);
+
+        /// Expected pairs sharing 24 bits: N(N-1)/2 / 2^24 = 2048, standard deviation 45
+        const double expected = (double)N * (N - 1) / 2 / (1 << 24);
+        for (int shift : { 0, 20, 40 })
+        {
+            std::vector<uint32_t> vCounts(1 << 24, 0);
+            for (uint64_t h : vHashes)
+            {
+                vCounts[(h >> shift) & 0xFFFFFF]++;
+            }
+            double pairs = 0;
+            for (uint32_t c : vCounts)
+            {
+                pairs += (double)c * (c - 1) / 2;
+            }
+            printf("Collisions of bits %d-%d over %d one-pixel variants: %.0f, %.0f expected\n", shift, shift + 23, N, pairs, expected);
+            CHECK(std::fabs(pairs - expected) < expected * 0.1);
+        }
+    }
+}
+
+int main()
+{
+    TestDetection();
+    TestAvalanche();
+    TestCollisions();
+    printf("%s\n", g_nFailures ? "FAILED" : "OK");
+    return g_nFailures;
+}